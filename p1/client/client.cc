@@ -23,7 +23,8 @@ static vector<pair<string, const char *>> commands = {
     {REQ_REG, "             Register a new user"},
     {REQ_SET, " -1 [file]   Set user's data to the contents of the file"},
     {REQ_GET, " -1 [string] Get data for the provided user"},
-    {REQ_ALL, " -1 [file]   Get all users' names, save to a file"}};
+    {REQ_ALL, " -1 [file]   Get all users' names, save to a file"},
+    {REQ_PIPE, " -1 [file]   Run the commands in a file over one connection"}};
 
 /// arg_t represents the command-line arguments to the client
 struct arg_t {
@@ -35,6 +36,8 @@ struct arg_t {
   string command = "";  // The command to execute
   string arg1 = "";     // The first argument to the command (if any)
   string arg2 = "";     // The second argument to the command (if any)
+  bool gcm = false;     // Use the AES-256-GCM protocol version
+  string ticket = "";   // The file for caching a session ticket
 
   /// Construct an arg_t from the command-line arguments to the program
   ///
@@ -46,7 +49,7 @@ struct arg_t {
   arg_t(int argc, char **argv) {
     // First, use getopt to parse the command-line arguments
     long opt;
-    while ((opt = getopt(argc, argv, "k:u:w:s:p:C:1:2:h")) != -1) {
+    while ((opt = getopt(argc, argv, "k:u:w:s:p:C:1:2:gT:h")) != -1) {
       switch (opt) {
       case 'p': // port of server
         port = atoi(optarg);
@@ -72,6 +75,12 @@ struct arg_t {
       case '2': // second argument
         arg2 = string(optarg);
         break;
+      case 'g': // use AES-GCM
+        gcm = true;
+        break;
+      case 'T': // session ticket file
+        ticket = string(optarg);
+        break;
       default: // on any error, print a help message.  This case subsumes `-h`
         throw 1;
         return;
@@ -85,6 +94,7 @@ struct arg_t {
         REQ_SET,
         REQ_GET,
         REQ_ALL,
+        REQ_PIPE,
     };
     string args2[] = {};
     for (auto a : args0) {
@@ -136,22 +146,14 @@ struct arg_t {
       cout << "  " << commands[i].first << commands[i].second << endl;
     cout << endl;
 
-    cout << " K/V Table Commands (pass via -C, with arguments as -1 and -2)\n";
-    for (int i = 6; i < 11; ++i)
-      cout << "  " << commands[i].first << commands[i].second << endl;
-    cout << endl;
-
-    cout << " K/V MRU Commands (pass via -C, with argument as -1)\n";
-    for (int i = 11; i < 12; ++i)
-      cout << "  " << commands[i].first << commands[i].second << endl;
-    cout << endl;
-
-    cout << " Map/Reduce Commands (pass via -C, with arguments as -1 and -2)\n";
-    for (int i = 12; i < 14; ++i)
+    cout << " Session Commands (pass via -C, with argument as -1)\n";
+    for (size_t i = 6; i < commands.size(); ++i)
       cout << "  " << commands[i].first << commands[i].second << endl;
     cout << endl;
 
     cout << " Other Options:\n";
+    cout << "  -g          Use the AES-256-GCM protocol version\n";
+    cout << "  -T [file]   Cache a session ticket in a file, to skip RSA\n";
     cout << "  -h          Print help (this message)\n";
   }
 };
@@ -179,14 +181,19 @@ int main(int argc, char **argv) {
   RSA *pubkey = load_pub(args->keyfile.c_str());
   ContextManager pkr([&]() { RSA_free(pubkey); });
 
+  req_use_gcm(args->gcm);
+  if (args->ticket != "")
+    req_use_ticket(args->ticket);
+
   // Connect to the server and perform the appropriate operation
   int sd = connect_to_server(args->server, args->port);
   ContextManager sdc([&]() { close(sd); });
 
   // Figure out which command was requested, and run it
-  vector<string> cmd = {REQ_REG, REQ_BYE, REQ_SET, REQ_GET, REQ_ALL, REQ_SAV};
-  decltype(req_reg) *func[] = {req_reg, req_bye, req_set,
-                               req_get, req_all, req_sav};
+  vector<string> cmd = {REQ_REG, REQ_BYE, REQ_SET, REQ_GET,
+                        REQ_ALL, REQ_SAV, REQ_PIPE};
+  decltype(req_reg) *func[] = {req_reg, req_bye, req_set, req_get,
+                               req_all, req_sav, req_pip};
   for (size_t i = 0; i < cmd.size(); ++i)
     if (args->command == cmd[i])
       func[i](sd, pubkey, args->username, args->userpass, args->arg1,
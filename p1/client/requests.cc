@@ -1,7 +1,13 @@
 #include <cassert>
+#include <csignal>
+#include <cstdint>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <openssl/rand.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 #include "../common/contextmanager.h"
@@ -147,13 +153,161 @@ std::vector<uint8_t> OBlockGang(EVP_CIPHER_CTX *ctx,  const std::string &user,
 }
 
 
+/// true if requests should use the AES-256-GCM protocol version
+static bool use_gcm = false;
+
+/// Choose whether subsequent requests use AES-256-GCM (see PROTO_GCM in
+/// protocol.h) or AES-256-CBC
+///
+/// @param gcm true to use AES-256-GCM
+void req_use_gcm(bool gcm) { use_gcm = gcm; }
+
+/// Get this thread's AES context, keyed for encrypting a request's @ablock
+///
+/// @param key The AES key and iv for this request
+///
+/// @return The context, or nullptr on error
+static EVP_CIPHER_CTX *request_context(const vector<uint8_t> &key) {
+  return thread_aes_context(key, true, use_gcm);
+}
+
+/// Re-key this thread's AES context for decrypting the server's response
+///
+/// @param ctx Set to the re-keyed context
+/// @param key The AES key and iv for this request
+///
+/// @return true if the context is ready, false on error
+static bool response_context(EVP_CIPHER_CTX *&ctx, const vector<uint8_t> &key) {
+  ctx = thread_aes_context(key, false, use_gcm, true);
+  return ctx != nullptr;
+}
+
+/// The file where the session ticket is cached, or "" to not use tickets
+static string ticket_file = "";
+
+/// When the current request is resuming a session, this holds what the
+/// @tblock needs
+static struct {
+  bool active = false;        // true if the request is resuming a session
+  std::vector<uint8_t> nonce; // The nonce this request's key is bound to
+  std::vector<uint8_t> ticket; // The server's ticket for the session
+} resume;
+
+/// Cache session tickets in a file, and use them to skip the RSA handshake
+/// (see REQ_TICKET and REQ_RESUME in protocol.h)
+///
+/// @param file The file for the ticket
+void req_use_ticket(const string &file) { ticket_file = file; }
+
+/// Get the protocol version marker for the current mode
+static const string &proto_marker() { return use_gcm ? PROTO_GCM : PROTO_CBC; }
+
+/// Choose the AES key for a request.  If there is an unexpired cached ticket,
+/// the key is derived from the ticket's session, and the request will send a
+/// @tblock.  Otherwise it is a fresh key for an @rblock.
+///
+/// @param cmd The command being requested
+///
+/// @return The AES key and iv for this request
+static vector<uint8_t> request_key(const string &cmd) {
+  resume.active = false;
+  if (ticket_file != "" && file_exists(ticket_file)) {
+    // The cache holds expiry.aeskey.@ticket.  Leave a little slack on the
+    // expiry, so the ticket doesn't expire while the request is in flight.
+    auto f = load_entire_file(ticket_file);
+    size_t keylen = AES_KEYSIZE + AES_IVSIZE;
+    if (f.size() == 8 + keylen + LEN_TICKET &&
+        *(uint64_t *)f.data() > (uint64_t)time(nullptr) + 5) {
+      vector<uint8_t> session(f.begin() + 8, f.begin() + 8 + keylen);
+      resume.ticket.assign(f.begin() + 8 + keylen, f.end());
+      resume.nonce.resize(LEN_RESUME_NONCE);
+      if (RAND_bytes(resume.nonce.data(), LEN_RESUME_NONCE)) {
+        vector<uint8_t> binding;
+        better_insert(binding, cmd);
+        better_insert(binding, proto_marker());
+        better_insert(binding, resume.nonce);
+        auto key = derive_aes_key(session, binding.data(), binding.size());
+        if (!key.empty()) {
+          resume.active = true;
+          return key;
+        }
+      }
+    }
+  }
+  return create_aes_key();
+}
+
+/// If this request asked for a session ticket, read it from the front of the
+/// response and cache it
+///
+/// @param sd  The open socket descriptor for communicating with the server
+/// @param key The AES key and iv for this request, which is the session key
+static void recv_ticket(int sd, const vector<uint8_t> &key) {
+  if (ticket_file == "" || resume.active)
+    return;
+  vector<uint8_t> hdr(16);
+  if (reliable_get_to_eof_or_n(sd, hdr.begin(), 16) != 16)
+    return;
+  uint64_t expiry = *(uint64_t *)hdr.data();
+  uint64_t tlen = *(uint64_t *)(hdr.data() + 8);
+  if (expiry == 0 || tlen != LEN_TICKET)
+    return; // The server doesn't issue tickets
+  vector<uint8_t> ticket(LEN_TICKET);
+  if (reliable_get_to_eof_or_n(sd, ticket.begin(), LEN_TICKET) != LEN_TICKET)
+    return;
+  vector<uint8_t> cache(hdr.begin(), hdr.begin() + 8);
+  better_insert(cache, key);
+  better_insert(cache, ticket);
+  if (!write_file(ticket_file, cache, 0))
+    cerr << "Error writing session ticket to " << ticket_file << endl;
+}
+
+/// If a resumed request's response couldn't be decrypted, the server didn't
+/// accept the ticket, so discard it.  The next request will do a full
+/// handshake.
+///
+/// @param response The decrypted response
+static void check_resume(const vector<uint8_t> &response) {
+  if (resume.active && response.empty()) {
+    cerr << "Session ticket was rejected, and has been discarded" << endl;
+    unlink(ticket_file.c_str());
+  }
+}
+
+/// Build a @tblock for resuming a session (see REQ_RESUME in protocol.h)
+///
+/// @param cmd       The command being requested
+/// @param ablockLen The length of the encrypted @ablock
+///
+/// @return The @tblock
+static std::vector<uint8_t> TBlock(const std::string &cmd, uint64_t ablockLen) {
+  std::vector<uint8_t> tblock;
+  tblock.reserve(LEN_RKBLOCK);
+  better_insert(tblock, REQ_RESUME);
+  better_insert(tblock, cmd);
+  better_insert(tblock, proto_marker());
+  better_insert(tblock, resume.nonce);
+  better_insert(tblock, ablockLen);
+  better_insert(tblock, (size_t)resume.ticket.size());
+  better_insert(tblock, resume.ticket);
+  pad0(tblock, LEN_RKBLOCK);
+  return tblock;
+}
+
 std::vector<uint8_t> RBlockYay(const std::string &cmd, std::vector<uint8_t> &holy_key, RSA *pub, uint64_t ablockLen) {
+  // 0. A session with a ticket doesn't need RSA at all
+  if (resume.active)
+    return TBlock(cmd, ablockLen);
   // 1. Create the @rblock using the formula listed above... 
   std::vector<uint8_t> WatchOutKeef_ItsDaRBlock; // Unencrypted @rblock
   WatchOutKeef_ItsDaRBlock.reserve(LEN_RBLOCK_CONTENT);
   better_insert(WatchOutKeef_ItsDaRBlock, cmd);
   better_insert(WatchOutKeef_ItsDaRBlock, holy_key);
   better_insert(WatchOutKeef_ItsDaRBlock, ablockLen);
+  if (use_gcm || ticket_file != "")
+    better_insert(WatchOutKeef_ItsDaRBlock, proto_marker());
+  if (ticket_file != "")
+    better_insert(WatchOutKeef_ItsDaRBlock, REQ_TICKET);
   padR(WatchOutKeef_ItsDaRBlock, LEN_RBLOCK_CONTENT);
   // 2. Create unsigned char toBuffer[LEN_RKBLOCK] and then encrypt Chief Keef's Opps
   unsigned char toBuffer[LEN_RKBLOCK];
@@ -209,8 +363,8 @@ void req_key(int sd, const string &keyfile) {
 /// @param user    The name of the user doing the request
 /// @param pass    The password of the user doing the request
 void req_reg(int sd, RSA *pubkey, const string &user, const string &pass, const string &, const string &) {
-  vector<uint8_t> holy_key = create_aes_key();
-  EVP_CIPHER_CTX *ctx = create_aes_context(holy_key, true);
+  vector<uint8_t> holy_key = request_key(REQ_REG);
+  EVP_CIPHER_CTX *ctx = request_context(holy_key);
   std::vector<uint8_t> ablock;
   ablock.reserve(LEN_UNAME + LEN_PASSWORD + LEN_PROFILE_FILE + 16);
   ablock = OBlockGang(ctx, user, pass);
@@ -223,14 +377,16 @@ void req_reg(int sd, RSA *pubkey, const string &user, const string &pass, const
   if (!send_reliably(sd, rblock)) 
     cerr << "Error in sending rblock" << endl;
 
+  recv_ticket(sd, holy_key);
   std::vector<uint8_t> servResponse; 
   servResponse.reserve(holy_key.size() + 10);
   servResponse = reliable_get_to_eof(sd);
 
-  if (!reset_aes_context(ctx, holy_key, false)) 
+  if (!response_context(ctx, holy_key)) 
     cerr << "error in reset_aes_context" << endl;
 
   std::vector<uint8_t> decryptResponse = aes_crypt_msg(ctx, servResponse);
+  check_resume(decryptResponse);
 
   cout << (const char *)decryptResponse.data() << endl;
   // NB: These asserts are to prevent compiler warnings
@@ -248,8 +404,8 @@ void req_reg(int sd, RSA *pubkey, const string &user, const string &pass, const
 /// @param pass    The password of the user doing the request
 void req_bye(int sd, RSA *pubkey, const string &user, const string &pass,
              const string &, const string &) {
-  vector<uint8_t> holy_key = create_aes_key();
-  EVP_CIPHER_CTX *ctx = create_aes_context(holy_key, true);
+  vector<uint8_t> holy_key = request_key(REQ_BYE);
+  EVP_CIPHER_CTX *ctx = request_context(holy_key);
   std::vector<uint8_t> ablock;
   ablock.reserve(LEN_UNAME + LEN_PASSWORD + LEN_PROFILE_FILE + 16);
   ablock = OBlockGang(ctx, user, pass);
@@ -260,12 +416,14 @@ void req_bye(int sd, RSA *pubkey, const string &user, const string &pass,
   // Sending the encrypted @rblock first and then sending the encrypted @ablock
   if (!send_reliably(sd, rblock))
     cerr << "Error sending reliably" << endl;
+  recv_ticket(sd, holy_key);
   std::vector<uint8_t> servResponse = reliable_get_to_eof(sd);
 
-  if (!reset_aes_context(ctx, holy_key, false)) 
+  if (!response_context(ctx, holy_key)) 
     cerr << "errors nahhhh" << endl;
 
   std::vector<uint8_t> decryptResponse = aes_crypt_msg(ctx, servResponse);
+  check_resume(decryptResponse);
 
   cout << (const char *) decryptResponse.data() << endl; 
 
@@ -285,8 +443,8 @@ void req_bye(int sd, RSA *pubkey, const string &user, const string &pass,
 /// @param pass    The password of the user doing the request
 void req_sav(int sd, RSA *pubkey, const string &user, const string &pass,
              const string &, const string &) {
-  vector<uint8_t> holy_key = create_aes_key();
-  EVP_CIPHER_CTX *ctx = create_aes_context(holy_key, true);
+  vector<uint8_t> holy_key = request_key(REQ_SAV);
+  EVP_CIPHER_CTX *ctx = request_context(holy_key);
   std::vector<uint8_t> ablock;
   ablock.reserve(LEN_UNAME + LEN_PASSWORD + LEN_PROFILE_FILE + 16);
   ablock = OBlockGang(ctx, user, pass);
@@ -299,12 +457,14 @@ void req_sav(int sd, RSA *pubkey, const string &user, const string &pass,
   if (!send_reliably(sd, rblock))
     cerr << "grrr.. unreliable send grrrrr" << endl;
 
+  recv_ticket(sd, holy_key);
   std::vector<uint8_t> servResponse = reliable_get_to_eof(sd);
 
-  if (!reset_aes_context(ctx, holy_key, false)) 
+  if (!response_context(ctx, holy_key)) 
     cerr << "error nahhh " << endl;
 
   std::vector<uint8_t> decryptResponse = aes_crypt_msg(ctx, servResponse);
+  check_resume(decryptResponse);
 
   cout << (const char*) decryptResponse.data() << endl;
 
@@ -325,8 +485,8 @@ void req_sav(int sd, RSA *pubkey, const string &user, const string &pass,
 /// @param setfile The file whose contents should be sent
 void req_set(int sd, RSA *pubkey, const string &user, const string &pass,
              const string &setfile, const string &) {
-  vector<uint8_t> holy_key = create_aes_key();
-  EVP_CIPHER_CTX *ctx = create_aes_context(holy_key, 1);
+  vector<uint8_t> holy_key = request_key(REQ_SET);
+  EVP_CIPHER_CTX *ctx = request_context(holy_key);
   // Checking setfile existence and then placing into @b 
   if (file_exists(setfile)) {
     std::vector<uint8_t> informacionParaLosStorage;
@@ -354,24 +514,23 @@ void req_set(int sd, RSA *pubkey, const string &user, const string &pass,
     // cout << "\n\n\n This is the Ablock: " << da_holy_grail.data() << endl;
 
     // cout << "contents of da_holy_grail:\n" << da_holy_grail.size() << endl;
-    // 2. Encrypt the @ablock
-    std::vector<uint8_t> ChiefKeefOBlock = aes_crypt_msg(ctx, da_holy_grail); // Encrypted @ablock
-
+    // 2. Send the @rblock, then stream the @ablock, encrypting as we go, so
+    //    that a large file never has its whole ciphertext in memory
     std::vector<uint8_t> rblock;
     rblock.reserve(LEN_RKBLOCK);
-    rblock = RBlockYay(REQ_SET, holy_key, pubkey, ChiefKeefOBlock.size());
-    better_insert(rblock, ChiefKeefOBlock);
-
+    rblock = RBlockYay(REQ_SET, holy_key, pubkey,
+                       aes_encrypted_len(ctx, da_holy_grail.size()));
 
-    if (!send_reliably(sd, rblock))
+    if (!send_reliably(sd, rblock) || !aes_send_msg(sd, ctx, da_holy_grail))
       cerr << "error in sending reliably unreliable... rblock: " << rblock.data() << endl;
 
-    std::vector<uint8_t> servResponse = reliable_get_to_eof(sd);
-
-    if (!reset_aes_context(ctx, holy_key, 0)) 
+    recv_ticket(sd, holy_key);
+    std::vector<uint8_t> decryptResponse;
+    if (!response_context(ctx, holy_key)) 
       cerr << "Error resetting AES context: Here's the key: " << (const char*) holy_key.data() << endl; 
-    
-    std::vector<uint8_t> decryptResponse = aes_crypt_msg(ctx, servResponse);
+    else if (!aes_recv_msg(sd, ctx, SIZE_MAX, decryptResponse))
+      cerr << "Error receiving response" << endl;
+    check_resume(decryptResponse);
     cout << (const char*) decryptResponse.data() << endl;
   } else 
       cerr << "error, file does not exist" << endl;
@@ -394,20 +553,22 @@ void req_set(int sd, RSA *pubkey, const string &user, const string &pass,
 /// @param getname The name of the user whose content should be fetched
 void req_get(int sd, RSA *pubkey, const string &user, const string &pass,
              const string &getname, const string &) {
-  vector<uint8_t> holy_key = create_aes_key();
-  EVP_CIPHER_CTX *ctx = create_aes_context(holy_key, 1);
+  vector<uint8_t> holy_key = request_key(REQ_GET);
+  EVP_CIPHER_CTX *ctx = request_context(holy_key);
   std::vector<uint8_t> ablock = OBlockGang(ctx, user, pass, getname);
   std::vector<uint8_t> rblock = RBlockYay(REQ_GET, holy_key, pubkey, ablock.size());
   better_insert(rblock, ablock);
   if (!send_reliably(sd, rblock))
     cerr << "error in sending reliably unreliable... rblock: " << rblock.data() << endl;
 
-  std::vector<uint8_t> servResponse = reliable_get_to_eof(sd);
-
-  if (!reset_aes_context(ctx, holy_key, 0)) 
+  // Decrypt the (possibly large) response as it arrives
+  recv_ticket(sd, holy_key);
+  std::vector<uint8_t> decryptResponse;
+  if (!response_context(ctx, holy_key)) 
     cerr << "error in resetting context line 446" << endl;
-
-  std::vector<uint8_t> decryptResponse = aes_crypt_msg(ctx, servResponse);
+  else if (!aes_recv_msg(sd, ctx, SIZE_MAX, decryptResponse))
+    cerr << "Error receiving response" << endl;
+  check_resume(decryptResponse);
   std::string s = getname + ".file.dat";
 
   // std::vector<uint8_t> finalResponse(decryptResponse.data(), decryptResponse.data() + 8);
@@ -444,8 +605,8 @@ void req_get(int sd, RSA *pubkey, const string &user, const string &pass,
 /// @param allfile The file where the result should go
 void req_all(int sd, RSA *pubkey, const string &user, const string &pass,
              const string &allfile, const string &) {
-  vector<uint8_t> holy_key = create_aes_key();
-  EVP_CIPHER_CTX *ctx = create_aes_context(holy_key, 1);
+  vector<uint8_t> holy_key = request_key(REQ_ALL);
+  EVP_CIPHER_CTX *ctx = request_context(holy_key);
   std::vector<uint8_t> ablock = OBlockGang(ctx, user, pass);
   std::vector<uint8_t> rblock = RBlockYay(REQ_ALL, holy_key, pubkey, ablock.size());
   better_insert(rblock, ablock);
@@ -453,12 +614,14 @@ void req_all(int sd, RSA *pubkey, const string &user, const string &pass,
   if (!send_reliably(sd, rblock))
     cerr << "bad boy! line 479 yoohoo!" << endl;
 
+  recv_ticket(sd, holy_key);
   std::vector<uint8_t> servResponse = reliable_get_to_eof(sd);
 
-  if (!reset_aes_context(ctx, holy_key, 0)) 
+  if (!response_context(ctx, holy_key)) 
     cerr << "error resetting context" << endl;
 
   std::vector<uint8_t> decryptResponse = aes_crypt_msg(ctx, servResponse);
+  check_resume(decryptResponse);
 
   if (!write_file(allfile, decryptResponse, 16)) 
     cerr << "error writing to file" << endl;
@@ -474,3 +637,131 @@ void req_all(int sd, RSA *pubkey, const string &user, const string &pass,
   assert(allfile.length() > 0);
 }
 
+
+/// Build the unencrypted @ablock for a request: len(@u).@u.len(@p).@p, and
+/// then len(@x).@x if there is an extra field
+///
+/// @param user  The name of the user doing the request
+/// @param pass  The password of the user doing the request
+/// @param extra The extra field, if any
+///
+/// @return The @ablock, before encryption
+static vector<uint8_t> plain_ablock(const string &user, const string &pass,
+                                    const vector<uint8_t> *extra) {
+  vector<uint8_t> ablock;
+  better_insert(ablock, (size_t)user.length());
+  better_insert(ablock, user);
+  better_insert(ablock, (size_t)pass.length());
+  better_insert(ablock, pass);
+  if (extra) {
+    better_insert(ablock, (size_t)extra->size());
+    better_insert(ablock, *extra);
+  }
+  return ablock;
+}
+
+/// req_pip() runs the commands in a file over one pipelined session, sending
+/// them all without waiting, and reporting each response as it arrives.  Each
+/// line of the file is a command and its argument, e.g. "SETPFILE file.txt" or
+/// "GETPFILE bob".  Results are saved to files just as for the same command
+/// run on its own.
+///
+/// @param sd        The open socket descriptor for communicating with the server
+/// @param pubkey    The public key of the server
+/// @param user      The name of the user doing the request
+/// @param pass      The password of the user doing the request
+/// @param batchfile The file of commands to run
+void req_pip(int sd, RSA *pubkey, const string &user, const string &pass,
+             const string &batchfile, const string &) {
+  // Parse the batch file, one "CMD [arg]" per line
+  vector<pair<string, string>> batch;
+  auto contents = load_entire_file(batchfile);
+  string text(contents.begin(), contents.end());
+  for (size_t pos = 0; pos < text.size();) {
+    size_t eol = text.find('\n', pos);
+    if (eol == string::npos)
+      eol = text.size();
+    string line = text.substr(pos, eol - pos);
+    pos = eol + 1;
+    if (line.empty())
+      continue;
+    size_t sp = line.find(' ');
+    batch.push_back({line.substr(0, sp),
+                     sp == string::npos ? "" : line.substr(sp + 1)});
+  }
+
+  // Start the session
+  vector<uint8_t> holy_key = request_key(REQ_PIPE);
+  EVP_CIPHER_CTX *ctx = request_context(holy_key);
+  vector<uint8_t> ablock = aes_crypt_msg(ctx, vector<uint8_t>());
+  vector<uint8_t> rblock = RBlockYay(REQ_PIPE, holy_key, pubkey, ablock.size());
+  better_insert(rblock, ablock);
+  if (!send_reliably(sd, rblock)) {
+    cerr << "Error sending pipelined session request" << endl;
+    return;
+  }
+  recv_ticket(sd, holy_key);
+
+  // Send every request from another thread, so that responses can be read
+  // (and the server doesn't block on a full socket) while we're still sending.
+  // If the server drops the session early, the sender's writes should fail
+  // rather than kill the client.
+  signal(SIGPIPE, SIG_IGN);
+  thread sender([&]() {
+    for (size_t i = 0; i < batch.size(); ++i) {
+      uint64_t id = i + 1;
+      const string &cmd = batch[i].first, &arg = batch[i].second;
+      vector<uint8_t> extra;
+      if (cmd == REQ_SET)
+        extra = load_entire_file(arg);
+      else if (cmd == REQ_GET)
+        extra.assign(arg.begin(), arg.end());
+      bool has_extra = cmd == REQ_SET || cmd == REQ_GET;
+      vector<uint8_t> plain = plain_ablock(user, pass, has_extra ? &extra : nullptr);
+
+      string wire_cmd = cmd;
+      wire_cmd.resize(8, '_');
+      EVP_CIPHER_CTX *fctx = thread_aes_context(
+          frame_aes_key(holy_key, "REQ_", id, wire_cmd), true, use_gcm);
+      vector<uint8_t> hdr;
+      better_insert(hdr, (size_t)id);
+      better_insert(hdr, wire_cmd);
+      better_insert(hdr, aes_encrypted_len(fctx, plain.size()));
+      if (!send_reliably(sd, hdr) || !aes_send_msg(sd, fctx, plain)) {
+        cerr << "Error sending request " << id << endl;
+        break;
+      }
+    }
+    shutdown(sd, SHUT_WR);
+  });
+
+  // Read responses as they arrive: id.len(@rfblock).@rfblock
+  vector<uint8_t> any_response;
+  while (true) {
+    vector<uint8_t> hdr(16);
+    if (reliable_get_to_eof_or_n(sd, hdr.begin(), 16) != 16)
+      break;
+    uint64_t id = *(uint64_t *)hdr.data();
+    uint64_t len = *(uint64_t *)(hdr.data() + 8);
+    vector<uint8_t> response;
+    EVP_CIPHER_CTX *fctx =
+        thread_aes_context(frame_aes_key(holy_key, "RES_", id), false, use_gcm);
+    if (!aes_recv_msg(sd, fctx, len, response) || id < 1 || id > batch.size()) {
+      cerr << "Error receiving response " << id << endl;
+      break;
+    }
+    any_response = {1};
+    const string &cmd = batch[id - 1].first, &arg = batch[id - 1].second;
+    string code(response.begin(), response.end());
+    if (code.compare(0, RES_OK.length(), RES_OK) == 0) {
+      code = RES_OK;
+      if (cmd == REQ_GET && !write_file(arg + ".file.dat", response, 16))
+        cerr << "error writing to file" << endl;
+      if (cmd == REQ_ALL && !write_file(arg, response, 16))
+        cerr << "error writing to file" << endl;
+    }
+    cout << id << " " << cmd << " " << code << endl;
+  }
+  sender.join();
+  check_resume(any_response);
+}
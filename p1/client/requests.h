@@ -3,6 +3,18 @@
 #include <openssl/rsa.h>
 #include <string>
 
+/// Choose whether subsequent requests use AES-256-GCM (see PROTO_GCM in
+/// protocol.h) or AES-256-CBC
+///
+/// @param gcm true to use AES-256-GCM
+void req_use_gcm(bool gcm);
+
+/// Cache session tickets in a file, and use them to skip the RSA handshake
+/// (see REQ_TICKET and REQ_RESUME in protocol.h)
+///
+/// @param file The file for the ticket
+void req_use_ticket(const std::string &file);
+
 /// req_key() writes a request for the server's key on a socket descriptor.
 /// When it gets a key back, it writes it to a file.
 ///
@@ -74,3 +86,15 @@ void req_get(int sd, RSA *pubkey, const std::string &user,
 void req_all(int sd, RSA *pubkey, const std::string &user,
              const std::string &pass, const std::string &allfile,
              const std::string &);
+
+/// req_pip() runs the commands in a file over one pipelined session.  Each
+/// line of the file is a command and its argument.
+///
+/// @param sd        The open socket descriptor for communicating with the server
+/// @param pubkey    The public key of the server
+/// @param user      The name of the user doing the request
+/// @param pass      The password of the user doing the request
+/// @param batchfile The file of commands to run
+void req_pip(int sd, RSA *pubkey, const std::string &user,
+             const std::string &pass, const std::string &batchfile,
+             const std::string &);
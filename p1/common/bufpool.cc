@@ -0,0 +1,82 @@
+#include <atomic>
+#include <vector>
+
+#include "bufpool.h"
+
+using namespace std;
+
+/// Count the size classes: BUFPOOL_MIN, 2*BUFPOOL_MIN, ..., BUFPOOL_MAX
+static constexpr int count_classes() {
+  int n = 1;
+  for (size_t s = BUFPOOL_MIN; s < BUFPOOL_MAX; s *= 2)
+    ++n;
+  return n;
+}
+
+/// The number of size classes
+static constexpr int BUFPOOL_CLASSES = count_classes();
+
+/// See bufpool_stats_t
+static atomic<size_t> hits{0}, misses{0};
+
+/// Get the calling thread's free lists, one per size class
+static vector<vector<uint8_t>> *free_lists() {
+  thread_local vector<vector<uint8_t>> lists[BUFPOOL_CLASSES];
+  return lists;
+}
+
+/// Get an empty buffer from the calling thread's pool
+///
+/// @param capacity The number of bytes the buffer must be able to hold
+///
+/// @return A vector with size 0 and capacity of at least `capacity`
+vector<uint8_t> bufpool_get(size_t capacity) {
+  vector<uint8_t> buf;
+  if (capacity > BUFPOOL_MAX) {
+    misses.fetch_add(1, memory_order_relaxed);
+    buf.reserve(capacity);
+    return buf;
+  }
+  // The smallest class that holds `capacity`
+  int c = 0;
+  size_t size = BUFPOOL_MIN;
+  while (size < capacity) {
+    size *= 2;
+    ++c;
+  }
+  auto &list = free_lists()[c];
+  if (!list.empty()) {
+    hits.fetch_add(1, memory_order_relaxed);
+    buf.swap(list.back());
+    list.pop_back();
+    return buf;
+  }
+  misses.fetch_add(1, memory_order_relaxed);
+  buf.reserve(size);
+  return buf;
+}
+
+/// Give a buffer back to the calling thread's pool.  If the pool is full, or
+/// the buffer is too big or too small to pool, it is freed.
+///
+/// @param buf The buffer, which is left empty
+void bufpool_put(vector<uint8_t> &&buf) {
+  vector<uint8_t> mine;
+  mine.swap(buf);
+  if (mine.capacity() < BUFPOOL_MIN || mine.capacity() >= 2 * BUFPOOL_MAX)
+    return;
+  // The largest class that `mine` can hold, so that a get from that class is
+  // always big enough
+  int c = 0;
+  for (size_t size = 2 * BUFPOOL_MIN;
+       size <= mine.capacity() && c + 1 < BUFPOOL_CLASSES; size *= 2)
+    ++c;
+  auto &list = free_lists()[c];
+  if (list.size() < BUFPOOL_DEPTH) {
+    mine.clear();
+    list.push_back(move(mine));
+  }
+}
+
+/// Get a snapshot of the pool's counters
+bufpool_stats_t bufpool_stats() { return {hits.load(), misses.load()}; }
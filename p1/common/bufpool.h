@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// bufpool.h provides a per-thread pool of byte buffers for the server's
+/// receive and decrypt paths.  Buffers are grouped into power-of-two size
+/// classes, from BUFPOOL_MIN up to BUFPOOL_MAX (enough for a full profile file
+/// plus framing and cipher overhead).  Each thread keeps a few free buffers of
+/// each class, so a worker that handles a stream of large requests reuses the
+/// same memory instead of going back to malloc for every request.
+///
+/// A buffer may be returned by a different thread than the one that got it;
+/// it then joins the returning thread's pool.  Requests larger than BUFPOOL_MAX
+/// are allocated and freed normally.
+
+/// The smallest size class
+const size_t BUFPOOL_MIN = 4096;
+
+/// The largest size class
+const size_t BUFPOOL_MAX = 2097152;
+
+/// The number of free buffers that a thread keeps in each size class
+const size_t BUFPOOL_DEPTH = 4;
+
+/// Counters describing how well the pool is working, across all threads
+struct bufpool_stats_t {
+  size_t hits;   // Gets satisfied from a free list
+  size_t misses; // Gets that had to allocate
+};
+
+/// Get an empty buffer from the calling thread's pool
+///
+/// @param capacity The number of bytes the buffer must be able to hold
+///
+/// @return A vector with size 0 and capacity of at least `capacity`
+std::vector<uint8_t> bufpool_get(size_t capacity);
+
+/// Give a buffer back to the calling thread's pool.  If the pool is full, or
+/// the buffer is too big or too small to pool, it is freed.
+///
+/// @param buf The buffer, which is left empty
+void bufpool_put(std::vector<uint8_t> &&buf);
+
+/// Get a snapshot of the pool's counters
+bufpool_stats_t bufpool_stats();
@@ -1,5 +1,8 @@
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <string>
 #include <sys/stat.h>
@@ -149,6 +152,52 @@ vector<uint8_t> create_aes_key() {
   return key;
 }
 
+/// Derive an AES key (and iv) from a secret and some context bytes, using
+/// HKDF-Expand with HMAC-SHA256.  Both ends of a connection can derive the same
+/// key, and different context bytes give unrelated keys.
+///
+/// @param secret  The secret to derive from (e.g., a resumed session's key)
+/// @param context The bytes that the derived key should be bound to
+/// @param len     The number of bytes in `context`
+///
+/// @return A vector holding the key and iv bits, or an empty vector on error
+vector<uint8_t> derive_aes_key(const vector<uint8_t> &secret,
+                               const unsigned char *context, size_t len) {
+  // T(i) = HMAC(secret, T(i-1) . context . i), concatenated until long enough
+  vector<uint8_t> key, block, t;
+  for (uint8_t i = 1; key.size() < AES_KEYSIZE + AES_IVSIZE; ++i) {
+    block = t;
+    block.insert(block.end(), context, context + len);
+    block.push_back(i);
+    t.resize(SHA256_DIGEST_LENGTH);
+    unsigned int tlen;
+    if (!HMAC(EVP_sha256(), secret.data(), secret.size(), block.data(),
+              block.size(), t.data(), &tlen))
+      return err<vector<uint8_t>>({}, "Error in HMAC(): ",
+                                  ERR_error_string(ERR_get_error(), 0));
+    key.insert(key.end(), t.begin(), t.end());
+  }
+  key.resize(AES_KEYSIZE + AES_IVSIZE);
+  return key;
+}
+
+/// Derive the key for one frame of a pipelined session (see REQ_PIPE in
+/// protocol.h)
+///
+/// @param aeskey The session's key and iv
+/// @param label  "REQ_" for a request frame, "RES_" for a response frame
+/// @param id     The frame's id
+/// @param cmd    The frame's command (request frames only)
+///
+/// @return The frame's key and iv, or an empty vector on error
+vector<uint8_t> frame_aes_key(const vector<uint8_t> &aeskey, const string &label,
+                              uint64_t id, const string &cmd) {
+  vector<uint8_t> binding(label.begin(), label.end());
+  binding.insert(binding.end(), (uint8_t *)&id, (uint8_t *)&id + sizeof(id));
+  binding.insert(binding.end(), cmd.begin(), cmd.end());
+  return derive_aes_key(aeskey, binding.data(), binding.size());
+}
+
 /// Create an aes context for doing a single encryption or decryption.  The
 /// context must be reset after each full encrypt/decrypt.
 ///
@@ -209,6 +258,53 @@ bool reset_aes_context(EVP_CIPHER_CTX *ctx, vector<uint8_t> &key,
   return true;
 }
 
+/// Get the calling thread's cached AES context, re-keyed for a single
+/// encryption or decryption.  The context is allocated the first time a thread
+/// calls this, and is re-keyed (not re-allocated) on every later call, so the
+/// caller must not reclaim it, and must finish with it before calling this
+/// again.
+///
+/// @param key      A vector holding the bits of the key and iv
+/// @param encrypt  true to encrypt, false to decrypt
+/// @param gcm      true for AES-256-GCM, false for AES-256-CBC
+/// @param response For AES-GCM, true if this context is for the server's
+///                 response.  Requests and responses share a key, so they must
+///                 use different nonces (see protocol.h).
+///
+/// @return The thread's AES context, or nullptr on error
+EVP_CIPHER_CTX *thread_aes_context(const vector<uint8_t> &key, bool encrypt,
+                                   bool gcm, bool response) {
+  // The context lives as long as the thread, and remembers which cipher it was
+  // last initialized with, so that we only pay for setting the cipher when the
+  // mode changes
+  thread_local unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx(
+      EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+  thread_local const EVP_CIPHER *current = nullptr;
+  if (!ctx)
+    return err<EVP_CIPHER_CTX *>(nullptr,
+                                 "Error: OpenSSL couldn't create context: ",
+                                 ERR_error_string(ERR_get_error(), 0));
+  if (key.size() != AES_KEYSIZE + AES_IVSIZE)
+    return err<EVP_CIPHER_CTX *>(nullptr, "Error: AES key has wrong length");
+
+  // For GCM, the response nonce is the request nonce with its top bit flipped
+  unsigned char iv[AES_IVSIZE];
+  memcpy(iv, key.data() + AES_KEYSIZE, AES_IVSIZE);
+  if (gcm && response)
+    iv[0] ^= 0x80;
+
+  const EVP_CIPHER *cipher = gcm ? EVP_aes_256_gcm() : EVP_aes_256_cbc();
+  if (!EVP_CipherInit_ex(ctx.get(), cipher == current ? nullptr : cipher,
+                         nullptr, key.data(), iv, encrypt)) {
+    current = nullptr;
+    return err<EVP_CIPHER_CTX *>(nullptr,
+                                 "Error: OpenSSL couldn't re-key context: ",
+                                 ERR_error_string(ERR_get_error(), 0));
+  }
+  current = cipher;
+  return ctx.get();
+}
+
 /// When an AES context is done being used, call this to reclaim its memory
 ///
 /// @param ctx The context to reclaim
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <openssl/pem.h>
+#include <string>
+#include <sys/uio.h>
 #include <vector>
 
 /// size of an RSA key
@@ -15,6 +17,24 @@ const int AES_IVSIZE = 16;
 /// Size of blocks that get encrypted
 const int AES_BLOCKSIZE = 1024;
 
+/// Number of bytes that the streaming functions (aes_send_msg/aes_recv_msg)
+/// encrypt or decrypt at a time
+const int AES_STREAM_CHUNK = 16 * AES_BLOCKSIZE;
+
+/// Number of bytes of ciphertext that aes_send_iov() gathers before handing
+/// them to the kernel in one sendmsg() call
+const size_t AES_SEND_BATCH = 4 * AES_STREAM_CHUNK;
+
+/// Messages whose ciphertext is at least this large are sent with MSG_ZEROCOPY,
+/// if aes_send_zerocopy(true) has been called
+const size_t AES_ZEROCOPY_MIN = 4 * AES_SEND_BATCH;
+
+/// Size of the nonce used by AES-GCM.  It is taken from the front of the iv.
+const int AES_GCM_IVSIZE = 12;
+
+/// Size of the authentication tag that AES-GCM appends to each message
+const int AES_GCM_TAGSIZE = 16;
+
 /// Load an RSA public key from the given filename
 ///
 /// @param filename The name of the file that has the public key in it
@@ -36,6 +56,99 @@ RSA *load_pub(const char *filename);
 std::vector<uint8_t> aes_crypt_msg(EVP_CIPHER_CTX *ctx,
                                    const std::vector<uint8_t> &msg);
 
+/// Run the AES symmetric encryption/decryption algorithm on a buffer, writing
+/// the result into a buffer provided by the caller.  `out` may be the same as
+/// `in`, so that a message can be encrypted or decrypted in place.  If the
+/// context is an AES-GCM context, then encryption appends the authentication
+/// tag to the output, and decryption expects the tag to be the last
+/// AES_GCM_TAGSIZE bytes of the input and fails if it does not match.  After
+/// calling, the CTX cannot be used again until it is reset.
+///
+/// @param ctx   The pre-configured AES context to use for this operation
+/// @param in    The bytes to encrypt/decrypt
+/// @param count The number of bytes in `in`
+/// @param out   Where to put the result.  It must have room for count +
+///              AES_IVSIZE + AES_GCM_TAGSIZE bytes.
+///
+/// @return The number of bytes written to `out`, or -1 on error
+int aes_crypt_buf(EVP_CIPHER_CTX *ctx, const unsigned char *in, int count,
+                  unsigned char *out);
+
+/// Compute the size of the ciphertext that an encryption context will produce
+/// for a message, so that it can be announced before the message is streamed.
+///
+/// @param ctx   An AES context configured for encryption
+/// @param count The number of bytes of plaintext
+///
+/// @return The number of bytes of ciphertext, including any GCM tag
+size_t aes_encrypted_len(EVP_CIPHER_CTX *ctx, size_t count);
+
+/// Encrypt a message and send it on a socket, AES_STREAM_CHUNK bytes at a
+/// time, so that the whole ciphertext is never held in memory and encryption
+/// overlaps with transmission.  The bytes on the wire are identical to
+/// send_reliably(sd, aes_crypt_msg(ctx, ...)).  After calling, the CTX cannot
+/// be used again until it is reset.
+///
+/// @param sd    The socket on which to send
+/// @param ctx   An AES context configured for encryption
+/// @param msg   The plaintext to send
+/// @param count The number of bytes in `msg`
+///
+/// @return true if the whole message was encrypted and sent, false otherwise
+bool aes_send_msg(int sd, EVP_CIPHER_CTX *ctx, const unsigned char *msg,
+                  size_t count);
+
+/// Encrypt a vector and send it on a socket (see above)
+bool aes_send_msg(int sd, EVP_CIPHER_CTX *ctx, const std::vector<uint8_t> &msg);
+
+/// Encrypt a string and send it on a socket (see above)
+bool aes_send_msg(int sd, EVP_CIPHER_CTX *ctx, const std::string &msg);
+
+/// Encrypt a message that is made of several pieces, and send it on a socket
+/// after an unencrypted prefix (e.g., a frame header), without first copying
+/// the pieces into one buffer.  Ciphertext is gathered into AES_SEND_BATCH-byte
+/// batches, and each batch goes out in a single sendmsg() call, along with the
+/// prefix for the first batch.  The bytes on the wire are identical to sending
+/// the prefix followed by aes_crypt_msg(ctx, concatenation of parts).  After
+/// calling, the CTX cannot be used again until it is reset.
+///
+/// @param sd      The socket on which to send
+/// @param ctx     An AES context configured for encryption
+/// @param prefix  The unencrypted pieces to send first
+/// @param nprefix The number of entries in `prefix`
+/// @param parts   The plaintext pieces of the message
+/// @param nparts  The number of entries in `parts`
+///
+/// @return true if everything was encrypted and sent, false otherwise
+bool aes_send_iov(int sd, EVP_CIPHER_CTX *ctx, const iovec *prefix,
+                  int nprefix, const iovec *parts, int nparts);
+
+/// Turn MSG_ZEROCOPY on or off for large messages sent by aes_send_iov().  It is
+/// off by default.  When it is on, the kernel transmits straight from our
+/// ciphertext buffers instead of copying them, and aes_send_iov() waits for the
+/// kernel to release the buffers before reusing them.  Sockets that don't
+/// support zero-copy fall back to an ordinary send.
+///
+/// @param enable true to use MSG_ZEROCOPY, false to not
+void aes_send_zerocopy(bool enable);
+
+/// Receive an encrypted message from a socket, decrypting each
+/// AES_STREAM_CHUNK-byte piece as it arrives, so that the whole ciphertext is
+/// never held in memory and decryption overlaps with transmission.  For
+/// AES-GCM, the last AES_GCM_TAGSIZE bytes are the tag.  After calling, the
+/// CTX cannot be used again until it is reset.
+///
+/// @param sd    The socket from which to read
+/// @param ctx   An AES context configured for decryption
+/// @param count The number of bytes of ciphertext to read, or SIZE_MAX to read
+///              until the socket is closed
+/// @param out   Set to the plaintext
+///
+/// @return true if the whole message was received and decrypted, false
+///         otherwise (including when the socket closes before `count` bytes)
+bool aes_recv_msg(int sd, EVP_CIPHER_CTX *ctx, size_t count,
+                  std::vector<uint8_t> &out);
+
 /// Run the AES symmetric encryption/decryption algorithm on a string. Note that
 /// this will do either encryption or decryption, depending on how the provided
 /// CTX has been configured.  After calling, the CTX cannot be used again until
@@ -55,6 +168,31 @@ std::vector<uint8_t> aes_crypt_msg(EVP_CIPHER_CTX *ctx, const std::string &msg);
 /// @return A vector holding the key and iv bits, or an empty vector on error
 std::vector<uint8_t> create_aes_key();
 
+/// Derive an AES key (and iv) from a secret and some context bytes, using
+/// HKDF-Expand with HMAC-SHA256.  Both ends of a connection can derive the same
+/// key, and different context bytes give unrelated keys.
+///
+/// @param secret  The secret to derive from (e.g., a resumed session's key)
+/// @param context The bytes that the derived key should be bound to
+/// @param len     The number of bytes in `context`
+///
+/// @return A vector holding the key and iv bits, or an empty vector on error
+std::vector<uint8_t> derive_aes_key(const std::vector<uint8_t> &secret,
+                                    const unsigned char *context, size_t len);
+
+/// Derive the key for one frame of a pipelined session (see REQ_PIPE in
+/// protocol.h)
+///
+/// @param aeskey The session's key and iv
+/// @param label  "REQ_" for a request frame, "RES_" for a response frame
+/// @param id     The frame's id
+/// @param cmd    The frame's command (request frames only)
+///
+/// @return The frame's key and iv, or an empty vector on error
+std::vector<uint8_t> frame_aes_key(const std::vector<uint8_t> &aeskey,
+                                   const std::string &label, uint64_t id,
+                                   const std::string &cmd = "");
+
 /// Create an aes context for doing a single encryption or decryption.  The
 /// context must be reset after each full encrypt/decrypt.
 ///
@@ -79,6 +217,24 @@ EVP_CIPHER_CTX *create_aes_context(const std::vector<uint8_t> &key,
 bool reset_aes_context(EVP_CIPHER_CTX *ctx, std::vector<uint8_t> &key,
                        bool encrypt);
 
+/// Get the calling thread's cached AES context, re-keyed for a single
+/// encryption or decryption.  The context is allocated the first time a thread
+/// calls this, and is re-keyed (not re-allocated) on every later call, so the
+/// caller must not reclaim it, and must finish with it before calling this
+/// again.
+///
+/// @param key      A vector holding the bits of the key and iv
+/// @param encrypt  true to encrypt, false to decrypt
+/// @param gcm      true for AES-256-GCM, false for AES-256-CBC
+/// @param response For AES-GCM, true if this context is for the server's
+///                 response.  Requests and responses share a key, so they must
+///                 use different nonces (see protocol.h).
+///
+/// @return The thread's AES context, or nullptr on error
+EVP_CIPHER_CTX *thread_aes_context(const std::vector<uint8_t> &key,
+                                   bool encrypt, bool gcm = false,
+                                   bool response = false);
+
 /// When an AES context is done being used, call this to reclaim its memory
 ///
 /// @param ctx The context to reclaim
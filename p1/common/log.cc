@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+
+using namespace std;
+
+/// How often the background thread drains the per-thread buffers
+const auto LOG_FLUSH_INTERVAL = chrono::milliseconds(5);
+
+/// Number of messages that each thread can have outstanding before new
+/// messages are dropped
+const size_t LOG_RING_SLOTS = 256;
+
+/// log_ring is a single-producer, single-consumer ring of log records.  The
+/// owning thread is the only writer of `head`, and the flusher thread is the
+/// only writer of `tail`, so neither side needs a lock.
+struct log_ring {
+  /// One message in the ring
+  struct record {
+    log_level lvl;            // The severity of the message
+    size_t len;               // The number of valid bytes in text
+    char text[LOG_LINE_MAX];  // The message text (not null-terminated)
+  };
+
+  record slots[LOG_RING_SLOTS]; // The records themselves
+  atomic<size_t> head{0};       // Next slot the owner will write
+  atomic<size_t> tail{0};       // Next slot the flusher will read
+};
+
+/// logger owns the registry of rings and the background flusher thread.  There
+/// is exactly one, created the first time anything is logged.
+class logger {
+  /// Every ring that has ever been handed out.  Rings are never freed before
+  /// the logger is destroyed, so a thread can exit while its messages are
+  /// still waiting to be written.
+  vector<log_ring *> rings;
+
+  /// Protects `rings`.  Only taken when a thread logs for the first time, and
+  /// by the flusher.
+  mutex rings_lock;
+
+  /// Serializes drain(), so that log_flush() and the flusher thread don't
+  /// interleave their output
+  mutex drain_lock;
+
+  /// Used to wake the flusher early when the logger is shutting down
+  mutex wake_lock;
+  condition_variable wake;
+
+  /// Set to false to stop the flusher
+  atomic<bool> running{true};
+
+public:
+  /// The lowest level that will be logged
+  atomic<log_level> level{log_level::info};
+
+  /// The number of messages dropped because a ring was full
+  atomic<size_t> dropped{0};
+
+  /// Construct the logger and start its background thread
+  logger() : flusher([&]() { run(); }) {}
+
+  /// Stop the flusher, write out any remaining messages, and free the rings
+  ~logger() {
+    {
+      lock_guard<mutex> g(wake_lock);
+      running = false;
+    }
+    wake.notify_one();
+    flusher.join();
+    drain();
+    for (auto r : rings)
+      delete r;
+  }
+
+  /// Create a ring for the calling thread and register it with the flusher
+  ///
+  /// @return The new ring
+  log_ring *make_ring() {
+    log_ring *r = new log_ring();
+    lock_guard<mutex> g(rings_lock);
+    rings.push_back(r);
+    return r;
+  }
+
+  /// Move every pending message from every ring to stdout/stderr
+  void drain() {
+    lock_guard<mutex> d(drain_lock);
+    vector<log_ring *> snapshot;
+    {
+      lock_guard<mutex> g(rings_lock);
+      snapshot = rings;
+    }
+    string out, errs;
+    for (auto r : snapshot) {
+      size_t t = r->tail.load(memory_order_relaxed);
+      size_t h = r->head.load(memory_order_acquire);
+      for (; t != h; ++t) {
+        auto &rec = r->slots[t % LOG_RING_SLOTS];
+        if (rec.lvl >= log_level::warn) {
+          errs += (rec.lvl == log_level::error) ? "[ERROR] " : "[WARN] ";
+          errs.append(rec.text, rec.len);
+          errs += '\n';
+        } else {
+          out.append(rec.text, rec.len);
+          out += '\n';
+        }
+      }
+      r->tail.store(t, memory_order_release);
+    }
+    // NB: We use stdio (not write()) so that our output stays ordered with
+    //     respect to anything else the program prints with cout
+    if (!out.empty()) {
+      fwrite(out.data(), 1, out.size(), stdout);
+      fflush(stdout);
+    }
+    if (!errs.empty()) {
+      fwrite(errs.data(), 1, errs.size(), stderr);
+      fflush(stderr);
+    }
+  }
+
+private:
+  /// The body of the flusher thread
+  void run() {
+    unique_lock<mutex> g(wake_lock);
+    while (running) {
+      wake.wait_for(g, LOG_FLUSH_INTERVAL);
+      g.unlock();
+      drain();
+      g.lock();
+    }
+  }
+
+  /// The background flusher.  NB: this must be the last field, so that
+  /// everything run() touches is constructed before the thread starts.
+  thread flusher;
+};
+
+/// Get the one logger, creating it on first use
+static logger &get_logger() {
+  static logger l;
+  return l;
+}
+
+/// Get the calling thread's ring, creating it on first use
+static log_ring *my_ring() {
+  thread_local log_ring *ring = get_logger().make_ring();
+  return ring;
+}
+
+/// Set the minimum severity of messages that should be logged.  The default is
+/// log_level::info.
+///
+/// @param lvl The lowest level that will be logged
+void log_set_level(log_level lvl) { get_logger().level = lvl; }
+
+/// Add a message to the calling thread's log buffer.  The message is the
+/// concatenation of the three parts, in the same manner as err().
+///
+/// @param lvl  The severity of the message
+/// @param msg1 The message to log
+/// @param msg2 More of the message to log
+/// @param msg3 More of the message to log
+void log_msg(log_level lvl, const char *msg1, const char *msg2,
+             const char *msg3) {
+  logger &l = get_logger();
+  if (lvl < l.level.load(memory_order_relaxed))
+    return;
+  log_ring *r = my_ring();
+  size_t h = r->head.load(memory_order_relaxed);
+  if (h - r->tail.load(memory_order_acquire) == LOG_RING_SLOTS) {
+    l.dropped.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+  // Copy the parts into the slot, truncating if they don't fit
+  auto &rec = r->slots[h % LOG_RING_SLOTS];
+  rec.lvl = lvl;
+  rec.len = 0;
+  for (const char *part : {msg1, msg2, msg3}) {
+    size_t n = min(strlen(part), LOG_LINE_MAX - rec.len);
+    memcpy(rec.text + rec.len, part, n);
+    rec.len += n;
+  }
+  r->head.store(h + 1, memory_order_release);
+}
+
+/// Write out everything that has been logged so far, from every thread.  This
+/// blocks until the messages have been written, so it should only be used when
+/// the program is shutting down.
+void log_flush() { get_logger().drain(); }
+
+/// Report how many messages have been dropped because a thread's buffer was
+/// full
+///
+/// @return The number of dropped messages since the program started
+size_t log_dropped() { return get_logger().dropped.load(); }
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+
+/// log.h provides a small asynchronous logging facility for the server.  A
+/// call to log_msg() copies the message into a ring buffer that belongs to the
+/// calling thread, without taking any locks or doing any I/O.  A background
+/// thread periodically drains every thread's ring and writes the messages to
+/// stdout (info/debug) or stderr (warn/error) in bulk.  This keeps console I/O,
+/// and the stdio lock, off of the accept loop and the request handlers.
+///
+/// If a thread's ring is full, the message is dropped and counted, rather than
+/// blocking the caller.  Messages longer than LOG_LINE_MAX are truncated.
+
+/// The severity of a log message.  Messages below the current level are
+/// discarded before they are copied.
+enum class log_level { debug, info, warn, error };
+
+/// Maximum number of bytes of text that a single log message can hold
+const size_t LOG_LINE_MAX = 240;
+
+/// Set the minimum severity of messages that should be logged.  The default is
+/// log_level::info.
+///
+/// @param lvl The lowest level that will be logged
+void log_set_level(log_level lvl);
+
+/// Add a message to the calling thread's log buffer.  The message is the
+/// concatenation of the three parts, in the same manner as err().
+///
+/// @param lvl  The severity of the message
+/// @param msg1 The message to log
+/// @param msg2 More of the message to log
+/// @param msg3 More of the message to log
+void log_msg(log_level lvl, const char *msg1, const char *msg2 = "",
+             const char *msg3 = "");
+
+/// Write out everything that has been logged so far, from every thread.  This
+/// blocks until the messages have been written, so it should only be used when
+/// the program is shutting down.
+void log_flush();
+
+/// Report how many messages have been dropped because a thread's buffer was
+/// full
+///
+/// @return The number of dropped messages since the program started
+size_t log_dropped();
+
+/// Log a message at the debug level
+inline void log_debug(const char *msg1, const char *msg2 = "",
+                      const char *msg3 = "") {
+  log_msg(log_level::debug, msg1, msg2, msg3);
+}
+
+/// Log a message at the info level
+inline void log_info(const char *msg1, const char *msg2 = "",
+                     const char *msg3 = "") {
+  log_msg(log_level::info, msg1, msg2, msg3);
+}
+
+/// Log a message at the warn level
+inline void log_warn(const char *msg1, const char *msg2 = "",
+                     const char *msg3 = "") {
+  log_msg(log_level::warn, msg1, msg2, msg3);
+}
+
+/// Log a message at the error level
+inline void log_error(const char *msg1, const char *msg2 = "",
+                      const char *msg3 = "") {
+  log_msg(log_level::error, msg1, msg2, msg3);
+}
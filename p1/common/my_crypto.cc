@@ -1,10 +1,19 @@
-#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <linux/errqueue.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <vector>
 
+#include "crypto.h"
 #include "err.h"
+#include "net.h"
 
 using namespace std;
 
@@ -20,6 +29,57 @@ void printVec(std::vector<uint8_t> VectorPrint) {
   printf("\n\n\n");
 }
 
+/// Run the AES symmetric encryption/decryption algorithm on a buffer, writing
+/// the result into a buffer provided by the caller.  `out` may be the same as
+/// `in`, so that a message can be encrypted or decrypted in place.  If the
+/// context is an AES-GCM context, then encryption appends the authentication
+/// tag to the output, and decryption expects the tag to be the last
+/// AES_GCM_TAGSIZE bytes of the input and fails if it does not match.  After
+/// calling, the CTX cannot be used again until it is reset.
+///
+/// @param ctx   The pre-configured AES context to use for this operation
+/// @param in    The bytes to encrypt/decrypt
+/// @param count The number of bytes in `in`
+/// @param out   Where to put the result.  It must have room for count +
+///              AES_IVSIZE + AES_GCM_TAGSIZE bytes.
+///
+/// @return The number of bytes written to `out`, or -1 on error
+int aes_crypt_buf(EVP_CIPHER_CTX *ctx, const unsigned char *in, int count,
+                  unsigned char *out) {
+  bool gcm = EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_GCM_MODE;
+  bool encrypt = EVP_CIPHER_CTX_encrypting(ctx);
+
+  // When decrypting GCM, the tag rides at the end of the ciphertext
+  if (gcm && !encrypt) {
+    if (count < AES_GCM_TAGSIZE)
+      return err(-1, "aes_crypt_buf: message too short for GCM tag");
+    count -= AES_GCM_TAGSIZE;
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AES_GCM_TAGSIZE,
+                             (void *)(in + count)))
+      return err(-1, "aes_crypt_buf: couldn't set GCM tag: ",
+                 ERR_error_string(ERR_get_error(), 0));
+  }
+
+  int len = 0, len_final = 0;
+  if (!EVP_CipherUpdate(ctx, out, &len, in, count))
+    return err(-1, "aes_crypt_buf: EVP_CipherUpdate failed: ",
+               ERR_error_string(ERR_get_error(), 0));
+  // NB: for GCM decryption, this is where a bad tag is detected
+  if (!EVP_CipherFinal_ex(ctx, out + len, &len_final))
+    return err(-1, "aes_crypt_buf: EVP_CipherFinal_ex failed: ",
+               ERR_error_string(ERR_get_error(), 0));
+  len += len_final;
+
+  if (gcm && encrypt) {
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AES_GCM_TAGSIZE,
+                             out + len))
+      return err(-1, "aes_crypt_buf: couldn't get GCM tag: ",
+                 ERR_error_string(ERR_get_error(), 0));
+    len += AES_GCM_TAGSIZE;
+  }
+  return len;
+}
+
 /// Run the AES symmetric encryption/decryption algorithm on a buffer of bytes.
 /// Note that this will do either encryption or decryption, depending on how the
 /// provided CTX has been configured.  After calling, the CTX cannot be used
@@ -31,29 +91,341 @@ void printVec(std::vector<uint8_t> VectorPrint) {
 /// @return A vector with the encrypted or decrypted result, or an empty
 ///         vector if there was an error
 vector<uint8_t> aes_crypt_msg(EVP_CIPHER_CTX *ctx, const unsigned char *start, int count) {
+  std::vector<uint8_t> out_buffo(count + EVP_MAX_BLOCK_LENGTH + AES_GCM_TAGSIZE);
+  int len = aes_crypt_buf(ctx, start, count, out_buffo.data());
+  if (len < 0)
+    return {};
+  out_buffo.resize(len);
+  return out_buffo;
+}
 
-  int cipher_block_size = EVP_CIPHER_block_size(EVP_CIPHER_CTX_cipher(ctx));
-  std::vector<uint8_t> out_buffo(count + cipher_block_size);
+/// Compute the size of the ciphertext that an encryption context will produce
+/// for a message, so that it can be announced before the message is streamed.
+///
+/// @param ctx   An AES context configured for encryption
+/// @param count The number of bytes of plaintext
+///
+/// @return The number of bytes of ciphertext, including any GCM tag
+size_t aes_encrypted_len(EVP_CIPHER_CTX *ctx, size_t count) {
+  if (EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_GCM_MODE)
+    return count + AES_GCM_TAGSIZE;
+  // CBC with PKCS#7 padding always adds between 1 and a whole block
+  size_t bs = EVP_CIPHER_CTX_block_size(ctx);
+  return (count / bs + 1) * bs;
+}
 
-  int len, len_out = 0, len_final = 0;
+/// Encrypt a message and send it on a socket, AES_STREAM_CHUNK bytes at a
+/// time, so that the whole ciphertext is never held in memory and encryption
+/// overlaps with transmission.  The bytes on the wire are identical to
+/// send_reliably(sd, aes_crypt_msg(ctx, ...)).  After calling, the CTX cannot
+/// be used again until it is reset.
+///
+/// @param sd    The socket on which to send
+/// @param ctx   An AES context configured for encryption
+/// @param msg   The plaintext to send
+/// @param count The number of bytes in `msg`
+///
+/// @return true if the whole message was encrypted and sent, false otherwise
+bool aes_send_msg(int sd, EVP_CIPHER_CTX *ctx, const unsigned char *msg,
+                  size_t count) {
+  iovec part = {(void *)msg, count};
+  return aes_send_iov(sd, ctx, nullptr, 0, &part, 1);
+}
 
-  if (!EVP_CipherUpdate(ctx, out_buffo.data() + len_out, &len, start, count)) {
-    cerr << "Improper EVP_CipherUpdate, rework it";
-    return {};
+/// Encrypt a vector and send it on a socket (see above)
+bool aes_send_msg(int sd, EVP_CIPHER_CTX *ctx, const vector<uint8_t> &msg) {
+  return aes_send_msg(sd, ctx, msg.data(), msg.size());
+}
+
+/// Encrypt a string and send it on a socket (see above)
+bool aes_send_msg(int sd, EVP_CIPHER_CTX *ctx, const string &msg) {
+  return aes_send_msg(sd, ctx, (const unsigned char *)msg.data(),
+                      msg.length());
+}
+
+/// Number of ciphertext buffers that aes_send_iov() rotates through, so that
+/// it can keep encrypting while the kernel still holds earlier zero-copy
+/// batches
+const int AES_SEND_BUFFERS = 4;
+
+/// Whether aes_send_iov() should use MSG_ZEROCOPY for large messages
+static atomic<bool> zerocopy_on{false};
+
+/// Turn MSG_ZEROCOPY on or off for large messages sent by aes_send_iov()
+///
+/// @param enable true to use MSG_ZEROCOPY, false to not
+void aes_send_zerocopy(bool enable) { zerocopy_on = enable; }
+
+namespace {
+/// iov_sender tracks one aes_send_iov() call's progress through the socket:
+/// the prefix that still has to go out, and how many zero-copy sends the
+/// kernel has yet to release.
+struct iov_sender {
+  int sd;                 // The socket on which to send
+  bool zerocopy;          // true if batches are sent with MSG_ZEROCOPY
+  vector<iovec> prefix;   // Unencrypted pieces that haven't been sent yet
+  size_t sends = 0;       // Zero-copy sendmsg() calls made so far
+  size_t released = 0;    // Zero-copy sends the kernel is done with
+};
+} // namespace
+
+/// Wait until the kernel has released the buffers of all but the most recent
+/// `keep` zero-copy sends, by reading completions from the socket's error
+/// queue
+///
+/// @param s    The sender
+/// @param keep The number of sends that may stay outstanding
+///
+/// @return true on success, false if the socket failed
+static bool reap_zerocopy(iov_sender &s, size_t keep) {
+#ifdef MSG_ZEROCOPY
+  while (s.sends - s.released > keep) {
+    char control[128];
+    msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(s.sd, &msg, MSG_ERRQUEUE) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return err(false, "aes_send_iov: error reading zero-copy completions");
+      // Nothing yet.  A completion shows up as POLLERR, so poll for that, but
+      // give up if the connection itself has failed.
+      pollfd pfd = {s.sd, 0, 0};
+      if (poll(&pfd, 1, 100) == 0) {
+        int e = 0;
+        socklen_t elen = sizeof(e);
+        if (getsockopt(s.sd, SOL_SOCKET, SO_ERROR, &e, &elen) < 0 || e != 0)
+          return err(false, "aes_send_iov: socket failed during zero-copy send");
+      }
+      if (pfd.revents & (POLLHUP | POLLNVAL))
+        return err(false, "aes_send_iov: socket closed during zero-copy send");
+      continue;
+    }
+    for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      auto *ee = (sock_extended_err *)CMSG_DATA(cm);
+      if (ee->ee_errno == 0 && ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+        s.released += ee->ee_data - ee->ee_info + 1; // Range [ee_info, ee_data]
+    }
   }
+#else
+  (void)s;
+  (void)keep;
+#endif
+  return true;
+}
 
-  len_out += len;
+/// Send any remaining prefix, followed by a batch of ciphertext, with as few
+/// sendmsg() calls as the kernel allows
+///
+/// @param s   The sender
+/// @param buf The ciphertext
+/// @param len The number of bytes in `buf`
+///
+/// @return true if everything was sent, false otherwise
+static bool send_batch(iov_sender &s, unsigned char *buf, size_t len) {
+  vector<iovec> iov;
+  iov.swap(s.prefix);
+  if (len > 0)
+    iov.push_back({buf, len});
+  int flags = 0;
+#ifdef MSG_ZEROCOPY
+  if (s.zerocopy)
+    flags = MSG_ZEROCOPY;
+#endif
+  size_t next = 0; // The first iovec that still has bytes to send
+  while (next < iov.size()) {
+    msghdr msg = {};
+    msg.msg_iov = iov.data() + next;
+    msg.msg_iovlen = iov.size() - next;
+    ssize_t sent = sendmsg(s.sd, &msg, flags);
+    if (sent < 0) {
+      // NB: ENOBUFS means the kernel can't pin any more of our pages, so the
+      //     rest of this message is sent the ordinary way
+      if (errno == ENOBUFS && flags != 0)
+        flags = 0;
+      else if (errno != EINTR)
+        return err(false, "Error in sendmsg(): ", strerror(errno));
+      continue;
+    }
+    if (flags != 0)
+      ++s.sends;
+    // Skip past whatever was sent, which may end partway through an iovec
+    while (next < iov.size() && (size_t)sent >= iov[next].iov_len)
+      sent -= iov[next++].iov_len;
+    if (next < iov.size()) {
+      iov[next].iov_base = (unsigned char *)iov[next].iov_base + sent;
+      iov[next].iov_len -= sent;
+    }
+  }
+  return true;
+}
 
-  if (1 != EVP_CipherFinal_ex(ctx, out_buffo.data() + len_out, &len_final)) {
-    cerr << "Improper EVP_CipherUpdate, rework it";
-    return {};
+/// Encrypt a message that is made of several pieces, and send it on a socket
+/// after an unencrypted prefix, without first copying the pieces into one
+/// buffer.  Ciphertext is gathered into AES_SEND_BATCH-byte batches, and each
+/// batch goes out in a single sendmsg() call, along with the prefix for the
+/// first batch.  After calling, the CTX cannot be used again until it is reset.
+///
+/// @param sd      The socket on which to send
+/// @param ctx     An AES context configured for encryption
+/// @param prefix  The unencrypted pieces to send first
+/// @param nprefix The number of entries in `prefix`
+/// @param parts   The plaintext pieces of the message
+/// @param nparts  The number of entries in `parts`
+///
+/// @return true if everything was encrypted and sent, false otherwise
+bool aes_send_iov(int sd, EVP_CIPHER_CTX *ctx, const iovec *prefix,
+                  int nprefix, const iovec *parts, int nparts) {
+  const size_t BUFSIZE =
+      AES_SEND_BATCH + AES_STREAM_CHUNK + EVP_MAX_BLOCK_LENGTH + AES_GCM_TAGSIZE;
+  thread_local vector<unsigned char> bufs[AES_SEND_BUFFERS];
+
+  iov_sender s;
+  s.sd = sd;
+  s.prefix.assign(prefix, prefix + nprefix);
+  size_t total = 0;
+  for (int i = 0; i < nparts; ++i)
+    total += parts[i].iov_len;
+  s.zerocopy = false;
+#ifdef MSG_ZEROCOPY
+  int one = 1;
+  if (zerocopy_on && aes_encrypted_len(ctx, total) >= AES_ZEROCOPY_MIN)
+    s.zerocopy =
+        setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+
+  // Ordinary sends copy the batch, so one buffer is enough.  Zero-copy sends
+  // rotate through all of them, and wait before reusing one that the kernel
+  // may still be reading.
+  size_t batch = 0;
+  auto next_buffer = [&]() -> unsigned char * {
+    auto &b = bufs[s.zerocopy ? batch % AES_SEND_BUFFERS : 0];
+    if (b.size() < BUFSIZE)
+      b.resize(BUFSIZE);
+    return b.data();
+  };
+  unsigned char *buf = next_buffer();
+  size_t fill = 0;
+  auto flush = [&]() {
+    if (!send_batch(s, buf, fill))
+      return false;
+    ++batch;
+    if (s.zerocopy && !reap_zerocopy(s, AES_SEND_BUFFERS - 1))
+      return false;
+    buf = next_buffer();
+    fill = 0;
+    return true;
+  };
+
+  bool ok = true;
+  for (int i = 0; ok && i < nparts; ++i) {
+    auto *msg = (const unsigned char *)parts[i].iov_base;
+    for (size_t off = 0; ok && off < parts[i].iov_len; off += AES_STREAM_CHUNK) {
+      int n = min(parts[i].iov_len - off, (size_t)AES_STREAM_CHUNK), len;
+      if (!EVP_CipherUpdate(ctx, buf + fill, &len, msg + off, n)) {
+        ok = err(false, "aes_send_iov: EVP_CipherUpdate failed: ",
+                 ERR_error_string(ERR_get_error(), 0));
+        break;
+      }
+      fill += len;
+      if (fill >= AES_SEND_BATCH)
+        ok = flush();
+    }
+  }
+  if (ok) {
+    int len;
+    if (!EVP_CipherFinal_ex(ctx, buf + fill, &len))
+      ok = err(false, "aes_send_iov: EVP_CipherFinal_ex failed: ",
+               ERR_error_string(ERR_get_error(), 0));
+    else {
+      fill += len;
+      if (EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_GCM_MODE) {
+        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AES_GCM_TAGSIZE,
+                                buf + fill))
+          fill += AES_GCM_TAGSIZE;
+        else
+          ok = err(false, "aes_send_iov: couldn't get GCM tag: ",
+                   ERR_error_string(ERR_get_error(), 0));
+      }
+    }
+    if (ok && (fill > 0 || !s.prefix.empty()))
+      ok = send_batch(s, buf, fill);
   }
+  // NB: Even on failure, the kernel may still be reading our buffers (and the
+  //     caller's prefix), so wait for it to let go of them before returning
+  return reap_zerocopy(s, 0) && ok;
+}
 
-  out_buffo.resize(len_out + len_final);
+/// Receive an encrypted message from a socket, decrypting each
+/// AES_STREAM_CHUNK-byte piece as it arrives, so that the whole ciphertext is
+/// never held in memory and decryption overlaps with transmission.  For
+/// AES-GCM, the last AES_GCM_TAGSIZE bytes are the tag.  After calling, the
+/// CTX cannot be used again until it is reset.
+///
+/// @param sd    The socket from which to read
+/// @param ctx   An AES context configured for decryption
+/// @param count The number of bytes of ciphertext to read, or SIZE_MAX to read
+///              until the socket is closed
+/// @param out   Set to the plaintext
+///
+/// @return true if the whole message was received and decrypted, false
+///         otherwise (including when the socket closes before `count` bytes)
+bool aes_recv_msg(int sd, EVP_CIPHER_CTX *ctx, size_t count,
+                  vector<uint8_t> &out) {
+  // For GCM we can't tell which bytes are the tag until the message ends, so
+  // the last AES_GCM_TAGSIZE bytes received are always held back
+  bool gcm = EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_GCM_MODE;
+  size_t hold = gcm ? AES_GCM_TAGSIZE : 0;
+  // NB: this is needed for every message, so each thread keeps its own
+  thread_local vector<uint8_t> chunk;
+  chunk.resize(AES_STREAM_CHUNK + hold);
+  size_t pending = 0; // bytes at the front of chunk not yet decrypted
+  size_t got = 0;     // total bytes of ciphertext received
+  out.clear();
+  // NB: count comes from the peer, so don't trust it for more than 1 MB up front
+  if (count != SIZE_MAX)
+    out.reserve(min(count, (size_t)64 * AES_STREAM_CHUNK));
 
-  return out_buffo;
-    // These asserts are just for preventing compiler warnings:
-    assert(ctx);
-    assert(start);
-    assert(count != -100);
+  while (got < count) {
+    int want = min(count - got, chunk.size() - pending);
+    int rcd = reliable_get_to_eof_or_n(sd, chunk.begin() + pending, want);
+    if (rcd < 0)
+      return false;
+    got += rcd;
+    pending += rcd;
+    if (pending > hold) {
+      int n = pending - hold, len;
+      size_t o = out.size();
+      out.resize(o + n + EVP_MAX_BLOCK_LENGTH);
+      if (!EVP_CipherUpdate(ctx, out.data() + o, &len, chunk.data(), n))
+        return err(false, "aes_recv_msg: EVP_CipherUpdate failed: ",
+                   ERR_error_string(ERR_get_error(), 0));
+      out.resize(o + len);
+      memmove(chunk.data(), chunk.data() + n, hold);
+      pending = hold;
+    }
+    if (rcd < want)
+      break; // EOF
   }
+  if (count != SIZE_MAX && got < count)
+    return err(false, "aes_recv_msg: connection closed before end of message");
+
+  if (gcm) {
+    if (pending < hold)
+      return err(false, "aes_recv_msg: message too short for GCM tag");
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AES_GCM_TAGSIZE,
+                             chunk.data()))
+      return err(false, "aes_recv_msg: couldn't set GCM tag: ",
+                 ERR_error_string(ERR_get_error(), 0));
+  }
+  int len;
+  size_t o = out.size();
+  out.resize(o + EVP_MAX_BLOCK_LENGTH);
+  // NB: for GCM, this is where a bad tag is detected
+  if (!EVP_CipherFinal_ex(ctx, out.data() + o, &len))
+    return err(false, "aes_recv_msg: EVP_CipherFinal_ex failed: ",
+               ERR_error_string(ERR_get_error(), 0));
+  out.resize(o + len);
+  return true;
+}
@@ -1,17 +1,17 @@
 #include <arpa/inet.h>
 #include <atomic>
 #include <functional>
-#include <iostream>
 #include <netdb.h>
 #include <unistd.h>
 
 #include "contextmanager.h"
 #include "err.h"
+#include "log.h"
 #include "net.h"
 
 using namespace std;
 
-/// Internal method to send a buffer of data over a socket.
+/// Send a buffer of data over a socket.
 ///
 /// @param sd    The socket on which to send
 /// @param bytes A pointer to the first byte of the data to send
@@ -97,8 +97,9 @@ int reliable_get_to_eof_or_n(int sd, vector<uint8_t>::iterator pos, int amnt) {
 ///
 /// @return A vector with the data that was read, or an empty vector on error
 vector<uint8_t> reliable_get_to_eof(int sd) {
-  // set up the initial buffer
-  vector<uint8_t> res(16);
+  // set up the initial buffer.  Most messages are at least a few hundred
+  // bytes, so starting bigger saves several rounds of doubling and copying.
+  vector<uint8_t> res(4096);
   int recd = 0;
   // start reading.  Double the buffer any time we fill up
   while (true) {
@@ -210,7 +211,7 @@ bool accept_client(int sd, thread_pool &pool) {
   // Use accept() to wait for a client to connect.  When it connects, hand it to
   // a thread pool for servicing
   while (pool.check_active()) {
-    cout << "Waiting for a client to connect...\n";
+    log_info("Waiting for a client to connect...");
     sockaddr_in clientAddr = {0, 0, 0, 0};
     socklen_t clientAddrSize = sizeof(clientAddr);
     int connSd = accept(sd, (sockaddr *)&clientAddr, &clientAddrSize);
@@ -221,10 +222,10 @@ bool accept_client(int sd, thread_pool &pool) {
         return err(false, "Error accepting request from client: ",
                    msg_from_errno(errno).c_str());
     }
-    char cliName[1024];
-    cout << "Connected to "
-         << inet_ntop(AF_INET, &clientAddr.sin_addr, cliName, sizeof(cliName))
-         << endl;
+    char cliName[INET_ADDRSTRLEN];
+    const char *name =
+        inet_ntop(AF_INET, &clientAddr.sin_addr, cliName, sizeof(cliName));
+    log_info("Connected to ", name ? name : "(unknown)");
     pool.service_connection(connSd);
   }
   return true;
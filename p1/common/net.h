@@ -6,6 +6,15 @@
 
 #include "pool.h"
 
+/// Send a buffer of data over a socket.
+///
+/// @param sd    The socket on which to send
+/// @param bytes A pointer to the first byte of the data to send
+/// @param len   The number of bytes to send
+///
+/// @return True if the whole buffer was sent, false otherwise
+bool reliable_send(int sd, const unsigned char *bytes, int len);
+
 /// Send a vector of data over a socket.
 ///
 /// @param sd  The socket on which to send
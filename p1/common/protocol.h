@@ -76,6 +76,59 @@ const int LEN_RBLOCK_CONTENT = 128;
 /// Length of salt
 const int LEN_SALT = 16;
 
+/// Protocol version marker for AES-256-GCM.  A client that wants its @ablock
+/// and the response to be authenticated places this immediately after
+/// len(@ablock) in the @rblock, i.e. padR(cmd.aeskey.len(@ablock)."AES__GCM").
+/// Without it, AES-256-CBC is used, as described for each request below.
+///
+/// In GCM mode, the nonce is the first AES_GCM_IVSIZE bytes of the iv in
+/// aeskey, and the response nonce is the same with the high bit of its first
+/// byte flipped, so that the request and response never share a nonce.  The
+/// @ablock and the encrypted response each have an AES_GCM_TAGSIZE-byte tag
+/// appended, and len(@ablock) includes the tag.  A tag that does not match
+/// results in ERR_CRYPTO.
+const std::string PROTO_GCM = "AES__GCM";
+
+/// Protocol version marker for AES-256-CBC.  It is only needed when something
+/// must follow the protocol version in the @rblock (e.g., REQ_TICKET).
+const std::string PROTO_CBC = "AES__CBC";
+
+/// Length of a session ticket
+const int LEN_TICKET = 88;
+
+/// Length of the client's random nonce in a @tblock
+const int LEN_RESUME_NONCE = 16;
+
+/// Ask the server for a session ticket.  A client places this after the
+/// protocol version in the @rblock, i.e.
+/// padR(cmd.aeskey.len(@ablock).proto."TICKET__"), where proto is PROTO_GCM or
+/// PROTO_CBC.  The server then prefixes its response with the ticket:
+///
+/// @response expiry.len(@ticket).@ticket.enc(aeskey, response).<EOF>
+///
+/// where expiry is an 8-byte binary Unix time after which the ticket will not
+/// be accepted.  If the server does not issue tickets, expiry and len(@ticket)
+/// are both 0.  The ticket is opaque to the client: it is the session's aeskey
+/// (and the expiry), encrypted and authenticated with a key that only the
+/// server knows.
+const std::string REQ_TICKET = "TICKET__";
+
+/// Resume a session on a new connection without an RSA handshake.  In place of
+/// the @rblock, the client sends a @tblock, which is not encrypted:
+///
+/// @tblock   pad0("RESUME__".cmd.proto.nonce.len(@ablock).len(@ticket).@ticket)
+///
+/// where cmd is any of the commands below, proto is PROTO_GCM or PROTO_CBC, and
+/// nonce is LEN_RESUME_NONCE fresh random bytes.  The key for this request is
+/// not the session's aeskey itself, but derive_aes_key(aeskey, cmd.proto.nonce)
+/// (see crypto.h), so that no two requests share a key and iv, and so that
+/// changing cmd or proto makes the @ablock undecryptable.  The rest of the
+/// request, and the response, are exactly as for the same command with an
+/// @rblock.  A ticket that is expired, forged, or whose nonce has already been
+/// used results in ERR_CRYPTO, after which the client should fall back to an
+/// @rblock.
+const std::string REQ_RESUME = "RESUME__";
+
 //
 // Request Messages
 //
@@ -201,6 +254,39 @@ const std::string REQ_GET = "GETPFILE";
 ///           ERR_CRYPTO      -- Server could not decrypt @ablock
 const std::string REQ_ALL = "ALLUSERS";
 
+/// Start a pipelined session, in which many requests share one connection, and
+/// their responses may come back in any order.  The @ablock is empty.  After
+/// the request (and the session ticket, if one was asked for), the client
+/// sends any number of request frames, and half-closes the connection when it
+/// has no more.  The server sends one response frame per request frame, and
+/// closes the connection once every request has been answered.
+///
+/// @rblock   enc(pubkey, padR("PIPELINE".aeskey.len(@ablock).proto))
+/// @ablock   enc(aeskey, "")
+/// @request  id.cmd.len(@fblock).@fblock
+/// @fblock   enc(derive_aes_key(aeskey, "REQ_".id.cmd), @ablock of cmd)
+/// @response id.len(@rfblock).@rfblock
+/// @rfblock  enc(derive_aes_key(aeskey, "RES_".id), response to cmd)
+///
+/// id is an 8-byte binary number, which must increase from one request frame
+/// to the next, so that no two frames share a key.  cmd is any of the
+/// commands above except PUB_KEY_ and PIPELINE, and the @ablock and response
+/// for each frame are exactly as documented for that command.  Requests made
+/// by the same user (@u) run in the order they were sent; requests made by
+/// different users may run concurrently, even if one reads what the other
+/// writes (e.g., alice's GETPFILE of bob may run before or after an earlier
+/// SETPFILE by bob).  A client that needs such a read to see the write must
+/// wait for the write's response first.  ALLUSERS, PERSIST_, and EXIT____
+/// wait for everything before them and hold back everything after them.
+///
+/// @errors   ERR_CRYPTO      -- (in a response frame) Server could not decrypt
+///                              @fblock
+///           ERR_INVALID_COMMAND -- (in a response frame) cmd is not allowed
+const std::string REQ_PIPE = "PIPELINE";
+
+/// Largest @fblock that the server will accept in a pipelined session
+const int LEN_PIPE_FRAME_MAX = LEN_PROFILE_FILE + 4096;
+
 //
 // Response Messages
 //
@@ -1,4 +1,5 @@
-# Build a client and server using the student's parsing.cc
+# Build a client and server using the student's parsing.cc (and responses.cc,
+# which the pipelined requests in parsing.cc depend on)
 
 # The executables will have the suffix .exe
 EXESUFFIX = exe
@@ -11,10 +12,10 @@ CLIENT_PROVIDED = client requests crypto err file net my_crypto
 
 # Names for building the server
 SERVER_MAIN     = server
-SERVER_CXX      = parsing
-SERVER_COMMON   = 
-SERVER_PROVIDED = server responses my_storage sequentialmap_factories crypto \
-                  err file net my_pool my_crypto
+SERVER_CXX      = parsing tickets pipeline responses
+SERVER_COMMON   = log crypto my_crypto bufpool
+SERVER_PROVIDED = server my_storage sequentialmap_factories \
+                  err file net my_pool
 
 # NB: This Makefile does not add extra CXXFLAGS
 
@@ -6,8 +6,8 @@ EXESUFFIX = exe
 # Names for building the client:
 CLIENT_MAIN     = client
 CLIENT_CXX      = requests
-CLIENT_COMMON   = 
-CLIENT_PROVIDED = client crypto err file net my_crypto
+CLIENT_COMMON   = crypto my_crypto
+CLIENT_PROVIDED = client err file net
 
 # Names for building the server
 SERVER_MAIN     = server
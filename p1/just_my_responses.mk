@@ -12,9 +12,9 @@ CLIENT_PROVIDED = client requests crypto err file net my_crypto
 # Names for building the server
 SERVER_MAIN     = server
 SERVER_CXX      = responses
-SERVER_COMMON   = 
+SERVER_COMMON   = log crypto my_crypto
 SERVER_PROVIDED = server parsing sequentialmap_factories \
-                  crypto err file net my_pool my_crypto my_storage
+                  err file net my_pool my_storage
 
 # Pull in the common build rules
 include common.mk
\ No newline at end of file
@@ -5,16 +5,25 @@
 EXESUFFIX = p1.nocrypt.exe
 
 # Names for building the client
+#
+# NB: client.cc calls requests that the provided requests.o doesn't have (GCM,
+#     tickets and pipelining), so requests.cc, and the crypto helpers it uses,
+#     are built from source for the client
 CLIENT_MAIN     = client
-CLIENT_CXX      = client
-CLIENT_COMMON   = err file net
-CLIENT_PROVIDED = crypto requests my_crypto
+CLIENT_CXX      = client requests
+CLIENT_COMMON   = err file net log crypto my_crypto
+CLIENT_PROVIDED = # no provided files needed for this client
 
 # Names for building the server
 SERVER_MAIN     = server
-SERVER_CXX      = server responses my_storage sequentialmap_factories
-SERVER_COMMON   = err file net my_pool
-SERVER_PROVIDED = parsing crypto my_crypto
+#
+# NB: server.cc and responses.cc likewise use the crypto stage, tickets,
+#     pipelining and vectored sends, which the provided parsing.o and crypto.o
+#     don't have, so those are built from source too
+SERVER_CXX      = server responses my_storage sequentialmap_factories \
+                  parsing crypto_stage tickets pipeline
+SERVER_COMMON   = err file net log crypto my_crypto bufpool
+SERVER_PROVIDED = my_pool
 
 # Names for building the benchmark executable
 BENCH_MAIN = # No benchmarks are built by this build
@@ -1,5 +1,5 @@
 # Build a client and server from the reference solution, but use the student's
-# server/parsing.cc and client/requests.cc.
+# server/parsing.cc, server/responses.cc and client/requests.cc.
 
 # The executables will have the suffix p1.rsa.exe
 EXESUFFIX = p1.rsa.exe
@@ -7,15 +7,15 @@ EXESUFFIX = p1.rsa.exe
 # Names for building the client
 CLIENT_MAIN     = client
 CLIENT_CXX      = requests
-CLIENT_COMMON   = # no common/*.cc files needed for this build
-CLIENT_PROVIDED = client crypto err file net my_crypto
+CLIENT_COMMON   = crypto my_crypto
+CLIENT_PROVIDED = client err file net
 
 # Names for building the server
 SERVER_MAIN     = server
-SERVER_CXX      = parsing 
-SERVER_COMMON   = # no common/*.cc files needed for this build
-SERVER_PROVIDED = server responses my_storage sequentialmap_factories \
-                  crypto my_crypto err file net my_pool
+SERVER_CXX      = parsing tickets pipeline responses
+SERVER_COMMON   = log crypto my_crypto bufpool
+SERVER_PROVIDED = server my_storage sequentialmap_factories \
+                  err file net my_pool
 
 # Names for building the benchmark executable
 BENCH_MAIN = # No benchmarks are built by this build
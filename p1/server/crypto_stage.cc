@@ -0,0 +1,147 @@
+#include <chrono>
+#include <cstdio>
+#include <pthread.h>
+#include <sched.h>
+
+#include "../common/log.h"
+
+#include "crypto_stage.h"
+#include "parsing.h"
+
+using namespace std;
+
+/// The most decrypts a crypto thread will take off the queue at once.  Taking
+/// several per wakeup amortizes the lock and the context switch during a burst
+/// of new connections.  Decrypts never block, so a batch can't be held up by a
+/// slow client.
+const size_t CRYPTO_BATCH = 8;
+
+/// Create the crypto threads
+///
+/// @param crypto_threads The number of crypto threads
+/// @param pin            true to pin each crypto thread to its own CPU
+/// @param pri            The private key used by the server
+/// @param report_secs    How often to log the queue counters (0 = never)
+crypto_stage::crypto_stage(int crypto_threads, bool pin, RSA *pri,
+                           size_t report_secs)
+    : pri(pri), nthreads(crypto_threads) {
+  int ncpu = thread::hardware_concurrency();
+  for (int i = 0; i < crypto_threads; ++i)
+    threads.emplace_back(&crypto_stage::run, this,
+                         (pin && ncpu > 0) ? i % ncpu : -1);
+  if (report_secs > 0)
+    threads.emplace_back(&crypto_stage::report, this, report_secs);
+}
+
+/// Stop the crypto threads.  Decrypts that haven't started fail.
+crypto_stage::~crypto_stage() {
+  {
+    lock_guard<mutex> g(lock);
+    running = false;
+    for (auto j : queue) {
+      j->done = true;
+      j->finished.notify_one();
+    }
+    queue.clear();
+  }
+  ready.notify_all();
+  stopping.notify_all();
+  for (auto &t : threads)
+    t.join();
+
+  auto s = stats();
+  char msg[LOG_LINE_MAX];
+  snprintf(msg, sizeof(msg),
+           "crypto_stage: %zu handshakes in %zu batches, max queue depth %zu",
+           s.handshakes, s.batches, s.max_depth);
+  log_debug(msg);
+}
+
+/// RSA-decrypt an @rblock on one of the crypto threads, and wait for it
+///
+/// @param enc The encrypted @rblock
+/// @param dec Set to the decrypted @rblock
+///
+/// @return true if the @rblock was decrypted
+bool crypto_stage::decrypt(const vector<uint8_t> &enc, vector<uint8_t> &dec) {
+  job_t job;
+  job.enc = &enc;
+  job.dec = &dec;
+  unique_lock<mutex> g(lock);
+  if (!running)
+    return false;
+  queue.push_back(&job);
+  if (queue.size() > max_depth)
+    max_depth = queue.size();
+  ready.notify_one();
+  job.finished.wait(g, [&]() { return job.done; });
+  return job.ok;
+}
+
+/// Get a snapshot of the queue counters
+crypto_stage::stats_t crypto_stage::stats() {
+  size_t depth;
+  {
+    lock_guard<mutex> g(lock);
+    depth = queue.size();
+  }
+  return {depth, max_depth, handshakes, batches};
+}
+
+/// The body of each crypto thread
+///
+/// @param cpu The CPU to pin to, or -1 to not pin
+void crypto_stage::run(int cpu) {
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      log_warn("crypto_stage: could not pin crypto thread to a CPU");
+  }
+  vector<job_t *> batch;
+  while (true) {
+    {
+      // Take this thread's share of the queue, up to CRYPTO_BATCH, so that
+      // one thread doesn't take work that an idle one could start on now
+      unique_lock<mutex> g(lock);
+      ready.wait(g, [&]() { return !running || !queue.empty(); });
+      if (!running)
+        return;
+      size_t share = (queue.size() + nthreads - 1) / nthreads;
+      while (!queue.empty() && batch.size() < min(share, CRYPTO_BATCH)) {
+        batch.push_back(queue.front());
+        queue.pop_front();
+      }
+    }
+    ++batches;
+    for (auto j : batch) {
+      bool ok = decrypt_rblock(pri, *j->enc, *j->dec);
+      ++handshakes;
+      // NB: The job lives on its worker's stack, so it must not be touched
+      //     once done is set and the lock is released
+      lock_guard<mutex> g(lock);
+      j->ok = ok;
+      j->done = true;
+      j->finished.notify_one();
+    }
+    batch.clear();
+  }
+}
+
+/// The body of the thread that logs the queue counters
+///
+/// @param secs How often to log them
+void crypto_stage::report(size_t secs) {
+  unique_lock<mutex> g(lock);
+  auto stopped = [&]() { return !running; };
+  while (!stopping.wait_for(g, chrono::seconds(secs), stopped)) {
+    size_t depth = queue.size();
+    char msg[LOG_LINE_MAX];
+    snprintf(msg, sizeof(msg),
+             "crypto_stage: queue depth %zu (max %zu), %zu handshakes in %zu "
+             "batches",
+             depth, max_depth.load(), handshakes.load(), batches.load());
+    log_info(msg);
+  }
+}
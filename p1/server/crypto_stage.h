@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <openssl/rsa.h>
+#include <thread>
+#include <vector>
+
+/// crypto_stage is the RSA stage of the server's request pipeline.  A worker
+/// thread reads each @rblock from its socket as usual, and then hands the
+/// RSA-decrypt (the expensive part of a request) to a small, fixed set of
+/// crypto threads, and waits for the result.  This bounds how many CPUs a
+/// burst of new connections can spend on handshakes, so that requests that
+/// have already made it past the handshake keep running.
+///
+/// NB: The crypto threads never touch a socket.  A slow or idle client holds
+///     up only the worker that is reading from it, exactly as it would without
+///     the stage, and the crypto threads can always be stopped.
+class crypto_stage {
+public:
+  /// Counters describing the crypto stage's queue
+  struct stats_t {
+    size_t depth;      // Decrypts currently waiting for a crypto thread
+    size_t max_depth;  // The largest that depth has ever been
+    size_t handshakes; // Number of @rblocks decrypted
+    size_t batches;    // Number of times a crypto thread took work
+  };
+
+  /// Create the crypto threads
+  ///
+  /// @param crypto_threads The number of crypto threads
+  /// @param pin            true to pin each crypto thread to its own CPU
+  /// @param pri            The private key used by the server
+  /// @param report_secs    How often to log the queue counters (0 = never)
+  crypto_stage(int crypto_threads, bool pin, RSA *pri, size_t report_secs);
+
+  /// Stop the crypto threads.  Decrypts that haven't started fail.
+  ~crypto_stage();
+
+  /// RSA-decrypt an @rblock on one of the crypto threads, and wait for it
+  ///
+  /// @param enc The encrypted @rblock
+  /// @param dec Set to the decrypted @rblock
+  ///
+  /// @return true if the @rblock was decrypted
+  bool decrypt(const std::vector<uint8_t> &enc, std::vector<uint8_t> &dec);
+
+  /// Get a snapshot of the queue counters
+  stats_t stats();
+
+private:
+  /// One decrypt, owned by the worker that is waiting for it
+  struct job_t {
+    const std::vector<uint8_t> *enc; // The encrypted @rblock
+    std::vector<uint8_t> *dec;       // The decrypted @rblock
+    bool done = false;               // Set once a crypto thread is finished
+    bool ok = false;                 // true if it decrypted
+    std::condition_variable finished; // Signals done
+  };
+
+  /// The body of each crypto thread
+  ///
+  /// @param cpu The CPU to pin to, or -1 to not pin
+  void run(int cpu);
+
+  /// The body of the thread that logs the queue counters
+  ///
+  /// @param secs How often to log them
+  void report(size_t secs);
+
+  RSA *pri;                          // The server's private key
+  std::deque<job_t *> queue;         // Decrypts awaiting a crypto thread
+  std::mutex lock;                   // Protects queue, running, and every job
+  std::condition_variable ready;     // Signals that queue has work, or a stop
+  std::condition_variable stopping;  // Signals a stop, to the reporter
+  bool running = true;               // false once shutdown starts
+  size_t nthreads;                   // The number of crypto threads
+  std::atomic<size_t> max_depth{0};  // See stats_t
+  std::atomic<size_t> handshakes{0}; // See stats_t
+  std::atomic<size_t> batches{0};    // See stats_t
+  std::vector<std::thread> threads;  // The crypto threads (and the reporter)
+};
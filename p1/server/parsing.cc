@@ -4,14 +4,18 @@
 #include <string>
 #include <vector>
 
+#include "../common/bufpool.h"
 #include "../common/contextmanager.h"
 #include "../common/crypto.h"
 #include "../common/err.h"
+#include "../common/log.h"
 #include "../common/net.h"
 #include "../common/protocol.h"
 
 #include "parsing.h"
+#include "pipeline.h"
 #include "responses.h"
+#include "tickets.h"
 
 using namespace std;
 
@@ -21,72 +25,190 @@ bool is_kblock(std::vector<uint8_t> &msg) {
   return key_check == REQ_KEY;
 }
 
+/// Turn a @tblock into the equivalent decrypted @rblock, by opening its ticket
+/// and deriving this request's key.  No RSA is needed.
+///
+/// @param tblock The @tblock, as received
+/// @param rb     Set to the result
+///
+/// @return true if the ticket was accepted
+static bool parse_tblock(const std::vector<uint8_t> &tblock, rblock_t &rb) {
+  // "RESUME__".cmd.proto.nonce.len(@ablock).len(@ticket).@ticket
+  const unsigned char *cmd = tblock.data() + 8;
+  const unsigned char *proto = cmd + 8;
+  const unsigned char *nonce = proto + 8;
+  const unsigned char *alen = nonce + LEN_RESUME_NONCE;
+  size_t tlen = *(size_t *)(alen + 8);
+  const unsigned char *ticket = alen + 16;
+  std::vector<uint8_t> session;
+  if (tlen != LEN_TICKET || !ticket_open(ticket, nonce, session)) {
+    log_warn("parse_request: session ticket rejected");
+    return rb.ok = false;
+  }
+  std::vector<uint8_t> aeskey = derive_aes_key(session, cmd, 16 + LEN_RESUME_NONCE);
+  if (aeskey.empty())
+    return rb.ok = false;
+
+  // Lay the fields out exactly as in a decrypted @rblock
+  rb.content.assign(cmd, cmd + 8);
+  rb.content.insert(rb.content.end(), aeskey.begin(), aeskey.end());
+  rb.content.insert(rb.content.end(), alen, alen + 8);
+  rb.content.insert(rb.content.end(), proto, proto + 8);
+  rb.content.resize(LEN_RKBLOCK);
+  rb.resumed = true;
+  return rb.ok = true;
+}
 
-/// When a new client connection is accepted, this code will run to figure out
-/// what the client is requesting, and to dispatch to the right function for
-/// satisfying the request.
+
+/// RSA-decrypt an @rblock
 ///
-/// @param sd      The socket on which communication with the client takes place
-/// @param pri     The private key used by the server
-/// @param pub     The public key file contents, to possibly send to the client
-/// @param storage The Storage object with which clients interact
+/// @param pri The private key used by the server
+/// @param enc The encrypted @rblock
+/// @param dec Set to the decrypted @rblock
 ///
-/// @return true if the server should halt immediately, false otherwise
-bool parse_request(int sd, RSA *pri, const vector<uint8_t> &pub,
-                   Storage *storage) {
+/// @return true if the @rblock was decrypted
+bool decrypt_rblock(RSA *pri, const std::vector<uint8_t> &enc,
+                    std::vector<uint8_t> &dec) {
+  dec.resize(LEN_RKBLOCK); // Length of @rblock AFTER DECRYPTION
+  return RSA_private_decrypt(enc.size(), enc.data(), dec.data(), pri,
+                             RSA_PKCS1_OAEP_PADDING) >= 0;
+}
 
-  std::vector<uint8_t> encryptedRSA(256);
-  std::vector<uint8_t> welcomehomeR;
+/// Read the @kblock or @rblock at the start of a request, and RSA-decrypt it.
+/// The decrypt is the expensive part of a request, so the server may hand it
+/// to a separate set of threads, while the read stays on the thread that owns
+/// the connection.
+///
+/// @param sd      The socket on which communication with the client takes
+///                place
+/// @param decrypt The code that RSA-decrypts an @rblock
+/// @param rb      Set to the result
+///
+/// @return true if the block was read (and decrypted, if it was an @rblock)
+bool parse_rblock(int sd, const rblock_decrypt_t &decrypt, rblock_t &rb) {
+
+  // NB: every request needs this buffer, so each thread keeps its own
+  thread_local std::vector<uint8_t> encryptedRSA(LEN_RKBLOCK);
+  memset(encryptedRSA.data(), 0, LEN_RKBLOCK);
 
   // cout << "HIT 1\n\n";
 
-  int bytes_received = reliable_get_to_eof_or_n(sd, encryptedRSA.begin(), 256); // getting the @rblock back
+  int bytes_received = reliable_get_to_eof_or_n(sd, encryptedRSA.begin(), LEN_RKBLOCK); // getting the @rblock back
 
   // cout << "Bytes from RSA retrieval: " << bytes_received << endl;
 
   if (is_kblock(encryptedRSA)) {
     // cout << "KEY MADE FIRST\n\n" << endl;
-    return handle_key(sd, pub);
+    rb.is_key = true;
+    return rb.ok = true;
   }
+  if (memcmp(encryptedRSA.data(), REQ_RESUME.data(), REQ_RESUME.length()) == 0)
+    return parse_tblock(encryptedRSA, rb);
 
   // cout << "HIT 2\n\n";
 
-  if (bytes_received == 0) {
-    cerr << "No bytes received from @rblock" << endl;
+  if (bytes_received <= 0) {
+    log_warn("parse_request: no bytes received for @rblock");
+    return rb.ok = false;
   }
-  unsigned char RSA_temp[LEN_RKBLOCK]; // Length of @rblock AFTER DECRYPTION 
 
   // cout << "HIT 3\n\n\n"<< endl; 
-  RSA_private_decrypt(encryptedRSA.size(), encryptedRSA.data(), RSA_temp, pri, RSA_PKCS1_OAEP_PADDING);
-  for (int i = 0; i < LEN_RKBLOCK; i++) {
-    welcomehomeR.push_back(RSA_temp[i]);
+  if (!decrypt(encryptedRSA, rb.content)) {
+    log_warn("parse_request: could not decrypt @rblock");
+    return rb.ok = false;
   }
+  return rb.ok = true;
+}
+
+/// Read the @kblock or @rblock at the start of a request, and RSA-decrypt it
+/// on the calling thread
+///
+/// @param sd  The socket on which communication with the client takes place
+/// @param pri The private key used by the server
+/// @param rb  Set to the result
+///
+/// @return true if the block was read (and decrypted, if it was an @rblock)
+bool parse_rblock(int sd, RSA *pri, rblock_t &rb) {
+  return parse_rblock(
+      sd,
+      [pri](const std::vector<uint8_t> &enc, std::vector<uint8_t> &dec) {
+        return decrypt_rblock(pri, enc, dec);
+      },
+      rb);
+}
+
+/// Finish a request whose @kblock or @rblock has already been handled by
+/// parse_rblock(): receive and decrypt the @ablock, and dispatch to the right
+/// function for satisfying the request.
+///
+/// @param sd      The socket on which communication with the client takes place
+/// @param rb      The result of parse_rblock() for this request
+/// @param pub     The public key file contents, to possibly send to the client
+/// @param storage The Storage object with which clients interact
+///
+/// @return true if the server should halt immediately, false otherwise
+bool finish_request(int sd, const rblock_t &rb, const vector<uint8_t> &pub,
+                    Storage *storage) {
+  if (rb.is_key)
+    return handle_key(sd, pub);
+  if (!rb.ok) {
+    send_reliably(sd, RES_ERR_CRYPTO);
+    return false;
+  }
+  const std::vector<uint8_t> &welcomehomeR = rb.content;
 
   // cout << "HIT 4\n\n\n" << endl;
   std::string CMD(welcomehomeR.data(), welcomehomeR.data() + 8); // std::string initalization beats insert()... 
 
-
   // cout << "\n\n\n\nCMD: " << CMD.c_str() << endl; 
 
   std::vector<uint8_t> aeskey(welcomehomeR.data() + 8, welcomehomeR.data() + 56);
 
   size_t len = *(size_t *)(welcomehomeR.data() + 56); // length of the @ablock using size_t casting instead of eightbytecastback
 
-  std::vector<uint8_t> welcomehomeA(len);
-
-  // cout << "HIT 5\n\n\n" << endl;
-  if (!reliable_get_to_eof_or_n(sd, welcomehomeA.begin(), len))
-    cerr << "Error in receiving aBlock" << endl;
-
+  // The protocol version follows len(@ablock); anything else there is padding,
+  // which means the client is speaking plain AES-CBC
+  bool gcm = memcmp(welcomehomeR.data() + 64, PROTO_GCM.data(),
+                    PROTO_GCM.length()) == 0;
+
+  // Decrypt @ablock as it arrives, with this thread's cached context, then
+  // re-key the same context for the response.  Streaming means that a large
+  // SETPFILE never has its whole ciphertext in memory, but the plaintext is
+  // still collected whole: the handlers, and Storage, take the whole profile,
+  // so this saves the ciphertext's copy, not the plaintext's.
+  // NB: len comes from the client, so it only sizes the buffer up to the
+  //     largest legal @ablock
+  std::vector<uint8_t> aBlock = bufpool_get(
+      min(len, (size_t)LEN_PROFILE_FILE + AES_BLOCKSIZE) + EVP_MAX_BLOCK_LENGTH);
+  ContextManager give_back([&]() { bufpool_put(move(aBlock)); });
+  EVP_CIPHER_CTX *ctx = thread_aes_context(aeskey, false, gcm);
+  if (!ctx || !aes_recv_msg(sd, ctx, len, aBlock)) {
+    send_reliably(sd, RES_ERR_CRYPTO);
+    return false;
+  }
 
-  // std::vector<uint8_t> welcomehomeA;
-  // reliable_get_to_eof_or_n(sd, welcomehomeA.begin(), len); // getting the @ablock back
+  // If the client asked for a session ticket, it comes before the response.
+  // NB: this must happen before ctx is re-keyed, since it uses the same one.
+  if (!rb.resumed && memcmp(welcomehomeR.data() + 72, REQ_TICKET.data(),
+                            REQ_TICKET.length()) == 0) {
+    std::vector<uint8_t> ticket;
+    uint64_t expiry = ticket_issue(aeskey, ticket);
+    uint64_t tlen = ticket.size();
+    std::vector<uint8_t> prefix(sizeof(expiry) + sizeof(tlen) + tlen);
+    memcpy(prefix.data(), &expiry, sizeof(expiry));
+    memcpy(prefix.data() + sizeof(expiry), &tlen, sizeof(tlen));
+    memcpy(prefix.data() + sizeof(expiry) + sizeof(tlen), ticket.data(), tlen);
+    if (!send_reliably(sd, prefix))
+      return false;
+  }
 
-  EVP_CIPHER_CTX *ctx = create_aes_context(aeskey, false);
-  std::vector<uint8_t> aBlock = aes_crypt_msg(ctx, welcomehomeA);
+  ctx = thread_aes_context(aeskey, true, gcm, true);
+  if (!ctx)
+    log_warn("parse_request: error resetting AES context");
 
-  if (!reset_aes_context(ctx, aeskey, true)) 
-    cerr << "Error in resetting context.." << endl;
+  // A pipelined session carries its own requests, in frames
+  if (CMD == REQ_PIPE)
+    return serve_pipeline(sd, aeskey, gcm, storage);
 
   std::vector<std::string> comm = {REQ_REG, REQ_BYE, REQ_SAV, REQ_SET, REQ_GET, REQ_ALL};
   decltype(handle_reg) *cmds[] = {handle_reg, handle_bye, handle_sav,
@@ -97,10 +219,26 @@ bool parse_request(int sd, RSA *pri, const vector<uint8_t> &pub,
       return cmds[i](sd, storage, ctx, aBlock);
 
   // NB: These assertions are only here to prevent compiler warnings
-  assert(pri);
   assert(storage);
   assert(pub.size() > 0);
   assert(sd);
 
   return false;
 }
+
+/// When a new client connection is accepted, this code will run to figure out
+/// what the client is requesting, and to dispatch to the right function for
+/// satisfying the request.
+///
+/// @param sd      The socket on which communication with the client takes place
+/// @param pri     The private key used by the server
+/// @param pub     The public key file contents, to possibly send to the client
+/// @param storage The Storage object with which clients interact
+///
+/// @return true if the server should halt immediately, false otherwise
+bool parse_request(int sd, RSA *pri, const vector<uint8_t> &pub,
+                   Storage *storage) {
+  rblock_t rb;
+  parse_rblock(sd, pri, rb);
+  return finish_request(sd, rb, pub, storage);
+}
@@ -1,10 +1,72 @@
 #pragma once
 
+#include <functional>
 #include <openssl/pem.h>
 #include <vector>
 
 #include "storage.h"
 
+/// rblock_t holds the result of the RSA stage of a request, so that it can be
+/// handed from the thread that decrypted it to the thread that finishes the
+/// request
+struct rblock_t {
+  bool ok = false;              // true if the block was read (and decrypted)
+  bool is_key = false;          // true if this is a KEY request (@kblock)
+  bool resumed = false;         // true if this came from a @tblock
+  std::vector<uint8_t> content; // The decrypted @rblock
+};
+
+/// A function that RSA-decrypts an @rblock, given the encrypted block and a
+/// vector to hold the decrypted one, and returns true on success
+typedef std::function<bool(const std::vector<uint8_t> &, std::vector<uint8_t> &)>
+    rblock_decrypt_t;
+
+/// RSA-decrypt an @rblock
+///
+/// @param pri The private key used by the server
+/// @param enc The encrypted @rblock
+/// @param dec Set to the decrypted @rblock
+///
+/// @return true if the @rblock was decrypted
+bool decrypt_rblock(RSA *pri, const std::vector<uint8_t> &enc,
+                    std::vector<uint8_t> &dec);
+
+/// Read the @kblock or @rblock at the start of a request, and RSA-decrypt it.
+/// The decrypt is the expensive part of a request, so the server may hand it
+/// to a separate set of threads (see crypto_stage.h), while the read stays on
+/// the thread that owns the connection.
+///
+/// @param sd      The socket on which communication with the client takes
+///                place
+/// @param decrypt The code that RSA-decrypts an @rblock
+/// @param rb      Set to the result
+///
+/// @return true if the block was read (and decrypted, if it was an @rblock)
+bool parse_rblock(int sd, const rblock_decrypt_t &decrypt, rblock_t &rb);
+
+/// Read the @kblock or @rblock at the start of a request, and RSA-decrypt it
+/// on the calling thread
+///
+/// @param sd  The socket on which communication with the client takes place
+/// @param pri The private key used by the server
+/// @param rb  Set to the result
+///
+/// @return true if the block was read (and decrypted, if it was an @rblock)
+bool parse_rblock(int sd, RSA *pri, rblock_t &rb);
+
+/// Finish a request whose @kblock or @rblock has already been handled by
+/// parse_rblock(): receive and decrypt the @ablock, and dispatch to the right
+/// function for satisfying the request.
+///
+/// @param sd      The socket on which communication with the client takes place
+/// @param rb      The result of parse_rblock() for this request
+/// @param pub     The public key file contents, to possibly send to the client
+/// @param storage The Storage object with which clients interact
+///
+/// @return true if the server should halt immediately, false otherwise
+bool finish_request(int sd, const rblock_t &rb,
+                    const std::vector<uint8_t> &pub, Storage *storage);
+
 /// When a new client connection is accepted, this code will run to figure out
 /// what the client is requesting, and to dispatch to the right function for
 /// satisfying the request.
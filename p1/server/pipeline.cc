@@ -0,0 +1,326 @@
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/bufpool.h"
+#include "../common/crypto.h"
+#include "../common/log.h"
+#include "../common/net.h"
+#include "../common/protocol.h"
+
+#include "pipeline.h"
+#include "responses.h"
+
+using namespace std;
+
+/// executor is a fixed set of threads that run tasks from a shared queue.  It
+/// is shared by every pipelined connection.
+class executor {
+  deque<function<void()>> tasks; // Tasks waiting for a thread
+  mutex lock;                    // Protects tasks and running
+  condition_variable ready;      // Signals that tasks has work
+  bool running = true;           // false once the executor is being destroyed
+  vector<thread> threads;        // The threads
+
+public:
+  /// Start the threads
+  ///
+  /// @param n The number of threads
+  executor(int n) {
+    for (int i = 0; i < n; ++i)
+      threads.emplace_back([this]() {
+        while (true) {
+          function<void()> task;
+          {
+            unique_lock<mutex> g(lock);
+            ready.wait(g, [&]() { return !running || !tasks.empty(); });
+            if (!running)
+              return;
+            task = move(tasks.front());
+            tasks.pop_front();
+          }
+          task();
+        }
+      });
+  }
+
+  /// Stop the threads.  Tasks that haven't started are dropped.
+  ~executor() {
+    {
+      lock_guard<mutex> g(lock);
+      running = false;
+    }
+    ready.notify_all();
+    for (auto &t : threads)
+      t.join();
+  }
+
+  /// Queue a task to run on one of the threads
+  ///
+  /// @param task The task
+  void submit(function<void()> task) {
+    {
+      lock_guard<mutex> g(lock);
+      tasks.push_back(move(task));
+    }
+    ready.notify_one();
+  }
+};
+
+/// The pipeline threads, or nullptr if pipeline_init() was not called
+static unique_ptr<executor> pipeline_threads;
+
+/// Start the threads that run pipelined requests.  If this is never called,
+/// pipelined requests run one at a time on the connection's own thread.
+///
+/// @param threads The number of threads to start
+void pipeline_init(int threads) {
+  if (threads > 0)
+    pipeline_threads.reset(new executor(threads));
+}
+
+namespace {
+/// pipe_conn is the state of one pipelined session.  Requests are sorted into
+/// lanes by the user who makes them.  Each lane runs its requests in order,
+/// one at a time, but different lanes run concurrently.
+struct pipe_conn {
+  int sd;                         // The connection
+  const vector<uint8_t> &aeskey;  // The session key
+  bool gcm;                       // true for AES-256-GCM
+  Storage *storage;               // The Storage object
+
+  mutex lock;                     // Protects lanes and outstanding
+  condition_variable idle;        // Signals that outstanding reached 0
+  size_t outstanding = 0;         // Requests received but not yet answered
+  unordered_map<string, deque<function<void()>>> lanes; // Pending, by user
+
+  mutex send_lock;                // Keeps response frames from interleaving
+  bool stop = false;              // Set once a request stops the server
+
+  // NB: Request buffers are taken on the connection's thread, but finished
+  //     with on pipeline threads.  Giving them to the pipeline thread's
+  //     bufpool would strand them there, so they come back here instead, for
+  //     the connection's thread to reuse.
+  mutex spare_lock;               // Protects spare
+  vector<vector<uint8_t>> spare;  // Request buffers that are free again
+
+  pipe_conn(int sd, const vector<uint8_t> &aeskey, bool gcm, Storage *storage)
+      : sd(sd), aeskey(aeskey), gcm(gcm), storage(storage) {}
+};
+} // namespace
+
+/// Encrypt a response and send it as a response frame
+///
+/// @param c        The session
+/// @param id       The id of the request being answered
+/// @param response The unencrypted response
+static void send_frame(pipe_conn &c, uint64_t id, const response_t &response) {
+  EVP_CIPHER_CTX *ctx =
+      thread_aes_context(frame_aes_key(c.aeskey, "RES_", id), true, c.gcm);
+  if (!ctx)
+    return;
+  uint64_t hdr[2] = {id, aes_encrypted_len(ctx, response.size())};
+  iovec header = {hdr, sizeof(hdr)}, parts[3];
+  int nparts = response.pieces(parts);
+  lock_guard<mutex> g(c.send_lock);
+  if (!aes_send_iov(c.sd, ctx, &header, 1, parts, nparts))
+    log_warn("serve_pipeline: error sending response frame");
+}
+
+/// Get a buffer for a request frame, preferring one that an earlier request in
+/// the session has given back.  Called by the connection's thread.
+///
+/// @param c        The session
+/// @param capacity The number of bytes the buffer must be able to hold
+///
+/// @return An empty buffer with at least `capacity` bytes of capacity
+static vector<uint8_t> frame_buffer(pipe_conn &c, size_t capacity) {
+  {
+    lock_guard<mutex> g(c.spare_lock);
+    for (auto &b : c.spare) {
+      if (b.capacity() >= capacity) {
+        vector<uint8_t> buf;
+        buf.swap(b);
+        swap(b, c.spare.back());
+        c.spare.pop_back();
+        return buf;
+      }
+    }
+  }
+  return bufpool_get(capacity);
+}
+
+/// Give a request frame's buffer back to its session.  Called by whichever
+/// thread ran the request.
+///
+/// @param c   The session
+/// @param buf The buffer, which is left empty
+static void frame_buffer_done(pipe_conn &c, vector<uint8_t> &&buf) {
+  vector<uint8_t> mine;
+  mine.swap(buf);
+  mine.clear();
+  lock_guard<mutex> g(c.spare_lock);
+  if (c.spare.size() < BUFPOOL_DEPTH)
+    c.spare.push_back(move(mine));
+}
+
+/// Make a response that is just an error code
+///
+/// @param code The error code
+///
+/// @return The response
+static response_t error_response(const string &code) {
+  response_t r;
+  r.set(code);
+  return r;
+}
+
+/// Find the lane for a request: the user who makes it, so that each user's
+/// requests run in the order they were sent.  (A GET is laned by the user who
+/// asks, not the one asked about, or it could pass the asker's own REG.)
+///
+/// @param cmd    The request's command
+/// @param req    The unencrypted request
+/// @param target Set to the user
+///
+/// @return true if the request belongs in one user's lane, false if it must
+///         not run concurrently with anything (or is malformed)
+static bool frame_target(const string &cmd, const vector<uint8_t> &req,
+                         string &target) {
+  if (cmd != REQ_REG && cmd != REQ_SET && cmd != REQ_GET)
+    return false;
+  // len(@u).@u...
+  if (req.size() < 8)
+    return false;
+  size_t len = *(size_t *)req.data();
+  if (req.size() - 8 < len)
+    return false;
+  target.assign(req.begin() + 8, req.begin() + 8 + len);
+  return true;
+}
+
+/// Run the next request in a lane, and keep going until the lane is empty
+///
+/// @param c    The session
+/// @param lane The lane's user
+static void drain_lane(pipe_conn &c, const string &lane) {
+  while (true) {
+    function<void()> task;
+    {
+      // NB: The moved-from task stays at the front until it is done, since
+      //     a non-empty lane is how serve_pipeline() knows that it's running
+      lock_guard<mutex> g(c.lock);
+      task = move(c.lanes[lane].front());
+    }
+    task();
+    lock_guard<mutex> g(c.lock);
+    auto &q = c.lanes[lane];
+    q.pop_front();
+    if (--c.outstanding == 0)
+      c.idle.notify_all();
+    if (q.empty()) {
+      c.lanes.erase(lane);
+      return;
+    }
+  }
+}
+
+/// Serve a pipelined session, until the client half-closes the connection and
+/// every request has been answered.
+///
+/// @param sd      The socket on which communication with the client takes place
+/// @param aeskey  The session's AES key and iv
+/// @param gcm     true if the session uses AES-256-GCM
+/// @param storage The Storage object with which clients interact
+///
+/// @return true if the server should halt immediately, false otherwise
+bool serve_pipeline(int sd, const vector<uint8_t> &aeskey, bool gcm,
+                    Storage *storage) {
+  vector<string> comm = {REQ_REG, REQ_BYE, REQ_SAV, REQ_SET, REQ_GET, REQ_ALL};
+  decltype(respond_reg) *cmds[] = {respond_reg, respond_bye, respond_sav,
+                                   respond_set, respond_get, respond_all};
+  pipe_conn c(sd, aeskey, gcm, storage);
+  uint64_t last_id = 0;
+
+  while (true) {
+    // Read the next frame: id.cmd.len(@fblock).@fblock
+    vector<uint8_t> hdr(24);
+    int got = reliable_get_to_eof_or_n(sd, hdr.begin(), hdr.size());
+    if (got == 0)
+      break; // The client has sent everything
+    uint64_t id = *(uint64_t *)hdr.data();
+    string cmd(hdr.begin() + 8, hdr.begin() + 16);
+    uint64_t len = *(uint64_t *)(hdr.data() + 16);
+    if (got != (int)hdr.size() || id <= last_id || len > LEN_PIPE_FRAME_MAX) {
+      log_warn("serve_pipeline: malformed frame, closing session");
+      break;
+    }
+    last_id = id;
+
+    vector<uint8_t> req = frame_buffer(c, len + EVP_MAX_BLOCK_LENGTH);
+    EVP_CIPHER_CTX *ctx =
+        thread_aes_context(frame_aes_key(aeskey, "REQ_", id, cmd), false, gcm);
+    if (!ctx || !aes_recv_msg(sd, ctx, len, req)) {
+      bufpool_put(move(req));
+      send_frame(c, id, error_response(RES_ERR_CRYPTO));
+      continue;
+    }
+    size_t which = 0;
+    while (which < comm.size() && comm[which] != cmd)
+      ++which;
+    if (which == comm.size()) {
+      bufpool_put(move(req));
+      send_frame(c, id, error_response(RES_ERR_INV_CMD));
+      continue;
+    }
+
+    // A request that doesn't belong to one lane waits for everything before
+    // it, and runs here, so nothing after it can start until it's done
+    string target;
+    bool in_lane = pipeline_threads && frame_target(cmd, req, target);
+
+    auto respond = cmds[which];
+    auto task = [&c, id, respond, req = move(req)]() mutable {
+      response_t response;
+      bool stop = respond(c.storage, req, response);
+      frame_buffer_done(c, move(req));
+      if (stop) {
+        lock_guard<mutex> g(c.lock);
+        c.stop = true;
+      }
+      send_frame(c, id, response);
+    };
+
+    if (!in_lane) {
+      unique_lock<mutex> g(c.lock);
+      c.idle.wait(g, [&]() { return c.outstanding == 0; });
+      g.unlock();
+      task();
+      lock_guard<mutex> g2(c.lock);
+      if (c.stop)
+        break;
+      continue;
+    }
+    lock_guard<mutex> g(c.lock);
+    ++c.outstanding;
+    auto &q = c.lanes[target];
+    q.push_back(move(task));
+    if (q.size() == 1)
+      pipeline_threads->submit([&c, target]() { drain_lane(c, target); });
+  }
+
+  // Don't let go of the session until every response has been sent, and then
+  // move its spare buffers into this thread's pool
+  unique_lock<mutex> g(c.lock);
+  c.idle.wait(g, [&]() { return c.outstanding == 0; });
+  for (auto &b : c.spare)
+    bufpool_put(move(b));
+  return c.stop;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+
+#include "storage.h"
+
+/// pipeline.h implements the server side of pipelined sessions (see REQ_PIPE
+/// in protocol.h).  The thread that owns the connection reads and decrypts
+/// request frames, and hands each one to a shared set of pipeline threads,
+/// which run the request and send its response frame as soon as it is ready.
+
+/// Start the threads that run pipelined requests.  If this is never called,
+/// pipelined requests run one at a time on the connection's own thread.
+///
+/// @param threads The number of threads to start
+void pipeline_init(int threads);
+
+/// Serve a pipelined session, until the client half-closes the connection and
+/// every request has been answered.
+///
+/// @param sd      The socket on which communication with the client takes place
+/// @param aeskey  The session's AES key and iv
+/// @param gcm     true if the session uses AES-256-GCM
+/// @param storage The Storage object with which clients interact
+///
+/// @return true if the server should halt immediately, false otherwise
+bool serve_pipeline(int sd, const std::vector<uint8_t> &aeskey, bool gcm,
+                    Storage *storage);
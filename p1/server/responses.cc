@@ -3,6 +3,7 @@
 #include <string>
 
 #include "../common/crypto.h"
+#include "../common/log.h"
 #include "../common/net.h"
 
 #include "responses.h"
@@ -37,59 +38,83 @@ int maybeEightByteCastback(std::vector<uint8_t> &please) {
 }
 
 
-/// Respond to an ALL command by generating a list of all the usernames in the
-/// Auth table and returning them, one per line.
+/// Set the response to just a result code
 ///
-/// @param sd      The socket onto which the result should be written
-/// @param storage The Storage object, which contains the auth table
-/// @param ctx     The AES encryption context
-/// @param req     The unencrypted contents of the request
+/// @param code The result code
+void response_t::set(const string &code) {
+  msg = code;
+  has_data = false;
+  data.clear();
+}
+
+/// Set the response to a result code, followed by len(data).data
+///
+/// @param code    The result code
+/// @param payload The data that goes with it, which is moved into the response
+void response_t::set(const string &code, vector<uint8_t> &&payload) {
+  msg = code;
+  has_data = true;
+  data = move(payload);
+  len = data.size();
+}
+
+/// Describe the response as the pieces that make it up, in order
+///
+/// @param out Where to put the pieces.  It must have room for 3.
+///
+/// @return The number of pieces
+int response_t::pieces(iovec *out) const {
+  out[0] = {(void *)msg.data(), msg.length()};
+  if (!has_data)
+    return 1;
+  out[1] = {(void *)&len, sizeof(len)};
+  out[2] = {(void *)data.data(), data.size()};
+  return 3;
+}
+
+/// Compute the number of bytes in the unencrypted response
+size_t response_t::size() const {
+  return msg.length() + (has_data ? sizeof(len) + data.size() : 0);
+}
+
+/// Compute the response to an ALL command: a list of all the usernames in the
+/// Auth table, one per line.
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param vec      The unencrypted contents of the request
+/// @param response Set to the response
 ///
 /// @return false, to indicate that the server shouldn't stop
-bool handle_all(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
-                const vector<uint8_t> &vec) {
-  std::vector<uint8_t> response; // response to the client's request
-  response.reserve(100);
+bool respond_all(Storage *storage, const vector<uint8_t> &vec,
+                 response_t &response) {
   size_t len = *(size_t *)(vec.data());
   std::string name(vec.data() + 8, vec.data() + 8 + len);
   size_t len_pass = *(size_t *)(vec.data() + 8 + name.length());
   std::string pass(vec.data() + 16 + name.length(), vec.data() + 16 + name.length() + len_pass);
 
   if (!storage->auth(name, pass).succeeded) {
-    cerr << "auth failed... " << name.c_str() << endl;
-    send_reliably(sd, aes_crypt_msg(ctx, RES_ERR_LOGIN));
+    log_warn("handle_all: auth failed for ", name.c_str());
+    response.set(RES_ERR_LOGIN);
   } else {
       auto tup = storage->get_all_users(name, pass);
-      if (tup.succeeded) {
-        response.insert(response.begin(), tup.msg.begin(), tup.msg.end());
-        size_t get_len = tup.data.size();
-        response.insert(response.end(), (uint8_t *)(&get_len), ((uint8_t *)&get_len) + sizeof(get_len));
-        response.insert(response.end(), tup.data.begin(), tup.data.end());
-        send_reliably(sd, aes_crypt_msg(ctx, response));
-      } else {
-          send_reliably(sd, aes_crypt_msg(ctx, tup.msg));
-    }
+      if (tup.succeeded)
+        response.set(tup.msg, move(tup.data));
+      else
+        response.set(tup.msg);
   }
-
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(vec.size() > 0);
   return false;
 }
 
-/// Respond to a SET command by putting the provided data into the Auth table
+/// Compute the response to a SET command, by putting the provided data into
+/// the Auth table
 ///
-/// @param sd      The socket onto which the result should be written
-/// @param storage The Storage object, which contains the auth table
-/// @param ctx     The AES encryption context
-/// @param req     The unencrypted contents of the request
+/// @param storage  The Storage object, which contains the auth table
+/// @param vec      The unencrypted contents of the request
+/// @param response Set to the response
 ///
 /// @return false, to indicate that the server shouldn't stop
-bool handle_set(int sd, Storage *storage, EVP_CIPHER_CTX *ctx, const vector<uint8_t> &vec) {
-  std::vector<uint8_t> response; // content to set & response to the client's request
-  response.reserve(100);
+bool respond_set(Storage *storage, const vector<uint8_t> &vec,
+                 response_t &response) {
   size_t len = *(size_t *)(vec.data());
   std::string name(vec.data() + 8, vec.data() + 8 + len);
   size_t len_pass = *(size_t *)(vec.data() + 8 + name.length());
@@ -97,35 +122,23 @@ bool handle_set(int sd, Storage *storage, EVP_CIPHER_CTX *ctx, const vector<uint
   size_t da_len = *(size_t *)(vec.data() + 16 + name.length() + pass.length());
   std::vector<uint8_t> content(vec.data() + 24 + name.length() + pass.length(), vec.data() + 24 + name.length() + da_len + pass.length());
   if (!storage->set_user_data(name, pass, content).succeeded) {
-    response = aes_crypt_msg(ctx, RES_ERR_LOGIN);
-    cerr << "set_user_data failed..." << endl;
+    response.set(RES_ERR_LOGIN);
+    log_warn("handle_set: set_user_data failed for ", name.c_str());
   } else {
-      response = aes_crypt_msg(ctx, RES_OK);
+      response.set(RES_OK);
   }
-
-  if (!send_reliably(sd, response))
-    cerr << "Ohh nah mama this aint right! Send that handle_reg: send response command once more :D";
-
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(vec.size() > 0);
   return false;
 }
 
-/// Respond to a GET command by getting the data for a user
+/// Compute the response to a GET command, by getting the data for a user
 ///
-/// @param sd      The socket onto which the result should be written
-/// @param storage The Storage object, which contains the auth table
-/// @param ctx     The AES encryption context
-/// @param req     The unencrypted contents of the request
+/// @param storage  The Storage object, which contains the auth table
+/// @param vec      The unencrypted contents of the request
+/// @param response Set to the response
 ///
 /// @return false, to indicate that the server shouldn't stop
-bool handle_get(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
-                const vector<uint8_t> &vec) {
-  std::vector<uint8_t> response; // content to set & response to the client's request
-  response.reserve(100);
+bool respond_get(Storage *storage, const vector<uint8_t> &vec,
+                 response_t &response) {
   size_t len = *(size_t *)(vec.data());
   std::string name(vec.data() + 8, vec.data() + 8 + len);
   size_t len_pass = *(size_t *)(vec.data() + 8 + name.length());
@@ -135,60 +148,165 @@ bool handle_get(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 
   if (storage->auth(name, pass).succeeded) { // must auth for correct client before storage calls
     auto tup = storage->get_user_data(name, pass, getname);
-    if (!tup.succeeded) {
-      send_reliably(sd, aes_crypt_msg(ctx, tup.msg)); // failed get_user_data
-    } else {
-        response.insert(response.begin(), tup.msg.begin(), tup.msg.end());
-        size_t get_len = tup.data.size();
-        response.insert(response.end(), (uint8_t *)(&get_len), ((uint8_t *)&get_len) + sizeof(get_len));
-        response.insert(response.end(), tup.data.begin(), tup.data.end());
-        send_reliably(sd, aes_crypt_msg(ctx, response));
-    }
+    if (!tup.succeeded)
+      response.set(tup.msg); // failed get_user_data
+    else
+      response.set(tup.msg, move(tup.data));
   } else
-      send_reliably(sd, aes_crypt_msg(ctx, RES_ERR_LOGIN)); // if auth failed.. 
-
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(vec.size() > 0);
+      response.set(RES_ERR_LOGIN); // if auth failed.. 
   return false;
 }
 
-/// Respond to a REG command by trying to add a new user
+/// Compute the response to a REG command, by trying to add a new user
 ///
-/// @param sd      The socket onto which the result should be written
-/// @param storage The Storage object, which contains the auth table
-/// @param ctx     The AES encryption context
-/// @param req     The unencrypted contents of the request
+/// @param storage  The Storage object, which contains the auth table
+/// @param vec      The unencrypted contents of the request
+/// @param response Set to the response
 ///
 /// @return false, to indicate that the server shouldn't stop
-bool handle_reg(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
-                const vector<uint8_t> &vec) {
-  std::vector<uint8_t> response; // response to the client's request
-  response.reserve(100);
+bool respond_reg(Storage *storage, const vector<uint8_t> &vec,
+                 response_t &response) {
   size_t len = *(size_t *)(vec.data());
   std::string name(vec.data() + 8, vec.data() + 8 + len);
   size_t len_pass = *(size_t *)(vec.data() + 8 + name.length());
   std::string pass(vec.data() + 16 + name.length(), vec.data() + 16 + name.length() + len_pass);
 
   if (!storage->add_user(name, pass).succeeded) {
-    cerr << "Ohh nah mama this aint right! Send that handle_reg: add user command once more :D";
-    response = aes_crypt_msg(ctx, RES_ERR_USER_EXISTS);
+    log_warn("handle_reg: add_user failed for ", name.c_str());
+    response.set(RES_ERR_USER_EXISTS);
   } else {
-      response = aes_crypt_msg(ctx, RES_OK);
+      response.set(RES_OK);
   }
+  return false;
+}
 
-  if (!send_reliably(sd, response))
-    cerr << "Ohh nah mama this aint right! Send that handle_reg: send response command once more :D";
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(vec.size() > 0);
+/// Compute the response to a BYE command, and shut down the storage if the
+/// user authenticates
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param vec      The unencrypted contents of the request
+/// @param response Set to the response
+///
+/// @return true, to indicate that the server should stop, or false on an error
+bool respond_bye(Storage *storage, const vector<uint8_t> &vec,
+                 response_t &response) {
+  size_t len = *(size_t *)(vec.data());
+  std::string name(vec.data() + 8, vec.data() + 8 + len);
+  size_t len_pass = *(size_t *)(vec.data() + 8 + name.length());
+  std::string pass(vec.data() + 16 + name.length(), vec.data() + 16 + name.length() + len_pass);
+
+  auto tup = storage->auth(name, pass);
+  if (!tup.succeeded) {
+    log_warn("handle_bye: auth failed for ", name.c_str());
+    response.set(RES_ERR_LOGIN);
+    return false;
+  }
+  storage->shutdown();
+  response.set(RES_OK);
+  return true;
+}
+
+/// Compute the response to a SAV command, and persist the file if the user
+/// authenticates
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param vec      The unencrypted contents of the request
+/// @param response Set to the response
+///
+/// @return false, to indicate that the server shouldn't stop
+bool respond_sav(Storage *storage, const vector<uint8_t> &vec,
+                 response_t &response) {
+  size_t len = *(size_t *)(vec.data());
+  std::string name(vec.data() + 8, vec.data() + 8 + len);
+  size_t len_pass = *(size_t *)(vec.data() + 8 + name.length());
+  std::string pass(vec.data() + 16 + name.length(), vec.data() + 16 + name.length() + len_pass);
+
+  auto tup = storage->auth(name, pass);
+  if (!tup.succeeded) {
+    log_warn("handle_sav: auth failed for ", name.c_str());
+    response.set(RES_ERR_LOGIN);
+  } else if (storage->save_file().succeeded) {
+    response.set(RES_OK);
+  } else
+    response.set(RES_ERR_SERVER);
   return false;
 }
 
+/// Run one of the respond_*() functions, and send its response on a socket.
+/// The response is encrypted as it is sent, so its ciphertext is never whole
+/// in memory, but its data (e.g., a profile from get_user_data()) is.
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param vec     The unencrypted contents of the request
+/// @param respond The function that computes the response
+/// @param name    The name of the handler, for error messages
+///
+/// @return The result of `respond`
+static bool respond_and_send(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                             const vector<uint8_t> &vec,
+                             decltype(respond_all) *respond, const char *name) {
+  response_t response;
+  bool stop = respond(storage, vec, response);
+  iovec parts[3];
+  if (!aes_send_iov(sd, ctx, nullptr, 0, parts, response.pieces(parts)))
+    log_warn(name, ": error sending response");
+  return stop;
+}
+
+/// Respond to an ALL command by generating a list of all the usernames in the
+/// Auth table and returning them, one per line.
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param req     The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_all(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                const vector<uint8_t> &vec) {
+  return respond_and_send(sd, storage, ctx, vec, respond_all, "handle_all");
+}
+
+/// Respond to a SET command by putting the provided data into the Auth table
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param req     The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_set(int sd, Storage *storage, EVP_CIPHER_CTX *ctx, const vector<uint8_t> &vec) {
+  return respond_and_send(sd, storage, ctx, vec, respond_set, "handle_set");
+}
+
+/// Respond to a GET command by getting the data for a user
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param req     The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_get(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                const vector<uint8_t> &vec) {
+  return respond_and_send(sd, storage, ctx, vec, respond_get, "handle_get");
+}
+
+/// Respond to a REG command by trying to add a new user
+///
+/// @param sd      The socket onto which the result should be written
+/// @param storage The Storage object, which contains the auth table
+/// @param ctx     The AES encryption context
+/// @param req     The unencrypted contents of the request
+///
+/// @return false, to indicate that the server shouldn't stop
+bool handle_reg(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
+                const vector<uint8_t> &vec) {
+  return respond_and_send(sd, storage, ctx, vec, respond_reg, "handle_reg");
+}
+
 /// In response to a request for a key, do a reliable send of the contents of
 /// the pubfile
 ///
@@ -198,7 +316,7 @@ bool handle_reg(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 /// @return false, to indicate that the server shouldn't stop
 bool handle_key(int sd, const vector<uint8_t> &pubfile) {
   if (!send_reliably(sd, pubfile))
-    cerr << "how did u not send the inital key man cmon..";
+    log_warn("handle_key: error sending public key");
   // NB: These asserts are to prevent compiler warnings
   assert(sd);
   assert(pubfile.size() > 0);
@@ -216,28 +334,7 @@ bool handle_key(int sd, const vector<uint8_t> &pubfile) {
 /// @return true, to indicate that the server should stop, or false on an error
 bool handle_bye(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const vector<uint8_t> &vec) {
-  size_t len = *(size_t *)(vec.data());
-  std::string name(vec.data() + 8, vec.data() + 8 + len);
-  size_t len_pass = *(size_t *)(vec.data() + 8 + name.length());
-  std::string pass(vec.data() + 16 + name.length(), vec.data() + 16 + name.length() + len_pass);
-  std::vector<uint8_t> response; 
-
-  auto tup = storage->auth(name, pass);
-  if (!tup.succeeded) {
-    cerr << "Ohh nah mama this aint right! Send that handle_reg: add user command once more :D";
-    response = aes_crypt_msg(ctx, RES_ERR_LOGIN);
-  } else {
-      storage->shutdown();
-      send_reliably(sd, aes_crypt_msg(ctx, RES_OK));
-      return true;
-  }
-
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(vec.size() > 0);
-  return false;
+  return respond_and_send(sd, storage, ctx, vec, respond_bye, "handle_bye");
 }
 
 /// Respond to a SAV command by persisting the file, but only if the user
@@ -251,31 +348,5 @@ bool handle_bye(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
 /// @return false, to indicate that the server shouldn't stop
 bool handle_sav(int sd, Storage *storage, EVP_CIPHER_CTX *ctx,
                 const vector<uint8_t> &vec) {
-  size_t len = *(size_t *)(vec.data());
-  std::string name(vec.data() + 8, vec.data() + 8 + len);
-  size_t len_pass = *(size_t *)(vec.data() + 8 + name.length());
-  std::string pass(vec.data() + 16 + name.length(), vec.data() + 16 + name.length() + len_pass);
-  std::vector<uint8_t> response; 
-
-  auto tup = storage->auth(name, pass);
-
-  if (!tup.succeeded) {
-    cerr << "Ohh nah mama this aint right! Send that handle_reg: add user command once more :D";
-    response = aes_crypt_msg(ctx, RES_ERR_LOGIN);
-    send_reliably(sd, response);
-  } else {
-      if (storage->save_file().succeeded) {
-        response = aes_crypt_msg(ctx, RES_OK);
-        send_reliably(sd, response);
-    } else
-        send_reliably(sd, aes_crypt_msg(ctx, RES_ERR_SERVER)); 
-  }
-
-
-  // NB: These asserts are to prevent compiler warnings
-  assert(sd);
-  assert(storage);
-  assert(ctx);
-  assert(vec.size() > 0);
-  return false;
-}
\ No newline at end of file
+  return respond_and_send(sd, storage, ctx, vec, respond_sav, "handle_sav");
+}
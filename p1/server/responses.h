@@ -1,12 +1,109 @@
 #pragma once
 
 #include <openssl/pem.h>
+#include <string>
+#include <sys/uio.h>
 #include <vector>
 
 #include "../common/protocol.h"
 
 #include "storage.h"
 
+/// response_t is an unencrypted response, kept as its separate pieces (a result
+/// code, optionally followed by len(data).data), so that it can be encrypted
+/// and sent by aes_send_iov() without first being copied into one buffer.
+struct response_t {
+  std::string msg;           // The result code
+  bool has_data = false;     // true if len(data).data follows the result code
+  uint64_t len = 0;          // The length of data, as it is sent
+  std::vector<uint8_t> data; // The data that goes with the result code
+
+  /// Set the response to just a result code
+  ///
+  /// @param code The result code
+  void set(const std::string &code);
+
+  /// Set the response to a result code, followed by len(data).data
+  ///
+  /// @param code    The result code
+  /// @param payload The data that goes with it, which is moved into the response
+  void set(const std::string &code, std::vector<uint8_t> &&payload);
+
+  /// Describe the response as the pieces that make it up, in order
+  ///
+  /// @param out Where to put the pieces.  It must have room for 3.
+  ///
+  /// @return The number of pieces
+  int pieces(iovec *out) const;
+
+  /// Compute the number of bytes in the unencrypted response
+  size_t size() const;
+};
+
+/// Compute the response to an ALL command: a list of all the usernames in the
+/// Auth table, one per line.
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param req      The unencrypted contents of the request
+/// @param response Set to the response
+///
+/// @return false, to indicate that the server shouldn't stop
+bool respond_all(Storage *storage, const std::vector<uint8_t> &req,
+                 response_t &response);
+
+/// Compute the response to a SET command, by putting the provided data into
+/// the Auth table
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param req      The unencrypted contents of the request
+/// @param response Set to the response
+///
+/// @return false, to indicate that the server shouldn't stop
+bool respond_set(Storage *storage, const std::vector<uint8_t> &req,
+                 response_t &response);
+
+/// Compute the response to a GET command, by getting the data for a user
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param req      The unencrypted contents of the request
+/// @param response Set to the response
+///
+/// @return false, to indicate that the server shouldn't stop
+bool respond_get(Storage *storage, const std::vector<uint8_t> &req,
+                 response_t &response);
+
+/// Compute the response to a REG command, by trying to add a new user
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param req      The unencrypted contents of the request
+/// @param response Set to the response
+///
+/// @return false, to indicate that the server shouldn't stop
+bool respond_reg(Storage *storage, const std::vector<uint8_t> &req,
+                 response_t &response);
+
+/// Compute the response to a BYE command, and shut down the storage if the
+/// user authenticates
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param req      The unencrypted contents of the request
+/// @param response Set to the response
+///
+/// @return true, to indicate that the server should stop, or false on an error
+bool respond_bye(Storage *storage, const std::vector<uint8_t> &req,
+                 response_t &response);
+
+/// Compute the response to a SAV command, and persist the file if the user
+/// authenticates
+///
+/// @param storage  The Storage object, which contains the auth table
+/// @param req      The unencrypted contents of the request
+/// @param response Set to the response
+///
+/// @return false, to indicate that the server shouldn't stop
+bool respond_sav(Storage *storage, const std::vector<uint8_t> &req,
+                 response_t &response);
+
 /// In response to a request for a key, do a reliable send of the contents of
 /// the pubfile
 ///
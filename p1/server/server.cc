@@ -4,15 +4,20 @@
 #include <string>
 #include <unistd.h>
 
+#include "../common/bufpool.h"
 #include "../common/contextmanager.h"
 #include "../common/crypto.h"
 #include "../common/err.h"
 #include "../common/file.h"
+#include "../common/log.h"
 #include "../common/net.h"
 #include "../common/pool.h"
 
+#include "crypto_stage.h"
 #include "parsing.h"
+#include "pipeline.h"
 #include "storage.h"
+#include "tickets.h"
 
 using namespace std;
 
@@ -29,6 +34,12 @@ struct arg_t {
   size_t quota_req = 16;       // K/V request quota (requests/interval)
   size_t top_size = 4;         // Number of keys to track for TOP queries
   string admin_name = "";      // Name of the administrator
+  int crypto_threads = 1;      // Threads for RSA handshakes (0 = workers)
+  bool pin_crypto = false;     // Pin each crypto thread to its own CPU
+  size_t crypto_report = 0;    // Seconds between crypto stage stats (0 = none)
+  bool verbose = false;        // Log debug messages
+  size_t ticket_lifetime = 3600; // Seconds a session ticket lasts (0 = none)
+  bool zerocopy = false;       // Send large responses with MSG_ZEROCOPY
 
   /// Construct an arg_t from the command-line arguments to the program
   ///
@@ -39,7 +50,7 @@ struct arg_t {
   ///        `-h` is passed in
   arg_t(int argc, char **argv) {
     long opt;
-    while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:c:Pm:vT:z")) != -1) {
       switch (opt) {
       case 'p':
         port = atoi(optarg);
@@ -74,6 +85,24 @@ struct arg_t {
       case 'a':
         admin_name = string(optarg);
         break;
+      case 'c':
+        crypto_threads = atoi(optarg);
+        break;
+      case 'P':
+        pin_crypto = true;
+        break;
+      case 'm':
+        crypto_report = atoi(optarg);
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      case 'T':
+        ticket_lifetime = atoi(optarg);
+        break;
+      case 'z':
+        zerocopy = true;
+        break;
       default: // on any error, print a help message.  This case subsumes `-h`
         throw 1;
         return;
@@ -98,6 +127,12 @@ struct arg_t {
          << "  -r [int]    Request quota (requests/interval)\n"
          << "  -o [int]    Size of the TOP key cache\n"
          << "  -a [string] Specify name of admin user\n"
+         << "  -c [int]    # of threads for RSA handshakes (0 = use -t threads)\n"
+         << "  -P          Pin each RSA handshake thread to its own CPU\n"
+         << "  -m [int]    Seconds between RSA handshake queue stats (0 = none)\n"
+         << "  -v          Log debug messages (e.g., handshake queue stats)\n"
+         << "  -T [int]    Session ticket lifetime in seconds (0 = no tickets)\n"
+         << "  -z          Send large responses with MSG_ZEROCOPY\n"
          << "  -h          Print help (this message)\n";
   }
 };
@@ -115,6 +150,9 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (args->verbose)
+    log_set_level(log_level::debug);
+
   // print the configuration
   cout << "Listening on port " << args->port << " using (key/data) = ("
        << args->keyfile << ", " << args->datafile << ")\n";
@@ -125,6 +163,16 @@ int main(int argc, char **argv) {
     return -1;
   ContextManager r([&]() { RSA_free(pri); });
 
+  // Large responses can be sent straight from our buffers, without a copy
+  aes_send_zerocopy(args->zerocopy);
+
+  // Pipelined sessions run their requests on their own set of threads
+  pipeline_init(args->threads);
+
+  // Session tickets let returning clients skip the RSA handshake
+  if (!ticket_init(args->ticket_lifetime))
+    return 1;
+
   // load the public key file contents
   auto pub = load_entire_file(args->keyfile + ".pub");
   if (pub.size() == 0)
@@ -144,17 +192,38 @@ int main(int argc, char **argv) {
   int sd = create_server_socket(args->port);
   ContextManager csd([&]() { close(sd); });
   // Create a thread pool that will invoke parse_request (from a pool thread)
-  // each time a new socket is given to it.
+  // each time a new socket is given to it.  With crypto threads, the pool
+  // thread still reads the @rblock, but the RSA decrypt runs in a separate
+  // stage.
+  crypto_stage *stage = nullptr;
+  if (args->crypto_threads > 0)
+    stage = new crypto_stage(args->crypto_threads, args->pin_crypto, pri,
+                             args->crypto_report);
+  rblock_decrypt_t staged = [&](const vector<uint8_t> &enc,
+                                vector<uint8_t> &dec) {
+    return stage->decrypt(enc, dec);
+  };
   thread_pool *pool = pool_factory(args->threads, [&](int sd) {
-    return parse_request(sd, pri, pub, storage);
+    if (stage == nullptr)
+      return parse_request(sd, pri, pub, storage);
+    rblock_t rb;
+    parse_rblock(sd, staged, rb);
+    return finish_request(sd, rb, pub, storage);
   });
-  
+
   // Start accepting connections and passing them to the pool.
   accept_client(sd, *pool);
 
   // The program can't exit until all threads in the pool are done.
   pool->await_shutdown();
   storage->shutdown();
+  auto bs = bufpool_stats();
+  char msg[LOG_LINE_MAX];
+  snprintf(msg, sizeof(msg), "bufpool: %zu buffers reused, %zu allocated",
+           bs.hits, bs.misses);
+  log_debug(msg);
+  delete stage;
+  log_flush();
   delete pool;
   delete args;
   delete storage;
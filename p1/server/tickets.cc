@@ -0,0 +1,124 @@
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <openssl/rand.h>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../common/crypto.h"
+#include "../common/err.h"
+#include "../common/protocol.h"
+
+#include "tickets.h"
+
+using namespace std;
+
+/// A nonce in the replay cache, with the expiry of its ticket
+typedef pair<uint64_t, string> replay_t;
+
+/// The state behind session tickets.  It is written once by ticket_init(),
+/// before any threads start, except for the replay cache.
+static struct {
+  bool enabled = false;       // true once ticket_init() succeeds
+  uint64_t lifetime = 0;      // Seconds for which a new ticket is valid
+  vector<uint8_t> key;        // The ticket key (AES_KEYSIZE bytes)
+  mutex replay_lock;          // Protects replays and expiries
+  unordered_map<string, uint64_t> replays; // nonce -> expiry of its ticket
+  priority_queue<replay_t, vector<replay_t>, greater<replay_t>>
+      expiries;                // replays, soonest expiry first
+} tickets;
+
+/// Plaintext inside a ticket: the session's aeskey, then the expiry
+const int LEN_TICKET_BODY = AES_KEYSIZE + AES_IVSIZE + sizeof(uint64_t);
+
+/// Generate the ticket key and start issuing tickets.  Until this is called,
+/// no tickets are issued or accepted.
+///
+/// @param lifetime The number of seconds for which a new ticket is valid
+///
+/// @return true on success, false if the ticket key couldn't be generated
+bool ticket_init(uint64_t lifetime) {
+  tickets.key.resize(AES_KEYSIZE);
+  if (!RAND_bytes(tickets.key.data(), AES_KEYSIZE))
+    return err(false, "ticket_init: Error in RAND_bytes()");
+  tickets.lifetime = lifetime;
+  tickets.enabled = lifetime > 0;
+  return true;
+}
+
+/// Create a ticket for a session
+///
+/// @param aeskey The session's key and iv
+/// @param ticket Set to the ticket, or cleared if tickets are not enabled
+///
+/// @return The ticket's expiry time (Unix seconds), or 0 if no ticket was made
+uint64_t ticket_issue(const vector<uint8_t> &aeskey, vector<uint8_t> &ticket) {
+  ticket.clear();
+  if (!tickets.enabled || aeskey.size() != AES_KEYSIZE + AES_IVSIZE)
+    return 0;
+  uint64_t expiry = time(nullptr) + tickets.lifetime;
+  unsigned char body[LEN_TICKET_BODY];
+  memcpy(body, aeskey.data(), aeskey.size());
+  memcpy(body + aeskey.size(), &expiry, sizeof(expiry));
+
+  // ticket = iv . enc(ticketkey, body) . tag
+  vector<uint8_t> key = tickets.key;
+  key.resize(AES_KEYSIZE + AES_IVSIZE);
+  if (!RAND_bytes(key.data() + AES_KEYSIZE, AES_IVSIZE))
+    return err(0, "ticket_issue: Error in RAND_bytes()");
+  ticket.resize(LEN_TICKET);
+  memcpy(ticket.data(), key.data() + AES_KEYSIZE, AES_IVSIZE);
+  EVP_CIPHER_CTX *ctx = thread_aes_context(key, true, true);
+  if (!ctx || aes_crypt_buf(ctx, body, LEN_TICKET_BODY,
+                            ticket.data() + AES_IVSIZE) != LEN_TICKET_BODY +
+                                                               AES_GCM_TAGSIZE) {
+    ticket.clear();
+    return 0;
+  }
+  return expiry;
+}
+
+/// Check a ticket and recover the session's aeskey from it.  Each nonce is
+/// only accepted once per ticket lifetime, so that a recorded request can't be
+/// replayed.
+///
+/// @param ticket The ticket (LEN_TICKET bytes)
+/// @param nonce  The client's nonce for this request (LEN_RESUME_NONCE bytes)
+/// @param aeskey Set to the session's key and iv
+///
+/// @return true if the ticket is authentic, unexpired, and not a replay
+bool ticket_open(const unsigned char *ticket, const unsigned char *nonce,
+                 vector<uint8_t> &aeskey) {
+  if (!tickets.enabled)
+    return false;
+  vector<uint8_t> key = tickets.key;
+  key.insert(key.end(), ticket, ticket + AES_IVSIZE);
+  unsigned char body[LEN_TICKET_BODY + AES_IVSIZE];
+  EVP_CIPHER_CTX *ctx = thread_aes_context(key, false, true);
+  if (!ctx || aes_crypt_buf(ctx, ticket + AES_IVSIZE, LEN_TICKET - AES_IVSIZE,
+                            body) != LEN_TICKET_BODY)
+    return false;
+  uint64_t expiry, now = time(nullptr);
+  memcpy(&expiry, body + AES_KEYSIZE + AES_IVSIZE, sizeof(expiry));
+  if (expiry <= now)
+    return false;
+
+  {
+    // Purge the nonces whose tickets have expired.  Only the expired ones are
+    // visited, so a resume never scans the whole cache.
+    lock_guard<mutex> g(tickets.replay_lock);
+    while (!tickets.expiries.empty() && tickets.expiries.top().first <= now) {
+      tickets.replays.erase(tickets.expiries.top().second);
+      tickets.expiries.pop();
+    }
+    string n((const char *)nonce, LEN_RESUME_NONCE);
+    if (!tickets.replays.emplace(n, expiry).second)
+      return false;
+    tickets.expiries.emplace(expiry, move(n));
+  }
+  aeskey.assign(body, body + AES_KEYSIZE + AES_IVSIZE);
+  return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/// tickets.h manages the server's session tickets (see REQ_TICKET and
+/// REQ_RESUME in protocol.h).  A ticket is a session's aeskey and expiry,
+/// encrypted with AES-256-GCM under a ticket key that is generated when the
+/// server starts and never leaves its memory.  Restarting the server therefore
+/// invalidates every ticket, and clients fall back to a full RSA handshake.
+
+/// Generate the ticket key and start issuing tickets.  Until this is called,
+/// no tickets are issued or accepted.
+///
+/// @param lifetime The number of seconds for which a new ticket is valid
+///
+/// @return true on success, false if the ticket key couldn't be generated
+bool ticket_init(uint64_t lifetime);
+
+/// Create a ticket for a session
+///
+/// @param aeskey The session's key and iv
+/// @param ticket Set to the ticket, or cleared if tickets are not enabled
+///
+/// @return The ticket's expiry time (Unix seconds), or 0 if no ticket was made
+uint64_t ticket_issue(const std::vector<uint8_t> &aeskey,
+                      std::vector<uint8_t> &ticket);
+
+/// Check a ticket and recover the session's aeskey from it.  Each nonce is
+/// only accepted once per ticket lifetime, so that a recorded request can't be
+/// replayed.
+///
+/// @param ticket The ticket (LEN_TICKET bytes)
+/// @param nonce  The client's nonce for this request (LEN_RESUME_NONCE bytes)
+/// @param aeskey Set to the session's key and iv
+///
+/// @return true if the ticket is authentic, unexpired, and not a replay
+bool ticket_open(const unsigned char *ticket, const unsigned char *nonce,
+                 std::vector<uint8_t> &aeskey);
@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "../server/concurrenthashmap.h"
+#include "../server/kv_ops.h"
 
 using namespace std;
 
@@ -23,6 +24,7 @@ struct arg_t {
   size_t reads = 80;      // Lookup percent.  Half the remainder will be inserts
   size_t iters = 1048576; // Iterations per thread
   size_t buckets = 1024;  // Number of buckets for the server's hash tables
+  bool check = false;     // Check read-modify-writes instead of timing
 
   /// Construct an arg_t from the command-line arguments to the program
   ///
@@ -34,7 +36,7 @@ struct arg_t {
   arg_t(int argc, char **argv) {
     // NB: We don't do any validation of the arguments
     long opt;
-    while ((opt = getopt(argc, argv, "k:t:r:i:b:h")) != -1) {
+    while ((opt = getopt(argc, argv, "k:t:r:i:b:ch")) != -1) {
       switch (opt) {
       case 'k':
         keys = atoi(optarg);
@@ -51,6 +53,9 @@ struct arg_t {
       case 'b':
         buckets = atoi(optarg);
         break;
+      case 'c':
+        check = true;
+        break;
       default: // on any error, print a help message.  This case subsumes `-h`
         throw 1;
         return;
@@ -69,10 +74,106 @@ struct arg_t {
          << "  -r [int] Read-only percent\n"
          << "  -i [int] Iterations per thread\n"
          << "  -b [int] Number of buckets\n"
+         << "  -c       Check compare-and-swap, append and increment, instead of\n"
+         << "           timing\n"
          << "  -h       Print help (this message)\n";
   }
 };
 
+/// Check that versions make compare-and-swap safe: every thread adds 1 to
+/// random keys, `iters` times, by reading a key's value and version and then
+/// writing the sum only if the version hasn't changed.  If no update is lost,
+/// the values add up to the number of increments.
+///
+/// @param args The command-line arguments
+///
+/// @return true if no update was lost
+static bool check_cas(const arg_t &args) {
+  auto tbl = intset_factory(args.buckets);
+  for (size_t i = 0; i < args.keys; ++i)
+    tbl->insert(i, 0, []() {});
+  atomic<uint64_t> retries(0);
+  vector<thread> threads;
+  for (size_t i = 0; i < args.threads; ++i)
+    threads.emplace_back([&](unsigned seed) {
+      for (size_t o = 0; o < args.iters; ++o) {
+        int key = rand_r(&seed) % args.keys;
+        while (true) {
+          int seen = 0;
+          uint64_t ver = tbl->do_with_readonly_version(
+              key, [&](const int &v, uint64_t) { seen = v; });
+          bool swapped = false;
+          tbl->do_with_version(key, [&](int &v, uint64_t now) {
+            swapped = (now == ver);
+            if (swapped)
+              v = seen + 1;
+            return swapped;
+          });
+          if (swapped)
+            break;
+          ++retries;
+        }
+      }
+    }, i);
+  for (auto &t : threads)
+    t.join();
+  uint64_t sum = 0;
+  for (size_t i = 0; i < args.keys; ++i)
+    tbl->do_with_readonly(i, [&](const int &v) { sum += v; });
+  delete tbl;
+  cout << "CAS increments: " << args.threads * args.iters << ", sum of values: "
+       << sum << ", retries: " << retries << endl;
+  return sum == args.threads * args.iters;
+}
+
+/// Check that kv_incr() and kv_append() don't lose updates: every thread adds
+/// 1 to a random counter and appends one byte to a random string, `iters`
+/// times.  If no update is lost, the counters add up to the number of
+/// increments, and the strings' lengths to the number of appends.
+///
+/// @param args The command-line arguments
+///
+/// @return true if no update was lost
+static bool check_rmw(const arg_t &args) {
+  ConcurrentHashMap<string, vector<uint8_t>> kv(args.buckets);
+  for (size_t i = 0; i < args.keys; ++i) {
+    kv.insert("n" + to_string(i), {'0'}, []() {});
+    kv.insert("a" + to_string(i), {}, []() {});
+  }
+  atomic<uint64_t> failed(0);
+  vector<thread> threads;
+  for (size_t i = 0; i < args.threads; ++i)
+    threads.emplace_back([&](unsigned seed) {
+      vector<uint8_t> byte = {'x'};
+      string text;
+      bool ok;
+      for (size_t o = 0; o < args.iters; ++o) {
+        string key = to_string(rand_r(&seed) % args.keys);
+        if (kv_incr(kv, "n" + key, 1, text, ok) == 0 || !ok)
+          ++failed;
+        if (kv_append(kv, "a" + key, byte, args.iters * args.threads, ok) ==
+                0 ||
+            !ok)
+          ++failed;
+      }
+    }, i);
+  for (auto &t : threads)
+    t.join();
+  uint64_t sum = 0, len = 0;
+  for (size_t i = 0; i < args.keys; ++i) {
+    kv.do_with_readonly("n" + to_string(i), [&](const vector<uint8_t> &v) {
+      sum += stoull(string(v.begin(), v.end()));
+    });
+    kv.do_with_readonly("a" + to_string(i),
+                        [&](const vector<uint8_t> &v) { len += v.size(); });
+  }
+  cout << "Increments and appends: " << args.threads * args.iters
+       << ", sum of counters: " << sum << ", total length: " << len
+       << ", failures: " << failed << endl;
+  return failed == 0 && sum == args.threads * args.iters &&
+         len == args.threads * args.iters;
+}
+
 /// An enum for the 6 events that can happen in an intset benchmark
 enum EVENTS { INS_T, INS_F, RMV_T, RMV_F, LOK_T, LOK_F, COUNT };
 
@@ -89,6 +190,13 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (args->check) {
+    bool ok = check_cas(*args);
+    ok = check_rmw(*args) && ok;
+    delete args;
+    return ok ? 0 : 1;
+  }
+
   // Print configuration
   cout << "# (k,t,r,i,b) = (" << args->keys << "," << args->threads << ","
        << args->reads << "," << args->iters << "," << args->buckets << ")\n";
@@ -377,3 +377,7 @@ const std::string RES_OKUPD = "OK_UPDATE";
 /// Response code to indicate that there was an error when searching for the
 /// given key
 const std::string RES_ERR_KEY = "ERR_KEY";
+
+/// Response code to indicate that a compare-and-swap found a different version
+/// than the one given
+const std::string RES_ERR_VERSION = "ERR_VERSION";
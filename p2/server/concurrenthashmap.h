@@ -1,15 +1,20 @@
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <functional>
 #include <iostream>
-#include <list>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <stdio.h>
 #include <utility>
 
 
+#include "epoch.h"
 #include "map.h"
+#include "mvcc.h"
+#include "slab.h"
 
 /// ConcurrentHashMap is a concurrent implementation of the Map interface (a
 /// Key/Value store).  It is implemented as a vector of vecBucket, with one lock
@@ -26,9 +31,24 @@
 /// This map uses std::hash to map keys to positions in the vector.  A
 /// production map should use something better.
 ///
-/// This map provides strong consistency guarantees: every operation uses
-/// two-phase locking (2PL), and the lambda parameters to methods enable nesting
-/// of 2PL operations across maps.
+/// This map uses multi-version concurrency control (see mvcc.h).  Each key
+/// keeps a chain of versions, newest first, and every change adds a version to
+/// the chain instead of changing one in place.  Writers use the bucket locks,
+/// and the lambda parameters of the writing methods still run under them, so
+/// that 2PL operations can nest across maps.  The read-only methods take no
+/// locks at all: they read the versions that a snapshot sees, so a long
+/// do_all_readonly() never blocks a writer, and still sees one consistent
+/// state.  A read-only method that runs inside another one (in any map) shares
+/// its snapshot, so nesting them gives a consistent view across maps.
+///
+/// Every version is stamped with the commit that made it, which comes from a
+/// clock that all maps share.  The stamp doubles as the key's version for
+/// do_with_version(): it changes whenever the value might have changed, and is
+/// never reused.
+///
+/// Old versions, and the entries of removed keys, are unlinked by the writers
+/// that come after them, once no snapshot can see them any more, and retired
+/// to epoch.h, which frees them once no reader can still be looking at them.
 ///
 /// @param K The type of the keys in this map
 /// @param V The type of the values in this map
@@ -36,26 +56,59 @@ template <typename K, typename V> class ConcurrentHashMap : public Map<K, V> {
 
 public:
 
+  /// One version of a key's value
+  struct version {
+    V val;
+    std::atomic<uint64_t> stamp{MVCC_PENDING}; // The commit that made it
+    bool dead;                                 // Does it mark a removal?
+    std::atomic<version *> older{nullptr};     // The version it replaced
+
+    version(V val, bool dead) : val(std::move(val)), dead(dead) {}
+  };
+
+  /// One key, and its versions
+  //
+  // NB: nodes and versions come from slab_new(), so a map with millions of
+  //     entries doesn't make millions of separate heap allocations
+  struct node {
+    K first;
+    std::atomic<version *> newest{nullptr}; // The latest version
+    std::atomic<node *> next{nullptr};      // The next key in the bucket
+
+    node(const K &key) : first(key) {}
+  };
+
   typedef struct bucket{
-    std::list<std::pair<K, V> > info; 
-    std::mutex bucketLock; 
-  }bucket; 
+    std::atomic<node *> head{nullptr};
+    std::mutex bucketLock;
+    size_t removed = 0; // Nodes whose newest version marks a removal
+  }bucket;
 
-  std::vector<bucket *> vecBucket; 
-  size_t numBuckets; 
+  std::vector<bucket *> vecBucket;
+  size_t numBuckets;
 
   /// Construct by specifying the number of vecBucket it should have
   ///
   /// @param _vecBucket The number of vecBucket
   ConcurrentHashMap(size_t _vecBucket) : numBuckets(_vecBucket) {
     for (size_t i = 0; i < numBuckets; i++) {
-      bucket *newBuck = new bucket; 
-      vecBucket.push_back(newBuck);       
+      bucket *newBuck = new bucket;
+      vecBucket.push_back(newBuck);
     }
   }
 
-  /// Destruct the ConcurrentHashMap
-  virtual ~ConcurrentHashMap() { }
+  /// Destruct the ConcurrentHashMap.  No thread may be using it.
+  virtual ~ConcurrentHashMap() {
+    // NB: What the map retired is freed by the reclaimer, on its own
+    for (auto b : vecBucket) {
+      for (node *n = b->head; n != nullptr;) {
+        node *next = n->next;
+        free_node(n);
+        n = next;
+      }
+      delete b;
+    }
+  }
 
   size_t hashing(K key) {
     std::hash<K> hash;
@@ -67,30 +120,182 @@ public:
     return buckNum;
   }
 
+  /// Free a chain of versions
+  ///
+  /// @param v The newest version in the chain
+  static void free_versions(version *v) {
+    while (v != nullptr) {
+      version *older = v->older;
+      slab_delete(v);
+      v = older;
+    }
+  }
+
+  /// Free a key and all of its versions
+  ///
+  /// @param n The key's node
+  static void free_node(node *n) {
+    free_versions(n->newest);
+    slab_delete(n);
+  }
+
+  /// Free a key that was unlinked, once no reader can be looking at it
+  ///
+  /// @param n The key's node
+  static void retire_node(node *n) {
+    epoch_manager::get().retire(
+        n, [](void *p) { free_node(static_cast<node *>(p)); });
+  }
+
+  /// Free a chain of versions that was unlinked, once no reader can be looking
+  /// at it
+  ///
+  /// @param v The newest version in the chain
+  static void retire_versions(version *v) {
+    epoch_manager::get().retire(
+        v, [](void *p) { free_versions(static_cast<version *>(p)); });
+  }
+
+  /// Find a key's node in a bucket.  Readers can call this without the lock.
+  ///
+  /// @param b   The bucket
+  /// @param key The key
+  ///
+  /// @return The node, or nullptr if the bucket has none for the key
+  static node *find(bucket *b, const K &key) {
+    for (node *n = b->head; n != nullptr; n = n->next)
+      if (n->first == key)
+        return n;
+    return nullptr;
+  }
+
+  /// Find the version of a key that a snapshot sees
+  ///
+  /// @param b    The bucket
+  /// @param key  The key
+  /// @param snap The snapshot
+  ///
+  /// @return The version, or nullptr if the key doesn't exist in the snapshot
+  static version *lookup(bucket *b, const K &key, uint64_t snap) {
+    node *n = find(b, key);
+    return n == nullptr ? nullptr : visible(n, snap);
+  }
+
+  /// Find the version of a node that a snapshot sees
+  ///
+  /// @param n    The node
+  /// @param snap The snapshot
+  ///
+  /// @return The version, or nullptr if the key doesn't exist in the snapshot
+  static version *visible(node *n, uint64_t snap) {
+    version *v = n->newest;
+    while (v != nullptr) {
+      uint64_t stamp = v->stamp;
+      if (stamp == MVCC_PENDING)
+        std::this_thread::yield(); // It's about to get its stamp
+      else if (stamp > snap)
+        v = v->older;
+      else
+        break;
+    }
+    return (v == nullptr || v->dead) ? nullptr : v;
+  }
+
+  /// Find the latest version of a key.  The caller holds the bucket's lock.
+  ///
+  /// @param n The key's node (or nullptr)
+  ///
+  /// @return The version, or nullptr if the key doesn't exist
+  static version *latest(node *n) {
+    if (n == nullptr || n->newest.load()->dead)
+      return nullptr;
+    return n->newest;
+  }
+
+  /// Add a new version of a key, and commit it.  The caller holds the
+  /// bucket's lock, so every version it can see has its stamp already.  This
+  /// also unlinks whatever no snapshot can see any more: the bucket's removed
+  /// keys, and the key's old versions.
+  ///
+  /// @param b The bucket
+  /// @param n The key's node, which is new if it has no versions yet
+  /// @param v The new version
+  ///
+  /// @return The commit's stamp
+  uint64_t commit(bucket *b, node *n, version *v) {
+    auto &clock = mvcc_clock::get();
+    uint64_t oldest = 0; // Only worth finding if a key was removed
+    std::atomic<node *> *link = &b->head;
+    for (node *m = b->removed > 0 ? link->load() : nullptr; m != nullptr;
+         m = *link) {
+      version *mv = m->newest;
+      if (m != n && mv->dead &&
+          mv->stamp <= (oldest != 0 ? oldest : (oldest = clock.oldest()))) {
+        // A reader may be standing on m, and m->next still leads on
+        *link = m->next.load();
+        retire_node(m);
+        --b->removed;
+        continue;
+      }
+      link = &m->next;
+    }
+
+    // NB: v and a new n aren't reachable until n->newest and b->head are set,
+    //     so their own fields don't need to be ordered with anything else
+    version *top = n->newest;
+    v->older.store(top, std::memory_order_relaxed);
+    n->newest = v;
+    if (top == nullptr) {
+      n->next.store(b->head, std::memory_order_relaxed);
+      b->head = n;
+    }
+    uint64_t stamp = clock.stamp();
+    v->stamp.store(stamp, std::memory_order_release);
+    if (top != nullptr && top->dead)
+      --b->removed;
+    if (v->dead)
+      ++b->removed;
+
+    // Every snapshot stops at the first version it can see, so nothing reaches
+    // the versions older than the first that all of them can see.  Usually
+    // that is the new one.
+    if (top != nullptr) {
+      oldest = clock.oldest();
+      version *keep = v;
+      while (keep->stamp > oldest && keep->older != nullptr)
+        keep = keep->older;
+      if (keep->older != nullptr) {
+        retire_versions(keep->older);
+        keep->older = nullptr;
+      }
+    }
+    return stamp;
+  }
+
   /// Clear the map.  This operation needs to use 2pl
   virtual void clear() {
 
-    std::vector<std::unique_lock<std::mutex> > lockAll; 
+    std::vector<std::unique_lock<std::mutex> > lockAll;
     for (auto &i : vecBucket) {
       lockAll.push_back(std::unique_lock<std::mutex>(i->bucketLock));
     }
 
+    // Removing every key is one commit, so no snapshot sees half of it
+    std::vector<version *> removals;
     for (auto &i : vecBucket) {
-      i->info.clear();
+      for (node *n = i->head; n != nullptr; n = n->next) {
+        if (latest(n) == nullptr)
+          continue;
+        version *v = slab_new<version>(V(), true);
+        v->older.store(n->newest, std::memory_order_relaxed);
+        n->newest = v;
+        removals.push_back(v);
+        ++i->removed;
+      }
     }
-
-
-
-    // for (int i = 0; i < numBuckets; i++) {
-    //   (vecBucket.at(i).bucketLock).lock();
-    //   // clear what is in the bucket
-    //   for (int k = 0; k < vecBucket.at(i).info.size(); k++) {
-    //     (vecBucket.at(i).info).pop_back();
-    //   }
-    // }
-    // for (int i = 0; i < numBuckets; i++) {
-    //   (vecBucket.at(i).bucketLock).unlock();
-    // }
+    uint64_t stamp = mvcc_clock::get().stamp();
+    for (auto v : removals)
+      v->stamp.store(stamp, std::memory_order_release);
   }
 
 
@@ -114,38 +319,17 @@ public:
 
     auto &bucket = vecBucket[hashedKey];
     std::lock_guard<std::mutex> lock(bucket->bucketLock);
-    for (auto &i : bucket->info) {
-      if (i.first == key) {
-        return false;
-      }
-    }
+    node *n = find(bucket, key);
+    if (latest(n) != nullptr)
+      return false;
 
-    bucket->info.push_back(std::make_pair(key, val)); 
+    // NB: A removed key's node is reused, so a bucket never has two nodes for
+    //     one key
+    if (n == nullptr)
+      n = slab_new<node>(key);
+    commit(bucket, n, slab_new<version>(val, false));
     on_success();
     return true;
-
-
-
-
-  //   //typename std::list<std::pair<K, V> >::iterator it;
-  //   for (auto it = (vecBucket.at(hashedKey).info).begin(); it != (vecBucket.at(hashedKey).info).end(); it++) {
-  //     if (it->first == key) {
-  //       return false; 
-  //     }
-  //   }
-
-  //   for (size_t i = 0; i < (vecBucket.at(hashedKey).info).size(); i++) {
-  //     if (key == (vecBucket.at(hashedKey).info).at(i).first) {
-  //       (vecBucket.at(hashedKey).bucketLock).unlock();
-  //       return false;
-  //     }
-  //   }
-
-  //   (vecBucket.at(hashedKey).info).push_back(std::pair<K, V>(key, val));
-    
-  //   on_success();
-  //   return true; 
-  // }
   }
 
   /// Insert the provided key/value pair if there is no mapping for the key yet.
@@ -162,46 +346,22 @@ public:
   virtual bool upsert(K key, V val, std::function<void()> on_ins,
                       std::function<void()> on_upd) {
     int hashedKey = hashing(key);
-  
+
     auto &bucket = vecBucket[hashedKey];
-   
+
     std::lock_guard<std::mutex> lock(bucket->bucketLock);
-  
-    for (auto &i : bucket->info) {
-      if (i.first == key) {
-        i.second = val;
-        on_upd();
-        return false; 
-      }
-    }
 
-    bucket->info.push_back(std::make_pair(key, val)); 
+    node *n = find(bucket, key);
+    bool existed = latest(n) != nullptr;
+    if (n == nullptr)
+      n = slab_new<node>(key);
+    commit(bucket, n, slab_new<version>(val, false));
+    if (existed) {
+      on_upd();
+      return false;
+    }
     on_ins();
     return true;
-
-
-
-    // (vecBucket.at(hashedKey).bucketLock).lock();
-
-    // if (hashedKey == -1) {
-    //   (vecBucket.at(hashedKey).bucketLock).unlock();
-    //   return false;
-    // }
-    // //typename std::list<std::pair<K, V> >::iterator it;
-    // for (auto it = (vecBucket.at(hashedKey).info).begin(); it != (vecBucket.at(hashedKey).info).end(); it++) {
-    //   if (it->first == key) {
-    //     it->second = val;
-    //     on_upd();
-    //     ((vecBucket.at(hashedKey).bucketLock)).unlock();
-    //     return false;
-    //   }
-    // }
-    
-    // (vecBucket.at(hashedKey).info).push_back(std::pair<K, V>(key, val));
-    // on_ins();
-    // ((vecBucket.at(hashedKey).bucketLock)).unlock();
-    // return true;
-
   }
 
   /// Apply a function to the value associated with a given key.  The function
@@ -217,31 +377,17 @@ public:
     int hashedKey = hashing(key);
     auto &bucket = vecBucket[hashedKey];
     std::lock_guard<std::mutex> lock(bucket->bucketLock);
-    for (auto &i : bucket->info) {
-      if (i.first == key) {
-        f(i.second);
-        return true;
-      }
-    }
-    // no key found
-    return false;
-
-    // (vecBucket.at(hashedKey).bucketLock).lock();
-
-    // if (hashedKey == -1) {
-    //   (vecBucket.at(hashedKey).bucketLock).unlock();
-    //   return false;
-    // }
-    // //typename std::list<std::pair<K, V> >::iterator it;
-    // for (auto it = vecBucket.at(hashedKey).info.begin(); it != vecBucket.at(hashedKey).info.end(); it++) {
-    //   if (it->first == key) {
-    //     f(it->second);
-    //     (vecBucket.at(hashedKey).bucketLock).unlock();
-    //     return true;
-    //   }
-    // }
-    // (vecBucket.at(hashedKey).bucketLock).unlock();
-    // return false; 
+    node *n = find(bucket, key);
+    version *cur = latest(n);
+    if (cur == nullptr)
+      return false; // no key found
+
+    // f works on a copy, which becomes the new version, since readers may be
+    // looking at the current one
+    version *v = slab_new<version>(cur->val, false);
+    f(v->val);
+    commit(bucket, n, v);
+    return true;
   }
 
   /// Apply a function to the value associated with a given key.  The function
@@ -255,36 +401,57 @@ public:
   virtual bool do_with_readonly(K key, std::function<void(const V &)> f) {
     int hashedKey = hashing(key);
 
+    mvcc_snapshot snap;
+    version *v = lookup(vecBucket[hashedKey], key, snap.epoch());
+    if (v == nullptr)
+      return false;
+    f(v->val);
+    return true;
+  }
+
+  /// Apply a function to the value associated with a given key, and to the
+  /// key's version.  The function is allowed to modify the value, and returns
+  /// true if it did, so that the key gets a new version.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value and version
+  ///
+  /// @return The key's version after the function ran, or 0 if the key
+  ///         doesn't exist
+  virtual uint64_t do_with_version(K key,
+                                   std::function<bool(V &, uint64_t)> f) {
+    int hashedKey = hashing(key);
     auto &bucket = vecBucket[hashedKey];
     std::lock_guard<std::mutex> lock(bucket->bucketLock);
-
-    // iterate over info to find the matching key
-    for (auto &i : bucket->info) {
-      if (i.first == key) {
-        f(i.second);
-        return true;
-      }
+    node *n = find(bucket, key);
+    version *cur = latest(n);
+    if (cur == nullptr)
+      return 0;
+    version *v = slab_new<version>(cur->val, false);
+    if (!f(v->val, cur->stamp)) {
+      slab_delete(v);
+      return cur->stamp;
     }
+    return commit(bucket, n, v);
+  }
 
-    return false;
-
-    // (vecBucket.at(hashedKey).bucketLock).lock();
-
-    // if (hashedKey == -1) {
-    //   (vecBucket.at(hashedKey).bucketLock).unlock();
-    //   return false;
-    // }
-    // //const typename std::list<std::pair<K, V> >::iterator it;
-    // for (auto it = vecBucket.at(hashedKey).info.cbegin(); it != vecBucket.at(hashedKey).info.cend(); it++) {
-    //   if (it->first == key) {
-    //     f(it->second);
-    //     (vecBucket.at(hashedKey).bucketLock).unlock();
-    //     return true;
-    //   }
-    // }
-    // (vecBucket.at(hashedKey).bucketLock).unlock();
-
-    // return false;
+  /// Apply a function to the value associated with a given key, and to the
+  /// key's version.  The function is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value and version
+  ///
+  /// @return The key's version, or 0 if the key doesn't exist
+  virtual uint64_t
+  do_with_readonly_version(K key,
+                           std::function<void(const V &, uint64_t)> f) {
+    int hashedKey = hashing(key);
+    mvcc_snapshot snap;
+    version *v = lookup(vecBucket[hashedKey], key, snap.epoch());
+    if (v == nullptr)
+      return 0;
+    f(v->val, v->stamp);
+    return v->stamp;
   }
 
   /// Remove the mapping from a key to its value
@@ -296,80 +463,37 @@ public:
   virtual bool remove(K key, std::function<void()> on_success) {
     int hashedKey = hashing(key);
 
- 
+
     auto &bucket = vecBucket[hashedKey];
-  
+
     std::lock_guard<std::mutex> lock(bucket->bucketLock);
 
-    for (auto i = bucket->info.begin(); i != bucket->info.end(); i++) {
-      auto &temp = *i; 
-      if (temp.first == key) {
-        bucket->info.erase(i); 
-        on_success();
-        return true;
-      }
-    }
-    return false; // else key was not found
-
-    // (vecBucket.at(hashedKey).bucketLock).lock();
-
-    // if (hashedKey == -1) {
-    //   (vecBucket.at(hashedKey).bucketLock).unlock();
-    //   return false;
-    // }
-    // //typename std::list<std::pair<K, V> >::iterator it
-    // for (auto it = vecBucket.at(hashedKey).info.begin(); it != vecBucket.at(hashedKey).info.end(); it++) {
-    //   if (it->first == key) {
-    //     it = vecBucket.at(hashedKey).info.erase(it);
-    //     on_success();
-    //     (vecBucket.at(hashedKey).bucketLock).unlock();
-    //     return true;
-    //   }
-    // }
-    // (vecBucket.at(hashedKey).bucketLock).unlock();
-    // return false;
+    // The key's node stays in the bucket until no snapshot can see the key
+    node *n = find(bucket, key);
+    if (latest(n) == nullptr)
+      return false; // else key was not found
+    commit(bucket, n, slab_new<version>(V(), true));
+    on_success();
+    return true;
   }
 
   /// Apply a function to every key/value pair in the map.  Note that the
-  /// function is not allowed to modify keys or values.
+  /// function is not allowed to modify keys or values.  The pairs are the ones
+  /// in a snapshot, so this takes no locks, and writers don't wait for it.
   ///
   /// @param f    The function to apply to each key/value pair
-  /// @param then A function to run when this is done, but before unlocking...
-  ///             useful for 2pl
+  /// @param then A function to run when this is done, but before the snapshot
+  ///             is released... useful for reading other maps in the same
+  ///             snapshot
   virtual void do_all_readonly(std::function<void(const K, const V &)> f, std::function<void()> then) {
-    //const typename std::vector<bucket>::iterator itlock;
-
-    // 2PL: phase 1 locks, phase 2 unlocks
-    std::vector<std::unique_lock<std::mutex> > lockAll; 
-    for (auto &i : vecBucket) {
-      lockAll.push_back(std::unique_lock<std::mutex>(i->bucketLock));
-    }
-
+    mvcc_snapshot snap;
     for (auto &i : vecBucket) {
-      for (auto &j : i->info) {
-        f(j.first, j.second);
+      for (node *n = i->head; n != nullptr; n = n->next) {
+        version *v = visible(n, snap.epoch());
+        if (v != nullptr)
+          f(n->first, v->val);
       }
     }
-    then(); // done applying f but before unlocking
-
-
-
-
-    // for (int i = 0; i < numBuckets; i++) {
-    //   (vecBucket.at(numBuckets).bucketLock).lock();
-    // } 
-    
-    // //const typename std::vector<bucket>::iterator it;
-    // //const typename std::list<std::pair<K, V> >::iterator iter
-    // for (auto it = vecBucket.cbegin(); it != vecBucket.cend(); it++) {
-    //   for (auto iter = it->info.cbegin(); iter != it->info.cend(); iter++) {
-    //     f(iter->first, iter->second);
-    //   }
-    // }
-    // then();
-    // //const typename std::vector<bucket>::iterator itUnlock;
-    // for (int i = 0; i < numBuckets; i++) {
-    //   (vecBucket.at(numBuckets).bucketLock).unlock();
-    // }
+    then(); // done applying f but before releasing the snapshot
   }
 };
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// epoch.h provides epoch-based reclamation (EBR), which lets a structure free
+/// the objects it unlinks even though readers that take no locks might still
+/// be looking at them.  It doesn't depend on the structure: anything that can
+/// unlink an object and name a function to free it can use it.
+///
+/// - A reader pins the current epoch before it follows any links, and unpins
+///   it when it is done.  Pins nest.
+/// - A writer retires each object after unlinking it.  Retired objects collect
+///   in a per-thread list, so retiring takes no lock; full lists are handed to
+///   the reclaimer in batches, labeled with the epoch at that moment.
+/// - A background thread (the reclaimer) advances the global epoch whenever
+///   every pinned thread has caught up with it, and frees each batch once the
+///   epoch is two past the batch's label.  By then, every reader that was
+///   pinned when the objects were unlinked has unpinned.
+///
+/// Readers never wait.  A reader that stays pinned for a long time just holds
+/// back the reclaimer, so memory waits for it instead.
+///
+/// NB: As in mvcc.h, the atomics use sequentially consistent memory order,
+///     since the proof relies on one order of the unlinks, the pins, and the
+///     epoch's updates.
+
+/// The most threads that can use EBR at once
+const size_t EPOCH_THREADS = 256;
+
+/// The number of objects a thread retires before it hands them to the
+/// reclaimer
+const size_t EPOCH_BATCH = 64;
+
+/// How often the reclaimer runs, when it isn't woken up sooner
+const std::chrono::milliseconds EPOCH_PERIOD(10);
+
+/// The number of objects waiting for the reclaimer that makes it run early
+const size_t EPOCH_BACKLOG = 64 * EPOCH_BATCH;
+
+/// epoch_manager holds the global epoch, each thread's pin, and the objects
+/// that are waiting to be freed
+class epoch_manager {
+  /// One thread's pin, padded so that threads don't share a line
+  struct alignas(64) record {
+    std::atomic<bool> taken{false}; // Does a thread own this record?
+    std::atomic<uint64_t> pin{0};   // The epoch it is pinned in (0 = none)
+  };
+
+  /// An object that was unlinked
+  struct retired {
+    void *obj;             // The object
+    void (*free)(void *);  // The function that frees it
+  };
+
+  /// Retired objects that were handed to the reclaimer together
+  struct batch {
+    uint64_t epoch;            // The epoch when they were handed over
+    std::vector<retired> objs; // The objects
+  };
+
+  /// A thread's record, and the objects it has retired but not handed over.
+  /// When the thread exits, the objects are handed over and the record is
+  /// released.
+  struct local {
+    record *mine = nullptr;   // The record
+    size_t depth = 0;         // How many pins the thread holds
+    std::vector<retired> buf; // Retired, not handed over
+
+    ~local() {
+      if (mine == nullptr)
+        return;
+      epoch_manager::get().hand_over(*this);
+      mine->taken = false;
+    }
+  };
+
+  std::atomic<uint64_t> global{1}; // The epoch (never 0)
+  std::atomic<size_t> used{0};     // Records in use are all below this
+  record records[EPOCH_THREADS];
+
+  std::mutex lock;                // Protects the fields below
+  std::condition_variable wake;   // Wakes the reclaimer early
+  std::vector<batch> limbo;       // Handed over, not yet freed
+  size_t waiting = 0;             // The number of objects in limbo
+  bool started = false;           // Is the reclaimer running?
+
+  /// Get the calling thread's local state, claiming a record if it has none
+  local &me() {
+    thread_local local l;
+    while (l.mine == nullptr) {
+      for (size_t i = 0; i < EPOCH_THREADS && l.mine == nullptr; ++i) {
+        bool expect = false;
+        if (records[i].taken.compare_exchange_strong(expect, true)) {
+          l.mine = &records[i];
+          size_t u = used;
+          while (u < i + 1 && !used.compare_exchange_weak(u, i + 1)) {
+          }
+        }
+      }
+      if (l.mine == nullptr)
+        std::this_thread::yield(); // Every record is taken; wait for one
+    }
+    return l;
+  }
+
+  /// Give a thread's retired objects to the reclaimer
+  ///
+  /// @param l The thread's local state
+  void hand_over(local &l) {
+    if (l.buf.empty())
+      return;
+    // Every object in buf was unlinked by now, so this epoch is late enough
+    // for all of them
+    batch b{global, std::move(l.buf)};
+    l.buf.clear();
+    std::lock_guard<std::mutex> g(lock);
+    waiting += b.objs.size();
+    limbo.push_back(std::move(b));
+    if (!started) {
+      started = true;
+      std::thread([this]() { reclaimer(); }).detach();
+    }
+    if (waiting >= EPOCH_BACKLOG)
+      wake.notify_one();
+  }
+
+  /// Advance the epoch, if every pinned thread is pinned in the current one
+  void try_advance() {
+    uint64_t e = global;
+    for (size_t i = 0, n = used; i < n; ++i) {
+      uint64_t p = records[i].pin;
+      if (p != 0 && p != e)
+        return;
+    }
+    global.compare_exchange_strong(e, e + 1);
+  }
+
+  /// The reclaimer's loop.  NB: It never stops, since the manager is never
+  /// destroyed.
+  void reclaimer() {
+    std::unique_lock<std::mutex> g(lock);
+    while (true) {
+      wake.wait_for(g, EPOCH_PERIOD);
+      if (limbo.empty())
+        continue;
+      g.unlock();
+      // NB: Two steps are enough to free everything, if no reader is pinned
+      try_advance();
+      try_advance();
+      uint64_t now = global;
+      std::vector<batch> ready;
+      g.lock();
+      size_t keep = 0;
+      for (auto &b : limbo) {
+        if (b.epoch + 2 <= now)
+          ready.push_back(std::move(b));
+        else
+          limbo[keep++] = std::move(b);
+      }
+      limbo.resize(keep);
+      for (auto &b : ready)
+        waiting -= b.objs.size();
+      g.unlock();
+      for (auto &b : ready)
+        for (auto &r : b.objs)
+          r.free(r.obj);
+      g.lock();
+    }
+  }
+
+public:
+  /// Get the manager.  NB: like slab_pool, the manager is never destroyed, so
+  ///     that threads that outlive static destruction are safe.
+  static epoch_manager &get() {
+    static epoch_manager *mgr = new epoch_manager();
+    return *mgr;
+  }
+
+  /// Pin the current epoch for the calling thread, or add to its pin
+  void pin() {
+    local &l = me();
+    if (l.depth++ == 0)
+      l.mine->pin = global.load();
+  }
+
+  /// Release one of the calling thread's pins
+  void unpin() {
+    local &l = me();
+    if (--l.depth == 0)
+      l.mine->pin = 0;
+  }
+
+  /// Free an object once no pinned reader can still be looking at it.  The
+  /// object must already be unreachable for readers that pin from now on.
+  ///
+  /// @param obj  The object
+  /// @param free The function that frees it
+  void retire(void *obj, void (*free)(void *)) {
+    local &l = me();
+    l.buf.push_back({obj, free});
+    if (l.buf.size() >= EPOCH_BATCH)
+      hand_over(l);
+  }
+};
+
+/// epoch_guard holds a pin for as long as it is in scope
+class epoch_guard {
+public:
+  /// Pin the current epoch
+  epoch_guard() { epoch_manager::get().pin(); }
+
+  /// Release the pin
+  ~epoch_guard() { epoch_manager::get().unpin(); }
+};
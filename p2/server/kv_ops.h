@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "map.h"
+
+/// kv_ops.h provides the read-modify-write operations on a key/value store:
+/// compare-and-swap, append and increment.  Each one is a single
+/// do_with_version() call, so it can't lose an update to a concurrent writer,
+/// and each one reports the key's version afterwards, so that a client can
+/// follow up with a compare-and-swap.
+
+/// The type of the key/value store
+typedef Map<std::string, std::vector<uint8_t>> kv_map;
+
+/// Change the value of a key, but only if the key's version is still `ver`
+///
+/// @param kv      The key/value store
+/// @param key     The key whose value is being changed
+/// @param ver     The version the caller expects the key to have
+/// @param val     The new value
+/// @param matched Set to true if the version matched and the value changed
+///
+/// @return The key's version afterwards (its new version if it matched, its
+///         current one if not), or 0 if the key doesn't exist
+inline uint64_t kv_cas(kv_map &kv, const std::string &key, uint64_t ver,
+                       const std::vector<uint8_t> &val, bool &matched) {
+  matched = false;
+  return kv.do_with_version(key, [&](std::vector<uint8_t> &cur, uint64_t v) {
+    matched = (v == ver);
+    if (matched)
+      cur = val;
+    return matched;
+  });
+}
+
+/// Append bytes to the value of a key
+///
+/// @param kv   The key/value store
+/// @param key  The key whose value is being extended
+/// @param val  The bytes to append
+/// @param max  The longest that the value may become
+/// @param fits Set to false if the value would have become too long, in which
+///             case it is unchanged
+///
+/// @return The key's version afterwards, or 0 if the key doesn't exist
+inline uint64_t kv_append(kv_map &kv, const std::string &key,
+                          const std::vector<uint8_t> &val, size_t max,
+                          bool &fits) {
+  fits = true;
+  return kv.do_with_version(key, [&](std::vector<uint8_t> &cur, uint64_t) {
+    fits = cur.size() + val.size() <= max;
+    if (fits)
+      cur.insert(cur.end(), val.begin(), val.end());
+    return fits;
+  });
+}
+
+/// Add to the value of a key, which must hold a decimal integer (e.g., "42").
+/// The sum is stored as a decimal integer too.
+///
+/// @param kv      The key/value store
+/// @param key     The key whose value is being incremented
+/// @param delta   The amount to add (may be negative)
+/// @param text    Set to the new value
+/// @param numeric Set to false if the value isn't an integer, or the sum
+///                overflows, in which case the value is unchanged
+///
+/// @return The key's version afterwards, or 0 if the key doesn't exist
+inline uint64_t kv_incr(kv_map &kv, const std::string &key, int64_t delta,
+                        std::string &text, bool &numeric) {
+  numeric = false;
+  return kv.do_with_version(key, [&](std::vector<uint8_t> &cur, uint64_t) {
+    std::string old(cur.begin(), cur.end());
+    char *end = nullptr;
+    errno = 0;
+    long long n = strtoll(old.c_str(), &end, 10);
+    long long sum;
+    numeric = !old.empty() && errno == 0 && *end == '\0' &&
+              !__builtin_add_overflow(n, (long long)delta, &sum);
+    if (!numeric)
+      return false;
+    text = std::to_string(sum);
+    cur.assign(text.begin(), text.end());
+    return true;
+  });
+}
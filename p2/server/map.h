@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <vector>
 
@@ -80,4 +81,35 @@ public:
   ///             useful for 2pl
   virtual void do_all_readonly(std::function<void(const K, const V &)> f,
                                std::function<void()> then) = 0;
+
+  // NB: The version methods must stay after every method above, so that those
+  //     keep their vtable slots: the prebuilt my_storage object calls them by
+  //     position.
+
+  /// Apply a function to the value associated with a given key, and to the
+  /// key's version.  Every change to a key's value gives the key a new
+  /// version, and versions are never reused, so two reads that see the same
+  /// version saw the same value.  The function is allowed to modify the value,
+  /// and returns true if it did, so that the key gets a new version.  This is
+  /// the building block for compare-and-swap and other read-modify-write
+  /// operations that must not race with concurrent updates.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value and version
+  ///
+  /// @return The key's version after the function ran, or 0 if the key
+  ///         doesn't exist
+  virtual uint64_t do_with_version(K key,
+                                   std::function<bool(V &, uint64_t)> f) = 0;
+
+  /// Apply a function to the value associated with a given key, and to the
+  /// key's version.  The function is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be read
+  /// @param f   The function to apply to the key's value and version
+  ///
+  /// @return The key's version, or 0 if the key doesn't exist
+  virtual uint64_t
+  do_with_readonly_version(K key,
+                           std::function<void(const V &, uint64_t)> f) = 0;
 };
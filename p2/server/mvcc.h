@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+#include "epoch.h"
+
+/// mvcc.h provides the clock and the snapshots for multi-version concurrency
+/// control (MVCC).  Every change to a ConcurrentHashMap is a commit, and every
+/// commit gets a stamp from one clock, which all maps share.  A reader takes a
+/// snapshot, which is the clock's current stamp, and sees exactly the commits
+/// whose stamps are no bigger, in every map, without taking any lock.
+///
+/// A writer links its new versions first, marked MVCC_PENDING, and then gets
+/// its stamp and puts it on them right away.  A reader that meets a pending
+/// version can't tell which side of its snapshot the stamp will land on, so it
+/// waits for the stamp; that is the only waiting in the scheme, and it only
+/// lasts a few instructions, unless the writer is preempted.
+///
+/// Writers never wait for readers.  Instead, every old version (and every
+/// removed entry) stays reachable until no snapshot can need it, and the
+/// clock tells writers which snapshots are still in use.  Unlinking something
+/// doesn't mean that no reader is looking at it, though, so a snapshot also
+/// pins an epoch (see epoch.h), and unlinked objects are freed through it.
+///
+/// NB: The atomics in this file, and the links in ConcurrentHashMap, use the
+///     default (sequentially consistent) memory order.  The proof that an
+///     unlinked object can be freed relies on a single order of the clock's
+///     ticks, the readers' announcements, and the unlinks.  On x86 this only
+///     costs anything on stores, which only writers do.
+
+/// The stamp of a version whose commit hasn't got its stamp yet
+const uint64_t MVCC_PENDING = UINT64_MAX;
+
+/// The most threads that can hold a snapshot at once
+const size_t MVCC_READERS = 256;
+
+/// mvcc_clock is the global commit clock, plus a table in which each thread
+/// that is reading announces its snapshot
+class mvcc_clock {
+  /// One thread's announcement, padded so that threads don't share a line
+  struct alignas(64) slot {
+    std::atomic<bool> taken{false}; // Does a thread own this slot?
+    std::atomic<uint64_t> snap{0};  // The owner's snapshot, or a stamp just
+                                    // before it (0 = none)
+  };
+
+  std::atomic<uint64_t> last{1}; // The last stamp handed out (never 0)
+  std::atomic<size_t> used{0};   // Slots in use are all below this
+  slot slots[MVCC_READERS];
+
+  /// A thread's claim on a slot, which is released when the thread exits
+  struct reader {
+    slot *mine = nullptr; // The slot
+    size_t depth = 0;     // How many snapshots the thread has open
+    uint64_t snap = 0;    // The open snapshot
+
+    ~reader() {
+      if (mine)
+        mine->taken = false;
+    }
+  };
+
+  /// Get the calling thread's claim, claiming a slot if it has none
+  reader &me() {
+    thread_local reader r;
+    while (r.mine == nullptr) {
+      for (size_t i = 0; i < MVCC_READERS && r.mine == nullptr; ++i) {
+        bool expect = false;
+        if (slots[i].taken.compare_exchange_strong(expect, true)) {
+          r.mine = &slots[i];
+          size_t u = used;
+          while (u < i + 1 && !used.compare_exchange_weak(u, i + 1)) {
+          }
+        }
+      }
+      if (r.mine == nullptr)
+        std::this_thread::yield(); // Every slot is taken; wait for one
+    }
+    return r;
+  }
+
+public:
+  /// Get the clock.  NB: like slab_pool, the clock is never destroyed, so that
+  ///     maps and threads that outlive static destruction are safe.
+  static mvcc_clock &get() {
+    static mvcc_clock *clock = new mvcc_clock();
+    return *clock;
+  }
+
+  /// Get the stamp for a commit, whose versions are linked and pending
+  ///
+  /// @return A stamp that is bigger than any stamp handed out before
+  uint64_t stamp() { return ++last; }
+
+  /// Get the oldest snapshot that any thread is using or could start using.
+  /// Every snapshot this old or newer stops at the first version it can see,
+  /// and can't reach anything that was unlinked before a commit whose stamp is
+  /// this old or older.
+  uint64_t oldest() {
+    uint64_t o = last;
+    for (size_t i = 0, n = used; i < n; ++i) {
+      uint64_t s = slots[i].snap;
+      if (s != 0 && s < o)
+        o = s;
+    }
+    return o;
+  }
+
+  /// Open a snapshot for the calling thread.  If the thread has one open
+  /// already, the new one is the same, so that nested reads agree.
+  ///
+  /// @return The snapshot
+  uint64_t enter() {
+    reader &r = me();
+    if (r.depth++ > 0)
+      return r.snap;
+    // The announcement may be older than the snapshot, but never newer, so
+    // that a writer which misses it is sure to have seen the clock no later
+    // than the snapshot
+    r.mine->snap = last.load();
+    r.snap = last;
+    return r.snap;
+  }
+
+  /// Close the calling thread's snapshot
+  void leave() {
+    reader &r = me();
+    if (--r.depth == 0)
+      r.mine->snap = 0;
+  }
+};
+
+/// mvcc_snapshot holds a snapshot open, and an epoch pinned, for as long as it
+/// is in scope
+class mvcc_snapshot {
+  epoch_guard pin; // Keeps what the snapshot reads from being freed
+  uint64_t snap;   // The snapshot
+
+public:
+  /// Open a snapshot, or join the calling thread's open one
+  mvcc_snapshot() : snap(mvcc_clock::get().enter()) {}
+
+  /// Close the snapshot
+  ~mvcc_snapshot() { mvcc_clock::get().leave(); }
+
+  /// Get the stamp of the latest commit the snapshot sees
+  uint64_t epoch() const { return snap; }
+};
@@ -13,6 +13,7 @@
 
 #include "authtableentry.h"
 #include "format.h"
+#include "kv_ops.h"
 #include "map.h"
 #include "map_factories.h"
 #include "storage.h"
@@ -402,6 +403,147 @@ public:
     assert(val.size() > 0);
   }
 
+  /// Append an 8-byte binary value to a response
+  ///
+  /// @param res The response data
+  /// @param v   The value to append
+  static void add_u64(vector<uint8_t> &res, uint64_t v) {
+    res.insert(res.end(), (uint8_t *)&v, (uint8_t *)&v + sizeof(v));
+  }
+
+  /// Get a copy of the value to which a key is mapped, and the key's version
+  ///
+  /// NB: This and the read-modify-write methods below are not part of the
+  ///     Storage interface, whose methods each match a request that the
+  ///     prebuilt parsing and responses objects dispatch.  They are the
+  ///     storage-level operations, for a server that dispatches its own
+  ///     requests.
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  /// @param key  The key whose value is being fetched
+  ///
+  /// @return A result tuple, as described in storage.h.  On success, the data
+  ///         is the version followed by the length and bytes of the value.
+  result_t kv_get_version(const string &user, const string &pass,
+                          const string &key) {
+    if (user.length() >= LEN_UNAME || pass.length() >= LEN_PASSWORD ||
+        key.length() > LEN_KEY)
+      return {false, RES_ERR_REQ_FMT, {}};
+
+    auto liar = auth(user, pass);
+    if (!liar.succeeded)
+      return liar;
+
+    vector<uint8_t> res;
+    uint64_t ver = kv_store->do_with_readonly_version(
+        key, [&](const vector<uint8_t> &val, uint64_t v) {
+          add_u64(res, v);
+          add_u64(res, val.size());
+          res.insert(res.end(), val.begin(), val.end());
+        });
+    if (ver == 0)
+      return {false, RES_ERR_KEY, {}};
+    return {true, RES_OK, res};
+  }
+
+  /// Change the value of a key, but only if the key's version hasn't changed
+  /// since the client read it (compare-and-swap)
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  /// @param key  The key whose value is being changed
+  /// @param ver  The version the client expects the key to have
+  /// @param val  The new value
+  ///
+  /// @return A result tuple, as described in storage.h.  The data is the
+  ///         key's new version on success, or its current version if it
+  ///         didn't match.
+  result_t kv_cas(const string &user, const string &pass, const string &key,
+                  uint64_t ver, const vector<uint8_t> &val) {
+    if (user.length() >= LEN_UNAME || pass.length() >= LEN_PASSWORD ||
+        key.length() > LEN_KEY || val.size() > LEN_VAL)
+      return {false, RES_ERR_REQ_FMT, {}};
+
+    auto liar = auth(user, pass);
+    if (!liar.succeeded)
+      return liar;
+
+    bool matched;
+    uint64_t now = ::kv_cas(*kv_store, key, ver, val, matched);
+    if (now == 0)
+      return {false, RES_ERR_KEY, {}};
+    vector<uint8_t> res;
+    add_u64(res, now);
+    if (!matched)
+      return {false, RES_ERR_VERSION, res};
+    return {true, RES_OK, res};
+  }
+
+  /// Append bytes to the value of a key
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  /// @param key  The key whose value is being extended
+  /// @param val  The bytes to append
+  ///
+  /// @return A result tuple, as described in storage.h.  On success, the data
+  ///         is the key's new version.
+  result_t kv_append(const string &user, const string &pass, const string &key,
+                     const vector<uint8_t> &val) {
+    if (user.length() >= LEN_UNAME || pass.length() >= LEN_PASSWORD ||
+        key.length() > LEN_KEY || val.size() > LEN_VAL)
+      return {false, RES_ERR_REQ_FMT, {}};
+
+    auto liar = auth(user, pass);
+    if (!liar.succeeded)
+      return liar;
+
+    bool fits;
+    uint64_t now = ::kv_append(*kv_store, key, val, LEN_VAL, fits);
+    if (now == 0)
+      return {false, RES_ERR_KEY, {}};
+    if (!fits)
+      return {false, RES_ERR_REQ_FMT, {}};
+    vector<uint8_t> res;
+    add_u64(res, now);
+    return {true, RES_OK, res};
+  }
+
+  /// Add to the value of a key, which holds a decimal integer
+  ///
+  /// @param user  The name of the user who made the request
+  /// @param pass  The password for the user, used to authenticate
+  /// @param key   The key whose value is being incremented
+  /// @param delta The amount to add (may be negative)
+  ///
+  /// @return A result tuple, as described in storage.h.  On success, the data
+  ///         is the key's new version, followed by the length and text of the
+  ///         new value.
+  result_t kv_incr(const string &user, const string &pass, const string &key,
+                   int64_t delta) {
+    if (user.length() >= LEN_UNAME || pass.length() >= LEN_PASSWORD ||
+        key.length() > LEN_KEY)
+      return {false, RES_ERR_REQ_FMT, {}};
+
+    auto liar = auth(user, pass);
+    if (!liar.succeeded)
+      return liar;
+
+    bool numeric;
+    string text;
+    uint64_t now = ::kv_incr(*kv_store, key, delta, text, numeric);
+    if (now == 0)
+      return {false, RES_ERR_KEY, {}};
+    if (!numeric)
+      return {false, RES_ERR_REQ_FMT, {}};
+    vector<uint8_t> res;
+    add_u64(res, now);
+    add_u64(res, text.size());
+    res.insert(res.end(), text.begin(), text.end());
+    return {true, RES_OK, res};
+  }
+
   /// Return all of the keys in the kv_store, as a "\n"-delimited string
   ///
   /// @param user The name of the user who made the request
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/// slab.h provides slab_allocator, an allocator for containers that allocate
+/// one fixed-size object at a time (e.g., the nodes of a std::list).  Objects
+/// are carved out of large slabs, so they don't pay for a malloc header each,
+/// and objects of one size stay together instead of fragmenting the heap.
+///
+/// Each thread keeps a small cache of free objects, so most allocations and
+/// frees don't take any lock.  When a cache runs dry, it refills from a shared
+/// depot in one batch; when it gets too full, it gives half back.  Slabs are
+/// never returned to the operating system: memory freed by a map stays
+/// available for that map's (or any same-sized) nodes.
+///
+/// NB: Only the map's own nodes come from slabs.  Values are not stored inline
+///     in the node, and there are no size-class slabs for them: Map<K, V>
+///     hands out values as `V &`, and V (std::vector<uint8_t> for the
+///     kv_store) is fixed by the prebuilt storage, parsing and responses
+///     objects, so its bytes must stay in a std::vector with the default
+///     allocator.  A key is inline only when it fits in std::string's
+///     small-string buffer.
+
+/// The number of bytes in each slab
+const size_t SLAB_BYTES = 65536;
+
+/// The number of free objects a thread caches before giving half back to the
+/// depot
+const size_t SLAB_CACHE = 256;
+
+/// slab_pool manages every object of one size.  There is one slab_pool per
+/// size, shared by all threads.
+///
+/// @param SIZE  The size of each object
+/// @param ALIGN The alignment of each object
+template <size_t SIZE, size_t ALIGN> class slab_pool {
+  static_assert(ALIGN <= alignof(std::max_align_t),
+                "slab_pool can't over-align objects");
+
+  /// A free object holds a link to the next free object
+  struct free_obj {
+    free_obj *next;
+  };
+
+  /// The size of each object, rounded up to hold a link and stay aligned
+  static constexpr size_t OBJ_BYTES =
+      (((SIZE > sizeof(free_obj) ? SIZE : sizeof(free_obj)) + ALIGN - 1) /
+       ALIGN) *
+      ALIGN;
+
+  /// A free list
+  struct free_list {
+    free_obj *head = nullptr; // The first free object
+    size_t count = 0;         // The number of free objects
+
+    /// Add an object to the list
+    void push(void *p) {
+      free_obj *o = static_cast<free_obj *>(p);
+      o->next = head;
+      head = o;
+      ++count;
+    }
+
+    /// Remove an object from the (non-empty) list
+    void *pop() {
+      free_obj *o = head;
+      head = o->next;
+      --count;
+      return o;
+    }
+  };
+
+  /// A thread's cache, which goes back to the depot when the thread exits
+  struct cache : free_list {
+    ~cache() { slab_pool::get().give_back(*this, this->count); }
+  };
+
+  std::mutex lock;          // Protects depot and slabs
+  free_list depot;          // Objects that no thread has cached
+  std::vector<char *> slabs; // Every slab, so that they stay reachable
+
+  /// Move up to `n` objects from the depot (or a new slab) into a cache
+  ///
+  /// @param c The cache to fill
+  /// @param n The number of objects wanted
+  void refill(free_list &c, size_t n) {
+    std::lock_guard<std::mutex> g(lock);
+    if (depot.count == 0) {
+      char *slab = static_cast<char *>(::operator new(SLAB_BYTES));
+      slabs.push_back(slab);
+      for (size_t off = 0; off + OBJ_BYTES <= SLAB_BYTES; off += OBJ_BYTES)
+        depot.push(slab + off);
+    }
+    while (n-- > 0 && depot.count > 0)
+      c.push(depot.pop());
+  }
+
+  /// Move `n` objects from a cache back to the depot
+  ///
+  /// @param c The cache to drain
+  /// @param n The number of objects to move
+  void give_back(free_list &c, size_t n) {
+    std::lock_guard<std::mutex> g(lock);
+    while (n-- > 0)
+      depot.push(c.pop());
+  }
+
+  /// Get the calling thread's cache
+  static free_list &my_cache() {
+    thread_local cache c;
+    return c;
+  }
+
+public:
+  /// Get the pool for this size.  NB: the pool is never destroyed, so that
+  ///     maps (and thread caches) that outlive static destruction are safe.
+  static slab_pool &get() {
+    static slab_pool *pool = new slab_pool();
+    return *pool;
+  }
+
+  /// Allocate one object
+  ///
+  /// @return Uninitialized memory for one object
+  void *alloc() {
+    free_list &c = my_cache();
+    if (c.count == 0)
+      refill(c, SLAB_CACHE / 2);
+    return c.pop();
+  }
+
+  /// Free one object
+  ///
+  /// @param p The object, which must have come from alloc()
+  void free(void *p) {
+    free_list &c = my_cache();
+    c.push(p);
+    if (c.count > SLAB_CACHE)
+      give_back(c, SLAB_CACHE / 2);
+  }
+};
+
+/// slab_allocator is a standard allocator that sends single-object
+/// allocations to the slab_pool for their size, and anything else to the
+/// regular heap.
+///
+/// @param T The type of object being allocated
+template <typename T> struct slab_allocator {
+  typedef T value_type;
+
+  slab_allocator() noexcept {}
+
+  template <typename U> slab_allocator(const slab_allocator<U> &) noexcept {}
+
+  /// Allocate space for `n` objects
+  T *allocate(size_t n) {
+    if (n != 1)
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    return static_cast<T *>(slab_pool<sizeof(T), alignof(T)>::get().alloc());
+  }
+
+  /// Free space for `n` objects
+  void deallocate(T *p, size_t n) noexcept {
+    if (n != 1)
+      ::operator delete(p);
+    else
+      slab_pool<sizeof(T), alignof(T)>::get().free(p);
+  }
+};
+
+/// All slab_allocators can free each other's objects
+template <typename T, typename U>
+bool operator==(const slab_allocator<T> &, const slab_allocator<U> &) {
+  return true;
+}
+
+/// All slab_allocators can free each other's objects
+template <typename T, typename U>
+bool operator!=(const slab_allocator<T> &, const slab_allocator<U> &) {
+  return false;
+}
+
+/// Allocate and construct one object from the slab_pool for its size, for
+/// structures that manage their own nodes instead of using a container
+///
+/// @param args The arguments to the object's constructor
+///
+/// @return The object
+template <typename T, typename... Args> T *slab_new(Args &&...args) {
+  void *p = slab_pool<sizeof(T), alignof(T)>::get().alloc();
+  return new (p) T(std::forward<Args>(args)...);
+}
+
+/// Destruct and free one object that came from slab_new()
+///
+/// @param p The object
+template <typename T> void slab_delete(T *p) {
+  p->~T();
+  slab_pool<sizeof(T), alignof(T)>::get().free(p);
+}
@@ -11,7 +11,7 @@ CLIENT_PROVIDED = client requests crypto err file net my_crypto
 
 # Names for building the server
 SERVER_MAIN     = server
-SERVER_CXX      = my_storage persist
+SERVER_CXX      = my_storage persist uring value_cache value_codec numa
 SERVER_COMMON   = 
 SERVER_PROVIDED = server responses parsing concurrenthashmap_factories \
                   crypto err file net my_pool my_crypto
@@ -0,0 +1,121 @@
+#!/usr/bin/python3
+import cse303
+import glob
+import re
+
+# Configure constants and users
+cse303.indentation = 80
+cse303.verbose = cse303.check_args_verbose()
+alice = cse303.UserConfig("alice", "alice_is_awesome")
+makefiles = ["Makefile"]
+
+# Four values of 400KB don't fit in a 1MB cache, so some of them are always on
+# disk.  Each value is a different byte, so that mixing them up shows.
+cache_mb = "1"
+keys = ["k1", "k2", "k3", "k4"]
+vals = {}
+for i, k in enumerate(keys):
+    vals[k] = k + ".val"
+    cse303.build_file_as(vals[k], str(i + 1) * 400000)
+k1new = "k1.new.val"
+cse303.build_file_as(k1new, "5" * 300000)
+
+# Create objects with server and client configuration
+server = cse303.ServerConfig("./obj64/server.exe", "9999", "rsa", "company.dir", "4", "1024")
+client = cse303.ClientConfig("./obj64/client.exe", "localhost", "9999", "localhost.pub")
+
+# Check if we should use spear's server or client
+cse303.override_exe(server, client)
+
+def start_server(msg, expects):
+    """Start the server with a value cache, and check the lines it prints
+    before it is ready"""
+    return cse303.do_cmd_a(msg, [
+        "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")"] +
+        expects, server.launchcmd() + ["-m", cache_mb])
+
+def stop_server():
+    """Stop the server, wait for it to exit, and return the value cache's
+    counters from the statistics it prints on stderr"""
+    cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
+    cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+    server.pid.wait()
+    err = server.pid.stderr.read().decode("utf-8")
+    m = re.search(r"Values: (\d+) bytes in memory, (\d+) evictions \((\d+) written to the value log\), (\d+) reads from disk", err)
+    if m is None:
+        return {}
+    return {"resident": int(m.group(1)), "evictions": int(m.group(2)),
+            "writes": int(m.group(3)), "faults": int(m.group(4))}
+
+def check_stat(stats, name, low, high):
+    """Check that one of the value cache's counters is in a range"""
+    cse303.leftmsg("Checking the cache's " + name + " (expect " + str(low) + ".." + str(high) + ")")
+    if name in stats and low <= stats[name] <= high:
+        cse303.okmsg()
+    else:
+        print("["+cse303.red("ERR: " + str(stats.get(name)))+"]")
+
+def check_all(expect):
+    """Get every key, and compare its value to the file it was set from"""
+    for k in keys:
+        cse303.do_cmd("Checking key " + k + ".", "___OK___", client.kvG(alice, k), server)
+        cse303.check_file_result(expect[k], k)
+
+# Set up a clean slate before getting started
+cse303.line()
+print("Getting ready to run tests")
+cse303.line()
+cse303.makeclean() # make clean
+cse303.clean_common_files(server, client) # .pub, .pri, .dir files
+for f in glob.glob(server.dirfile + ".*"): # the log, the value log, and the previous snapshot
+    cse303.delfile(f)
+cse303.killprocs()
+cse303.build(makefiles)
+
+print()
+cse303.line()
+print("Test #1: Values that don't fit are evicted, and read back when needed")
+cse303.line()
+server.pid = start_server("Starting server:", [
+    "Generating RSA keys as ("+server.keyfile+".pub, "+server.keyfile+".pri)",
+    "File not found: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "___OK___", client.reg(alice), server)
+cse303.after(server.pid) # need an extra cleanup to handle the KEY that was sent by first REG
+for k in keys:
+    cse303.do_cmd("Setting key " + k + ".", "___OK___", client.kvI(alice, k, vals[k]), server)
+check_all(vals)
+cse303.do_cmd("Upserting key k1.", "OK_UPDATE", client.kvU(alice, "k1", k1new), server)
+cse303.do_cmd("Checking key k1.", "___OK___", client.kvG(alice, "k1"), server)
+cse303.check_file_result(k1new, "k1")
+stats = stop_server()
+check_stat(stats, "resident", 0, 1048576)
+check_stat(stats, "evictions", 1, 100)
+check_stat(stats, "writes", 1, 100)
+check_stat(stats, "faults", 1, 100)
+
+print()
+cse303.line()
+print("Test #2: Evicted values come back from the snapshot after a restart")
+cse303.line()
+latest = dict(vals)
+latest["k1"] = k1new
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+check_all(latest)
+cse303.do_cmd("Instructing server to persist data.", "___OK___", client.persist(alice), server)
+stop_server()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+check_all(latest)
+stats = stop_server()
+check_stat(stats, "resident", 0, 1048576)
+check_stat(stats, "faults", len(keys), 100)
+
+cse303.clean_common_files(server, client)
+for f in glob.glob(server.dirfile + ".*"):
+    cse303.delfile(f)
+for f in list(vals.values()) + [k1new]:
+    cse303.delfile(f)
+
+print()
@@ -0,0 +1,76 @@
+#!/usr/bin/python3
+import cse303
+import glob
+
+# Configure constants and users
+cse303.indentation = 80
+cse303.verbose = cse303.check_args_verbose()
+alice = cse303.UserConfig("alice", "alice_is_awesome")
+afile1 = "common/err.h"
+makefiles = ["Makefile"]
+
+# The compactor wakes every LOG_COMPACT_INTERVAL seconds, and merges once there
+# are LOG_COMPACT_SEGMENTS sealed segments.  Each restart seals one.
+compact_wait = 7
+restarts = 3
+
+# Create objects with server and client configuration
+server = cse303.ServerConfig("./obj64/server.exe", "9999", "rsa", "company.dir", "4", "1024")
+client = cse303.ClientConfig("./obj64/client.exe", "localhost", "9999", "localhost.pub")
+
+# Check if we should use spear's server or client
+cse303.override_exe(server, client)
+
+def start_server(msg, expects):
+    """Start the server, and check the lines it prints before it is ready"""
+    return cse303.do_cmd_a(msg, [
+        "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")"] +
+        expects, server.launchcmd())
+
+def stop_server():
+    """Stop the server, and wait for it to exit"""
+    cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
+    cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+
+# Set up a clean slate before getting started
+cse303.line()
+print("Getting ready to run tests")
+cse303.line()
+cse303.makeclean() # make clean
+cse303.clean_common_files(server, client) # .pub, .pri, .dir files
+for f in glob.glob(server.dirfile + ".*"): # the log, and the previous snapshot
+    cse303.delfile(f)
+cse303.killprocs()
+cse303.build(makefiles)
+
+print()
+cse303.line()
+print("Test #1: A profile set after a SAV survives compaction of the log")
+cse303.line()
+server.pid = start_server("Starting server:", [
+    "Generating RSA keys as ("+server.keyfile+".pub, "+server.keyfile+".pri)",
+    "File not found: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "___OK___", client.reg(alice), server)
+cse303.after(server.pid) # need an extra cleanup to handle the KEY that was sent by first REG
+cse303.do_cmd("Instructing server to persist data.", "___OK___", client.persist(alice), server)
+cse303.do_cmd("Setting alice's content.", "___OK___", client.setC(alice, afile1), server)
+stop_server()
+for i in range(restarts):
+    server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+    cse303.waitfor(2)
+    stop_server()
+server.pid = start_server("Restarting server, and letting the log compact:", ["Loaded: " + server.dirfile])
+cse303.waitfor(compact_wait)
+stop_server()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking alice's content.", "___OK___", client.getC(alice, alice.name), server)
+cse303.check_file_result(afile1, alice.name)
+cse303.do_cmd("Instructing server to persist data.", "___OK___", client.persist(alice), server)
+stop_server()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking alice's content.", "___OK___", client.getC(alice, alice.name), server)
+cse303.check_file_result(afile1, alice.name)
+stop_server()
@@ -1,5 +1,6 @@
 #!/usr/bin/python3
 import cse303
+import glob
 
 # Configure constants and users
 cse303.indentation = 80
@@ -26,12 +27,55 @@ client = cse303.ClientConfig("./obj64/client.exe", "localhost", "9999", "localho
 # Check if we should use spear's server or client
 cse303.override_exe(server, client)
 
+# Changes are logged to numbered segments next to the data file (see
+# server/format.h).  The active segment is preallocated, and is only trimmed to
+# its records when it is sealed, so the log is only measured while the server
+# is stopped.  Each record has a 24-byte header (LOGREC2, checksum, length,
+# sequence number), and a K/V value is stored packed, behind a 1-byte tag.
+def logged(body):
+    """The size of a log record, given the size of its (unpadded) body"""
+    return 24 + cse303.next8(body)
+
+def log_segments():
+    """The log's segments, oldest first"""
+    return sorted(glob.glob(server.dirfile + ".seg.*"))
+
+def verify_logsize(expect):
+    """Compare the total size of the log's segments to an expected value"""
+    s = sum(cse303.get_len(f) for f in log_segments())
+    cse303.leftmsg("Checking size of the log (expect " + str(expect) + ")")
+    if s == expect:
+        cse303.okmsg()
+    else:
+        print("["+cse303.red("ERR: " + str(s))+"]")
+
+def verify_last_types(types):
+    """Check the types of the records in the newest non-empty segment"""
+    found = []
+    for seg in reversed(log_segments()):
+        with open(seg, "rb") as f:
+            data = f.read()
+        pos = 0
+        while pos + 24 <= len(data):
+            size = int.from_bytes(data[pos+12:pos+16], "little")
+            found.append(data[pos+24:pos+32].decode("ascii"))
+            pos += 24 + size
+        if found:
+            break
+    cse303.leftmsg("Checking the newest segment's records for " + str(types))
+    if found == types:
+        cse303.okmsg()
+    else:
+        print("["+cse303.red("ERR: " + str(found))+"]")
+
 # Set up a clean slate before getting started
 cse303.line()
 print("Getting ready to run tests")
 cse303.line()
 cse303.makeclean() # make clean
 cse303.clean_common_files(server, client) # .pub, .pri, .dir files
+for f in glob.glob(server.dirfile + ".*"): # the log, and the previous snapshot
+    cse303.delfile(f)
 cse303.killprocs()
 cse303.build(makefiles)
 cse303.leftmsg("Copying files with student persistence into place")
@@ -52,8 +96,8 @@ cse303.do_cmd("Registering new user alice.", "___OK___", client.reg(alice), serv
 cse303.after(server.pid) # need an extra cleanup to handle the KEY that was sent by first REG
 cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
-expect_size1 = cse303.next8(8 + 8 + len(alice.name) + 8 + 16 + 8 + 32 + 8)
-cse303.verify_filesize(server.dirfile, expect_size1)
+expect_size1 = logged(8 + 8 + len(alice.name) + 8 + 16 + 8 + 32 + 8)
+verify_logsize(expect_size1)
 server.pid = cse303.do_cmd_a("Restarting server:", [
     "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")",
     "Loaded: " + server.dirfile], server.launchcmd())
@@ -72,10 +116,10 @@ server.pid = cse303.do_cmd_a("Restarting server:", [
     "Loaded: " + server.dirfile], server.launchcmd())
 cse303.waitfor(2)
 cse303.do_cmd("Setting alice's content.", "___OK___", client.setC(alice, afile1), server)
-expect_size2 = expect_size1 + cse303.next8(8 + 8 + len("alice") + 8 + cse303.get_len(afile1))
-cse303.verify_filesize(server.dirfile, expect_size2)
 cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+expect_size2 = expect_size1 + logged(8 + 8 + len("alice") + 8 + cse303.get_len(afile1))
+verify_logsize(expect_size2)
 server.pid = cse303.do_cmd_a("Restarting server:", [
     "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")",
     "Loaded: " + server.dirfile], server.launchcmd())
@@ -83,10 +127,10 @@ cse303.waitfor(2)
 cse303.do_cmd("Checking alice's content.", "___OK___", client.getC(alice, alice.name), server)
 cse303.check_file_result(afile1, alice.name)
 cse303.do_cmd("Re-setting alice's content.", "___OK___", client.setC(alice, afile2), server)
-expect_size3 = expect_size2 + cse303.next8(8 + 8 + len("alice") + 8 + cse303.get_len(afile2))
-cse303.verify_filesize(server.dirfile, expect_size3)
 cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+expect_size3 = expect_size2 + logged(8 + 8 + len("alice") + 8 + cse303.get_len(afile2))
+verify_logsize(expect_size3)
 
 print()
 cse303.line()
@@ -98,9 +142,9 @@ server.pid = cse303.do_cmd_a("Restarting server:", [
 cse303.waitfor(2)
 cse303.do_cmd("Setting key k1.", "___OK___", client.kvI(alice, k1, k1file1), server)
 cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
-expect_size4 = expect_size3 + cse303.next8(8 + 8 + len(k1) + 8 + cse303.get_len(k1file1))
-cse303.verify_filesize(server.dirfile, expect_size4)
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+expect_size4 = expect_size3 + logged(8 + 8 + len(k1) + 8 + 1 + cse303.get_len(k1file1))
+verify_logsize(expect_size4)
 server.pid = cse303.do_cmd_a("Restarting server:", [
     "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")",
     "Loaded: " + server.dirfile], server.launchcmd())
@@ -120,12 +164,11 @@ server.pid = cse303.do_cmd_a("Restarting server:", [
 cse303.waitfor(2)
 cse303.do_cmd("Upserting key k1.", "OK_UPDATE", client.kvU(alice, k1, k1file2), server)
 cse303.do_cmd("Upserting key k2.", "OK_INSERT", client.kvU(alice, k2, k2file1), server)
-expect_size5 = expect_size4 + cse303.next8(8 + 8 + len(k1) + 8 + cse303.get_len(k1file2)) + cse303.next8(8 + 8 + len(k2) + 8 + cse303.get_len(k2file1))
-cse303.verify_filesize(server.dirfile, expect_size5 )
-cse303.verify_peek(server.dirfile, expect_size4, 8, "KVUPDATE")
-cse303.verify_peek(server.dirfile, expect_size4 + 8 + cse303.next8(8 + len(k1) + 8 + cse303.get_len(k1file2)), 8, "KVKVKVKV")
 cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+expect_size5 = expect_size4 + logged(8 + 8 + len(k1) + 8 + 1 + cse303.get_len(k1file2)) + logged(8 + 8 + len(k2) + 8 + 1 + cse303.get_len(k2file1))
+verify_logsize(expect_size5)
+verify_last_types(["KVPACKED", "KVPACKED"]) # an update and an insert are both logged packed
 server.pid = cse303.do_cmd_a("Restarting server:", [
     "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")",
     "Loaded: " + server.dirfile], server.launchcmd())
@@ -146,10 +189,11 @@ server.pid = cse303.do_cmd_a("Restarting server:", [
     "Loaded: " + server.dirfile], server.launchcmd())
 cse303.waitfor(2)
 cse303.do_cmd("Deleting key k1.", "___OK___", client.kvD(alice, k1), server)
-expect_size6 = expect_size5 + cse303.next8(8 + 8 + len(k1))
-cse303.verify_filesize(server.dirfile, expect_size6)
 cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+expect_size6 = expect_size5 + logged(8 + 8 + len(k1))
+verify_logsize(expect_size6)
+verify_last_types(["KVDELETE"])
 server.pid = cse303.do_cmd_a("Restarting server:", [
     "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")",
     "Loaded: " + server.dirfile], server.launchcmd())
@@ -170,10 +214,10 @@ cse303.do_cmd("Upserting key k2.", "OK_UPDATE", client.kvU(alice, k2, k2file1),
 cse303.do_cmd("Upserting key k2.", "OK_UPDATE", client.kvU(alice, k2, k2file2), server)
 cse303.do_cmd("Upserting key k3.", "OK_INSERT", client.kvU(alice, k3, k3file1), server)
 cse303.do_cmd("Upserting key k3.", "OK_UPDATE", client.kvU(alice, k3, k3file2), server)
-expect_size7 = expect_size6 + cse303.next8(8 + 8 + len(k2) + 8 + cse303.get_len(k2file1)) + cse303.next8(8 + 8 + len(k2) + 8 + cse303.get_len(k2file2)) + cse303.next8(8 + 8 + len(k3) + 8 + cse303.get_len(k3file1)) + cse303.next8(8 + 8 + len(k3) + 8 + cse303.get_len(k3file2))
-cse303.verify_filesize(server.dirfile, expect_size7)
 cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+expect_size7 = expect_size6 + logged(8 + 8 + len(k2) + 8 + 1 + cse303.get_len(k2file1)) + logged(8 + 8 + len(k2) + 8 + 1 + cse303.get_len(k2file2)) + logged(8 + 8 + len(k3) + 8 + 1 + cse303.get_len(k3file1)) + logged(8 + 8 + len(k3) + 8 + 1 + cse303.get_len(k3file2))
+verify_logsize(expect_size7)
 server.pid = cse303.do_cmd_a("Restarting server:", [
     "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")",
     "Loaded: " + server.dirfile], server.launchcmd())
@@ -187,15 +231,21 @@ cse303.await_server("Waiting for server to shut down.", "Server terminated", ser
 
 print()
 cse303.line()
-print("Test #7: SAV should compact the directory")
+print("Test #7: SAV should snapshot the directory")
 cse303.line()
 server.pid = cse303.do_cmd_a("Restarting server:", [
     "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")",
     "Loaded: " + server.dirfile], server.launchcmd())
 cse303.waitfor(2)
 cse303.do_cmd("Instructing server to persist data.", "___OK___", client.persist(alice), server)
-expect_size8 = cse303.next8(8 + 8 + len(alice.name) + 8 + 16 + 8 + 32 + 8 + cse303.get_len(afile2)) + cse303.next8(8 + 8 + len(k2) + 8 + cse303.get_len(k2file2)) + cse303.next8(8 + 8 + len(k3) + 8 + cse303.get_len(k3file2))
-cse303.verify_filesize(server.dirfile, expect_size8)
+cse303.check_exist(server.dirfile, True)
+cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
+cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+verify_logsize(expect_size7) # nothing was logged after the snapshot
+server.pid = cse303.do_cmd_a("Restarting server:", [
+    "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")",
+    "Loaded: " + server.dirfile], server.launchcmd())
+cse303.waitfor(2)
 cse303.do_cmd("Checking alice's content.", "___OK___", client.getC(alice, alice.name), server)
 cse303.check_file_result(afile2, alice.name)
 cse303.do_cmd("Checking key k1.", "ERR_KEY", client.kvG(alice, k1), server)
@@ -207,5 +257,7 @@ cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
 cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
 
 cse303.clean_common_files(server, client)
+for f in glob.glob(server.dirfile + ".*"):
+    cse303.delfile(f)
 
 print()
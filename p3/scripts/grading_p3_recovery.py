@@ -0,0 +1,152 @@
+#!/usr/bin/python3
+import cse303
+import glob
+
+# Configure constants and users
+cse303.indentation = 80
+cse303.verbose = cse303.check_args_verbose()
+alice = cse303.UserConfig("alice", "alice_is_awesome")
+k1 = "k1"
+k1file = "common/err.h"
+k2 = "second_key"
+k2file = "server/storage.h"
+k3 = "third_key"
+k3file = "common/net.h"
+makefiles = ["Makefile"]
+
+# Create objects with server and client configuration
+server = cse303.ServerConfig("./obj64/server.exe", "9999", "rsa", "company.dir", "4", "1024")
+client = cse303.ClientConfig("./obj64/client.exe", "localhost", "9999", "localhost.pub")
+
+# Check if we should use spear's server or client
+cse303.override_exe(server, client)
+
+def start_server(msg, expects):
+    """Start the server, and check the lines it prints before it is ready"""
+    return cse303.do_cmd_a(msg, [
+        "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")"] +
+        expects, server.launchcmd())
+
+def stop_server():
+    """Stop the server, and wait for it to exit"""
+    cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
+    cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+
+def crash_server():
+    """Kill the server, so that it doesn't get to seal its log segment"""
+    cse303.leftmsg("Killing server.")
+    server.pid.kill()
+    server.pid.wait()
+    cse303.okmsg()
+
+def check_stderr(msg, expect):
+    """Wait for the server to exit, and check that it said something on stderr"""
+    cse303.leftmsg(msg + " Expect: '" + expect + "'")
+    server.pid.wait()
+    err = server.pid.stderr.read().decode("utf-8")
+    if expect in err:
+        cse303.okmsg()
+    else:
+        print("["+cse303.red("ERR")+"] '" + err.rstrip() + "'")
+
+def log_segments():
+    """The log's segments, oldest first"""
+    return sorted(glob.glob(server.dirfile + ".seg.*"))
+
+def records_end(seg):
+    """The offset just past the last record in a segment"""
+    with open(seg, "rb") as f:
+        data = f.read()
+    pos = 0
+    while pos + 24 <= len(data) and data[pos:pos+8] == b"LOGREC02":
+        pos += 24 + int.from_bytes(data[pos+12:pos+16], "little")
+    return min(pos, len(data))
+
+# Set up a clean slate before getting started
+cse303.line()
+print("Getting ready to run tests")
+cse303.line()
+cse303.makeclean() # make clean
+cse303.clean_common_files(server, client) # .pub, .pri, .dir files
+for f in glob.glob(server.dirfile + ".*"): # the log, and the previous snapshot
+    cse303.delfile(f)
+cse303.killprocs()
+cse303.build(makefiles)
+
+print()
+cse303.line()
+print("Test #1: Acknowledged changes survive a crash")
+cse303.line()
+server.pid = start_server("Starting server:", [
+    "Generating RSA keys as ("+server.keyfile+".pub, "+server.keyfile+".pri)",
+    "File not found: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "___OK___", client.reg(alice), server)
+cse303.after(server.pid) # need an extra cleanup to handle the KEY that was sent by first REG
+cse303.do_cmd("Setting key k1.", "___OK___", client.kvI(alice, k1, k1file), server)
+cse303.do_cmd("Setting key k2.", "___OK___", client.kvI(alice, k2, k2file), server)
+crash_server()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k1.", "___OK___", client.kvG(alice, k1), server)
+cse303.check_file_result(k1file, k1)
+cse303.do_cmd("Checking key k2.", "___OK___", client.kvG(alice, k2), server)
+cse303.check_file_result(k2file, k2)
+stop_server()
+
+print()
+cse303.line()
+print("Test #2: A record torn by a crash is cut off the end of the log")
+cse303.line()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Setting key k3.", "___OK___", client.kvI(alice, k3, k3file), server)
+crash_server()
+torn = log_segments()[-1]
+end = records_end(torn)
+cse303.leftmsg("Writing half of a record after byte " + str(end) + " of " + torn)
+with open(torn, "r+b") as f:
+    f.seek(end)
+    f.write(b"LOGREC02" + bytes(4) + (4096).to_bytes(4, "little") + bytes(8) + b"torn" * 25)
+cse303.okmsg()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k3.", "___OK___", client.kvG(alice, k3), server)
+cse303.check_file_result(k3file, k3)
+stop_server()
+check_stderr("Checking that the torn record was reported.", "Discarding")
+cse303.verify_filesize(torn, end)
+
+print()
+cse303.line()
+print("Test #3: A bad record before the last segment stops the server")
+cse303.line()
+sealed = log_segments()[0]
+with open(sealed, "rb") as f:
+    good = f.read()
+cse303.leftmsg("Damaging the first record of " + sealed)
+with open(sealed, "r+b") as f:
+    f.seek(40)
+    f.write(b"XXXXXXXX")
+cse303.okmsg()
+server.pid = start_server("Restarting server, which should refuse to load the log:", [
+    "Damaged log segment: " + sealed])
+check_stderr("Checking stderr.", "Bad record at byte 0 of " + sealed)
+cse303.check_exist(sealed, True)
+cse303.leftmsg("Repairing " + sealed)
+with open(sealed, "wb") as f:
+    f.write(good)
+cse303.okmsg()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k1.", "___OK___", client.kvG(alice, k1), server)
+cse303.check_file_result(k1file, k1)
+cse303.do_cmd("Checking key k3.", "___OK___", client.kvG(alice, k3), server)
+cse303.check_file_result(k3file, k3)
+stop_server()
+
+cse303.clean_common_files(server, client)
+for f in glob.glob(server.dirfile + ".*"):
+    cse303.delfile(f)
+
+print()
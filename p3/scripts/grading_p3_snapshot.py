@@ -0,0 +1,124 @@
+#!/usr/bin/python3
+import cse303
+import glob
+
+# Configure constants and users
+cse303.indentation = 80
+cse303.verbose = cse303.check_args_verbose()
+alice = cse303.UserConfig("alice", "alice_is_awesome")
+afile1 = "common/err.h"
+k1 = "k1"
+k1file1 = "solutions/net.o"
+k1file2 = "server/server.cc"
+k2 = "second_key"
+k2file = "server/parsing.h"
+k3 = "third_key"
+k3file1 = "solutions/file.o"
+k3file2 = "common/net.h"
+k4 = "fourth_key"
+k4file = "server/storage.h"
+makefiles = ["Makefile"]
+
+# Create objects with server and client configuration
+server = cse303.ServerConfig("./obj64/server.exe", "9999", "rsa", "company.dir", "4", "1024")
+client = cse303.ClientConfig("./obj64/client.exe", "localhost", "9999", "localhost.pub")
+
+# Check if we should use spear's server or client
+cse303.override_exe(server, client)
+
+def start_server(msg, expects):
+    """Start the server, and check the lines it prints before it is ready"""
+    return cse303.do_cmd_a(msg, [
+        "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")"] +
+        expects, server.launchcmd())
+
+def stop_server():
+    """Stop the server, and wait for it to exit"""
+    cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
+    cse303.await_server("Waiting for server to shut down.", "Server terminated", server)
+
+def check_stderr(msg, expect):
+    """Wait for the server to exit, and check that it said something on stderr"""
+    cse303.leftmsg(msg + " Expect: '" + expect + "'")
+    server.pid.wait()
+    err = server.pid.stderr.read().decode("utf-8")
+    if expect in err:
+        cse303.okmsg()
+    else:
+        print("["+cse303.red("ERR")+"] '" + err.rstrip() + "'")
+
+def check_key(key, file):
+    """Get a key, and compare its value to a file"""
+    cse303.do_cmd("Checking key " + key + ".", "___OK___", client.kvG(alice, key), server)
+    cse303.check_file_result(file, key)
+
+# Set up a clean slate before getting started
+cse303.line()
+print("Getting ready to run tests")
+cse303.line()
+cse303.makeclean() # make clean
+cse303.clean_common_files(server, client) # .pub, .pri, .dir files
+for f in glob.glob(server.dirfile + ".*"): # the log, and the previous snapshot
+    cse303.delfile(f)
+cse303.killprocs()
+cse303.build(makefiles)
+
+print()
+cse303.line()
+print("Test #1: Startup loads the snapshot, then replays the log after it")
+cse303.line()
+server.pid = start_server("Starting server:", [
+    "Generating RSA keys as ("+server.keyfile+".pub, "+server.keyfile+".pri)",
+    "File not found: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "___OK___", client.reg(alice), server)
+cse303.after(server.pid) # need an extra cleanup to handle the KEY that was sent by first REG
+cse303.do_cmd("Setting key k1.", "___OK___", client.kvI(alice, k1, k1file1), server)
+cse303.do_cmd("Setting key k3.", "___OK___", client.kvI(alice, k3, k3file1), server)
+cse303.do_cmd("Instructing server to persist data.", "___OK___", client.persist(alice), server)
+cse303.check_exist(server.dirfile, True)
+cse303.do_cmd("Setting alice's content.", "___OK___", client.setC(alice, afile1), server)
+cse303.do_cmd("Upserting key k1.", "OK_UPDATE", client.kvU(alice, k1, k1file2), server)
+cse303.do_cmd("Upserting key k2.", "OK_INSERT", client.kvU(alice, k2, k2file), server)
+stop_server()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking alice's content.", "___OK___", client.getC(alice, alice.name), server)
+cse303.check_file_result(afile1, alice.name)
+check_key(k1, k1file2) # changed after the snapshot
+check_key(k2, k2file) # created after the snapshot
+check_key(k3, k3file1) # only in the snapshot, so read from it when asked for
+stop_server()
+
+print()
+cse303.line()
+print("Test #2: A damaged snapshot falls back to the previous one")
+cse303.line()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Upserting key k3.", "OK_UPDATE", client.kvU(alice, k3, k3file2), server)
+cse303.do_cmd("Instructing server to persist data.", "___OK___", client.persist(alice), server)
+cse303.check_exist(server.dirfile + ".prev", True)
+cse303.do_cmd("Setting key k4.", "___OK___", client.kvI(alice, k4, k4file), server)
+cse303.do_cmd("Deleting key k2.", "___OK___", client.kvD(alice, k2), server)
+stop_server()
+cse303.leftmsg("Damaging " + server.dirfile)
+with open(server.dirfile, "r+b") as f:
+    f.write(b"XXXXXXXX")
+cse303.okmsg()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking alice's content.", "___OK___", client.getC(alice, alice.name), server)
+cse303.check_file_result(afile1, alice.name)
+check_key(k1, k1file2)
+cse303.do_cmd("Checking key k2.", "ERR_KEY", client.kvG(alice, k2), server)
+check_key(k3, k3file2) # changed between the two snapshots
+check_key(k4, k4file) # changed after both
+stop_server()
+check_stderr("Checking stderr.", server.dirfile + " is damaged; loading " + server.dirfile + ".prev")
+
+cse303.clean_common_files(server, client)
+for f in glob.glob(server.dirfile + ".*"):
+    cse303.delfile(f)
+
+print()
@@ -119,3 +119,105 @@ const std::string KVUPDATE = "KVUPDATE";
 
 /// A unique 8-byte code for incremental persistence of deletes to the kv store
 const std::string KVDELETE = "KVDELETE";
+
+/// The log of incremental changes is not appended to the data file itself.  It
+/// is split into numbered segment files (e.g., company.dir.seg.00000001), each
+/// of which holds entries in the formats above.  When a segment grows past a
+/// fixed size it is sealed, and entries go to the next one.  A SAV (which the
+/// server also runs on its own, when the segments get too big) writes a new
+/// data file that starts with an entry naming the first segment that the data
+/// file does *not* already include:
+///
+/// Log start entry format:
+/// - 8-byte constant LOGSTART
+/// - 8-byte binary write of the length of the segment number (always 8)
+/// - 8-byte binary write of the segment number
+///
+/// To load, read the data file, then replay every segment numbered at or after
+/// its LOGSTART, in order.  Segments from before the LOGSTART are deleted once
+/// the data file is safely on disk, but might survive a crash, so they must be
+/// skipped rather than replayed.
+///
+/// Sealed segments are also merged in the background: a run of sealed
+/// segments is rewritten as one segment holding only each key's (or user's)
+/// final state within the run, as a KVUPDATE, KVDELETE, AUTHAUTH, or AUTHDIFF
+/// entry.
+
+/// A unique 8-byte code for the entry that records which log segment a data
+/// file continues with
+const std::string LOGSTART = "LOGSTART";
+
+/// Every entry that the server writes, in the data file and in the log, is
+/// framed by a header that lets a reader check it before trusting any of its
+/// lengths.  An entry whose write was torn by a crash fails its check, so that
+/// loading stops cleanly at the last good entry instead of parsing garbage:
+///
+/// Framed entry format (version 2):
+/// - 8-byte constant LOGREC02
+/// - 4-byte CRC32C of everything after it, through the end of the entry
+/// - 4-byte binary write of the length of the entry that follows
+/// - 8-byte sequence number (log entries are numbered from 1, in the order
+///   they were written; data file entries have sequence number 0)
+/// - The entry itself, in one of the formats above, starting with its 8-byte
+///   type and ending with its padding
+///
+/// Entries without a header (version 1) are still accepted when loading, so
+/// that files written by older servers can be read.
+
+/// A unique 8-byte code for the header of a framed entry
+const std::string LOGREC2 = "LOGREC02";
+
+/// A snapshot doesn't store the K/V store as KVKVKVKV entries.  After the
+/// framed LOGSTART and AUTHAUTH entries, it has a table of the K/V pairs,
+/// sorted by key, which the server maps into memory instead of reading.  On
+/// startup, only the keys are loaded; each value is read from the table the
+/// first time it is requested, so values that nobody asks for stay on disk.
+///
+/// K/V table format:
+/// - The values, each padded to an 8-byte boundary
+/// - The keys, each padded to an 8-byte boundary
+/// - The index: one 32-byte entry per key, in the keys' sorted order:
+///   - 8-byte offset of the key (from the start of the file)
+///   - 4-byte length of the key
+///   - 4-byte CRC32C of the value
+///   - 8-byte offset of the value
+///   - 8-byte length of the value
+/// - The footer, which is the last 48 bytes of the file:
+///   - 8-byte offset of the values (i.e., the end of the framed entries)
+///   - 8-byte offset of the keys
+///   - 8-byte offset of the index
+///   - 8-byte number of keys
+///   - 4-byte CRC32C of the keys and the index
+///   - 4-byte CRC32C of the first 36 bytes of the footer
+///   - 8-byte constant KVTABLE1
+///
+/// A snapshot without the footer holds its K/V pairs as KVKVKVKV entries, and
+/// is loaded by reading all of its entries.
+
+/// A unique 8-byte code that ends a snapshot with a K/V table
+const std::string KVTABLE = "KVTABLE1";
+
+/// Values may be compressed, each with the codec that suits it (see
+/// value_codec.h).  A value is stored in its packed form, which starts with
+/// the code for its codec, and changes to the K/V store are logged with a new
+/// entry, which replaces KVKVKVKV and KVUPDATE:
+///
+/// Packed Key/Value entry format:
+/// - 8-byte constant KVPACKED
+/// - 8-byte binary write of the length of the key
+/// - Binary write of the bytes of the key
+/// - 8-byte binary write of the length of the packed value
+/// - Binary write of the bytes of the packed value
+/// - Binary write of some bytes of padding, to ensure that the next entry will
+///   be aligned on an 8-byte boundary.
+///
+/// A KVPACKED entry inserts the key if it is new, and updates it otherwise.
+/// Snapshots end with KVTABLE2 instead of KVTABLE1 when their K/V table holds
+/// packed values; the table is otherwise the same.  Older entries and tables,
+/// with values that aren't packed, can still be loaded.
+
+/// A unique 8-byte code for incremental persistence of a packed value
+const std::string KVPACKED = "KVPACKED";
+
+/// A unique 8-byte code that ends a snapshot with a K/V table of packed values
+const std::string KVTABLE2 = "KVTABLE2";
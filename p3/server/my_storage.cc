@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstdio>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
@@ -22,8 +25,11 @@
 #include "format.h"
 #include "map.h"
 #include "map_factories.h"
+#include "numa.h"
 #include "persist.h"
 #include "storage.h"
+#include "value_cache.h"
+#include "value_codec.h"
 
 using namespace std;
 
@@ -49,28 +55,6 @@ bool addtoFile(FILE *pFile, const char *data, size_t bytes, const char* filename
   return true;
 }
 
-/// Pass in an open file and this function will extract all bytes and pass
-/// return into a vector<uint8_t> 
-///
-/// @param pFile  The open file to write to
-///
-/// @return       Populated vector<uint8_t> if read() works, empty otherwise
-std::vector<uint8_t> readFromFile(FILE *file) {
-  std::vector<uint8_t> fileReceive;
-  fseek(file, 0, SEEK_END);
-  long lSize = ftell(file);
-  rewind(file);
-  char buffer[lSize];
-  size_t result = fread(buffer, sizeof(uint8_t), lSize, file);
-  if (result != lSize) {
-    std::cerr << "Error reading from file" << std::endl;
-    return {};
-  }
-
-  fileReceive.insert(fileReceive.end(), (char *)&buffer, (char *)&buffer + lSize);
-  return fileReceive;
-}
-
 /// MyStorage is the student implementation of the Storage class
 class MyStorage : public Storage {
   /// The map of authentication information, indexed by username
@@ -85,10 +69,32 @@ class MyStorage : public Storage {
   /// which we persist the Storage object every time it changes
   string filename = "";
 
-  /// The open file
-  FILE *storage_file = nullptr;
+  /// The log of changes since the data file was written
+  seg_log *wal;
   
+  /// Serializes save_file(), which both clients and the log compactor run
   std::mutex storage_lock;
+
+  /// The first log segment that the previous snapshot (filename.prev) needs.
+  /// The previous snapshot is kept, along with the log after it, in case the
+  /// latest one is damaged.
+  uint64_t prev_first_seg = 0;
+
+  /// The latest snapshot, which the next one is built from ("" if none), and
+  /// the sequence number of the last log record that it includes
+  std::string snap_file;
+  uint64_t snap_seq = 0;
+
+  /// The K/V table of the latest snapshot.  A key whose value is empty (which
+  /// a real value never is) hasn't been read since it was loaded from a
+  /// snapshot, and its value is still in this table.
+  std::shared_ptr<kv_table> cold;
+
+  /// Protects cold
+  std::mutex cold_lock;
+
+  /// Decides which values stay in memory, and where the others are on disk
+  value_cache *values;
 public:
   /// Construct an empty object and specify the file from which it should be
   /// loaded.  To avoid exceptions and errors in the constructor, the act of
@@ -105,10 +111,14 @@ public:
   MyStorage(const std::string &fname, size_t buckets, size_t, size_t, size_t,
             double, size_t, const std::string &)
       : auth_table(authtable_factory(buckets)),
-        kv_store(kvstore_factory(buckets)), filename(fname) {}
+        kv_store(sharded_kvstore_factory(buckets)), filename(fname),
+        wal(new seg_log(fname)), values(value_cache_factory(fname + ".vlog")) {}
 
   /// Destructor for the storage object.
-  virtual ~MyStorage() {}
+  virtual ~MyStorage() {
+    delete wal;
+    delete values;
+  }
 
   /// Create a new entry in the Auth table.  If the user already exists, return
   /// an error.  Otherwise, create a salt, hash the password, and then save an
@@ -141,6 +151,7 @@ public:
 
     AuthTableEntry ae{user, vector<uint8_t>(salt, salt + sizeof(salt)), hashPass, {}};
 
+    bool logged = false;
     if (!this->auth_table->insert(user, ae, [&] () {
       /*
         Logging:
@@ -157,9 +168,10 @@ public:
         - PADDING = 8 - (SIZE OF ABOVE % 8)
       */
       std::vector<uint8_t> finalData;
-      std::string authCmd = "AUTHAUTH";
+      finalData.reserve(AUTHENTRY.size() + 4 * sizeof(size_t) + ae.username.length() +
+                        ae.salt.size() + ae.pass_hash.size() + ae.content.size() + 7);
 
-      finalData.insert(finalData.end(), authCmd.begin(), authCmd.end()); //AUTHAUTH
+      finalData.insert(finalData.end(), AUTHENTRY.begin(), AUTHENTRY.end()); //AUTHAUTH
 
       size_t userNameSize = ae.username.length();
       finalData.insert(finalData.end(), (char*)&userNameSize, ((char*)&userNameSize) + sizeof(size_t)); //LEN USER
@@ -189,18 +201,18 @@ public:
         }
       }
 
-      // add new data to storage_file
-      storage_file = fopen(filename.c_str(), "a");
-      if (storage_file != nullptr) {
-        fwrite(finalData.data(), sizeof(uint8_t), finalData.size(), storage_file);
-        fflush(storage_file);
-        fsync(fileno(storage_file));
-      }
+      // add new data to the log
+      logged = wal->append(finalData);
 
       // addtoFile(storage_file, (const char*)finalData.data(), finalData.size(), this->filename.c_str());
     })) {
       return {false, RES_ERR_USER_EXISTS, {}};
     }
+    // the user can't be kept if the log doesn't have them
+    if (!logged) {
+      this->auth_table->remove(user, [](){});
+      return {false, RES_ERR_SERVER, {}};
+    }
 
     return {true, RES_OK, {}};
 
@@ -229,8 +241,8 @@ public:
     }
 
 
+    bool logged = false;
     auto f = [&] (AuthTableEntry &ae) { 
-      ae.content = content; //setting the AuthTableEntry content to our vector<uint8_t> &content
 
       /*
         Logging:
@@ -252,11 +264,11 @@ public:
       finalData.insert(finalData.end(), ae.username.begin(), ae.username.end()); //STORE USERNAME
 
 
-      size_t contentSize = ae.content.size();
+      size_t contentSize = content.size();
       finalData.insert(finalData.end(), (char *)&contentSize, ((char*)&contentSize) + sizeof(size_t)); //STORE CONTENT LENGTH
    
 
-      finalData.insert(finalData.end(), ae.content.begin(), ae.content.end()); //STORE CONTENT
+      finalData.insert(finalData.end(), content.begin(), content.end()); //STORE CONTENT
 
       // add padding
       if ((finalData.size() % 8) > 0) {
@@ -266,13 +278,10 @@ public:
         }
       }
 
-      // add new data to storage_file
-      storage_file = fopen(filename.c_str(), "a");
-      if (storage_file != nullptr) {
-        fwrite(finalData.data(), sizeof(uint8_t), finalData.size(), storage_file);
-        fflush(storage_file);
-        fsync(fileno(storage_file));
-      }
+      // add new data to the log, and only change the content if it's there
+      logged = wal->append(finalData);
+      if (logged)
+        ae.content = content; //setting the AuthTableEntry content to our vector<uint8_t> &content
 
       //addtoFile(storage_file, (const char*)finalData.data(), finalData.size(), this->filename.c_str());
 
@@ -280,6 +289,8 @@ public:
 
     this->auth_table->do_with(user, f); // apply the function f
 
+    if (!logged)
+      return result_t{false, RES_ERR_SERVER, {}};
     return result_t{true, RES_OK, {}};
     // NB: These asserts are to prevent compiler warnings
     assert(user.length() > 0);
@@ -431,32 +442,35 @@ public:
     if (!authCheck.succeeded) {
       return result_t{false, RES_ERR_LOGIN, {} };
     }
-    //once the user is authenticated insert the key value
+    //once the user is authenticated insert the key value, compressing it if
+    //it's worth it
+    std::vector<uint8_t> packed = pack_value(val);
 
-    bool pleaseWork = this->kv_store->insert(key, val, [&] () {
+    bool logged = false;
+    bool pleaseWork = this->kv_store->insert(key, packed, [&] () {
         /*
           Logging:
-          - KVKVKVKV
+          - KVPACKED
           - 8 BYTE KEY LENGTH
           - KEY 
-          - 8 BYTE VAL LEN 
-          - VAL
+          - 8 BYTE PACKED VAL LEN 
+          - PACKED VAL
 
           - PADDING = 8 - (SIZE OF ABOVE % 8)
         */
         std::vector<uint8_t> finalData; 
 
-        finalData.insert(finalData.end(), KVENTRY.begin(), KVENTRY.end()); //KVKVKVKV
+        finalData.insert(finalData.end(), KVPACKED.begin(), KVPACKED.end()); //KVPACKED
 
         size_t keySize = key.length();
         finalData.insert(finalData.end(), (char *)&keySize, ((char*)&keySize) + sizeof(size_t)); //LEN KEY
 
         finalData.insert(finalData.end(), key.begin(), key.end()); //KEY
 
-        size_t valueSize = val.size();
+        size_t valueSize = packed.size();
         finalData.insert(finalData.end(), (char *)&valueSize, ((char *)&valueSize) + sizeof(size_t)); //LEN VAL
 
-        finalData.insert(finalData.end(), val.begin(), val.end()); //VAL
+        finalData.insert(finalData.end(), packed.begin(), packed.end()); //VAL
 
         if ((finalData.size() % 8) > 0) { //PADDING
           size_t pads = 8 - (finalData.size() % 8);
@@ -465,21 +479,23 @@ public:
           }
         }
 
-        // add new data to storage_file
-        storage_file = fopen(filename.c_str(), "a");
-        if (storage_file != nullptr) {
-          fwrite(finalData.data(), sizeof(uint8_t), finalData.size(), storage_file);
-          fflush(storage_file);
-          fsync(fileno(storage_file));
-        }
+        // add new data to the log
+        logged = wal->append(finalData);
+        if (logged)
+          values->charge(key, packed.size(), true);
 
         //addtoFile(this->storage_file, (const char*)finalData.data(), finalData.size(), this->filename.c_str()); 
     });
 
     if (!pleaseWork) {
       return result_t{false, RES_ERR_KEY, {} }; 
+    } else if (!logged) {
+      // the key can't be kept if the log doesn't have it
+      this->kv_store->remove(key, [](){});
+      return result_t{false, RES_ERR_SERVER, {}};
     } else {
-        return result_t{true, RES_OK, {} }; 
+      trim_cache();
+      return result_t{true, RES_OK, {} }; 
     }
   
     // NB: These asserts are to prevent compiler warnings
@@ -507,6 +523,7 @@ public:
 
     auto f = [&] (const std::vector<uint8_t> &val) {
       valReturn = val; 
+      values->touch(key);
     };
 
     bool thisisSparta = this->kv_store->do_with_readonly(key, f);
@@ -515,7 +532,33 @@ public:
       return result_t{false, RES_ERR_KEY, {}};
     }
 
-    return result_t{true, RES_OK, valReturn};
+    // the value isn't in memory (it was evicted, or hasn't been read since it
+    // was loaded), so bring it in from disk
+    if (valReturn.empty()) {
+      bool intact = true;
+      thisisSparta = this->kv_store->do_with(key, [&] (std::vector<uint8_t> &val) {
+        if (val.empty()) {
+          intact = read_cold(key, val);
+          if (intact)
+            values->charge(key, val.size(), false);
+        }
+        valReturn = val;
+      });
+      if (!thisisSparta)
+        return result_t{false, RES_ERR_KEY, {}};
+      if (!intact) {
+        cerr << "Cannot read the value of " << key << " from " << filename << endl;
+        return result_t{false, RES_ERR_SERVER, {}};
+      }
+      trim_cache();
+    }
+
+    std::vector<uint8_t> unpacked;
+    if (!unpack_value(valReturn, unpacked)) {
+      cerr << "Cannot unpack the value of " << key << endl;
+      return result_t{false, RES_ERR_SERVER, {}};
+    }
+    return result_t{true, RES_OK, unpacked};
 
     // NB: These asserts are to prevent compiler warnings
     assert(user.length() > 0);
@@ -537,6 +580,15 @@ public:
       return result_t{false, RES_ERR_LOGIN, {} };
     }
 
+    // keep a copy of the value, so that the key can be put back if the delete
+    // can't be logged.  (An evicted value is empty, and stays in the cache's
+    // books until the delete is logged, so it can be put back empty.)
+    std::vector<uint8_t> old;
+    if (!this->kv_store->do_with_readonly(key, [&] (const std::vector<uint8_t> &v) { old = v; })) {
+      return result_t{false, RES_ERR_KEY, {} };
+    }
+
+    bool logged = false;
     bool pleaseWork = this->kv_store->remove(key, [&] () {
       /*
         Logging:
@@ -563,13 +615,10 @@ public:
         }
       }
 
-      // add new data to storage_file
-      storage_file = fopen(filename.c_str(), "a");
-      if (storage_file != nullptr) {
-        fwrite(finalData.data(), sizeof(uint8_t), finalData.size(), storage_file);
-        fflush(storage_file);
-        fsync(fileno(storage_file));
-      }
+      // add new data to the log
+      logged = wal->append(finalData);
+      if (logged)
+        values->forget(key);
 
       //addtoFile(this->storage_file, (const char*)finalData.data(), finalData.size(), this->filename.c_str()); //FLUSH CHANGES 
     }); 
@@ -577,6 +626,13 @@ public:
     if (!pleaseWork) {
       return result_t{false, RES_ERR_KEY, {} }; 
     }
+    // NB: a change that another client made after the copy was taken is lost
+    //     here, but it only gets in if its own append came first, and no
+    //     append succeeds once one has failed
+    if (!logged) {
+      this->kv_store->insert(key, old, [](){});
+      return result_t{false, RES_ERR_SERVER, {} };
+    }
 
     return result_t{true, RES_OK, {} }; 
 
@@ -603,96 +659,77 @@ public:
       return result_t{false, RES_ERR_LOGIN, {}};
     }
 
-    bool pleaseWork = this->kv_store->upsert(key, val,
-        [&] () { //insert
-        /*
-          Logging:
-          - KVKVKVKV
-          - 8 BYTE KEY LENGTH
-          - KEY 
-          - 8 BYTE VAL LEN 
-          - VAL
-
-          - PADDING = 8 - (SIZE OF ABOVE % 8)
-        */
-          std::vector<uint8_t> finalData; 
-
-          finalData.insert(finalData.end(), KVENTRY.begin(), KVENTRY.end()); //KVKVKVKV
-
-          size_t keySize = key.length();
-          finalData.insert(finalData.end(), (char *)&keySize, ((char *)&keySize) + sizeof(size_t)); //LEN KEY
-
-          finalData.insert(finalData.end(), key.begin(), key.end()); //KEY
-
-          size_t valueSize = val.size();
-          finalData.insert(finalData.end(), (char *)&valueSize, ((char *)&valueSize) + sizeof(size_t)); //LEN VAL
-
-          finalData.insert(finalData.end(), val.begin(), val.end()); //VAL
-
-          if ((finalData.size() % 8) > 0) { //PADDING
-            size_t pads = 8 - (finalData.size() % 8);
-            for (size_t i = 0; i < pads; i++) {
-              finalData.push_back(0);
-            }
-          }
+    // compress the value if it's worth it; both an insert and an update are
+    // logged as a KVPACKED
+    std::vector<uint8_t> packed = pack_value(val);
 
-          // add new data to storage_file
-          storage_file = fopen(filename.c_str(), "a");
-          if (storage_file != nullptr) {
-            fwrite(finalData.data(), sizeof(uint8_t), finalData.size(), storage_file);
-            fflush(storage_file);
-            fsync(fileno(storage_file));
-          }
-        },
-
-        [&] () { //upsert 
-        /*
-          Logging:
-          - KVUPDATE
-          - 8 BYTE KEY LENGTH
-          - KEY 
-          - 8 BYTE VAL LEN 
-          - VAL
-
-          - PADDING = 8 - (SIZE OF ABOVE % 8)
-        */
-          std::vector<uint8_t> finalData;
-
-          finalData.insert(finalData.end(), KVUPDATE.begin(), KVUPDATE.end()); //KVUPDATE
+    /*
+      Logging:
+      - KVPACKED
+      - 8 BYTE KEY LENGTH
+      - KEY 
+      - 8 BYTE PACKED VAL LEN 
+      - PACKED VAL
+
+      - PADDING = 8 - (SIZE OF ABOVE % 8)
+    */
+    std::vector<uint8_t> finalData;
 
-          size_t keySize = key.length();
-          finalData.insert(finalData.end(), (char*)&keySize, (char*)&keySize + sizeof(size_t)); //LEN KEY
+    finalData.insert(finalData.end(), KVPACKED.begin(), KVPACKED.end()); //KVPACKED
 
-          finalData.insert(finalData.end(), key.begin(), key.end()); //KEY
+    size_t keySize = key.length();
+    finalData.insert(finalData.end(), (char *)&keySize, ((char *)&keySize) + sizeof(size_t)); //LEN KEY
 
-          size_t valueSize = val.size();
-          finalData.insert(finalData.end(), (char*)&valueSize, (char*)&valueSize + sizeof(size_t)); //LEN VAL
+    finalData.insert(finalData.end(), key.begin(), key.end()); //KEY
 
-          finalData.insert(finalData.end(), val.begin(), val.end()); //VAL
-          
-          //addtoFile(storage_file, (const char*)finalData.data(), finalData.size(), this->filename.c_str()); //FLUSH CHANGES
+    size_t valueSize = packed.size();
+    finalData.insert(finalData.end(), (char *)&valueSize, ((char *)&valueSize) + sizeof(size_t)); //LEN VAL
 
-          if ((finalData.size() % 8) > 0) { // PADDING
-            size_t pads = 8 - (finalData.size() % 8);
-            for (size_t i = 0; i < pads; i++) {
-              finalData.push_back(0);
-            }
-          }
+    finalData.insert(finalData.end(), packed.begin(), packed.end()); //VAL
 
-          // add new data to storage_file
-          storage_file = fopen(filename.c_str(), "a");
-          if (storage_file != nullptr) {
-            fwrite(finalData.data(), sizeof(uint8_t), finalData.size(), storage_file);
-            fflush(storage_file);
-            fsync(fileno(storage_file));
-          }
+    if ((finalData.size() % 8) > 0) { //PADDING
+      size_t pads = 8 - (finalData.size() % 8);
+      for (size_t i = 0; i < pads; i++) {
+        finalData.push_back(0);
+      }
+    }
 
-          // if (fflush(this->storage_file) != 0) { //CHECK FLUSH AGAIN
-          //   cerr << "Failure in kv_upsert fflush(this->storage_file)" << endl;
-          // }
+    // NB: this isn't kv_store->upsert(), because an update can't be undone
+    //     once it's applied.  An update only changes the value once it's
+    //     logged, and an insert is undone if it can't be logged.  If the key
+    //     comes or goes in between, just try again.
+    bool logged = false;
+    bool inserted = false;
+    while (true) {
+      bool updated = this->kv_store->do_with(key, [&] (std::vector<uint8_t> &cur) {
+        // add new data to the log
+        logged = wal->append(finalData);
+        if (logged) {
+          cur = packed;
+          values->charge(key, packed.size(), true);
+        }
       });
+      if (updated)
+        break;
+      inserted = this->kv_store->insert(key, packed, [&] () {
+        // add new data to the log
+        logged = wal->append(finalData);
+        if (logged)
+          values->charge(key, packed.size(), true);
+      });
+      if (inserted)
+        break;
+    }
 
-    if (!pleaseWork) {
+    if (!logged) {
+      // the key can't be kept if the log doesn't have it
+      if (inserted)
+        this->kv_store->remove(key, [](){});
+      return result_t{false, RES_ERR_SERVER, {}};
+    }
+    trim_cache();
+
+    if (!inserted) {
       return result_t{true, RES_OKUPD, {}}; 
     }
 
@@ -745,9 +782,17 @@ public:
   /// up any state related to .so files.  This is only called when all threads
   /// have stopped accessing the Storage object.
   virtual void shutdown() {
-    fflush(storage_file);
-    fsync(fileno(storage_file));
-    fclose(storage_file);
+    wal->close();
+    // NB: these go to stderr, so that "Server terminated" is still the next
+    //     thing on stdout after the last request
+    cerr << "Log: " << wal->stats() << endl;
+    if (values->enabled()) {
+      auto s = values->stats();
+      cerr << "Values: " << s.resident << " bytes in memory, " << s.evictions
+           << " evictions (" << s.writes << " written to the value log), "
+           << s.faults << " reads from disk" << endl;
+    }
+    cerr << "Compression: " << value_codec_stats() << endl;
   }
 
   /// Write the entire Storage object to the file specified by this.filename. To
@@ -757,87 +802,105 @@ public:
   ///
   /// @return A result tuple, as described in storage.h
   virtual result_t save_file() {
-    std::vector<uint8_t> sentData;
-    std::vector<uint8_t> kvStore;
+    std::lock_guard<std::mutex> lock(this->storage_lock);
     std::string tempFile = this->filename + ".tmp";
-    FILE* tempOpen = fopen(tempFile.c_str(), "w+b");
-
-    auto f = [&] (std::string name, const AuthTableEntry &ae) {
-      size_t user_len = name.size();
-      size_t salt_len = ae.salt.size();
-      size_t pass_len = ae.pass_hash.size();
-      size_t cont_len = ae.content.size();
-
-      sentData.insert(sentData.end(), AUTHENTRY.begin(), AUTHENTRY.end()); //AUTHAUTH
-
-      sentData.insert(sentData.end(), (char *)&user_len, ((char *)&user_len) + sizeof(size_t)); //LEN USER
-      sentData.insert(sentData.end(), name.begin(), name.end()); //USER
-
-      sentData.insert(sentData.end(), (char *)&salt_len, ((char *)&salt_len) + sizeof(size_t)); //LEN SALT
-      sentData.insert(sentData.end(), ae.salt.begin(), ae.salt.end()); //SALT
-
-      sentData.insert(sentData.end(), (char *)&pass_len, ((char *)&pass_len) + sizeof(size_t)); //LEN PASS HASH
-      sentData.insert(sentData.end(), ae.pass_hash.begin(), ae.pass_hash.end()); //PASS HASH
-
-      sentData.insert(sentData.end(), (char *)&cont_len, ((char *)&cont_len) + sizeof(size_t)); //LEN CONTENT
-      sentData.insert(sentData.end(), ae.content.begin(), ae.content.end()); //CONTENT
-
-      size_t pad = 0;
-      if ((sentData.size() % 8) > 0) { //PADDING
-        size_t pads = 8 - (sentData.size() % 8);
-        for (size_t i = 0; i < pads; i++) {
-          sentData.push_back(pad);
-        }
-      }
-    };
-
-    auto g = [&] (std::string key, const std::vector<uint8_t> &val) {
-      size_t key_len = key.size();
-      size_t val_len = val.size();
-
-      kvStore.insert(kvStore.end(), KVENTRY.begin(), KVENTRY.end());
-
-      kvStore.insert(kvStore.end(), (char *)&key_len, ((char *)&key_len) + sizeof(size_t));
-      kvStore.insert(kvStore.end(), key.begin(), key.end());
-
-      kvStore.insert(kvStore.end(), (char *)&val_len, ((char *)&val_len) + sizeof(size_t));
-      kvStore.insert(kvStore.end(), val.begin(), val.end());
-
-
-      // add padding
-      size_t pad = 0;
-      if ((kvStore.size() % 8) > 0) {
-        size_t pads = 8 - (kvStore.size() % 8);
-        for (size_t i = 0; i < pads; i++) {
-          kvStore.push_back(pad);
-        }
+    uint64_t cutSeq = 0;
+
+    // the snapshot is of the state at a point in the log, rather than of the
+    // tables at a moment when every bucket is locked: it is the previous
+    // snapshot plus the log up to the new segment, so the clients never wait
+    // for it.  (The value cache is cut first: a change is logged before it is
+    // charged to the cache, so every value that the cache saw change before
+    // its cut is in the snapshot.)
+    uint64_t cutGen = values->cut();
+    uint64_t firstSeg = wal->rotate(cutSeq);
+
+    // replay the previous snapshot and the log into the final state of each
+    // user, and of each key that changed
+    std::map<std::string, log_record> users;
+    std::map<std::string, std::vector<uint8_t>> changes;
+    auto apply = [&] (log_record &rec) {
+      if (rec.seq != 0 && rec.seq <= snap_seq)
+        return;
+      auto &f = rec.fields;
+      std::string name(f[0].begin(), f[0].end());
+      if (rec.type == AUTHENTRY) {
+        // NB: compaction can fold a user's later profile into an AUTHAUTH, so
+        //     one in the log may be for a user that the snapshot already has
+        users.insert_or_assign(name, std::move(rec));
+      } else if (rec.type == AUTHDIFF) {
+        auto it = users.find(name);
+        if (it != users.end())
+          it->second.fields[3] = std::move(f[1]);
+      } else if (rec.type == KVENTRY || rec.type == KVUPDATE) {
+        changes[name] = pack_raw(f[1]);
+      } else if (rec.type == KVPACKED) {
+        changes[name] = std::move(f[1]);
+      } else if (rec.type == KVDELETE) {
+        changes[name].clear();
       }
     };
+    auto base = cold_table();
+    std::vector<uint8_t> baseData;
+    if (base != nullptr)
+      baseData = base->entries();
+    else if (!snap_file.empty())
+      baseData = load_entire_file(snap_file);
+    log_record rec;
+    for (size_t index = 0; index < baseData.size() && decode_record(baseData, index, rec); rec = log_record())
+      apply(rec);
+    if (!wal->read_segments(prev_first_seg, firstSeg, apply)) {
+      cerr << "Cannot read the log since " << snap_file << endl;
+      return result_t{false, RES_ERR_SERVER, {}};
+    }
 
-    auto gFin = [&] () {
-
-    };
-
-    // lambda function for chaining of auth table and KV store
-    auto fChain = [&] () {
-
-      this->kv_store->do_all_readonly(g, gFin);
-    };
-
-    auth_table->do_all_readonly(f, fChain);
-
-    sentData.insert(sentData.end(), kvStore.begin(), kvStore.end());
+    // the snapshot starts by naming the first log segment it doesn't include,
+    // and (as the record's sequence number) the last log record it does.  The
+    // K/V pairs go in a table at the end.
+    std::vector<uint8_t> sentData;
+    encode_record(sentData, {LOGSTART, {std::vector<uint8_t>((uint8_t *)&firstSeg, (uint8_t *)&firstSeg + sizeof(firstSeg))}, cutSeq});
+    for (auto &u : users) {
+      u.second.seq = 0;
+      encode_record(sentData, u.second);
+    }
+    if (!write_snapshot(tempFile, sentData, base.get(), changes)) {
+      cerr << "Cannot write '" << tempFile << "'\n";
+      return result_t{false, RES_ERR_SERVER, {}};
+    }
 
-    // add new data to storage_file
-    tempOpen = fopen(tempFile.c_str(), "a");
-    fwrite(sentData.data(), sizeof(uint8_t), sentData.size(), tempOpen);
-    fflush(tempOpen);
-    fsync(fileno(tempOpen));
-    
+    // keep the snapshot we are replacing, in case this one is ever damaged
+    // (if we crash between the renames, load_file() falls back to it)
+    std::string prevFile = filename + ".prev";
+    if (rename(filename.c_str(), prevFile.c_str()) != 0 && errno != ENOENT) {
+      cerr << "Cannot rename '" << filename << "' to '" << prevFile << "'\n";
+      return result_t{false, RES_ERR_SERVER, {}};
+    }
+    if (rename(tempFile.c_str(), filename.c_str()) != 0) {
+      cerr << "Cannot rename '" << tempFile << "' to '" << filename << "'\n";
+      return result_t{false, RES_ERR_SERVER, {}};
+    }
 
-    //addtoFile(tempOpen, (const char*)sentData.data(), sentData.size(), tempFile.c_str());
+    // values that aren't in memory, and haven't changed since the cut, are
+    // now read from the new snapshot.  Until it is open, nothing changes: the
+    // old table and the log since the old snapshot still describe the data.
+    bool intact;
+    auto table = kv_table::open(filename, intact);
+    if (table == nullptr && !intact) {
+      cerr << "Cannot open the K/V table of '" << filename << "'\n";
+      return result_t{false, RES_ERR_SERVER, {}};
+    }
+    {
+      std::lock_guard<std::mutex> g(cold_lock);
+      cold = table;
+    }
+    values->snapshotted(cutGen);
 
-    rename(tempFile.c_str(), filename.c_str());
+    // the segments before the previous snapshot's first segment are in both
+    // snapshots now
+    wal->drop_before(prev_first_seg);
+    prev_first_seg = firstSeg;
+    snap_seq = cutSeq;
+    snap_file = filename;
 
     return result_t{true, RES_OK, {}};
   }
@@ -850,200 +913,186 @@ public:
   /// @return A result tuple, as described in storage.h.  Note that a
   ///         non-existent file is not an error.
   virtual result_t load_file() {
-
-    // std::lock_guard<std::mutex> lock(this->storage_lock);
-
-    storage_file = fopen(filename.c_str(), "r"); //open to read
-    if (storage_file == nullptr) {
-      return {true, "File not found: " + filename, {}};
-    }
-
     this->auth_table->clear();
     this->kv_store->clear();
 
-    std::vector<uint8_t> receivedData = readFromFile(storage_file); //reading from file
-
-    size_t index = 0;
-    std::string whichCmd;
-
-    while (index < receivedData.size()) { //start loop through received data
-
-      for (size_t i = 0; i < 8; i++) {
-        whichCmd += receivedData.at(index);
-        index += 1;
-      }
-
-      if (whichCmd.compare(AUTHENTRY) == 0) { 
-          //initalize all of AuthTableEntry data to pull
-          std::string userActual;
-          std::vector<uint8_t> saltActual; 
-          std::vector<uint8_t> hashedPassActual; 
-          std::vector<uint8_t> contentActual;
-
-          size_t user_len = *(size_t *)(receivedData.data() + index);
-          index += 8;
-
-          userActual.insert(userActual.end(), receivedData.begin() + index, receivedData.begin() + index + user_len);
-          index += user_len; //if our user length is equivalent to user, then increment index... 
-          
-          size_t salt_len = *(size_t *)(receivedData.data() + index);
-          index += 8;
-
-          saltActual.insert(saltActual.end(), receivedData.begin() + index, receivedData.begin() + index + salt_len);
-          index += salt_len;    //if our salt length is equivalent to user, then increment index... 
-          
-          size_t hashed_len = *(size_t *)(receivedData.data() + index);
-          index += 8;
-
-          hashedPassActual.insert(hashedPassActual.end(), receivedData.begin() + index, receivedData.begin() + index + hashed_len);
-          index += hashed_len; //if our user length is equivalent to user, then increment index... 
-          
-          size_t content_len = *(size_t *)(receivedData.data() + index);
-          index += 8;
-
-          contentActual.insert(contentActual.end(), receivedData.begin() + index, receivedData.begin() + index + content_len);
-          index += content_len;
-
-          /*
-            taking pointer position at end of AUTHAUTH entry and finding length of one singular log
-              by subtracting by initial position prior to the cmd entry 
-          */
-          size_t totalSize = content_len + hashed_len + salt_len + user_len + 40;
-
-          if ((totalSize % 8) > 0) {
-            int padding_Amt = 8 - (totalSize % 8); // incremented index by padding amount... should be aligned with next entry
-            index += padding_Amt;
-          }
-
-          //create "val" for the auth_table... 
-          AuthTableEntry newGuyinTown;
-          newGuyinTown.username = userActual;
-          newGuyinTown.salt = saltActual;
-          newGuyinTown.pass_hash = hashedPassActual;
-          newGuyinTown.content = contentActual;
-
-          this->auth_table->insert(userActual, newGuyinTown, [](){});
-      }
-
-      else if (whichCmd.compare(KVENTRY) == 0) {
-
-        std::string key;
-        std::vector<uint8_t> valVec;
-
-        size_t len_key = *(size_t *)(receivedData.data() + index);
-        index += 8;
-
-        key.insert(key.end(), receivedData.begin() + index, receivedData.begin() + index + len_key);
-        index += len_key;
-
-        size_t len_val = *(size_t *)(receivedData.data() + index);
-        index += 8;
-
-        valVec.insert(valVec.end(), receivedData.begin() + index, receivedData.begin() + index + len_val);
-        index += len_val;
-
-        /*
-          taking pointer position at end of AUTHAUTH entry and finding length of one singular log
-            by subtracting by initial position prior to the cmd entry
-        */
-        size_t totalSize = 24 + len_key + len_val;
-
-        if ((totalSize % 8) > 0) {
-          int padding_Amt = 8 - (totalSize % 8); // incremented index by padding amount... should be aligned with next entry
-          index += padding_Amt;
-        }
-
-        this->kv_store->insert(key, valVec, [](){});
+    // the data file is a snapshot, and the log segments hold the changes made
+    // after it.  If the latest snapshot is damaged (or missing, because we
+    // crashed while replacing it), use the previous one instead.
+    std::string msg = "File not found: " + filename;
+    uint64_t firstSeg = 0, snapSeq = 0, lastSeq = 0;
+    std::vector<std::string> snaps;
+    for (auto &snap : {filename, filename + ".prev"}) {
+      FILE *storage_file = fopen(snap.c_str(), "r");
+      if (storage_file != nullptr) {
+        fclose(storage_file);
+        snaps.push_back(snap);
       }
-
-      else if (whichCmd.compare(AUTHDIFF) == 0) {
-          std::string userActual;
-          std::vector<uint8_t> contentActual; 
-
-          size_t user_len = *(size_t *)(receivedData.data() + index);
-          index += 8;
-
-          userActual.insert(userActual.end(), receivedData.begin() + index, receivedData.begin() + index + user_len);
-          index += user_len; // if our user length is equivalent to user, then increment index...
-
-          size_t content_len = *(size_t *)(receivedData.data() + index);
-          index += 8;
-
-          contentActual.insert(contentActual.end(), receivedData.begin() + index, receivedData.begin() + index + content_len);
-          index += content_len;
-
-          /*
-            taking pointer position at end of AUTHAUTH entry and finding length of one singular log
-              by subtracting by initial position prior to the cmd entry
-          */
-          size_t totalSize = 24 + user_len + content_len;
-
-          if ((totalSize % 8) > 0) {
-            size_t padding_Amt = 8 - (totalSize % 8); // incremented index by padding amount... should be aligned with next entry
-            index += padding_Amt;
-          }
-
-          this->auth_table->do_with(userActual, [&] (AuthTableEntry &ae) { //actual storage interaction
-            ae.content = contentActual;
-          });
-
+    }
+    for (size_t i = 0; i < snaps.size(); ++i) {
+      msg = "Loaded: " + filename;
+      snap_file = snaps[i];
+      // a snapshot with a K/V table only needs its keys loaded; values are
+      // read when they are first requested
+      bool intact;
+      auto table = kv_table::open(snaps[i], intact);
+      if (table != nullptr) {
+        intact = replay(snaps[i], table->entries(), true, false, firstSeg, snapSeq, 0);
+        for (size_t k = 0; k < table->size(); ++k)
+          this->kv_store->insert(table->key(k), {}, [](){});
+        std::lock_guard<std::mutex> g(cold_lock);
+        cold = table;
+      } else if (intact) {
+        intact = replay(snaps[i], load_entire_file(snaps[i]), true, false, firstSeg, snapSeq, 0);
       }
-
-      else if (whichCmd.compare(KVDELETE) == 0) {
-        std::string key; 
-
-        size_t key_len = *(size_t *)(receivedData.data() + index);
-        index += 8;
-
-        key.insert(key.end(), receivedData.begin() + index, receivedData.begin() + index + key_len);
-
-       
-        index += key_len; 
-
-        size_t totalSize = 16 + key_len;
-
-        if ((totalSize % 8) > 0) {
-          int padding_Amt = 8 - (totalSize % 8);
-          index += padding_Amt;
-        }
-
-        this->kv_store->remove(key, [](){});
+      if (intact || i + 1 == snaps.size())
+        break;
+      cerr << snaps[i] << " is damaged; loading " << snaps[i + 1] << endl;
+      this->auth_table->clear();
+      this->kv_store->clear();
+      firstSeg = snapSeq = 0;
+      std::lock_guard<std::mutex> g(cold_lock);
+      cold = nullptr;
+    }
+    prev_first_seg = firstSeg;
+    snap_seq = snapSeq;
+
+    // only the log after the snapshot needs to be replayed.  A bad record
+    // before the last segment can't be a torn write, and the changes after it
+    // can't be applied without it, so it stops the server from starting.
+    lastSeq = snapSeq;
+    auto segs = wal->segments();
+    for (auto seg : segs) {
+      if (seg >= firstSeg) {
+        uint64_t unused;
+        std::string file = wal->segment_file(seg);
+        bool tail = seg == segs.back();
+        if (!replay(file, load_entire_file(file), false, tail, unused, lastSeq, snapSeq) && !tail)
+          return {false, "Damaged log segment: " + file, {}};
+        msg = "Loaded: " + filename;
       }
+    }
 
-      else if (whichCmd.compare(KVUPDATE) == 0) {
-        std::string key; 
-        std::vector<uint8_t> val; 
-
-        size_t len_key = *(size_t *)(receivedData.data() + index);
-        index += 8;
-
-        key.insert(key.end(), receivedData.begin() + index, receivedData.begin() + index + len_key);
-        index += len_key;
-        
-        size_t val_len = *(size_t *)(receivedData.data() + index);
-        index += 8;
+    // charge the values that were loaded into memory, and evict the ones that
+    // don't fit
+    this->kv_store->do_all_readonly([&] (std::string key, const std::vector<uint8_t> &val) {
+      if (!val.empty())
+        values->charge(key, val.size(), true);
+    }, [](){});
+    trim_cache();
+
+    if (!wal->open(lastSeq))
+      return {false, RES_ERR_SERVER, {}};
+    wal->start_compactor([&] () { save_file(); });
+    return {true, msg, {}};
+  }
 
-        val.insert(val.end(), receivedData.begin() + index, receivedData.begin() + index + val_len);
-        index += val_len;
+  /// Get the K/V table that unread values are read from
+  std::shared_ptr<kv_table> cold_table() {
+    std::lock_guard<std::mutex> g(cold_lock);
+    return cold;
+  }
 
-        size_t totalSize = 24 + len_key + val_len;
+  /// Read the value of a key that isn't in memory: from the value log, if the
+  /// value was evicted after it changed, or else from the latest snapshot.
+  /// The caller holds the key's bucket lock.
+  ///
+  /// @param key The key
+  /// @param val Set to the value
+  ///
+  /// @return true if the value was read intact
+  bool read_cold(const std::string &key, std::vector<uint8_t> &val) {
+    value_cache::location loc;
+    if (values->locate(key, loc))
+      return values->read(loc, val);
+    auto table = cold_table();
+    return table != nullptr && table->get(key, val);
+  }
 
-        if ((totalSize % 8) > 0) {
-          size_t padding_Amt = 8 - (totalSize % 8);
-          index += padding_Amt;
+  /// Evict values until the ones in memory fit in the cache's budget.  The
+  /// caller must not hold any bucket lock.
+  void trim_cache() {
+    for (auto &key : values->pick_victims()) {
+      bool evicted = false;
+      this->kv_store->do_with(key, [&] (std::vector<uint8_t> &val) {
+        if (!val.empty() && values->evict(key, val)) {
+          std::vector<uint8_t>().swap(val);
+          evicted = true;
         }
+      });
+      if (!evicted)
+        values->cancel(key);
+    }
+  }
 
-        this->kv_store->upsert(key, val, [](){}, [](){});
-        
+  /// Apply the records in a snapshot or a log segment to the tables.  If the
+  /// last log segment ends with a record that was torn by a crash, the segment
+  /// is cut off after the last good record, so that it doesn't need fixing by
+  /// hand.  (Snapshots are renamed into place whole, and the other segments
+  /// were sealed, so a bad record there is corruption, and the file is left
+  /// alone.)
+  ///
+  /// @param file     The name of the file
+  /// @param data     The file's entries
+  /// @param snapshot Is the file a snapshot, rather than a log segment?
+  /// @param tail     Is the file the last log segment, which a crash can tear?
+  /// @param firstSeg Set to the first log segment to replay, if the file is a
+  ///                 snapshot that names it
+  /// @param lastSeq  Raised to the highest sequence number in the file
+  /// @param skipSeq  Log records numbered up to this are skipped, because the
+  ///                 snapshot includes them
+  ///
+  /// @return true if the whole file was good
+  bool replay(const std::string &file, const std::vector<uint8_t> &data,
+              bool snapshot, bool tail, uint64_t &firstSeg, uint64_t &lastSeq,
+              uint64_t skipSeq) {
+    log_record rec;
+    size_t index = 0;
+    while (index < data.size() && decode_record(data, index, rec)) {
+      lastSeq = std::max(lastSeq, rec.seq);
+      if (rec.seq != 0 && rec.seq <= skipSeq)
+        continue;
+      auto &f = rec.fields;
+      std::string name(f[0].begin(), f[0].end());
+      if (rec.type == AUTHENTRY) {
+        // An upsert, for the same reason as in save_file()
+        this->auth_table->upsert(name, AuthTableEntry{name, f[1], f[2], f[3]}, [](){}, [](){});
+      } else if (rec.type == AUTHDIFF) {
+        this->auth_table->do_with(name, [&] (AuthTableEntry &ae) {
+          ae.content = f[1];
+        });
+      } else if (rec.type == KVENTRY) {
+        this->kv_store->insert(name, pack_raw(f[1]), [](){});
+      } else if (rec.type == KVUPDATE) {
+        this->kv_store->upsert(name, pack_raw(f[1]), [](){}, [](){});
+      } else if (rec.type == KVPACKED) {
+        this->kv_store->upsert(name, f[1], [](){}, [](){});
+      } else if (rec.type == KVDELETE) {
+        this->kv_store->remove(name, [](){});
+      } else if (rec.type == LOGSTART && f[0].size() == sizeof(firstSeg)) {
+        memcpy(&firstSeg, f[0].data(), sizeof(firstSeg));
       }
-
-      whichCmd.clear();
-    } //end of while loop... MAKE SURE INDEX MATCHES...
-
-    return {true, "Loaded: " + filename, {}};
-}
-
-
+    }
+    if (index == data.size())
+      return true;
+    if (snapshot)
+      return false;
+    // A segment that wasn't sealed still has its preallocated zeros at the end,
+    // which aren't worth a warning
+    bool garbage = std::any_of(data.begin() + index, data.end(),
+                               [](uint8_t b) { return b != 0; });
+    if (!tail) {
+      if (garbage)
+        cerr << "Bad record at byte " << index << " of " << file << endl;
+      return !garbage;
+    }
+    if (garbage)
+      cerr << "Discarding " << data.size() - index << " bytes after the last "
+           << "good record (byte " << index << ") of " << file << endl;
+    if (truncate(file.c_str(), index) != 0)
+      cerr << "Cannot truncate " << file << endl;
+    return !garbage;
+  }
 };
 
 /// Create an empty Storage object and specify the file from which it should
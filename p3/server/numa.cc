@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "map_factories.h"
+#include "numa.h"
+#include "sharded_map.h"
+
+using namespace std;
+
+/// The number of workers per node that sharded_kvstore_factory() starts (0 =
+/// NUMA mode is off)
+static size_t config_workers = 0;
+
+/// Is the calling thread one of a numa_router's workers?
+static thread_local bool in_worker = false;
+
+/// Parse a list of CPUs in the kernel's format (e.g., "0-3,8-11")
+///
+/// @param list The list
+///
+/// @return The CPUs
+static vector<int> parse_cpulist(const string &list) {
+  vector<int> cpus;
+  stringstream ss(list);
+  string range;
+  while (getline(ss, range, ',')) {
+    int lo, hi;
+    int n = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+    if (n == 1)
+      hi = lo;
+    if (n < 1 || hi < lo)
+      continue;
+    for (int c = lo; c <= hi; ++c)
+      cpus.push_back(c);
+  }
+  return cpus;
+}
+
+/// Find the machine's NUMA nodes.  If the kernel doesn't report any, the whole
+/// machine is one node.
+///
+/// @return The nodes that have CPUs
+vector<numa_node> numa_topology() {
+  // Only the CPUs that we are allowed to run on count
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+      CPU_SET(c, &allowed);
+
+  vector<numa_node> nodes;
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (dir != nullptr) {
+    while (dirent *d = readdir(dir)) {
+      int id;
+      if (sscanf(d->d_name, "node%d", &id) != 1)
+        continue;
+      ifstream f(string("/sys/devices/system/node/") + d->d_name + "/cpulist");
+      string list;
+      getline(f, list);
+      numa_node n{id, {}};
+      for (int c : parse_cpulist(list))
+        if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+          n.cpus.push_back(c);
+      if (!n.cpus.empty())
+        nodes.push_back(n);
+    }
+    closedir(dir);
+  }
+  if (nodes.empty()) {
+    numa_node n{0, {}};
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+      if (CPU_ISSET(c, &allowed))
+        n.cpus.push_back(c);
+    nodes.push_back(n);
+  }
+  sort(nodes.begin(), nodes.end(),
+       [](const numa_node &a, const numa_node &b) { return a.id < b.id; });
+  return nodes;
+}
+
+/// Start the workers
+///
+/// @param nodes   The nodes to run on
+/// @param workers The number of workers per node
+numa_router::numa_router(const vector<numa_node> &nodes, size_t workers) {
+  for (auto &n : nodes) {
+    node_queue *q = new node_queue();
+    q->node = n;
+    this->nodes.push_back(q);
+  }
+  for (auto q : this->nodes)
+    for (size_t i = 0; i < workers; ++i)
+      q->workers.emplace_back([this, q]() { worker(*q); });
+}
+
+/// Stop the workers
+numa_router::~numa_router() {
+  for (auto q : nodes) {
+    {
+      lock_guard<mutex> g(q->lock);
+      q->stopping = true;
+    }
+    q->cv.notify_all();
+    for (auto &t : q->workers)
+      t.join();
+    delete q;
+  }
+}
+
+/// Run a function on one of a node's workers, and wait for it to finish
+///
+/// @param node The index of the node, in the vector the router was made with
+/// @param f    The function
+void numa_router::run(size_t node, const function<void()> &f) {
+  if (in_worker) {
+    f();
+    return;
+  }
+  task t;
+  t.f = &f;
+  node_queue *q = nodes[node];
+  {
+    lock_guard<mutex> g(q->lock);
+    q->tasks.push_back(&t);
+  }
+  q->cv.notify_one();
+  unique_lock<mutex> g(t.lock);
+  t.cv.wait(g, [&]() { return t.done; });
+}
+
+/// Describe the nodes and their workers
+string numa_router::describe() const {
+  stringstream ss;
+  ss << nodes.size() << (nodes.size() == 1 ? " node" : " nodes") << " (";
+  for (size_t i = 0; i < nodes.size(); ++i)
+    ss << (i ? ", " : "") << "node " << nodes[i]->node.id << ": "
+       << nodes[i]->node.cpus.size() << " CPUs";
+  ss << "), " << (nodes.empty() ? 0 : nodes[0]->workers.size())
+     << " workers each";
+  return ss.str();
+}
+
+/// A worker's loop
+///
+/// @param q The worker's node
+void numa_router::worker(node_queue &q) {
+  in_worker = true;
+
+  // Run only on the node's CPUs, and allocate memory from the node.
+  // NB: set_mempolicy() fails on a kernel without NUMA support, but then
+  //     there is only one node, so it doesn't matter.
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c : q.node.cpus)
+    CPU_SET(c, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    cerr << "numa_router: could not pin a worker to node " << q.node.id
+         << endl;
+  const size_t bits = 8 * sizeof(unsigned long);
+  vector<unsigned long> mask(q.node.id / bits + 1, 0);
+  mask[q.node.id / bits] |= 1UL << (q.node.id % bits);
+  syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(),
+          mask.size() * bits + 1);
+
+  while (true) {
+    task *t;
+    {
+      unique_lock<mutex> g(q.lock);
+      q.cv.wait(g, [&]() { return q.stopping || !q.tasks.empty(); });
+      if (q.tasks.empty())
+        return;
+      t = q.tasks.front();
+      q.tasks.pop_front();
+    }
+    (*t->f)();
+    // NB: The caller frees the task as soon as it sees done, so it must be
+    //     notified before the lock is released
+    lock_guard<mutex> g(t->lock);
+    t->done = true;
+    t->cv.notify_one();
+  }
+}
+
+/// Configure NUMA mode, which storage_factory() uses for the kv_store
+///
+/// @param workers The number of workers per node (0 = NUMA mode is off)
+void numa_config(size_t workers) { config_workers = workers; }
+
+/// Create the kv_store: in NUMA mode, a ShardedMap with one shard per node,
+/// and otherwise the same map as kvstore_factory() makes
+///
+/// @param _buckets The number of buckets in the table (in all shards together)
+Map<string, vector<uint8_t>> *sharded_kvstore_factory(size_t _buckets) {
+  if (config_workers == 0)
+    return kvstore_factory(_buckets);
+  // NB: Like the kv_store, the router is never destroyed
+  numa_router *router = new numa_router(numa_topology(), config_workers);
+  cout << "NUMA: " << router->describe() << endl;
+  size_t buckets = max<size_t>(1, _buckets / router->size());
+  return new ShardedMap<string, vector<uint8_t>>(
+      *router, [buckets]() { return kvstore_factory(buckets); });
+}
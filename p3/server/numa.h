@@ -0,0 +1,106 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "map.h"
+
+/// numa.h lets the kv_store be sharded across the machine's NUMA nodes.  On a
+/// machine with more than one socket, memory that was allocated on one node is
+/// slower to reach from the others, and cache lines that threads on different
+/// nodes write bounce between the sockets.  In NUMA mode, each node gets its
+/// own shard of the keyspace, and its own workers, which are pinned to its CPUs
+/// and allocate memory from it.  Every operation on a key is run by a worker on
+/// the node that owns the key, so a shard's buckets and entries are only ever
+/// allocated and touched on one node.
+///
+/// NB: The thread pool and the request parser are not ours to change, so pool
+///     threads still run wherever the OS puts them.  They hand each K/V
+///     operation to the owning node and wait for it, which costs a wakeup per
+///     operation; that is why NUMA mode is off by default.
+
+/// One NUMA node, and the CPUs that belong to it
+struct numa_node {
+  int id;                // The node's number
+  std::vector<int> cpus; // Its CPUs
+};
+
+/// Find the machine's NUMA nodes.  If the kernel doesn't report any, the whole
+/// machine is one node.
+///
+/// @return The nodes that have CPUs
+std::vector<numa_node> numa_topology();
+
+/// numa_router runs functions on worker threads that are pinned to a given
+/// node, and waits for them to finish
+class numa_router {
+public:
+  /// Start the workers
+  ///
+  /// @param nodes   The nodes to run on
+  /// @param workers The number of workers per node
+  numa_router(const std::vector<numa_node> &nodes, size_t workers);
+
+  /// Stop the workers
+  ~numa_router();
+
+  /// Get the number of nodes
+  size_t size() const { return nodes.size(); }
+
+  /// Run a function on one of a node's workers, and wait for it to finish.  A
+  /// worker (of any node) that calls this runs the function itself, so that a
+  /// function which uses the router can't deadlock waiting for workers that
+  /// are all waiting for each other.
+  ///
+  /// @param node The index of the node, in the vector the router was made with
+  /// @param f    The function
+  void run(size_t node, const std::function<void()> &f);
+
+  /// Describe the nodes and their workers
+  std::string describe() const;
+
+private:
+  /// A function that a caller is waiting for
+  struct task {
+    const std::function<void()> *f; // The function
+    bool done = false;              // Has it run?
+    std::mutex lock;                // Protects done
+    std::condition_variable cv;     // Signals done
+  };
+
+  /// One node's queue and workers
+  struct node_queue {
+    numa_node node;                   // The node
+    std::mutex lock;                  // Protects tasks and stopping
+    std::condition_variable cv;       // Signals a new task, or stopping
+    std::deque<task *> tasks;         // Tasks waiting for a worker
+    bool stopping = false;            // Should the workers exit?
+    std::vector<std::thread> workers; // The workers
+  };
+
+  /// A worker's loop
+  ///
+  /// @param q The worker's node
+  void worker(node_queue &q);
+
+  std::vector<node_queue *> nodes; // The nodes
+};
+
+/// Configure NUMA mode, which storage_factory() uses for the kv_store.  This
+/// must be called before storage_factory().  By default NUMA mode is off.
+///
+/// @param workers The number of workers per node (0 = NUMA mode is off)
+void numa_config(size_t workers);
+
+/// Create the kv_store: in NUMA mode, a ShardedMap with one shard per node,
+/// and otherwise the same map as kvstore_factory() makes
+///
+/// @param _buckets The number of buckets in the table (in all shards together)
+Map<std::string, std::vector<uint8_t>> *sharded_kvstore_factory(size_t _buckets);
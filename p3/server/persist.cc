@@ -1,11 +1,1183 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
+#include "../common/err.h"
+
+#include "format.h"
 #include "persist.h"
+#include "value_codec.h"
 
 using namespace std;
 
 /// The purpose of this file is to allow you to define helper functions that
-/// simplify interacting with persistent storage.
\ No newline at end of file
+/// simplify interacting with persistent storage.
+
+/// The size of the chunks in which the compactor reads and writes, so that
+/// throttling is smooth
+const size_t COMPACT_CHUNK = 1048576;
+
+/// The size of the chunks in which each snapshot writer writes its values
+const size_t SNAPSHOT_CHUNK = 8 * 1048576;
+
+/// Report how many length-prefixed fields a type of record has
+///
+/// @param type The 8-byte record type
+///
+/// @return The number of fields, or 0 if the type is unknown
+static size_t field_count(const string &type) {
+  if (type == AUTHENTRY)
+    return 4;
+  if (type == AUTHDIFF || type == KVENTRY || type == KVUPDATE ||
+      type == KVPACKED)
+    return 2;
+  if (type == KVDELETE || type == LOGSTART)
+    return 1;
+  return 0;
+}
+
+/// The CRC32C polynomial, in reflected form
+static const uint32_t CRC32C_POLY = 0x82f63b78;
+
+/// Compute a CRC32C one byte at a time, for CPUs without a crc32 instruction
+///
+/// @param crc  The checksum so far, already inverted
+/// @param data The bytes
+/// @param len  The number of bytes
+///
+/// @return The new checksum, still inverted
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t len) {
+  static uint32_t table[256];
+  static bool ready = [] () {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k)
+        c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+      table[i] = c;
+    }
+    return true;
+  }();
+  (void)ready;
+  for (size_t i = 0; i < len; ++i)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+/// Compute a CRC32C eight bytes at a time, with SSE4.2's crc32 instruction
+///
+/// @param crc  The checksum so far, already inverted
+/// @param data The bytes
+/// @param len  The number of bytes
+///
+/// @return The new checksum, still inverted
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t *data, size_t len) {
+  uint64_t c = crc;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    c = __builtin_ia32_crc32di(c, word);
+  }
+  crc = (uint32_t)c;
+  for (; len > 0; ++data, --len)
+    crc = __builtin_ia32_crc32qi(crc, *data);
+  return crc;
+}
+#endif
+
+/// Compute a CRC32C (Castagnoli) checksum
+///
+/// @param crc  The checksum of the bytes before these (0 to start)
+/// @param data The bytes
+/// @param len  The number of bytes
+///
+/// @return The checksum of all the bytes so far
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len) {
+#if defined(__x86_64__)
+  static const bool hw = __builtin_cpu_supports("sse4.2");
+  if (hw)
+    return ~crc32c_hw(~crc, data, len);
+#endif
+  return ~crc32c_sw(~crc, data, len);
+}
+
+/// Append a header and an unframed record to a buffer
+///
+/// @param out  The buffer
+/// @param body The unframed record
+/// @param seq  The record's sequence number
+void frame_record(vector<uint8_t> &out, const vector<uint8_t> &body,
+                  uint64_t seq) {
+  size_t start = out.size();
+  uint32_t len = body.size();
+  out.insert(out.end(), LOGREC2.begin(), LOGREC2.end());
+  out.resize(out.size() + sizeof(uint32_t)); // The checksum goes here
+  out.insert(out.end(), (uint8_t *)&len, (uint8_t *)&len + sizeof(len));
+  out.insert(out.end(), (uint8_t *)&seq, (uint8_t *)&seq + sizeof(seq));
+  out.insert(out.end(), body.begin(), body.end());
+  size_t covered = start + LOGREC2.size() + sizeof(uint32_t);
+  uint32_t crc = crc32c(0, out.data() + covered, out.size() - covered);
+  memcpy(out.data() + start + LOGREC2.size(), &crc, sizeof(crc));
+}
+
+/// Append the framed on-disk form of a record to a buffer
+///
+/// @param out The buffer
+/// @param rec The record, including its sequence number
+void encode_record(vector<uint8_t> &out, const log_record &rec) {
+  vector<uint8_t> body(rec.type.begin(), rec.type.end());
+  for (auto &f : rec.fields) {
+    uint64_t len = f.size();
+    body.insert(body.end(), (uint8_t *)&len, (uint8_t *)&len + sizeof(len));
+    body.insert(body.end(), f.begin(), f.end());
+  }
+  body.resize((body.size() + 7) / 8 * 8, 0);
+  frame_record(out, body, rec.seq);
+}
+
+/// Parse an unframed record that starts at a position in a buffer, without
+/// reading past a given end
+///
+/// @param buf The buffer
+/// @param pos The position of the record; advanced past it on success
+/// @param end The end of the bytes that the record may use
+/// @param rec Set to the record's type and fields
+///
+/// @return true if a whole record of a known type was parsed
+static bool decode_body(const vector<uint8_t> &buf, size_t &pos, size_t end,
+                        log_record &rec) {
+  if (pos + 8 > end)
+    return false;
+  rec.type.assign(buf.begin() + pos, buf.begin() + pos + 8);
+  size_t n = field_count(rec.type);
+  if (n == 0)
+    return false;
+  rec.fields.resize(n);
+  size_t p = pos + 8;
+  for (auto &f : rec.fields) {
+    if (p + 8 > end)
+      return false;
+    uint64_t len;
+    memcpy(&len, buf.data() + p, sizeof(len));
+    p += 8;
+    if (len > end - p)
+      return false;
+    f.assign(buf.begin() + p, buf.begin() + p + len);
+    p += len;
+  }
+  p = pos + (p - pos + 7) / 8 * 8;
+  if (p > end)
+    return false;
+  pos = p;
+  return true;
+}
+
+/// Parse the record that starts at a position in a buffer
+///
+/// @param buf The buffer
+/// @param pos The position of the record; advanced past it on success
+/// @param rec Set to the record
+///
+/// @return true if a whole, intact record of a known type was parsed
+bool decode_record(const vector<uint8_t> &buf, size_t &pos, log_record &rec) {
+  if (pos + RECORD_HEADER_BYTES > buf.size() ||
+      memcmp(buf.data() + pos, LOGREC2.data(), LOGREC2.size()) != 0) {
+    rec.seq = 0;
+    return decode_body(buf, pos, buf.size(), rec); // Version 1
+  }
+  uint32_t crc, len;
+  memcpy(&crc, buf.data() + pos + 8, sizeof(crc));
+  memcpy(&len, buf.data() + pos + 12, sizeof(len));
+  memcpy(&rec.seq, buf.data() + pos + 16, sizeof(rec.seq));
+  size_t body = pos + RECORD_HEADER_BYTES;
+  if (len > buf.size() - body ||
+      crc32c(0, buf.data() + pos + 12, RECORD_HEADER_BYTES - 12 + len) != crc)
+    return false;
+  // NB: the body must use exactly the length in the header
+  size_t p = body;
+  if (!decode_body(buf, p, body + len, rec) || p != body + len)
+    return false;
+  pos = p;
+  return true;
+}
+
+/// The size of the footer at the end of a snapshot with a K/V table
+static const size_t KV_FOOTER_BYTES = 48;
+
+/// Append a value to a buffer, as raw bytes
+///
+/// @param out The buffer
+/// @param v   The value
+template <typename T> static void put(vector<uint8_t> &out, T v) {
+  out.insert(out.end(), (uint8_t *)&v, (uint8_t *)&v + sizeof(v));
+}
+
+/// Map a snapshot's K/V table
+///
+/// @param file The snapshot
+/// @param ok   Set to false if the snapshot has a table but it is damaged
+///
+/// @return The table, or nullptr if the snapshot has none (or it is damaged)
+shared_ptr<kv_table> kv_table::open(const string &file, bool &ok) {
+  ok = true;
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < KV_FOOTER_BYTES) {
+    ::close(fd);
+    return nullptr;
+  }
+  size_t len = st.st_size;
+  void *map = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    ok = false;
+    return nullptr;
+  }
+  shared_ptr<kv_table> t(new kv_table((const uint8_t *)map, len));
+  const uint8_t *foot = t->base + len - KV_FOOTER_BYTES;
+  if (memcmp(foot + 40, KVTABLE2.data(), KVTABLE2.size()) == 0)
+    t->packed = true;
+  else if (memcmp(foot + 40, KVTABLE.data(), KVTABLE.size()) != 0)
+    return nullptr; // An older snapshot, with KVKVKVKV entries
+
+  uint64_t values_off, keys_off, index_off, count;
+  uint32_t table_crc, foot_crc;
+  memcpy(&values_off, foot, 8);
+  memcpy(&keys_off, foot + 8, 8);
+  memcpy(&index_off, foot + 16, 8);
+  memcpy(&count, foot + 24, 8);
+  memcpy(&table_crc, foot + 32, 4);
+  memcpy(&foot_crc, foot + 36, 4);
+  size_t foot_off = len - KV_FOOTER_BYTES;
+  ok = crc32c(0, foot, 36) == foot_crc && values_off <= keys_off &&
+       keys_off <= index_off && index_off <= foot_off &&
+       count == (foot_off - index_off) / sizeof(index_entry) &&
+       (foot_off - index_off) % sizeof(index_entry) == 0 &&
+       crc32c(0, t->base + keys_off, foot_off - keys_off) == table_crc;
+  if (!ok)
+    return nullptr;
+  t->entries_end = values_off;
+  t->index = (const index_entry *)(t->base + index_off);
+  t->count = count;
+  // The index is checked, but not the offsets in it
+  for (size_t i = 0; i < count; ++i) {
+    auto &e = t->index[i];
+    if (e.key_off > foot_off || e.key_len > foot_off - e.key_off ||
+        e.val_off > foot_off || e.val_len > foot_off - e.val_off) {
+      ok = false;
+      return nullptr;
+    }
+  }
+  return t;
+}
+
+/// Construct a table from a mapped file
+///
+/// @param base The mapped file
+/// @param len  The file's length
+kv_table::kv_table(const uint8_t *base, size_t len) : base(base), len(len) {}
+
+/// Unmap the file
+kv_table::~kv_table() { munmap((void *)base, len); }
+
+/// Get a copy of the framed entries that come before the table
+vector<uint8_t> kv_table::entries() const {
+  return vector<uint8_t>(base, base + entries_end);
+}
+
+/// Get one of the keys
+///
+/// @param i The key's position in sorted order
+string kv_table::key(size_t i) const {
+  return string((const char *)base + index[i].key_off, index[i].key_len);
+}
+
+/// Compare two keys, in the order that K/V tables are sorted in
+///
+/// @param a     The first key
+/// @param a_len Its length
+/// @param b     The second key
+/// @param b_len Its length
+///
+/// @return A negative number, zero, or a positive number, as a is less than,
+///         equal to, or greater than b
+static int compare_keys(const uint8_t *a, size_t a_len, const uint8_t *b,
+                        size_t b_len) {
+  int c = memcmp(a, b, min(a_len, b_len));
+  if (c == 0)
+    c = a_len < b_len ? -1 : a_len > b_len ? 1 : 0;
+  return c;
+}
+
+/// Read a key's value, checking it against its CRC
+///
+/// @param key The key
+/// @param val Set to the value
+///
+/// @return true if the key is in the table and its value is intact
+bool kv_table::get(const string &key, vector<uint8_t> &val) const {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    auto &e = index[mid];
+    int c = compare_keys(base + e.key_off, e.key_len,
+                         (const uint8_t *)key.data(), key.size());
+    if (c == 0) {
+      if (crc32c(0, base + e.val_off, e.val_len) != e.val_crc)
+        return false;
+      val.clear();
+      if (!packed)
+        val.push_back(VALUE_RAW);
+      val.insert(val.end(), base + e.val_off, base + e.val_off + e.val_len);
+      return true;
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return false;
+}
+
+/// Make a directory's entries (e.g. a newly created or renamed file) durable
+///
+/// @param file A file in the directory
+static void sync_dir(const string &file) {
+  size_t slash = file.rfind('/');
+  string dir = slash == string::npos ? "." : file.substr(0, slash + 1);
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    ::close(fd);
+  }
+}
+
+/// Write all of a buffer to a file descriptor
+///
+/// @param fd   The file descriptor
+/// @param data The bytes to write
+/// @param len  The number of bytes
+///
+/// @return true if every byte was written
+static bool write_all(int fd, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::write(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+/// Write all of a buffer to a position in a file
+///
+/// @param fd   The file descriptor
+/// @param data The bytes to write
+/// @param len  The number of bytes
+/// @param off  The position in the file
+///
+/// @return true if every byte was written
+static bool pwrite_all(int fd, const uint8_t *data, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = ::pwrite(fd, data, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+/// Write a snapshot: its framed entries, and then a K/V table made by applying
+/// changes to the previous snapshot's table
+///
+/// @param file    The file to write
+/// @param entries The framed entries that come before the table
+/// @param base    The previous snapshot's K/V table (or nullptr)
+/// @param changes The K/V pairs changed since `base`
+///
+/// @return true if the snapshot was written and synced
+bool write_snapshot(const string &file, const vector<uint8_t> &entries,
+                    const kv_table *base,
+                    const map<string, vector<uint8_t>> &changes) {
+  // Phase 1: merge the base's keys with the changed ones, in sorted order, and
+  // work out where everything goes
+  struct item {
+    const uint8_t *key;   // The key
+    size_t key_len;       // Its length
+    const uint8_t *val;   // The value
+    size_t val_len;       // Its length
+    bool from_base;       // Is the value in the base (and its CRC there)?
+    bool raw;             // Does the value need VALUE_RAW in front of it?
+    uint32_t crc;         // The base's CRC of the value
+  };
+  vector<item> items;
+  size_t nb = base == nullptr ? 0 : base->count;
+  items.reserve(nb + changes.size());
+  auto c = changes.begin();
+  for (size_t b = 0; b < nb || c != changes.end();) {
+    const kv_table::index_entry *e = b < nb ? &base->index[b] : nullptr;
+    int cmp = e == nullptr ? 1
+              : c == changes.end()
+                  ? -1
+                  : compare_keys(base->base + e->key_off, e->key_len,
+                                 (const uint8_t *)c->first.data(),
+                                 c->first.size());
+    if (cmp < 0) {
+      items.push_back({base->base + e->key_off, e->key_len,
+                       base->base + e->val_off, e->val_len, true,
+                       !base->packed, e->val_crc});
+      ++b;
+      continue;
+    }
+    if (cmp == 0)
+      ++b;
+    // An empty value is a deleted key
+    if (!c->second.empty())
+      items.push_back({(const uint8_t *)c->first.data(), c->first.size(),
+                       c->second.data(), c->second.size(), false, false, 0});
+    ++c;
+  }
+  auto align = [](uint64_t n) { return (n + 7) / 8 * 8; };
+  size_t n = items.size();
+  vector<uint64_t> val_off(n + 1);
+  uint64_t values_off = align(entries.size()), pos = values_off;
+  for (size_t i = 0; i < n; ++i) {
+    val_off[i] = pos;
+    pos = align(pos + items[i].val_len + (items[i].raw ? 1 : 0));
+  }
+  val_off[n] = pos;
+  uint64_t keys_off = pos;
+
+  int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "write_snapshot: could not create %s\n", file.c_str());
+    return false;
+  }
+  bool ok = pwrite_all(fd, entries.data(), entries.size(), 0);
+
+  // Phase 2: each writer copies the values of its share of the keys, which
+  // is about the same number of bytes for each, straight to their places in
+  // the file
+  // NB: vector<bool> packs its elements into shared words, so the writers'
+  //     flags are kept in bytes instead
+  vector<uint32_t> crcs(n);
+  vector<uint8_t> damaged(n, false);
+  auto write_range = [&](size_t lo, size_t hi, uint8_t &done) {
+    vector<uint8_t> buf;
+    uint64_t at = val_off[lo];
+    done = true;
+    for (size_t i = lo; i < hi && done; ++i) {
+      auto &it = items[i];
+      size_t start = buf.size();
+      if (it.raw)
+        buf.push_back(VALUE_RAW);
+      buf.insert(buf.end(), it.val, it.val + it.val_len);
+      if (it.from_base && crc32c(0, it.val, it.val_len) != it.crc)
+        damaged[i] = true;
+      crcs[i] = it.from_base && !it.raw
+                    ? it.crc
+                    : crc32c(0, buf.data() + start, buf.size() - start);
+      buf.resize(val_off[i + 1] - at, 0);
+      if (buf.size() >= SNAPSHOT_CHUNK || i + 1 == hi) {
+        done = pwrite_all(fd, buf.data(), buf.size(), at);
+        at += buf.size();
+        buf.clear();
+      }
+    }
+  };
+  size_t writers = max<size_t>(1, min(SNAPSHOT_WRITERS, n));
+  vector<size_t> bound(writers + 1, n);
+  bound[0] = 0;
+  for (size_t w = 1; w < writers; ++w) {
+    uint64_t goal = values_off + (keys_off - values_off) * w / writers;
+    bound[w] = lower_bound(val_off.begin() + bound[w - 1], val_off.end() - 1,
+                           goal) -
+               val_off.begin();
+  }
+  vector<uint8_t> done(writers);
+  vector<thread> threads;
+  for (size_t w = 1; w < writers; ++w)
+    threads.emplace_back(write_range, bound[w], bound[w + 1], ref(done[w]));
+  write_range(bound[0], bound[1], done[0]);
+  for (auto &t : threads)
+    t.join();
+  for (size_t w = 0; w < writers; ++w)
+    ok = ok && done[w];
+  for (size_t i = 0; i < n; ++i) {
+    if (damaged[i]) {
+      fprintf(stderr, "write_snapshot: the value of %.*s is damaged\n",
+              (int)items[i].key_len, (const char *)items[i].key);
+      ok = false;
+    }
+  }
+
+  // The keys, the index, and the footer are small enough to do in one go
+  vector<uint8_t> tail;
+  vector<uint64_t> key_off(n);
+  for (size_t i = 0; i < n; ++i) {
+    key_off[i] = keys_off + tail.size();
+    tail.insert(tail.end(), items[i].key, items[i].key + items[i].key_len);
+    tail.resize(align(tail.size()), 0);
+  }
+  uint64_t index_off = keys_off + tail.size();
+  for (size_t i = 0; i < n; ++i) {
+    put<uint64_t>(tail, key_off[i]);
+    put<uint32_t>(tail, items[i].key_len);
+    put<uint32_t>(tail, crcs[i]);
+    put<uint64_t>(tail, val_off[i]);
+    put<uint64_t>(tail, items[i].val_len + (items[i].raw ? 1 : 0));
+  }
+  size_t footer = tail.size();
+  put<uint64_t>(tail, values_off);
+  put<uint64_t>(tail, keys_off);
+  put<uint64_t>(tail, index_off);
+  put<uint64_t>(tail, n);
+  put<uint32_t>(tail, crc32c(0, tail.data(), footer));
+  put<uint32_t>(tail, crc32c(0, tail.data() + footer, 36));
+  tail.insert(tail.end(), KVTABLE2.begin(), KVTABLE2.end());
+  ok = ok && pwrite_all(fd, tail.data(), tail.size(), keys_off);
+  ok = ok && fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+/// The durability that new seg_logs use
+static log_durability config_mode = log_durability::strict;
+
+/// How often new seg_logs sync in interval mode
+static size_t config_sync_ms = 100;
+
+/// The time between snapshots that new seg_logs use
+static size_t config_snapshot_secs = 0;
+
+/// Do new seg_logs append through io_uring?
+static bool config_uring = false;
+
+/// The names of the durability modes, for parsing and reporting
+static const pair<log_durability, string> durability_names[] = {
+    {log_durability::strict, "strict"},
+    {log_durability::interval, "interval"},
+    {log_durability::none, "none"}};
+
+/// Configure the durability of every seg_log created after this call
+///
+/// @param mode        The durability mode
+/// @param interval_ms How often to sync in interval mode
+void log_durability_config(log_durability mode, size_t interval_ms) {
+  config_mode = mode;
+  config_sync_ms = max<size_t>(1, interval_ms);
+}
+
+/// Configure how often new seg_logs have the current state snapshotted
+///
+/// @param seconds The time between snapshots (0 = only when the log is big)
+void log_snapshot_config(size_t seconds) { config_snapshot_secs = seconds; }
+
+/// Configure whether new seg_logs append through io_uring
+///
+/// @param enabled true to use io_uring
+void log_uring_config(bool enabled) { config_uring = enabled; }
+
+/// Parse the name of a durability mode
+///
+/// @param name The name
+/// @param mode Set to the mode
+///
+/// @return true if the name is a mode's name
+bool log_durability_parse(const string &name, log_durability &mode) {
+  for (auto &d : durability_names) {
+    if (d.second == name) {
+      mode = d.first;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Construct a log for a data file
+///
+/// @param base The name of the data file
+seg_log::seg_log(const string &base)
+    : base(base), tail_time(chrono::steady_clock::now()),
+      snapshot_secs(config_snapshot_secs), mode(config_mode),
+      sync_ms(config_sync_ms) {}
+
+/// Stop the compactor and close the active segment
+seg_log::~seg_log() {
+  close();
+  free(block_buf);
+  delete ring;
+}
+
+/// Get the name of a segment's file
+///
+/// @param n The segment number
+string seg_log::segment_file(uint64_t n) const {
+  char num[32];
+  snprintf(num, sizeof(num), "%08llu", (unsigned long long)n);
+  return base + ".seg." + num;
+}
+
+/// List the segments that exist on disk
+///
+/// @return The segments' numbers, in order
+vector<uint64_t> seg_log::segments() {
+  size_t slash = base.rfind('/');
+  string dir = slash == string::npos ? "." : base.substr(0, slash + 1);
+  string prefix =
+      (slash == string::npos ? base : base.substr(slash + 1)) + ".seg.";
+  vector<uint64_t> res;
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr)
+    return res;
+  while (dirent *e = readdir(d)) {
+    string name = e->d_name;
+    if (name.compare(0, prefix.size(), prefix) != 0 ||
+        name.size() == prefix.size())
+      continue;
+    string num = name.substr(prefix.size());
+    // NB: skip half-written merges (".tmp")
+    if (num.find_first_not_of("0123456789") == string::npos)
+      res.push_back(strtoull(num.c_str(), nullptr, 10));
+  }
+  closedir(d);
+  sort(res.begin(), res.end());
+  return res;
+}
+
+/// Create and open a segment as the active one.  The caller holds lock.
+///
+/// @param n The segment number
+///
+/// @return true if the segment could be created
+bool seg_log::open_segment(uint64_t n) {
+  string file = segment_file(n);
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  int nfd = LOG_DIRECT_IO ? ::open(file.c_str(), flags | O_DIRECT, 0644) : -1;
+  if (nfd < 0)
+    nfd = ::open(file.c_str(), flags, 0644);
+  if (nfd < 0)
+    return err(false, "seg_log: could not create ", file.c_str());
+  // NB: if the file system can't preallocate, appends still work; they just
+  //     grow the file as they go
+  fallocate(nfd, 0, 0, LOG_SEGMENT_BYTES);
+  fsync(nfd);
+  sync_dir(base);
+  seal();
+  fd = nfd;
+  active = n;
+  active_bytes = 0;
+  return true;
+}
+
+/// Trim the active segment to its real size, sync it, and close it.  The
+/// caller holds lock.
+void seg_log::seal() {
+  if (fd < 0)
+    return;
+  // Appends that are still in the ring must land before the file is trimmed
+  if (ring != nullptr && ring->ok())
+    ring->wait_all();
+  if (ftruncate(fd, active_bytes) != 0)
+    perror("seg_log: ftruncate");
+  fsync(fd);
+  ::close(fd);
+  fd = -1;
+}
+
+/// Start a new, empty active segment, numbered after every existing one
+///
+/// @param last_seq The highest sequence number in the existing segments
+///
+/// @return true if the segment could be created
+bool seg_log::open(uint64_t last_seq) {
+  auto existing = segments();
+  lock_guard<mutex> g(lock);
+  seq = last_seq;
+  if (config_uring && ring == nullptr) {
+    ring = new uring(64);
+    if (!ring->ok())
+      fprintf(stderr, "seg_log: io_uring is not available\n");
+  }
+  if (mode == log_durability::interval && !syncer.joinable()) {
+    ticking = true;
+    syncer = thread([this]() { sync_loop(); });
+  }
+  return open_segment(existing.empty() ? 1 : existing.back() + 1);
+}
+
+/// Append one record to the active segment, framed with the next sequence
+/// number, and make it as durable as the durability mode requires
+///
+/// @param rec The unframed record
+///
+/// @return true if the record was written (and synced, in strict mode)
+bool seg_log::append(const vector<uint8_t> &rec) {
+  vector<uint8_t> framed;
+  framed.reserve(RECORD_HEADER_BYTES + rec.size());
+  uint64_t mine;
+  uint64_t ticket = 0;       // The ring's ticket, if the append went there
+  uint8_t *copy = nullptr;   // The blocks that the ring is writing
+  size_t len;
+  {
+    lock_guard<mutex> g(lock);
+    frame_record(framed, rec, mine = ++seq);
+    if (active_bytes > 0 && active_bytes + framed.size() > LOG_SEGMENT_BYTES)
+      open_segment(active + 1);
+    if (fd < 0 || failed)
+      return false;
+
+    // block_buf already holds the bytes of the segment's last, partial block,
+    // so add the record after them and write every block that the record
+    // touches
+    size_t block_off = active_bytes / LOG_BLOCK_BYTES * LOG_BLOCK_BYTES;
+    size_t kept = active_bytes - block_off;
+    size_t used = kept + framed.size();
+    len = (used + LOG_BLOCK_BYTES - 1) / LOG_BLOCK_BYTES * LOG_BLOCK_BYTES;
+    if (len > block_cap) {
+      void *bigger;
+      if (posix_memalign(&bigger, LOG_BLOCK_BYTES, len) != 0)
+        return err(false, "seg_log: out of memory");
+      if (kept > 0)
+        memcpy(bigger, block_buf, kept);
+      free(block_buf);
+      block_buf = (uint8_t *)bigger;
+      block_cap = len;
+    }
+    memcpy(block_buf + kept, framed.data(), framed.size());
+    memset(block_buf + used, 0, len - used);
+    // In strict mode, io_uring can write and sync with one system call.  The
+    // file is preallocated, so its size is already right, and only the data
+    // needs to be synced.  Only the submission happens under the lock; the
+    // ring gets its own copy of the blocks, since the next append reuses
+    // block_buf before this one's write is done.
+    if (mode == log_durability::strict && ring != nullptr && ring->ok()) {
+      void *mem;
+      if (posix_memalign(&mem, LOG_BLOCK_BYTES, len) != 0)
+        return err(false, "seg_log: out of memory");
+      copy = (uint8_t *)mem;
+      memcpy(copy, block_buf, len);
+      ticket = ring->submit_write_sync(fd, copy, len, block_off);
+      if (ticket == 0) {
+        free(copy);
+        failed = true;
+        return err(false, "seg_log: could not write to ",
+                   segment_file(active).c_str());
+      }
+    } else if (!pwrite_all(fd, block_buf, len, block_off)) {
+      failed = true;
+      return err(false, "seg_log: could not write to ",
+                 segment_file(active).c_str());
+    }
+    active_bytes += framed.size();
+    ++appends;
+    size_t tail = active_bytes % LOG_BLOCK_BYTES;
+    if (tail > 0)
+      memmove(block_buf, block_buf + used - tail, tail);
+  }
+
+  if (mode != log_durability::strict)
+    return true;
+  if (ticket == 0)
+    return sync_to(mine);
+  // NB: If the write fails, the record is still in block_buf, so an append
+  //     that was submitted after it may put it on disk after all.  The caller
+  //     only learns that this append isn't known to be durable.
+  ssize_t done = ring->wait(ticket, len);
+  free(copy);
+  if (done < 0 || (size_t)done != len) {
+    failed = true;
+    return err(false, "seg_log: could not write and sync the log");
+  }
+  lock_guard<mutex> s(sync_lock);
+  synced = max(synced, mine);
+  ++syncs;
+  return true;
+}
+
+/// Wait until every record up to a sequence number is on disk
+///
+/// @param target The sequence number
+///
+/// @return true if the records are durable
+bool seg_log::sync_to(uint64_t target) {
+  unique_lock<mutex> s(sync_lock);
+  while (synced < target) {
+    if (syncing) {
+      synced_cv.wait(s);
+      continue;
+    }
+    // Lead a sync that covers every record written so far, including the ones
+    // that other threads are waiting on
+    syncing = true;
+    s.unlock();
+    uint64_t upto;
+    int sfd;
+    {
+      lock_guard<mutex> g(lock);
+      upto = seq;
+      // NB: dup() keeps the segment open even if it is sealed meanwhile.  If
+      //     there is no active segment, sealing already synced everything.
+      sfd = fd < 0 ? -1 : dup(fd);
+    }
+    bool ok = sfd < 0 || fdatasync(sfd) == 0;
+    if (sfd >= 0)
+      ::close(sfd);
+    s.lock();
+    syncing = false;
+    if (ok) {
+      synced = max(synced, upto);
+      ++syncs;
+    }
+    synced_cv.notify_all();
+    if (!ok) {
+      failed = true;
+      return err(false, "seg_log: could not sync ", base.c_str());
+    }
+  }
+  return true;
+}
+
+/// The body of the thread that syncs the log in interval mode
+void seg_log::sync_loop() {
+  unique_lock<mutex> s(sync_lock);
+  while (ticking) {
+    synced_cv.wait_for(s, chrono::milliseconds(sync_ms));
+    if (!ticking)
+      break;
+    s.unlock();
+    uint64_t target;
+    {
+      lock_guard<mutex> g(lock);
+      target = seq;
+    }
+    if (!sync_to(target))
+      fprintf(stderr, "seg_log: background sync failed\n");
+    s.lock();
+  }
+}
+
+/// Seal the active segment and start a new one, for a snapshot
+///
+/// @param last_seq Set to the sequence number of the last record before the
+///                 new segment
+///
+/// @return The number of the new active segment
+uint64_t seg_log::rotate(uint64_t &last_seq) {
+  lock_guard<mutex> g(lock);
+  open_segment(active + 1);
+  last_seq = seq;
+  tail_start = active;
+  tail_appends = appends;
+  tail_time = chrono::steady_clock::now();
+  return active;
+}
+
+/// Delete every segment numbered below `n`
+///
+/// @param n The first segment to keep
+void seg_log::drop_before(uint64_t n) {
+  lock_guard<mutex> c(compact_lock);
+  for (auto s : segments())
+    if (s < n)
+      unlink(segment_file(s).c_str());
+}
+
+/// Read the records of the sealed segments in a range, in order
+///
+/// @param first The first segment
+/// @param end   The segment after the last one
+/// @param f     The code to run on each record
+///
+/// @return true if every segment was read whole
+bool seg_log::read_segments(uint64_t first, uint64_t end,
+                            function<void(log_record &)> f) {
+  lock_guard<mutex> c(compact_lock);
+  bool ok = true;
+  for (auto s : segments()) {
+    if (s < first || s >= end)
+      continue;
+    int sfd = ::open(segment_file(s).c_str(), O_RDONLY);
+    if (sfd < 0) {
+      fprintf(stderr, "seg_log: could not open %s\n", segment_file(s).c_str());
+      ok = false;
+      continue;
+    }
+    vector<uint8_t> buf;
+    uint8_t chunk[65536];
+    for (ssize_t n; (n = ::read(sfd, chunk, sizeof(chunk))) > 0;)
+      buf.insert(buf.end(), chunk, chunk + n);
+    ::close(sfd);
+    log_record rec;
+    size_t pos = 0;
+    while (pos < buf.size() && decode_record(buf, pos, rec)) {
+      f(rec);
+      rec = log_record();
+    }
+    if (any_of(buf.begin() + pos, buf.end(), [](uint8_t b) { return b; })) {
+      fprintf(stderr, "seg_log: stopped at a bad record in %s\n",
+              segment_file(s).c_str());
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/// Wait until the compactor may move `bytes` more bytes
+///
+/// @param bytes The number of bytes about to be read or written
+void seg_log::throttle(size_t bytes) {
+  window_bytes += bytes;
+  auto due = window + chrono::microseconds(window_bytes * 1000000 /
+                                           LOG_COMPACT_RATE);
+  auto now = chrono::steady_clock::now();
+  if (due > now)
+    this_thread::sleep_for(due - now);
+}
+
+/// Merge the sealed segments, if there are enough of them.  The merged
+/// segment holds the final state of each key and user that the run of
+/// segments touched, and replaces the newest segment of the run.
+///
+/// The run is read twice, one segment at a time: first to find the last record
+/// of each key and user, and then to copy just those records out, so that only
+/// one segment (and not every value in the run) is in memory at once.
+void seg_log::compact() {
+  lock_guard<mutex> c(compact_lock);
+  uint64_t now_active;
+  {
+    lock_guard<mutex> g(lock);
+    now_active = active;
+  }
+  vector<uint64_t> sealed;
+  for (auto s : segments())
+    if (s < now_active)
+      sealed.push_back(s);
+  if (sealed.size() < LOG_COMPACT_SEGMENTS)
+    return;
+  window = chrono::steady_clock::now();
+  window_bytes = 0;
+
+  // Run a function on each record of each segment of the run, with the
+  // record's place in the run (segment index, offset).  A sealed segment was
+  // trimmed to its last record, so it must decode to its end.  If one doesn't,
+  // nothing is merged: the records after the damage can't be read, but they
+  // mustn't be deleted either.
+  typedef pair<size_t, size_t> place_t;
+  auto scan = [&](function<void(log_record &, place_t)> f) {
+    for (size_t i = 0; i < sealed.size(); ++i) {
+      int sfd = ::open(segment_file(sealed[i]).c_str(), O_RDONLY);
+      if (sfd < 0)
+        return false;
+      vector<uint8_t> buf;
+      uint8_t chunk[65536];
+      ssize_t n;
+      while ((n = ::read(sfd, chunk, sizeof(chunk))) > 0) {
+        buf.insert(buf.end(), chunk, chunk + n);
+        throttle(n);
+      }
+      ::close(sfd);
+      if (n < 0)
+        return false;
+      log_record rec;
+      for (size_t pos = 0; pos < buf.size(); rec = log_record()) {
+        size_t at = pos;
+        if (!decode_record(buf, pos, rec)) {
+          fprintf(stderr,
+                  "seg_log: bad record at offset %zu of %s, not compacting\n",
+                  at, segment_file(sealed[i]).c_str());
+          return false;
+        }
+        f(rec, {i, at});
+      }
+    }
+    return true;
+  };
+
+  // Pass 1: find the last record of each key and user.  A user's AUTHENTRY
+  // is kept (without its profile, which a later AUTHDIFF replaces), so that
+  // the user's last AUTHDIFF can be written as one AUTHENTRY with the new
+  // profile.
+  map<string, place_t> kv_last, auth_last;
+  unordered_map<string, log_record> registered;
+  bool ok = scan([&](log_record &rec, place_t at) {
+    string name(rec.fields[0].begin(), rec.fields[0].end());
+    if (rec.type == KVENTRY || rec.type == KVUPDATE || rec.type == KVPACKED ||
+        rec.type == KVDELETE) {
+      kv_last[name] = at;
+    } else if (rec.type == AUTHENTRY) {
+      rec.fields[3].clear();
+      registered[name] = std::move(rec);
+      auth_last[name] = at;
+    } else if (rec.type == AUTHDIFF) {
+      auth_last[name] = at;
+    }
+  });
+  if (!ok)
+    return;
+
+  // Pass 2: copy the last records to the merged segment
+  // NB: The merge replaces the *newest* segment of the run.  If we crash
+  //     before the older ones are deleted, replaying them first is harmless,
+  //     since the merged segment holds the final state of everything they
+  //     touched.
+  string dest = segment_file(sealed.back());
+  string tmp = dest + ".tmp";
+  int tfd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (tfd < 0) {
+    fprintf(stderr, "seg_log: could not create %s\n", tmp.c_str());
+    return;
+  }
+  vector<uint8_t> data;
+  auto flush = [&]() {
+    ok = ok && write_all(tfd, data.data(), data.size());
+    throttle(data.size());
+    data.clear();
+  };
+  ok = scan([&](log_record &rec, place_t at) {
+    string name(rec.fields[0].begin(), rec.fields[0].end());
+    bool kv = rec.type != AUTHENTRY && rec.type != AUTHDIFF;
+    auto &last = kv ? kv_last : auth_last;
+    auto it = last.find(name);
+    if (it == last.end() || it->second != at)
+      return;
+    if (rec.type == KVENTRY)
+      rec.type = KVUPDATE; // An upsert has the same effect in either case
+    auto reg = registered.find(name);
+    if (rec.type == AUTHDIFF && reg != registered.end()) {
+      // NB: The merged record keeps the AUTHDIFF's sequence number, or a
+      //     replay that skips records up to a snapshot that came between the
+      //     two would skip the new profile too
+      reg->second.fields[3] = std::move(rec.fields[1]);
+      reg->second.seq = rec.seq;
+      encode_record(data, reg->second);
+    } else {
+      encode_record(data, rec);
+    }
+    if (data.size() >= COMPACT_CHUNK)
+      flush();
+  }) && ok;
+  flush();
+  ok = ok && fsync(tfd) == 0;
+  ::close(tfd);
+  if (!ok || rename(tmp.c_str(), dest.c_str()) != 0) {
+    fprintf(stderr, "seg_log: could not write %s\n", tmp.c_str());
+    unlink(tmp.c_str());
+    return;
+  }
+  sync_dir(base);
+  sealed.pop_back();
+  for (auto s : sealed)
+    unlink(segment_file(s).c_str());
+}
+
+/// The body of the compactor thread
+///
+/// @param snapshot The code to run to write a snapshot of the current state
+void seg_log::run(function<void()> snapshot) {
+  unique_lock<mutex> g(wake_lock);
+  while (running) {
+    wake.wait_for(g, chrono::seconds(LOG_COMPACT_INTERVAL));
+    if (!running)
+      break;
+    g.unlock();
+    // Restarting replays the log since the last snapshot, so that's what
+    // decides when to take a new one.  The active segment is preallocated,
+    // so its size on disk isn't its real size.
+    size_t total;
+    uint64_t first, now_active;
+    bool stale;
+    {
+      lock_guard<mutex> l(lock);
+      total = active_bytes;
+      first = tail_start;
+      now_active = active;
+      stale = snapshot_secs > 0 && appends != tail_appends &&
+              chrono::steady_clock::now() - tail_time >=
+                  chrono::seconds(snapshot_secs);
+    }
+    for (auto s : segments()) {
+      struct stat st;
+      if (s >= first && s < now_active &&
+          stat(segment_file(s).c_str(), &st) == 0)
+        total += st.st_size;
+    }
+    if (stale || total > LOG_SNAPSHOT_BYTES)
+      snapshot();
+    else
+      compact();
+    g.lock();
+  }
+}
+
+/// Start the background compactor
+///
+/// @param snapshot The code to run to write a snapshot of the current state
+void seg_log::start_compactor(function<void()> snapshot) {
+  lock_guard<mutex> g(wake_lock);
+  if (running)
+    return;
+  running = true;
+  compactor = thread([this, snapshot]() { run(snapshot); });
+}
+
+/// Stop the compactor and close the active segment
+void seg_log::close() {
+  {
+    lock_guard<mutex> g(wake_lock);
+    running = false;
+  }
+  wake.notify_all();
+  if (compactor.joinable())
+    compactor.join();
+  {
+    lock_guard<mutex> s(sync_lock);
+    ticking = false;
+  }
+  synced_cv.notify_all();
+  if (syncer.joinable())
+    syncer.join();
+  lock_guard<mutex> g(lock);
+  seal();
+}
+
+/// Describe the log's durability mode and how much work it has done
+string seg_log::stats() {
+  size_t a, n;
+  {
+    lock_guard<mutex> g(lock);
+    a = appends;
+  }
+  {
+    lock_guard<mutex> s(sync_lock);
+    n = syncs;
+  }
+  string name;
+  for (auto &d : durability_names)
+    if (d.first == mode)
+      name = d.second;
+  return "durability " + name + ", " + to_string(a) + " appends, " +
+         to_string(n) + " syncs";
+}
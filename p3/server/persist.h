@@ -1,7 +1,379 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "uring.h"
+
 /// The purpose of this file is to allow you to declare helper functions that
-/// simplify interacting with persistent storage.
\ No newline at end of file
+/// simplify interacting with persistent storage.
+
+/// The size at which the active log segment is sealed and a new one is started
+const size_t LOG_SEGMENT_BYTES = 64 * 1048576;
+
+/// The block size of log writes.  Appends rewrite the last, partial block of
+/// the segment along with the new record, so that every write is a whole
+/// number of aligned blocks.
+const size_t LOG_BLOCK_BYTES = 4096;
+
+/// Should log segments be opened with O_DIRECT, so that appends bypass the page
+/// cache?  (If the file system doesn't support it, buffered I/O is used.)
+const bool LOG_DIRECT_IO = false;
+
+/// How often the compactor wakes up to look for work (seconds)
+const int LOG_COMPACT_INTERVAL = 5;
+
+/// The number of sealed segments it takes for the compactor to merge them
+const size_t LOG_COMPACT_SEGMENTS = 4;
+
+/// The total size of the log segments written since the last snapshot at which
+/// the compactor writes a new snapshot (i.e., runs a SAV), so that replaying
+/// the log on startup never takes too long
+const size_t LOG_SNAPSHOT_BYTES = 1024 * 1048576;
+
+/// The most bytes per second that the compactor may read and write, so that
+/// merging segments doesn't starve the log writer of disk bandwidth
+const size_t LOG_COMPACT_RATE = 32 * 1048576;
+
+/// The number of threads that copy values into a new snapshot
+const size_t SNAPSHOT_WRITERS = 4;
+
+/// How hard the log works to make each change durable before the server replies
+enum class log_durability {
+  strict,   // Sync before replying (concurrent appends share one sync)
+  interval, // Reply at once, and sync in the background every few ms
+  none      // Reply at once, and leave the changes to the OS's page cache
+};
+
+/// Configure the durability of every seg_log created after this call.  By
+/// default, the log is strict.
+///
+/// @param mode        The durability mode
+/// @param interval_ms How often to sync in interval mode
+void log_durability_config(log_durability mode, size_t interval_ms);
+
+/// Configure how often every seg_log created after this call has the current
+/// state snapshotted, if anything has changed.  By default, snapshots are only
+/// taken when the log gets big (or on SAV).
+///
+/// @param seconds The time between snapshots (0 = only when the log is big)
+void log_snapshot_config(size_t seconds);
+
+/// Configure whether every seg_log created after this call submits its appends
+/// through io_uring, as a write linked to a sync.  The append's lock is only
+/// held to submit; the wait for the write and sync happens outside it.  (If
+/// io_uring isn't available, the ordinary system calls are used.)  This only
+/// matters in strict mode, where it replaces group commit: each append is
+/// synced on its own.  By default, io_uring is not used.
+///
+/// @param enabled true to use io_uring
+void log_uring_config(bool enabled);
+
+/// Parse the name of a durability mode
+///
+/// @param name The name ("strict", "interval", or "none")
+/// @param mode Set to the mode
+///
+/// @return true if the name is a mode's name
+bool log_durability_parse(const std::string &name, log_durability &mode);
+
+/// The size of the header that frames each record (see LOGREC2 in format.h)
+const size_t RECORD_HEADER_BYTES = 24;
+
+/// log_record is one entry of the data file or of a log segment, in the formats
+/// described in format.h: an 8-byte type, followed by length-prefixed fields.
+struct log_record {
+  std::string type;                         // e.g. KVUPDATE
+  std::vector<std::vector<uint8_t>> fields; // e.g. the key and the value
+  uint64_t seq = 0;                         // The sequence number in its frame
+};
+
+/// Compute a CRC32C (Castagnoli) checksum, using the CPU's crc32 instruction
+/// when there is one
+///
+/// @param crc  The checksum of the bytes before these (0 to start)
+/// @param data The bytes
+/// @param len  The number of bytes
+///
+/// @return The checksum of all the bytes so far
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len);
+
+/// Append a header and an unframed record (in the format of format.h, with its
+/// padding) to a buffer
+///
+/// @param out  The buffer
+/// @param body The unframed record
+/// @param seq  The record's sequence number
+void frame_record(std::vector<uint8_t> &out, const std::vector<uint8_t> &body,
+                  uint64_t seq);
+
+/// Append the framed on-disk form of a record to a buffer
+///
+/// @param out The buffer
+/// @param rec The record, including its sequence number
+void encode_record(std::vector<uint8_t> &out, const log_record &rec);
+
+/// Parse the record that starts at a position in a buffer.  A framed record is
+/// only accepted if its checksum matches, and every length is checked against
+/// the size of the buffer, so a torn or garbled record is reported rather than
+/// read past.  Unframed (version 1) records are accepted too.
+///
+/// @param buf The buffer
+/// @param pos The position of the record; advanced past it on success
+/// @param rec Set to the record
+///
+/// @return true if a whole, intact record of a known type was parsed
+bool decode_record(const std::vector<uint8_t> &buf, size_t &pos,
+                   log_record &rec);
+
+/// kv_table is a read-only view of the K/V table at the end of a snapshot.  The
+/// file is mapped into memory, and opening it only checks the index, so that
+/// values cost nothing until they are read.
+class kv_table {
+public:
+  /// Map a snapshot's K/V table
+  ///
+  /// @param file The snapshot
+  /// @param ok   Set to false if the snapshot has a table but it is damaged
+  ///
+  /// @return The table, or nullptr if the snapshot has none (or it is
+  ///         damaged)
+  static std::shared_ptr<kv_table> open(const std::string &file, bool &ok);
+
+  /// Unmap the file
+  ~kv_table();
+
+  /// Get a copy of the framed entries that come before the table
+  std::vector<uint8_t> entries() const;
+
+  /// Report the number of keys
+  size_t size() const { return count; }
+
+  /// Get one of the keys
+  ///
+  /// @param i The key's position in sorted order
+  std::string key(size_t i) const;
+
+  /// Read a key's value, checking it against its CRC
+  ///
+  /// @param key The key
+  /// @param val Set to the packed value (see value_codec.h)
+  ///
+  /// @return true if the key is in the table and its value is intact
+  bool get(const std::string &key, std::vector<uint8_t> &val) const;
+
+private:
+  friend bool write_snapshot(
+      const std::string &file, const std::vector<uint8_t> &entries,
+      const kv_table *base,
+      const std::map<std::string, std::vector<uint8_t>> &changes);
+
+  /// Construct a table from a mapped file.  Use open().
+  kv_table(const uint8_t *base, size_t len);
+
+  /// One entry of the index, as it is laid out in the file
+  struct index_entry {
+    uint64_t key_off; // Offset of the key
+    uint32_t key_len; // Length of the key
+    uint32_t val_crc; // CRC32C of the value
+    uint64_t val_off; // Offset of the value
+    uint64_t val_len; // Length of the value
+  };
+
+  const uint8_t *base;       // The mapped file
+  const size_t len;          // The file's length
+  size_t entries_end = 0;    // Where the framed entries end
+  const index_entry *index = nullptr; // The index
+  size_t count = 0;          // The number of keys
+  bool packed = false;       // Are the values packed (KVTABLE2)?
+};
+
+/// Write a snapshot (see KVTABLE in format.h): its framed entries, and then a
+/// K/V table made by applying changes to the previous snapshot's table.  The
+/// layout of the whole file is worked out first, and then SNAPSHOT_WRITERS
+/// threads each copy the values for a range of keys to their places in it, so
+/// that a big snapshot is written at the speed of the disk.  Nothing is read
+/// from the live tables, so writing a snapshot doesn't hold up the clients.
+///
+/// @param file    The file to write (it is replaced, and synced)
+/// @param entries The framed entries that come before the table
+/// @param base    The previous snapshot's K/V table (or nullptr).  Its values
+///                are checked against their CRCs as they are copied.
+/// @param changes The K/V pairs that changed since `base`, with packed values;
+///                an empty value means that the key was deleted
+///
+/// @return true if the snapshot was written and synced
+bool write_snapshot(const std::string &file,
+                    const std::vector<uint8_t> &entries, const kv_table *base,
+                    const std::map<std::string, std::vector<uint8_t>> &changes);
+
+/// seg_log is the log of incremental changes, split into numbered segment files
+/// next to the data file (see format.h).  Appends go to the active segment
+/// until it fills up, and then to a new one.  Each segment is preallocated to
+/// its full size when it is created, and appends are written as aligned blocks
+/// and synced with fdatasync(), so that an append doesn't change the file's
+/// size, and syncing it doesn't have to write the inode.  Sealed segments are
+/// trimmed to their real size.  A background compactor merges
+/// runs of sealed segments into one, and asks for a new snapshot when the
+/// segments get too big in total.  The compactor's I/O is limited to
+/// LOG_COMPACT_RATE, so that it doesn't compete with the appends.
+///
+/// In strict mode, an append writes its record and then waits for an
+/// fdatasync() that covers it.  Only one sync runs at a time, and each one
+/// covers every record written before it started, so concurrent appends are
+/// committed as a group.  In interval mode, a background thread does the
+/// syncing, and in none mode, only sealing a segment syncs it.
+class seg_log {
+public:
+  /// Construct a log for a data file.  Nothing is opened until open().
+  ///
+  /// @param base The name of the data file
+  seg_log(const std::string &base);
+
+  /// Stop the compactor and close the active segment
+  ~seg_log();
+
+  /// List the segments that exist on disk
+  ///
+  /// @return The segments' numbers, in order
+  std::vector<uint64_t> segments();
+
+  /// Get the name of a segment's file
+  ///
+  /// @param n The segment number
+  std::string segment_file(uint64_t n) const;
+
+  /// Start a new, empty active segment, numbered after every existing one
+  ///
+  /// @param last_seq The highest sequence number in the existing segments
+  ///
+  /// @return true if the segment could be created
+  bool open(uint64_t last_seq);
+
+  /// Durably append one record to the active segment, framed with the next
+  /// sequence number.
+  ///
+  /// NB: Once a write or a sync fails, it isn't known which records made it
+  ///     to disk, so every later append fails too, until the server restarts
+  ///     and replays what is really there.
+  ///
+  /// @param rec The unframed record (in the format of format.h)
+  ///
+  /// @return true if the record was written and synced
+  bool append(const std::vector<uint8_t> &rec);
+
+  /// Seal the active segment and start a new one, for a snapshot.  If the
+  /// caller holds locks that keep every writer out, then the new segment is
+  /// exactly where the changes that a snapshot of the current state doesn't
+  /// include begin.
+  ///
+  /// @param last_seq Set to the sequence number of the last record before the
+  ///                 new segment
+  ///
+  /// @return The number of the new active segment
+  uint64_t rotate(uint64_t &last_seq);
+
+  /// Delete every segment numbered below `n`, because a snapshot includes them
+  ///
+  /// @param n The first segment to keep
+  void drop_before(uint64_t n);
+
+  /// Read the records of the sealed segments numbered from `first` up to (but
+  /// not including) `end`, in order.  The compactor is kept out while they are
+  /// read, so that it doesn't merge them away.
+  ///
+  /// @param first The first segment
+  /// @param end   The segment after the last one
+  /// @param f     The code to run on each record
+  ///
+  /// @return true if every segment was read whole
+  bool read_segments(uint64_t first, uint64_t end,
+                     std::function<void(log_record &)> f);
+
+  /// Start the background compactor
+  ///
+  /// @param snapshot The code to run to write a snapshot of the current state.
+  ///                 It should call rotate() and drop_before().  It runs when
+  ///                 the log since the last rotate() exceeds
+  ///                 LOG_SNAPSHOT_BYTES, or when log_snapshot_config()'s time
+  ///                 has passed and something was appended.
+  void start_compactor(std::function<void()> snapshot);
+
+  /// Stop the compactor and close the active segment
+  void close();
+
+  /// Describe the log's durability mode and how much work it has done
+  std::string stats();
+
+private:
+  /// Create and open a segment as the active one.  The caller holds lock.
+  ///
+  /// @param n The segment number
+  bool open_segment(uint64_t n);
+
+  /// Trim the active segment to its real size, sync it, and close it.  The
+  /// caller holds lock.
+  void seal();
+
+  /// Merge the sealed segments, if there are enough of them
+  void compact();
+
+  /// Wait until the compactor may move `bytes` more bytes
+  void throttle(size_t bytes);
+
+  /// The body of the compactor thread
+  void run(std::function<void()> snapshot);
+
+  /// Wait until every record up to a sequence number is on disk, syncing the
+  /// active segment if no other thread is already doing so
+  ///
+  /// @param target The sequence number
+  ///
+  /// @return true if the records are durable
+  bool sync_to(uint64_t target);
+
+  /// The body of the thread that syncs the log in interval mode
+  void sync_loop();
+
+  const std::string base;       // The data file
+  std::mutex lock;              // Protects fd, active, active_bytes, seq
+  int fd = -1;                  // The active segment
+  uint64_t active = 0;          // The active segment's number
+  size_t active_bytes = 0;      // The active segment's size
+  uint64_t seq = 0;             // The last sequence number handed out
+  uint8_t *block_buf = nullptr; // Aligned staging buffer; starts with the
+                                // active segment's last, partial block
+  size_t block_cap = 0;         // The size of block_buf
+  uring *ring = nullptr;        // For appends, if log_uring_config()
+  size_t appends = 0;           // Records appended (protected by lock)
+  std::atomic<bool> failed{false}; // Has a write or sync failed?
+  uint64_t tail_start = 0;      // The first segment after the last snapshot
+  size_t tail_appends = 0;      // The value of appends at the last snapshot
+  std::chrono::steady_clock::time_point tail_time; // Time of last snapshot
+  const size_t snapshot_secs;   // Time between snapshots (0 = by size only)
+  const log_durability mode;    // See log_durability
+  const size_t sync_ms;         // How often to sync in interval mode
+  std::mutex sync_lock;         // Protects synced, syncing, syncs, ticking
+  std::condition_variable synced_cv; // Signals the end of each sync
+  uint64_t synced = 0;          // Records up to here are on disk
+  bool syncing = false;         // Is a thread running fdatasync()?
+  size_t syncs = 0;             // The number of syncs that ran
+  bool ticking = false;         // Is the interval syncer running?
+  std::thread syncer;           // The interval syncer
+  std::mutex compact_lock;      // Serializes merges and drop_before()
+  std::mutex wake_lock;         // Protects running
+  std::condition_variable wake; // Wakes the compactor to stop
+  bool running = false;         // Is the compactor running?
+  std::chrono::steady_clock::time_point window; // Start of the rate window
+  size_t window_bytes = 0;      // Bytes moved in the rate window
+  std::thread compactor;        // The compactor thread
+};
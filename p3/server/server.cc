@@ -11,7 +11,11 @@
 #include "../common/net.h"
 #include "../common/pool.h"
 
+#include "numa.h"
 #include "parsing.h"
+#include "persist.h"
+#include "value_cache.h"
+#include "value_codec.h"
 #include "storage.h"
 
 using namespace std;
@@ -29,6 +33,13 @@ struct arg_t {
   size_t quota_req = 16;       // K/V request quota (requests/interval)
   size_t top_size = 4;         // Number of keys to track for TOP queries
   string admin_name = "";      // Name of the administrator
+  log_durability durability = log_durability::strict; // When to sync the log
+  size_t sync_interval = 100;  // Milliseconds between syncs (interval mode)
+  size_t snapshot_interval = 0; // Seconds between snapshots (0 = by log size)
+  size_t value_cache_mb = 0;   // Memory for K/V values (0 = keep them all)
+  size_t compress_min = 0;     // Smallest value to compress (0 = none)
+  size_t numa_workers = 0;     // K/V workers per NUMA node (0 = no sharding)
+  bool log_uring = false;      // Append to the log through io_uring
 
   /// Construct an arg_t from the command-line arguments to the program
   ///
@@ -39,7 +50,7 @@ struct arg_t {
   ///        `-h` is passed in
   arg_t(int argc, char **argv) {
     long opt;
-    while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:s:w:S:m:z:n:U")) != -1) {
       switch (opt) {
       case 'p':
         port = atoi(optarg);
@@ -74,6 +85,28 @@ struct arg_t {
       case 'a':
         admin_name = string(optarg);
         break;
+      case 's':
+        if (!log_durability_parse(optarg, durability))
+          throw 1;
+        break;
+      case 'w':
+        sync_interval = atoi(optarg);
+        break;
+      case 'S':
+        snapshot_interval = atoi(optarg);
+        break;
+      case 'm':
+        value_cache_mb = atoi(optarg);
+        break;
+      case 'z':
+        compress_min = atoi(optarg);
+        break;
+      case 'n':
+        numa_workers = atoi(optarg);
+        break;
+      case 'U':
+        log_uring = true;
+        break;
       default: // on any error, print a help message.  This case subsumes `-h`
         throw 1;
         return;
@@ -98,6 +131,16 @@ struct arg_t {
          << "  -r [int]    Request quota (requests/interval)\n"
          << "  -o [int]    Size of the TOP key cache\n"
          << "  -a [string] Specify name of admin user\n"
+         << "  -s [string] Log durability (strict, interval, or none)\n"
+         << "  -w [int]    Milliseconds between log syncs (interval mode)\n"
+         << "  -S [int]    Seconds between snapshots (0 = when the log is big)\n"
+         << "  -m [int]    Memory for K/V values (MB, 0 = keep them all)\n"
+         << "  -z [int]    Compress values of at least this many bytes (0 = never)\n"
+         << "  -n [int]    Shard the K/V store across NUMA nodes, with this many\n"
+         << "              workers per node (0 = don't shard).  K/V writes are\n"
+         << "              logged on these workers, so with -s strict, at most\n"
+         << "              this many writes per node can wait on a sync at once\n"
+         << "  -U          Append to the log through io_uring (strict mode)\n"
          << "  -h          Print help (this message)\n";
   }
 };
@@ -132,6 +175,12 @@ int main(int argc, char **argv) {
 
   // If the data file exists, load the data into a Storage object.  Otherwise,
   // create an empty Storage object.
+  log_durability_config(args->durability, args->sync_interval);
+  log_snapshot_config(args->snapshot_interval);
+  log_uring_config(args->log_uring);
+  value_cache_config(args->value_cache_mb * 1048576);
+  value_codec_config(args->compress_min);
+  numa_config(args->numa_workers);
   Storage *storage = storage_factory(
       args->datafile, args->num_buckets, args->quota_up, args->quota_down,
       args->quota_req, args->quota_interval, args->top_size, args->admin_name);
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "map.h"
+#include "numa.h"
+
+/// ShardedMap is a Map that splits its keys among several maps (shards), one
+/// per NUMA node, and runs each operation on a worker of the node that owns the
+/// key.  Each shard is made by one of its node's workers, so its buckets are
+/// allocated on that node, and since every insert and update runs there too, so
+/// are its entries.
+///
+/// NB: The shards are Maps, so a key's callbacks still run while its bucket is
+///     locked, just on another thread.  The callers must not hold any lock that
+///     the callbacks take, or the worker would wait for the caller forever.
+///
+/// NB: That includes the storage's log append, which must stay under the
+///     bucket lock so that the log's order matches the map's.  In strict mode,
+///     each append waits for a sync, so a node's workers, and the callers
+///     waiting on them, can only have as many syncs in flight as the node has
+///     workers.  With one worker per node, a node's writes sync one at a time.
+///
+/// @param K The type of the keys in this map
+/// @param V The type of the values in this map
+template <typename K, typename V> class ShardedMap : public Map<K, V> {
+  numa_router &router;             // Runs operations on the shards' nodes
+  std::vector<Map<K, V> *> shards; // One map per node
+
+  /// Pick the shard that owns a key.  NB: The shards hash the key too, to pick
+  /// a bucket, so the shard comes from the hash's high bits (after mixing),
+  /// which the bucket doesn't depend on as much as its low bits.
+  ///
+  /// @param key The key
+  ///
+  /// @return The index of the shard, which is also the index of its node
+  size_t shard_of(const K &key) const {
+    uint64_t h = std::hash<K>()(key) * 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) % shards.size();
+  }
+
+  /// Apply the function to every pair in the shards from `i` on, and then run
+  /// `then`, without letting go of any shard in between
+  void do_all_from(size_t i, std::function<void(const K, const V &)> &f,
+                   std::function<void()> &then) {
+    if (i == shards.size()) {
+      then();
+      return;
+    }
+    shards[i]->do_all_readonly(f, [&]() { do_all_from(i + 1, f, then); });
+  }
+
+public:
+  /// Construct a map with one shard per node
+  ///
+  /// @param router  The router, which must outlive the map
+  /// @param factory Makes one (empty) shard
+  ShardedMap(numa_router &router, std::function<Map<K, V> *()> factory)
+      : router(router), shards(router.size()) {
+    for (size_t i = 0; i < shards.size(); ++i)
+      router.run(i, [&]() { shards[i] = factory(); });
+  }
+
+  /// Destruct the map
+  virtual ~ShardedMap() {
+    for (auto s : shards)
+      delete s;
+  }
+
+  /// Clear the map.  Each shard is cleared with 2pl, but not all of them at
+  /// once, so this should only be used while no one else uses the map.
+  virtual void clear() {
+    for (size_t i = 0; i < shards.size(); ++i)
+      router.run(i, [&]() { shards[i]->clear(); });
+  }
+
+  /// Insert the provided key/value pair only if there is no mapping for the key
+  /// yet.
+  ///
+  /// @param key        The key to insert
+  /// @param val        The value to insert
+  /// @param on_success Code to run if the insertion succeeds
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table
+  virtual bool insert(K key, V val, std::function<void()> on_success) {
+    size_t i = shard_of(key);
+    bool res;
+    router.run(i, [&]() {
+      res = shards[i]->insert(std::move(key), std::move(val), on_success);
+    });
+    return res;
+  }
+
+  /// Insert the provided key/value pair if there is no mapping for the key yet.
+  /// If there is a key, then update the mapping by replacing the old value with
+  /// the provided value
+  ///
+  /// @param key    The key to upsert
+  /// @param val    The value to upsert
+  /// @param on_ins Code to run if the upsert succeeds as an insert
+  /// @param on_upd Code to run if the upsert succeeds as an update
+  ///
+  /// @return true if the key/value was inserted, false if the key already
+  ///         existed in the table and was thus updated instead
+  virtual bool upsert(K key, V val, std::function<void()> on_ins,
+                      std::function<void()> on_upd) {
+    size_t i = shard_of(key);
+    bool res;
+    router.run(i, [&]() {
+      res = shards[i]->upsert(std::move(key), std::move(val), on_ins, on_upd);
+    });
+    return res;
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with(K key, std::function<void(V &)> f) {
+    size_t i = shard_of(key);
+    bool res;
+    router.run(i, [&]() { res = shards[i]->do_with(std::move(key), f); });
+    return res;
+  }
+
+  /// Apply a function to the value associated with a given key.  The function
+  /// is not allowed to modify the value.
+  ///
+  /// @param key The key whose value will be modified
+  /// @param f   The function to apply to the key's value
+  ///
+  /// @return true if the key existed and the function was applied, false
+  ///         otherwise
+  virtual bool do_with_readonly(K key, std::function<void(const V &)> f) {
+    size_t i = shard_of(key);
+    bool res;
+    router.run(i,
+               [&]() { res = shards[i]->do_with_readonly(std::move(key), f); });
+    return res;
+  }
+
+  /// Remove the mapping from a key to its value
+  ///
+  /// @param key        The key whose mapping should be removed
+  /// @param on_success Code to run if the remove succeeds
+  ///
+  /// @return true if the key was found and the value unmapped, false otherwise
+  virtual bool remove(K key, std::function<void()> on_success) {
+    size_t i = shard_of(key);
+    bool res;
+    router.run(i,
+               [&]() { res = shards[i]->remove(std::move(key), on_success); });
+    return res;
+  }
+
+  /// Apply a function to every key/value pair in the map.  Note
+  /// that the function is not allowed to modify keys or values.  The shards
+  /// are visited in order, each one from inside the previous one's visit, so
+  /// that they are all locked at once when `then` runs, as with one map.  This
+  /// runs on the calling thread, since it touches every node anyway.
+  ///
+  /// @param f    The function to apply to each key/value pair
+  /// @param then A function to run when this is done, but before unlocking...
+  ///             useful for 2pl
+  virtual void do_all_readonly(std::function<void(const K, const V &)> f,
+                               std::function<void()> then) {
+    do_all_from(0, f, then);
+  }
+};
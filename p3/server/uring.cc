@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/// Set up a ring
+///
+/// @param entries The number of submission queue entries
+uring::uring(unsigned entries) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return;
+
+  sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  // NB: on newer kernels, both rings live in one mapping
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    sq_map_len = cq_map_len = std::max(sq_map_len, cq_map_len);
+  sq_map = mmap(nullptr, sq_map_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_map == MAP_FAILED) {
+    sq_map = nullptr;
+    close(fd);
+    return;
+  }
+  cq_map = single ? sq_map
+                  : mmap(nullptr, cq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqe_map_len = p.sq_entries * sizeof(io_uring_sqe);
+  sqe_map = mmap(nullptr, sqe_map_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (cq_map == MAP_FAILED || sqe_map == MAP_FAILED) {
+    if (cq_map != MAP_FAILED && !single)
+      munmap(cq_map, cq_map_len);
+    if (sqe_map != MAP_FAILED)
+      munmap(sqe_map, sqe_map_len);
+    munmap(sq_map, sq_map_len);
+    sq_map = cq_map = sqe_map = nullptr;
+    close(fd);
+    return;
+  }
+
+  uint8_t *sq = (uint8_t *)sq_map, *cq = (uint8_t *)cq_map;
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = cq + p.cq_off.cqes;
+  cq_entries = p.cq_entries;
+  ring_fd = fd;
+}
+
+/// Unmap the rings and close the ring's file descriptor
+uring::~uring() {
+  if (ring_fd < 0)
+    return;
+  munmap(sqe_map, sqe_map_len);
+  if (cq_map != sq_map)
+    munmap(cq_map, cq_map_len);
+  munmap(sq_map, sq_map_len);
+  close(ring_fd);
+}
+
+/// Queue one submission queue entry
+///
+/// @param op    The operation (IORING_OP_*)
+/// @param fd    The file descriptor
+/// @param data  The buffer (or nullptr)
+/// @param len   The buffer's length
+/// @param off   The position in the file
+/// @param flags The entry's flags (IOSQE_*)
+/// @param extra The operation's flags (e.g., IORING_FSYNC_DATASYNC)
+/// @param tag   The value to find in the completion
+void uring::push(uint8_t op, int fd, const void *data, size_t len, off_t off,
+                 uint8_t flags, uint32_t extra, uint64_t tag) {
+  unsigned tail = *sq_tail;
+  unsigned idx = tail & *sq_mask;
+  io_uring_sqe *sqe = (io_uring_sqe *)sqe_map + idx;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->flags = flags;
+  sqe->fd = fd;
+  sqe->off = off;
+  sqe->addr = (uint64_t)(uintptr_t)data;
+  sqe->len = len;
+  sqe->fsync_flags = extra;
+  sqe->user_data = tag;
+  sq_array[idx] = idx;
+  // The kernel must see the entry before it sees the new tail
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/// Collect completions until a condition holds.  The caller holds cq_lock.
+///
+/// @param g    The caller's hold on cq_lock
+/// @param done The condition
+///
+/// @return 0, or -errno if waiting in the kernel failed
+int uring::reap(std::unique_lock<std::mutex> &g, std::function<bool()> done) {
+  while (!done()) {
+    if (reaping) {
+      reaped.wait(g);
+      continue;
+    }
+    reaping = true;
+    g.unlock();
+    int n = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                    nullptr, 0);
+    int error = n < 0 ? errno : 0;
+    g.lock();
+    reaping = false;
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head, --inflight) {
+      io_uring_cqe *cqe = (io_uring_cqe *)cqes + (head & *cq_mask);
+      results[cqe->user_data] = cqe->res;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    reaped.notify_all();
+    if (error != 0 && error != EINTR)
+      return -error;
+  }
+  return 0;
+}
+
+/// Submit a write of a buffer to a position in a file, followed by an
+/// fdatasync() of the file
+///
+/// @param fd   The file descriptor
+/// @param data The bytes to write, which must not change until wait()
+/// @param len  The number of bytes
+/// @param off  The position in the file
+///
+/// @return A ticket for wait(), or 0 if the requests couldn't be submitted
+uint64_t uring::submit_write_sync(int fd, const uint8_t *data, size_t len,
+                                  off_t off) {
+  if (ring_fd < 0)
+    return 0;
+  uint64_t ticket;
+  {
+    // Don't submit more than the completion queue can hold
+    std::unique_lock<std::mutex> g(cq_lock);
+    if (reap(g, [&]() { return inflight + 2 <= cq_entries; }) != 0)
+      return 0;
+    ticket = ++tickets;
+    inflight += 2;
+  }
+  // The sync is linked to the write, so it only starts once the write has
+  // completed in full, and is cancelled if the write fails or is short.
+  // NB: Consecutive appends rewrite the same partial block, so the write also
+  //     drains everything before it, or an older copy of the block could land
+  //     on top of a newer one.
+  push(IORING_OP_WRITE, fd, data, len, off, IOSQE_IO_LINK | IOSQE_IO_DRAIN, 0,
+       ticket * 2);
+  push(IORING_OP_FSYNC, fd, nullptr, 0, 0, 0, IORING_FSYNC_DATASYNC,
+       ticket * 2 + 1);
+  for (unsigned to_submit = 2; to_submit > 0;) {
+    int n = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+    if (n < 0 && errno != EINTR) {
+      // Take back the entries that the kernel didn't take, so that the next
+      // submission doesn't send them
+      __atomic_store_n(sq_tail, *sq_tail - to_submit, __ATOMIC_RELEASE);
+      std::lock_guard<std::mutex> g(cq_lock);
+      inflight -= to_submit;
+      return 0;
+    }
+    if (n > 0)
+      to_submit -= std::min((unsigned)n, to_submit);
+  }
+  return ticket;
+}
+
+/// Wait for a write and sync to finish
+///
+/// @param ticket The ticket from submit_write_sync()
+/// @param len    The number of bytes that were to be written
+///
+/// @return The number of bytes written (which may be short, in which case the
+///         file was not synced), or -errno on failure
+ssize_t uring::wait(uint64_t ticket, size_t len) {
+  std::unique_lock<std::mutex> g(cq_lock);
+  int res = reap(g, [&]() {
+    return results.count(ticket * 2) && results.count(ticket * 2 + 1);
+  });
+  if (res != 0)
+    return res;
+  int32_t wrote = results[ticket * 2], synced = results[ticket * 2 + 1];
+  results.erase(ticket * 2);
+  results.erase(ticket * 2 + 1);
+  if (wrote < 0 || (size_t)wrote < len)
+    return wrote;
+  return synced < 0 ? synced : wrote;
+}
+
+/// Wait until every submitted request has finished
+void uring::wait_all() {
+  std::unique_lock<std::mutex> g(cq_lock);
+  if (reap(g, [&]() { return inflight == 0; }) != 0)
+    fprintf(stderr, "uring: could not wait for completions\n");
+}
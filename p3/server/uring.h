@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <sys/types.h>
+#include <unordered_map>
+
+/// uring is a minimal io_uring instance, talking to the kernel through the raw
+/// system calls (so that it doesn't need liburing).  It only knows how to do
+/// what the log needs: write a buffer and then sync the file, as two linked
+/// requests.  Submitting and waiting are separate, so that a caller can submit
+/// while holding its own lock, and wait after releasing it.
+///
+/// NB: Submissions must be serialized by the caller, but any number of threads
+///     may wait at once.  Whichever thread is in the kernel collects the
+///     completions for all of them.
+class uring {
+public:
+  /// Set up a ring.  If the kernel doesn't support io_uring (or it is blocked),
+  /// ok() reports false, and the caller should use ordinary system calls.
+  ///
+  /// @param entries The number of submission queue entries
+  uring(unsigned entries = 8);
+
+  /// Unmap the rings and close the ring's file descriptor
+  ~uring();
+
+  /// Report whether the ring was set up
+  bool ok() const { return ring_fd >= 0; }
+
+  /// Submit a write of a buffer to a position in a file, followed by an
+  /// fdatasync() of the file.  The write waits for everything submitted before
+  /// it to finish, so writes to the same blocks land in submission order.
+  ///
+  /// @param fd   The file descriptor
+  /// @param data The bytes to write, which must not change until wait()
+  /// @param len  The number of bytes
+  /// @param off  The position in the file
+  ///
+  /// @return A ticket for wait(), or 0 if the requests couldn't be submitted
+  uint64_t submit_write_sync(int fd, const uint8_t *data, size_t len,
+                             off_t off);
+
+  /// Wait for a write and sync to finish
+  ///
+  /// @param ticket The ticket from submit_write_sync()
+  /// @param len    The number of bytes that were to be written
+  ///
+  /// @return The number of bytes written (which may be short, in which case
+  ///         the file was not synced), or -errno on failure
+  ssize_t wait(uint64_t ticket, size_t len);
+
+  /// Wait until every submitted request has finished
+  void wait_all();
+
+private:
+  /// Queue one submission queue entry
+  ///
+  /// @param op    The operation (IORING_OP_*)
+  /// @param fd    The file descriptor
+  /// @param data  The buffer (or nullptr)
+  /// @param len   The buffer's length
+  /// @param off   The position in the file
+  /// @param flags The entry's flags (IOSQE_*)
+  /// @param extra The operation's flags (e.g., IORING_FSYNC_DATASYNC)
+  /// @param tag   The value to find in the completion
+  void push(uint8_t op, int fd, const void *data, size_t len, off_t off,
+            uint8_t flags, uint32_t extra, uint64_t tag);
+
+  /// Collect completions until a condition holds.  The caller holds cq_lock.
+  ///
+  /// @param g    The caller's hold on cq_lock
+  /// @param done The condition
+  ///
+  /// @return 0, or -errno if waiting in the kernel failed
+  int reap(std::unique_lock<std::mutex> &g, std::function<bool()> done);
+
+  int ring_fd = -1;              // The ring, from io_uring_setup
+  void *sq_map = nullptr;        // The submission queue ring
+  size_t sq_map_len = 0;         // Its length
+  void *cq_map = nullptr;        // The completion queue ring (maybe sq_map)
+  size_t cq_map_len = 0;         // Its length
+  void *sqe_map = nullptr;       // The submission queue entries
+  size_t sqe_map_len = 0;        // Their length
+  unsigned *sq_tail = nullptr;   // The submission queue's tail
+  unsigned *sq_mask = nullptr;   // The submission queue's index mask
+  unsigned *sq_array = nullptr;  // The submission queue's entry indices
+  unsigned *cq_head = nullptr;   // The completion queue's head
+  unsigned *cq_tail = nullptr;   // The completion queue's tail
+  unsigned *cq_mask = nullptr;   // The completion queue's index mask
+  void *cqes = nullptr;          // The completion queue's entries
+  unsigned cq_entries = 0;       // The completion queue's size
+
+  std::mutex cq_lock;            // Protects everything below
+  std::condition_variable reaped; // Signals each batch of completions
+  bool reaping = false;          // Is a thread waiting in the kernel?
+  unsigned inflight = 0;         // Requests submitted but not yet collected
+  uint64_t tickets = 0;          // The last ticket handed out
+  std::unordered_map<uint64_t, int32_t> results; // Results, by request tag
+};
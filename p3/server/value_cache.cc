@@ -0,0 +1,313 @@
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../common/err.h"
+
+#include "persist.h"
+#include "value_cache.h"
+
+using namespace std;
+
+/// The budget that value_cache_factory() uses
+static size_t config_bytes = 0;
+
+/// Close the file
+value_log_file::~value_log_file() {
+  if (fd >= 0)
+    close(fd);
+}
+
+/// Construct a cache
+///
+/// @param limit    The bytes of values to keep in memory (0 = no limit)
+/// @param log_file The name of the value log
+value_cache::value_cache(size_t limit, const string &log_file)
+    : limit(limit), log_name(log_file) {
+  // NB: Everything in the value log is also in the snapshot and the log
+  //     segments, so the value log starts empty every time
+  if (enabled()) {
+    lock_guard<mutex> g(lock);
+    open_log();
+  }
+}
+
+/// Open a new, empty generation of the value log.  The caller holds lock.
+void value_cache::open_log() {
+  // The file is unlinked first, so that the old generation lives on (without
+  // a name) for as long as something refers to it
+  unlink(log_name.c_str());
+  log = make_shared<value_log_file>();
+  log->fd = open(log_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (log->fd < 0)
+    log->fd = err(-1, "value_cache: could not open value log ",
+                  log_name.c_str());
+}
+
+/// Find a key's slot.  The caller holds lock.
+///
+/// @param key The key
+///
+/// @return The slot, or -1 if the key isn't tracked
+long value_cache::find(const string &key) {
+  auto it = slot_of.find(key);
+  return it == slot_of.end() ? -1 : (long)it->second;
+}
+
+/// Charge a value that was just put into the map
+///
+/// @param key     The key
+/// @param len     The size of the value
+/// @param changed Is this a new value (rather than one read back from disk)?
+void value_cache::charge(const string &key, size_t len, bool changed) {
+  if (!enabled())
+    return;
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s < 0) {
+    if (free_slots.empty()) {
+      s = clock.size();
+      clock.emplace_back();
+    } else {
+      s = free_slots.back();
+      free_slots.pop_back();
+    }
+    clock[s].key = key;
+    slot_of[key] = s;
+  }
+  entry &e = clock[s];
+  resident -= e.bytes;
+  if (e.evicting)
+    pending -= e.bytes;
+  e.bytes = len;
+  resident += e.bytes;
+  e.ref = true;
+  e.evicting = false;
+  if (changed) {
+    // Neither the snapshot nor the value log has this value yet
+    e.changed = gen;
+    e.loc = location();
+  } else {
+    ++faults;
+  }
+}
+
+/// Stop tracking a key that was removed from the map
+///
+/// @param key The key
+void value_cache::forget(const string &key) {
+  if (!enabled())
+    return;
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s < 0)
+    return;
+  entry &e = clock[s];
+  resident -= e.bytes;
+  if (e.evicting)
+    pending -= e.bytes;
+  slot_of.erase(key);
+  e = entry();
+  free_slots.push_back(s);
+}
+
+/// Note that a value was read
+///
+/// @param key The key
+void value_cache::touch(const string &key) {
+  if (!enabled())
+    return;
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s >= 0)
+    clock[s].ref = true;
+}
+
+/// Pick values to evict until the values in memory would fit in the budget
+///
+/// @return The keys whose values should be evicted
+vector<string> value_cache::pick_victims() {
+  vector<string> victims;
+  if (!enabled())
+    return victims;
+  lock_guard<mutex> g(lock);
+  // Values that are already on disk, or already picked, have no bytes to
+  // give.  If the values still in memory can't cover the overage, a second
+  // turn of the hand finds every one of them (the first only clears their
+  // reference bits), so there's no point in a third.
+  for (size_t steps = 0;
+       resident - pending > limit && !clock.empty() && steps < 2 * clock.size();
+       ++steps) {
+    entry &e = clock[hand];
+    hand = (hand + 1) % clock.size();
+    if (e.key.empty() || e.bytes == 0 || e.evicting)
+      continue;
+    if (e.ref) {
+      e.ref = false;
+      continue;
+    }
+    e.evicting = true;
+    pending += e.bytes;
+    victims.push_back(e.key);
+  }
+  return victims;
+}
+
+/// Give up on evicting a value that pick_victims() chose
+///
+/// @param key The key
+void value_cache::cancel(const string &key) {
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s >= 0 && clock[s].evicting) {
+    clock[s].evicting = false;
+    pending -= clock[s].bytes;
+  }
+}
+
+/// Make sure that a value which is waiting to be evicted is on disk
+///
+/// @param key The key
+/// @param val The value
+///
+/// @return true if the value is on disk and can be freed
+bool value_cache::evict(const string &key, const vector<uint8_t> &val) {
+  shared_ptr<value_log_file> file;
+  {
+    lock_guard<mutex> g(lock);
+    long s = find(key);
+    if (s < 0 || !clock[s].evicting)
+      return false; // Used (or removed) since it was picked
+    entry &e = clock[s];
+    if (e.changed == 0 || e.loc.file != nullptr) {
+      // A copy is already on disk, so there is nothing to write
+      e.evicting = false;
+      pending -= e.bytes;
+      resident -= e.bytes;
+      e.bytes = 0;
+      ++evictions;
+      return true;
+    }
+    file = log;
+  }
+  // NB: The value log is append-only, so an atomic add reserves the room and
+  //     the write needs no lock of ours; the value itself is safe because
+  //     the caller has its bucket locked
+  uint64_t off = file->end.fetch_add(val.size());
+  size_t done = 0;
+  while (file->fd >= 0 && done < val.size()) {
+    ssize_t n = pwrite(file->fd, val.data() + done, val.size() - done,
+                       off + done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  uint32_t crc = crc32c(0, val.data(), val.size());
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s < 0)
+    return false;
+  entry &e = clock[s];
+  e.evicting = false;
+  pending -= e.bytes;
+  if (done < val.size())
+    return err(false, "value_cache: could not write to the value log");
+  resident -= e.bytes;
+  e.bytes = 0;
+  ++evictions;
+  ++writes;
+  // If a snapshot was installed while we wrote, it has the value already
+  if (e.changed != 0)
+    e.loc = {file, off, val.size(), crc};
+  return true;
+}
+
+/// Find an evicted value in the value log
+///
+/// @param key The key
+/// @param loc Set to the value's location
+///
+/// @return true if the value is in the value log
+bool value_cache::locate(const string &key, location &loc) {
+  if (!enabled())
+    return false;
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s < 0 || clock[s].loc.file == nullptr)
+    return false;
+  loc = clock[s].loc;
+  return true;
+}
+
+/// Read a value from the value log, checking it against its CRC
+///
+/// @param loc The value's location, from locate()
+/// @param val Set to the value
+///
+/// @return true if the value was read intact
+bool value_cache::read(const location &loc, vector<uint8_t> &val) {
+  val.resize(loc.len);
+  size_t done = 0;
+  while (done < loc.len) {
+    ssize_t n = pread(loc.file->fd, val.data() + done, loc.len - done,
+                      loc.off + done);
+    if (n <= 0)
+      return err(false, "value_cache: could not read from the value log");
+    done += n;
+  }
+  if (crc32c(0, val.data(), val.size()) != loc.crc)
+    return err(false, "value_cache: bad checksum in the value log");
+  return true;
+}
+
+/// Start a new generation of the value log, for a snapshot
+///
+/// @return The number of the generation that the snapshot includes
+uint64_t value_cache::cut() {
+  if (!enabled())
+    return 0;
+  lock_guard<mutex> g(lock);
+  if (log->end > 0)
+    open_log();
+  return gen++;
+}
+
+/// Note that a snapshot of generation `cut_gen` is now the latest one
+///
+/// @param cut_gen The value returned by cut()
+void value_cache::snapshotted(uint64_t cut_gen) {
+  if (!enabled())
+    return;
+  lock_guard<mutex> g(lock);
+  // Dropping the locations releases the old generations of the value log
+  for (auto &e : clock) {
+    if (e.changed != 0 && e.changed <= cut_gen) {
+      e.changed = 0;
+      e.loc = location();
+    }
+  }
+}
+
+/// Get a snapshot of the counters
+value_cache::stats_t value_cache::stats() {
+  lock_guard<mutex> g(lock);
+  return {resident, evictions, writes, faults};
+}
+
+/// Configure the budget of the value_cache that storage_factory() gives the
+/// kv_store
+///
+/// @param bytes The bytes of values to keep in memory (0 = no limit)
+void value_cache_config(size_t bytes) { config_bytes = bytes; }
+
+/// Make a value_cache according to value_cache_config()
+///
+/// @param log_file The name of the value log
+///
+/// @return A new value_cache
+value_cache *value_cache_factory(const string &log_file) {
+  return new value_cache(config_bytes, log_file);
+}
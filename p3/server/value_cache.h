@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// One generation of the value log: an append-only file of evicted values.  A
+/// new generation starts at each snapshot, and the old one is closed (and,
+/// having been unlinked already, deleted) once nothing refers to it.
+struct value_log_file {
+  int fd = -1;                  // The file
+  std::atomic<uint64_t> end{0}; // The next free byte
+
+  /// Close the file
+  ~value_log_file();
+};
+
+/// value_cache keeps the values of the kv_store within a memory budget, so that
+/// the data set can be much bigger than RAM.  Every key stays in the kv_store,
+/// but only the values that are in use are kept there: when the values in
+/// memory add up to more than the budget, the CLOCK algorithm (an
+/// approximation of LRU) picks values to evict, and the kv_store is left
+/// holding an empty value in their place.  The cache remembers where each
+/// evicted value is on disk: in the latest snapshot's K/V table, if the value
+/// hasn't changed since the snapshot was taken, or else in the value log, where
+/// the value is appended when it is evicted.
+///
+/// The charge/forget/evict/locate methods are meant to be called from the
+/// kv_store's callbacks, while the entry's bucket is locked, so that the cache
+/// always agrees with the map about each key.  The cache's lock only guards its
+/// own bookkeeping: it is not held while a value is written to the value log,
+/// and the cache never reaches into the kv_store.
+class value_cache {
+public:
+  /// Where an evicted value is in the value log
+  struct location {
+    std::shared_ptr<value_log_file> file; // The log (nullptr = not in it)
+    uint64_t off = 0;                     // The value's position
+    uint64_t len = 0;                     // The value's length
+    uint32_t crc = 0;                     // The value's CRC32C
+  };
+
+  /// Counters describing the cache's work
+  struct stats_t {
+    size_t resident;  // Bytes of values in memory
+    size_t evictions; // Values evicted from memory
+    size_t writes;    // Evicted values appended to the value log
+    size_t faults;    // Values read back from disk
+  };
+
+  /// Construct a cache
+  ///
+  /// @param limit    The bytes of values to keep in memory (0 = no limit)
+  /// @param log_file The name of the value log
+  value_cache(size_t limit, const std::string &log_file);
+
+  /// Report whether the cache does anything
+  bool enabled() const { return limit > 0; }
+
+  /// Charge a value that was just put into the map
+  ///
+  /// @param key     The key
+  /// @param len     The size of the value
+  /// @param changed Is this a new value (rather than one read back from disk)?
+  void charge(const std::string &key, size_t len, bool changed);
+
+  /// Stop tracking a key that was removed from the map
+  ///
+  /// @param key The key
+  void forget(const std::string &key);
+
+  /// Note that a value was read, so that it isn't evicted soon
+  ///
+  /// @param key The key
+  void touch(const std::string &key);
+
+  /// Pick values to evict until the values in memory would fit in the budget.
+  /// They stay charged until they are evicted.
+  ///
+  /// @return The keys whose values should be evicted
+  std::vector<std::string> pick_victims();
+
+  /// Give up on evicting a value that pick_victims() chose
+  ///
+  /// @param key The key
+  void cancel(const std::string &key);
+
+  /// Make sure that a value which is waiting to be evicted is on disk,
+  /// appending it to the value log if it isn't.  The caller frees the value if
+  /// this returns true.
+  ///
+  /// @param key The key
+  /// @param val The value
+  ///
+  /// @return true if the value is on disk and can be freed
+  bool evict(const std::string &key, const std::vector<uint8_t> &val);
+
+  /// Find an evicted value in the value log
+  ///
+  /// @param key The key
+  /// @param loc Set to the value's location
+  ///
+  /// @return true if the value is in the value log (otherwise, it is in the
+  ///         latest snapshot)
+  bool locate(const std::string &key, location &loc);
+
+  /// Read a value from the value log, checking it against its CRC
+  ///
+  /// @param loc The value's location, from locate()
+  /// @param val Set to the value
+  ///
+  /// @return true if the value was read intact
+  bool read(const location &loc, std::vector<uint8_t> &val);
+
+  /// Start a new generation of the value log, for a snapshot.  Call this
+  /// before the log is cut for the snapshot: a change is logged before it is
+  /// charged, so the snapshot then has every value changed before this call.
+  ///
+  /// @return The number of the generation that the snapshot includes
+  uint64_t cut();
+
+  /// Note that a snapshot of generation `cut_gen` is now the latest one, so
+  /// that values which haven't changed since are read from it, and the value
+  /// log generations before it can be deleted
+  ///
+  /// @param cut_gen The value returned by cut()
+  void snapshotted(uint64_t cut_gen);
+
+  /// Get a snapshot of the counters
+  stats_t stats();
+
+private:
+  /// One key that the cache tracks
+  struct entry {
+    std::string key;       // The key ("" if this slot is free)
+    size_t bytes = 0;      // The size of the value, if it is in memory
+    bool ref = false;      // Used since the hand last passed?
+    bool evicting = false; // Chosen by pick_victims(), not yet evicted
+    uint64_t changed = 0;  // Generation of the last change (0 = the latest
+                           // snapshot has the value)
+    location loc;          // The value's copy in the value log, if any
+  };
+
+  /// Find a key's slot, or -1.  The caller holds lock.
+  long find(const std::string &key);
+
+  /// Open a new, empty generation of the value log.  The caller holds lock.
+  void open_log();
+
+  const size_t limit;                          // The budget, in bytes
+  const std::string log_name;                  // The value log's file name
+  std::mutex lock;                             // Protects everything below
+  std::shared_ptr<value_log_file> log;         // The current value log
+  uint64_t gen = 1;                            // The current generation
+  std::vector<entry> clock;                    // The clock's slots
+  std::vector<size_t> free_slots;              // Unused slots in clock
+  std::unordered_map<std::string, size_t> slot_of; // Key to slot
+  size_t hand = 0;                             // The clock hand
+  size_t resident = 0;                         // Bytes of values in memory
+  size_t pending = 0;                          // Bytes of evicting values
+  size_t evictions = 0, writes = 0, faults = 0; // See stats_t
+};
+
+/// Configure the budget of the value_cache that storage_factory() gives the
+/// kv_store.  This must be called before storage_factory().  By default there
+/// is no budget, and every value stays in memory.
+///
+/// @param bytes The bytes of values to keep in memory (0 = no limit)
+void value_cache_config(size_t bytes);
+
+/// Make a value_cache according to value_cache_config()
+///
+/// @param log_file The name of the value log
+///
+/// @return A new value_cache
+value_cache *value_cache_factory(const std::string &log_file);
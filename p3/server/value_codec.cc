@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "value_codec.h"
+
+using namespace std;
+
+/// The LZ77 codec is a simple byte-oriented one, in the style of LZ4, which
+/// trades some compression for speed.  A compressed value is a series of
+/// sequences, each of which is:
+/// - A 1-byte token: the high 4 bits are the number of literals, and the low 4
+///   bits are the length of the match, minus LZ_MIN_MATCH.  A field of 15 means
+///   that the rest of the number follows, in bytes that are added to it, up to
+///   and including the first one that isn't 255.
+/// - The rest of the number of literals, if any
+/// - The literals
+/// - The 2-byte distance back to the start of the match
+/// - The rest of the length of the match, if any
+///
+/// The last sequence stops after its literals.
+
+/// The shortest match that the codec encodes
+static const size_t LZ_MIN_MATCH = 4;
+
+/// The farthest back that a match can start
+static const size_t LZ_MAX_OFFSET = 65535;
+
+/// The number of bits in the hash of the 4 bytes at a position
+static const int LZ_HASH_BITS = 12;
+
+/// The smallest value that pack_value() compresses (0 = none)
+static size_t config_min = 0;
+
+/// Counters for value_codec_stats()
+static atomic<size_t> packed_count{0}, lz_count{0}, bytes_in{0}, bytes_out{0};
+
+/// Load 4 bytes, which may be unaligned
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/// Hash the 4 bytes at a position, to find earlier positions that match it
+static size_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/// Append the rest of a number that didn't fit in its 4 bits of a token
+///
+/// @param out The buffer
+/// @param len The rest of the number
+static void put_len(vector<uint8_t> &out, size_t len) {
+  for (; len >= 255; len -= 255)
+    out.push_back(255);
+  out.push_back(len);
+}
+
+/// Append one sequence
+///
+/// @param out  The buffer
+/// @param lit  The literals
+/// @param nlit The number of literals
+/// @param off  The distance back to the match
+/// @param mlen The length of the match (0 for the last sequence)
+static void put_seq(vector<uint8_t> &out, const uint8_t *lit, size_t nlit,
+                    size_t off, size_t mlen) {
+  size_t m = mlen > 0 ? mlen - LZ_MIN_MATCH : 0;
+  out.push_back((min<size_t>(nlit, 15) << 4) | min<size_t>(m, 15));
+  if (nlit >= 15)
+    put_len(out, nlit - 15);
+  out.insert(out.end(), lit, lit + nlit);
+  if (mlen == 0)
+    return;
+  out.push_back(off & 0xff);
+  out.push_back(off >> 8);
+  if (m >= 15)
+    put_len(out, m - 15);
+}
+
+/// Compress bytes, giving up as soon as the output gets too big
+///
+/// @param in    The bytes
+/// @param n     The number of bytes
+/// @param out   The buffer to append to
+/// @param limit The most bytes to append
+///
+/// @return true if the compressed bytes fit in `limit`
+static bool lz_compress(const uint8_t *in, size_t n, vector<uint8_t> &out,
+                        size_t limit) {
+  size_t start = out.size();
+  // Each slot holds the last position with that hash, plus one (0 = none)
+  vector<uint32_t> table(1 << LZ_HASH_BITS, 0);
+  size_t anchor = 0, i = 0;
+  while (n >= LZ_MIN_MATCH && i <= n - LZ_MIN_MATCH) {
+    uint32_t v = read32(in + i);
+    size_t h = hash4(v);
+    size_t cand = table[h];
+    table[h] = i + 1;
+    if (cand == 0 || i + 1 - cand > LZ_MAX_OFFSET ||
+        read32(in + cand - 1) != v) {
+      // The longer we go without a match, the faster we skip ahead, so that
+      // data that doesn't compress doesn't cost much
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+    --cand;
+    size_t m = LZ_MIN_MATCH;
+    while (i + m < n && in[cand + m] == in[i + m])
+      ++m;
+    put_seq(out, in + anchor, i - anchor, i - cand, m);
+    if (out.size() - start > limit)
+      return false;
+    i += m;
+    anchor = i;
+  }
+  put_seq(out, in + anchor, n - anchor, 0, 0);
+  return out.size() - start <= limit;
+}
+
+/// Decompress bytes into a buffer of the right size
+///
+/// @param in      The compressed bytes
+/// @param n       The number of compressed bytes
+/// @param out     The buffer
+/// @param out_len The size of the decompressed bytes
+///
+/// @return true if the compressed bytes were well formed, and filled the buffer
+///         exactly
+static bool lz_decompress(const uint8_t *in, size_t n, uint8_t *out,
+                          size_t out_len) {
+  size_t ip = 0, op = 0;
+  auto get_len = [&](size_t &len) {
+    uint8_t b;
+    do {
+      if (ip >= n)
+        return false;
+      b = in[ip++];
+      len += b;
+    } while (b == 255);
+    return true;
+  };
+  while (ip < n) {
+    uint8_t token = in[ip++];
+    size_t nlit = token >> 4;
+    if (nlit == 15 && !get_len(nlit))
+      return false;
+    if (nlit > n - ip || nlit > out_len - op)
+      return false;
+    memcpy(out + op, in + ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == n)
+      break;
+    if (n - ip < 2)
+      return false;
+    size_t off = in[ip] | (in[ip + 1] << 8);
+    ip += 2;
+    size_t m = token & 15;
+    if (m == 15 && !get_len(m))
+      return false;
+    m += LZ_MIN_MATCH;
+    if (off == 0 || off > op || m > out_len - op)
+      return false;
+    // NB: A match may overlap the bytes it produces (e.g., a run of one byte
+    //     has a distance of 1), so it can only be copied in one go if it
+    //     doesn't
+    if (off >= m) {
+      memcpy(out + op, out + op - off, m);
+      op += m;
+    } else {
+      for (size_t k = 0; k < m; ++k, ++op)
+        out[op] = out[op - off];
+    }
+  }
+  return op == out_len;
+}
+
+/// Configure the smallest value that pack_value() tries to compress
+///
+/// @param min_bytes The threshold (0 = never compress)
+void value_codec_config(size_t min_bytes) { config_min = min_bytes; }
+
+/// Pack a value without compressing it
+///
+/// @param val The value
+///
+/// @return The packed value
+vector<uint8_t> pack_raw(const vector<uint8_t> &val) {
+  vector<uint8_t> out;
+  out.reserve(val.size() + 1);
+  out.push_back(VALUE_RAW);
+  out.insert(out.end(), val.begin(), val.end());
+  return out;
+}
+
+/// Pack a value, compressing it if it is big enough and compresses well enough
+///
+/// @param val The value
+///
+/// @return The packed value
+vector<uint8_t> pack_value(const vector<uint8_t> &val) {
+  vector<uint8_t> out;
+  bool lz = config_min > 0 && val.size() >= config_min;
+  // If the start of a big value doesn't compress, the rest probably won't
+  if (lz && val.size() > 2 * VALUE_COMPRESS_SAMPLE) {
+    size_t s = VALUE_COMPRESS_SAMPLE;
+    lz = lz_compress(val.data(), s, out, s - s / VALUE_COMPRESS_SAVING);
+    out.clear();
+  }
+  if (lz) {
+    out.reserve(val.size());
+    out.push_back(VALUE_LZ);
+    uint32_t len = val.size();
+    out.insert(out.end(), (uint8_t *)&len, (uint8_t *)&len + sizeof(len));
+    size_t limit = val.size() - val.size() / VALUE_COMPRESS_SAVING;
+    lz = lz_compress(val.data(), val.size(), out, limit);
+  }
+  if (lz) {
+    out.shrink_to_fit();
+    ++lz_count;
+  } else {
+    out = pack_raw(val);
+  }
+  ++packed_count;
+  bytes_in += val.size();
+  bytes_out += out.size();
+  return out;
+}
+
+/// Unpack a value
+///
+/// @param packed The packed value
+/// @param val    Set to the value
+///
+/// @return true if the packed value was well formed
+bool unpack_value(const vector<uint8_t> &packed, vector<uint8_t> &val) {
+  if (packed.empty())
+    return false;
+  if (packed[0] == VALUE_RAW) {
+    val.assign(packed.begin() + 1, packed.end());
+    return true;
+  }
+  uint32_t len;
+  if (packed[0] != VALUE_LZ || packed.size() < 1 + sizeof(len))
+    return false;
+  memcpy(&len, packed.data() + 1, sizeof(len));
+  val.resize(len);
+  size_t hdr = 1 + sizeof(len);
+  return lz_decompress(packed.data() + hdr, packed.size() - hdr, val.data(),
+                       len);
+}
+
+/// Describe how many values pack_value() has compressed, and how well
+string value_codec_stats() {
+  size_t in = bytes_in, out = bytes_out;
+  ostringstream s;
+  s << lz_count << " of " << packed_count << " values compressed, " << in
+    << " bytes stored as " << out;
+  if (out > 0)
+    s << " (ratio " << (double)in / out << ")";
+  return s.str();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// The kv_store keeps each value in a packed form that starts with a 1-byte
+/// code for the codec the value was stored with, so that every entry can be
+/// compressed (or not) on its own merits.  The packed form is what goes into
+/// the log and into snapshots, too, so a value is compressed once, when it
+/// arrives, and decompressed when it is read.
+///
+/// Packed value format:
+/// - 1-byte codec (VALUE_RAW or VALUE_LZ)
+/// - For VALUE_RAW, the bytes of the value
+/// - For VALUE_LZ, the 4-byte length of the value, and then its LZ77
+///   sequences (see value_codec.cc)
+
+/// The code for a value that is stored as it is
+const uint8_t VALUE_RAW = 0;
+
+/// The code for a value that is compressed with the built-in LZ77 codec
+const uint8_t VALUE_LZ = 1;
+
+/// A value is only stored compressed if that saves at least 1/Nth of its size
+const size_t VALUE_COMPRESS_SAVING = 8;
+
+/// Before a big value is compressed, a sample of this many bytes from its start
+/// is tried, so that incompressible values (e.g., images) are given up on
+/// cheaply
+const size_t VALUE_COMPRESS_SAMPLE = 4096;
+
+/// Configure the smallest value that pack_value() tries to compress.  By
+/// default, no value is compressed.
+///
+/// @param min_bytes The threshold (0 = never compress)
+void value_codec_config(size_t min_bytes);
+
+/// Pack a value, compressing it if it is big enough and compresses well enough
+///
+/// @param val The value
+///
+/// @return The packed value
+std::vector<uint8_t> pack_value(const std::vector<uint8_t> &val);
+
+/// Pack a value without compressing it
+///
+/// @param val The value
+///
+/// @return The packed value
+std::vector<uint8_t> pack_raw(const std::vector<uint8_t> &val);
+
+/// Unpack a value
+///
+/// @param packed The packed value
+/// @param val    Set to the value
+///
+/// @return true if the packed value was well formed
+bool unpack_value(const std::vector<uint8_t> &packed,
+                  std::vector<uint8_t> &val);
+
+/// Describe how many values pack_value() has compressed, and how well
+std::string value_codec_stats();
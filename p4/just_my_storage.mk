@@ -11,7 +11,7 @@ CLIENT_PROVIDED = client requests crypto err file net my_crypto
 
 # Names for building the server
 SERVER_MAIN     = server
-SERVER_CXX      = my_storage
+SERVER_CXX      = my_storage kv_budget ttl_wheel
 SERVER_COMMON   = 
 SERVER_PROVIDED = server responses parsing persist concurrenthashmap_factories \
                   crypto err file net my_pool my_crypto my_quota_tracker \
@@ -12,7 +12,7 @@ CLIENT_PROVIDED = client requests crypto err file net my_crypto
 
 # Names for building the server
 SERVER_MAIN     = server
-SERVER_CXX      = my_storage my_quota_tracker
+SERVER_CXX      = my_storage kv_budget ttl_wheel my_quota_tracker
 SERVER_COMMON   = 
 SERVER_PROVIDED = server responses parsing persist concurrenthashmap_factories \
                   my_mru crypto err file net my_pool my_crypto helpers
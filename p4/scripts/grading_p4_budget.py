@@ -0,0 +1,142 @@
+#!/usr/bin/python3
+import cse303
+import re
+
+# Configure constants and users
+cse303.indentation = 80
+cse303.verbose = cse303.check_args_verbose()
+alice = cse303.UserConfig("alice", "alice_is_awesome")
+makefiles = ["Makefile"]
+
+# Four entries of 400KB don't fit in a 1MB budget.  Each value is a different
+# byte, so that mixing them up shows.
+budget_mb = "1"
+keys = ["k1", "k2", "k3", "k4"]
+vals = {}
+for i, k in enumerate(keys):
+    vals[k] = k + ".val"
+    cse303.build_file_as(vals[k], str(i + 1) * 400000)
+
+# Create objects with server and client configuration.  The quotas are big
+# enough that they don't get in the way.
+server = cse303.ServerConfig("./obj64/server.exe", "9999", "rsa", "company.dir", "4", "1024", "60", "100000000", "100000000", "10000", "8")
+client = cse303.ClientConfig("./obj64/client.exe", "localhost", "9999", "localhost.pub")
+
+# Check if we should use solution server or client
+cse303.override_exe(server, client)
+
+def start_server(msg, mode, expects):
+    """Start the server with a K/V memory budget, and check the lines it prints
+    before it is ready"""
+    return cse303.do_cmd_a(msg, [
+        "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")"] +
+        expects, server.launchcmd() + ["-m", budget_mb, "-e", mode])
+
+def stop_server():
+    """Stop the server, and return the budget's counters from the statistics it
+    prints as it shuts down"""
+    cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
+    cse303.after(server.pid)
+    cse303.leftmsg("Waiting for server to shut down. Expect: 'Server terminated'")
+    stats = {}
+    res = ""
+    while res != "Server terminated":
+        res = server.pid.stdout.readline().decode("utf-8")
+        if res == "":
+            break
+        res = res.rstrip()
+        m = re.match(r"K/V budget: (\d+) bytes resident, (\d+) evictions \((\d+) dropped, (\d+) spilled to disk\), (\d+) reads from disk", res)
+        if m is not None:
+            stats = {"resident": int(m.group(1)), "evictions": int(m.group(2)),
+                     "drops": int(m.group(3)), "spills": int(m.group(4)),
+                     "faults": int(m.group(5))}
+    if res == "Server terminated":
+        cse303.okmsg()
+    else:
+        print("[" + cse303.red("ERR") + "]")
+    return stats
+
+def check_stat(stats, name, low, high):
+    """Check that one of the budget's counters is in a range"""
+    cse303.leftmsg("Checking the budget's " + name + " (expect " + str(low) + ".." + str(high) + ")")
+    if name in stats and low <= stats[name] <= high:
+        cse303.okmsg()
+    else:
+        print("["+cse303.red("ERR: " + str(stats.get(name)))+"]")
+
+def check_key(k):
+    """Get a key, and compare its value to the file it was set from"""
+    cse303.do_cmd("Checking key " + k + ".", "___OK___", client.kvG(alice, k), server)
+    cse303.check_file_result(vals[k], k)
+
+def clean_files():
+    """Delete the data file and the spill file"""
+    cse303.clean_common_files(server, client) # .pub, .pri, .dir files
+    cse303.delfile(server.dirfile + ".spill")
+
+# Set up a clean slate before getting started
+cse303.line()
+print("Getting ready to run tests")
+cse303.line()
+cse303.makeclean() # make clean
+clean_files()
+cse303.killprocs()
+cse303.build(makefiles)
+
+print()
+cse303.line()
+print("Test #1: In drop mode, the least recently used entries are deleted")
+cse303.line()
+server.pid = start_server("Starting server:", "drop", [
+    "Generating RSA keys as ("+server.keyfile+".pub, "+server.keyfile+".pri)",
+    "File not found: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "___OK___", client.reg(alice), server)
+cse303.after(server.pid) # need an extra cleanup to handle the KEY that was sent by first REG
+for k in keys:
+    cse303.do_cmd("Setting key " + k + ".", "___OK___", client.kvI(alice, k, vals[k]), server)
+cse303.do_cmd("Checking key k1.", "ERR_KEY", client.kvG(alice, "k1"), server)
+cse303.do_cmd("Checking key k2.", "ERR_KEY", client.kvG(alice, "k2"), server)
+check_key("k3")
+check_key("k4")
+stats = stop_server()
+check_stat(stats, "resident", 1, 1048576)
+check_stat(stats, "drops", 2, 2)
+check_stat(stats, "spills", 0, 0)
+server.pid = start_server("Restarting server:", "drop", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k1.", "ERR_KEY", client.kvG(alice, "k1"), server) # the drop was logged
+check_key("k4")
+stop_server()
+
+print()
+cse303.line()
+print("Test #2: In disk mode, evicted values are spilled, and read back")
+cse303.line()
+clean_files()
+server.pid = start_server("Starting server:", "disk", [
+    "Generating RSA keys as ("+server.keyfile+".pub, "+server.keyfile+".pri)",
+    "File not found: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "___OK___", client.reg(alice), server)
+cse303.after(server.pid) # need an extra cleanup to handle the KEY that was sent by first REG
+for k in keys:
+    cse303.do_cmd("Setting key " + k + ".", "___OK___", client.kvI(alice, k, vals[k]), server)
+for k in keys:
+    check_key(k)
+stats = stop_server()
+check_stat(stats, "resident", 1, 1048576)
+check_stat(stats, "drops", 0, 0)
+check_stat(stats, "spills", 1, 100)
+check_stat(stats, "faults", 1, 100)
+server.pid = start_server("Restarting server:", "disk", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+for k in keys:
+    check_key(k)
+stop_server()
+
+clean_files()
+for f in vals.values():
+    cse303.delfile(f)
+
+print()
@@ -0,0 +1,116 @@
+#!/usr/bin/python3
+import cse303
+import time
+
+# Configure constants and users
+cse303.indentation = 80
+cse303.verbose = cse303.check_args_verbose()
+alice = cse303.UserConfig("alice", "alice_is_awesome")
+k1 = "k1"
+k1file = "common/err.h"
+k2 = "second_key"
+k2file1 = "server/storage.h"
+k2file2 = "common/net.h"
+k3 = "third_key"
+k3file = "server/server.cc"
+makefiles = ["Makefile"]
+
+# Every key lives for four seconds.  The wheel rounds up to a 100ms tick, so
+# the checks below stay half a second clear of a deadline.
+ttl_secs = "4"
+
+# Create objects with server and client configuration.  The quotas are big
+# enough that they don't get in the way.
+server = cse303.ServerConfig("./obj64/server.exe", "9999", "rsa", "company.dir", "4", "1024", "60", "100000000", "100000000", "10000", "8")
+client = cse303.ClientConfig("./obj64/client.exe", "localhost", "9999", "localhost.pub")
+
+# Check if we should use solution server or client
+cse303.override_exe(server, client)
+
+def start_server(msg, expects):
+    """Start the server with a time to live for K/V entries, and check the
+    lines it prints before it is ready"""
+    return cse303.do_cmd_a(msg, [
+        "Listening on port "+server.port+" using (key/data) = (rsa, "+server.dirfile+")"] +
+        expects, server.launchcmd() + ["-x", ttl_secs])
+
+def stop_server(stats):
+    """Stop the server, and check the expiry statistics it prints as it shuts
+    down"""
+    cse303.do_cmd("Stopping server.", "___OK___", client.bye(alice), server)
+    cse303.after(server.pid)
+    cse303.leftmsg("Waiting for server to shut down. Expect: '" + stats + "'")
+    seen = False
+    res = ""
+    while res != "Server terminated":
+        res = server.pid.stdout.readline().decode("utf-8")
+        if res == "":
+            break
+        res = res.rstrip()
+        seen = seen or res == stats
+    if seen and res == "Server terminated":
+        cse303.okmsg()
+    else:
+        print("[" + cse303.red("ERR") + "]")
+
+def check_key(key, file):
+    """Get a key, and compare its value to a file"""
+    cse303.do_cmd("Checking key " + key + ".", "___OK___", client.kvG(alice, key), server)
+    cse303.check_file_result(file, key)
+
+def sleep(secs):
+    """Let time pass on the server"""
+    cse303.leftmsg("Waiting " + str(secs) + " seconds")
+    time.sleep(secs)
+    cse303.okmsg()
+
+# Set up a clean slate before getting started
+cse303.line()
+print("Getting ready to run tests")
+cse303.line()
+cse303.makeclean() # make clean
+cse303.clean_common_files(server, client) # .pub, .pri, .dir files
+cse303.killprocs()
+cse303.build(makefiles)
+
+print()
+cse303.line()
+print("Test #1: Keys expire, and an upsert restarts the clock")
+cse303.line()
+server.pid = start_server("Starting server:", [
+    "Generating RSA keys as ("+server.keyfile+".pub, "+server.keyfile+".pri)",
+    "File not found: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Registering new user alice.", "___OK___", client.reg(alice), server)
+cse303.after(server.pid) # need an extra cleanup to handle the KEY that was sent by first REG
+cse303.do_cmd("Setting key k1.", "___OK___", client.kvI(alice, k1, k1file), server)
+check_key(k1, k1file)
+cse303.do_cmd("Setting key k2.", "___OK___", client.kvI(alice, k2, k2file1), server)
+sleep(2)
+cse303.do_cmd("Upserting key k2.", "OK_UPDATE", client.kvU(alice, k2, k2file2), server)
+sleep(2.5)
+cse303.do_cmd("Checking key k1.", "ERR_KEY", client.kvG(alice, k1), server)
+check_key(k2, k2file2) # would have expired without the upsert
+sleep(2)
+cse303.do_cmd("Checking key k2.", "ERR_KEY", client.kvG(alice, k2), server)
+cse303.do_cmd("Setting key k1 again.", "___OK___", client.kvI(alice, k1, k1file), server)
+cse303.do_cmd("Setting key k3.", "___OK___", client.kvI(alice, k3, k3file), server)
+cse303.do_cmd("Deleting key k1.", "___OK___", client.kvD(alice, k1), server)
+stop_server("K/V TTL: 2 keys expired, 1 waiting to expire")
+
+print()
+cse303.line()
+print("Test #2: Expired keys stay gone after a restart")
+cse303.line()
+server.pid = start_server("Restarting server:", ["Loaded: " + server.dirfile])
+cse303.waitfor(2)
+cse303.do_cmd("Checking key k1.", "ERR_KEY", client.kvG(alice, k1), server)
+cse303.do_cmd("Checking key k2.", "ERR_KEY", client.kvG(alice, k2), server)
+check_key(k3, k3file) # loaded keys get a fresh time to live
+sleep(2.5)
+cse303.do_cmd("Checking key k3.", "ERR_KEY", client.kvG(alice, k3), server)
+stop_server("K/V TTL: 1 keys expired, 0 waiting to expire")
+
+cse303.clean_common_files(server, client)
+
+print()
@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <iterator>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../common/err.h"
+
+#include "kv_budget.h"
+
+using namespace std;
+
+/// The budget that kv_budget_factory() uses
+static size_t config_bytes = 0;
+
+/// What kv_budget_factory()'s budgets do with evicted entries
+static kv_budget::mode config_mode = kv_budget::mode::drop;
+
+/// Construct a budget
+///
+/// @param limit      The number of bytes the kv_store may use (0 = no limit)
+/// @param how        What to do with evicted entries
+/// @param spill_file The file for values evicted to disk
+kv_budget::kv_budget(size_t limit, mode how, const string &spill_file)
+    : limit(limit), evict_mode(how) {
+  // NB: Spilled values are only a cache of what's in the main data file, so
+  //     the spill file starts empty every time
+  if (limit > 0 && how == mode::disk) {
+    spill_fd = open(spill_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (spill_fd < 0)
+      spill_fd = err(-1, "kv_budget: could not open spill file ",
+                     spill_file.c_str());
+  }
+}
+
+/// Close the spill file
+kv_budget::~kv_budget() {
+  if (spill_fd >= 0)
+    close(spill_fd);
+}
+
+/// Find a key's slot
+///
+/// @param key The key
+///
+/// @return The slot, or -1 if the key isn't tracked
+long kv_budget::find(const string &key) {
+  auto it = slot_of.find(key);
+  return it == slot_of.end() ? -1 : (long)it->second;
+}
+
+/// Find room for a value in the spill file: the smallest unused extent that
+/// fits, or else the end of the file
+///
+/// @param len The size of the value
+///
+/// @return The offset of the room
+uint64_t kv_budget::take_extent(uint64_t len) {
+  auto it = free_by_len.lower_bound(len);
+  if (it == free_by_len.end()) {
+    spill_end += len;
+    return spill_end - len;
+  }
+  uint64_t off = it->second, rest = it->first - len;
+  free_by_len.erase(it);
+  free_by_off.erase(off);
+  if (rest > 0) {
+    free_by_len.emplace(rest, off + len);
+    free_by_off.emplace(off + len, rest);
+  }
+  return off;
+}
+
+/// Give back a value's room in the spill file, merging it with the unused
+/// extents on either side
+///
+/// @param off The offset of the room
+/// @param len The size of the room
+void kv_budget::free_extent(uint64_t off, uint64_t len) {
+  if (len == 0)
+    return;
+  auto unlink = [&](map<uint64_t, uint64_t>::iterator i) {
+    auto r = free_by_len.equal_range(i->second);
+    for (auto j = r.first; j != r.second; ++j)
+      if (j->second == i->first) {
+        free_by_len.erase(j);
+        break;
+      }
+    return free_by_off.erase(i);
+  };
+  auto next = free_by_off.lower_bound(off);
+  if (next != free_by_off.end() && next->first == off + len) {
+    len += next->second;
+    next = unlink(next);
+  }
+  if (next != free_by_off.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == off) {
+      off = prev->first;
+      len += prev->second;
+      unlink(prev);
+    }
+  }
+  if (off + len < spill_end) {
+    free_by_len.emplace(len, off);
+    free_by_off.emplace(off, len);
+    return;
+  }
+  spill_end = off;
+  if (spill_fd >= 0 && ftruncate(spill_fd, spill_end) != 0)
+    cout << "kv_budget: could not truncate spill file" << endl;
+}
+
+/// Charge an entry that was just inserted or updated
+///
+/// @param key The key
+/// @param len The size of the new value
+void kv_budget::charge(const string &key, size_t len) {
+  if (!enabled())
+    return;
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s < 0) {
+    if (free_slots.empty()) {
+      s = clock.size();
+      clock.emplace_back();
+    } else {
+      s = free_slots.back();
+      free_slots.pop_back();
+    }
+    clock[s].key = key;
+    slot_of[key] = s;
+  }
+  entry &e = clock[s];
+  resident -= e.bytes;
+  if (e.evicting)
+    pending -= e.bytes;
+  e.bytes = key.size() + len + KV_ENTRY_OVERHEAD;
+  resident += e.bytes;
+  e.ref = true;
+  e.evicting = false;
+  if (e.spilled)
+    free_extent(e.spill_off, e.spill_len);
+  e.spilled = false;
+}
+
+/// Stop tracking an entry that was removed from the map
+///
+/// @param key The key
+void kv_budget::forget(const string &key) {
+  if (!enabled())
+    return;
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s < 0)
+    return;
+  entry &e = clock[s];
+  resident -= e.bytes;
+  if (e.evicting) {
+    pending -= e.bytes;
+    ++drops;
+  }
+  if (e.spilled)
+    free_extent(e.spill_off, e.spill_len);
+  slot_of.erase(key);
+  e = entry();
+  free_slots.push_back(s);
+}
+
+/// Note that an entry was read
+///
+/// @param key The key
+void kv_budget::touch(const string &key) {
+  if (!enabled())
+    return;
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s >= 0)
+    clock[s].ref = true;
+}
+
+/// Pick entries to evict until the kv_store would be back under budget
+///
+/// @return The keys to evict
+vector<string> kv_budget::pick_victims() {
+  vector<string> victims;
+  if (!enabled())
+    return victims;
+  lock_guard<mutex> g(lock);
+  // NB: Entries that are already on their way out, or (in disk mode) already
+  //     spilled, can't free anything.  If the rest can't cover the overage,
+  //     stop after the hand has gone around twice: once to clear reference
+  //     bits and once more to pick.
+  for (size_t steps = 0;
+       resident - pending > limit && !clock.empty() && steps < 2 * clock.size();
+       ++steps) {
+    entry &e = clock[hand];
+    hand = (hand + 1) % clock.size();
+    if (e.key.empty() || e.evicting)
+      continue;
+    // A spilled entry has nothing left to move to disk
+    if (e.spilled && evict_mode == mode::disk)
+      continue;
+    if (e.ref) {
+      e.ref = false;
+      continue;
+    }
+    e.evicting = true;
+    pending += e.bytes;
+    ++evictions;
+    victims.push_back(e.key);
+  }
+  return victims;
+}
+
+/// Give up on evicting an entry that pick_victims() chose
+///
+/// @param key The key
+void kv_budget::cancel(const string &key) {
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s >= 0 && clock[s].evicting) {
+    clock[s].evicting = false;
+    pending -= clock[s].bytes;
+  }
+}
+
+/// Write an entry's value to the spill file, if the entry is still waiting to
+/// be evicted
+///
+/// @param key The key
+/// @param val The value
+///
+/// @return true if the value was spilled and can be freed
+bool kv_budget::spill(const string &key, const vector<uint8_t> &val) {
+  uint64_t off;
+  {
+    lock_guard<mutex> g(lock);
+    long s = find(key);
+    if (s < 0 || !clock[s].evicting)
+      return false; // Used (or removed) since it was picked
+    off = take_extent(val.size());
+  }
+  // NB: The caller holds the entry's bucket lock, so the entry can't change
+  //     while we write without kv_budget's lock
+  size_t done = 0;
+  while (spill_fd >= 0 && done < val.size()) {
+    ssize_t n = pwrite(spill_fd, val.data() + done, val.size() - done, off + done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s < 0 || done < val.size())
+    free_extent(off, val.size());
+  if (s < 0)
+    return false;
+  entry &e = clock[s];
+  e.evicting = false;
+  pending -= e.bytes;
+  if (done < val.size())
+    return err(false, "kv_budget: could not write to spill file");
+  resident -= e.bytes;
+  e.bytes = key.size() + KV_ENTRY_OVERHEAD;
+  resident += e.bytes;
+  e.spilled = true;
+  e.spill_off = off;
+  e.spill_len = val.size();
+  ++spills;
+  return true;
+}
+
+/// Read a spilled value back from the spill file.  The caller must hold the
+/// entry's bucket lock.
+///
+/// @param key The key
+/// @param val Set to the value
+///
+/// @return true if the key was spilled and its value was read
+bool kv_budget::read_spilled(const string &key, vector<uint8_t> &val) {
+  uint64_t off, len;
+  {
+    lock_guard<mutex> g(lock);
+    long s = find(key);
+    if (s < 0 || !clock[s].spilled)
+      return false;
+    off = clock[s].spill_off;
+    len = clock[s].spill_len;
+    ++faults;
+  }
+  val.resize(len);
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(spill_fd, val.data() + done, len - done, off + done);
+    if (n <= 0)
+      return err(false, "kv_budget: could not read from spill file");
+    done += n;
+  }
+  return true;
+}
+
+/// Get the size of a spilled value.  The caller must hold the entry's bucket
+/// lock.
+///
+/// @param key The key
+/// @param len Set to the size of the value
+///
+/// @return true if the key was spilled
+bool kv_budget::spilled_size(const string &key, uint64_t &len) {
+  lock_guard<mutex> g(lock);
+  long s = find(key);
+  if (s < 0 || !clock[s].spilled)
+    return false;
+  len = clock[s].spill_len;
+  return true;
+}
+
+/// Copy a spilled value from the spill file to the end of another file.  The
+/// caller must hold the entry's bucket lock.
+///
+/// @param key The key
+/// @param out The file to copy into
+///
+/// @return true if the key was spilled and its value was copied
+bool kv_budget::copy_spilled(const string &key, FILE *out) {
+  uint64_t off, len;
+  {
+    lock_guard<mutex> g(lock);
+    long s = find(key);
+    if (s < 0 || !clock[s].spilled)
+      return false;
+    off = clock[s].spill_off;
+    len = clock[s].spill_len;
+  }
+  // NB: The value goes through in pieces, so a large one is never in memory
+  char buf[65536];
+  while (len > 0) {
+    ssize_t n = pread(spill_fd, buf, min<uint64_t>(len, sizeof(buf)), off);
+    if (n <= 0)
+      return err(false, "kv_budget: could not read from spill file");
+    if (fwrite(buf, 1, n, out) != (size_t)n)
+      return false;
+    off += n;
+    len -= n;
+  }
+  return true;
+}
+
+/// Get a snapshot of the counters
+kv_budget::stats_t kv_budget::stats() {
+  lock_guard<mutex> g(lock);
+  return {resident, evictions, drops, spills, faults};
+}
+
+/// Configure the memory budget that storage_factory() gives the kv_store
+///
+/// @param bytes The number of bytes the kv_store may use (0 = no limit)
+/// @param how   What to do with evicted entries
+void kv_budget_config(size_t bytes, kv_budget::mode how) {
+  config_bytes = bytes;
+  config_mode = how;
+}
+
+/// Make a kv_budget according to kv_budget_config()
+///
+/// @param spill_file The file for values evicted to disk
+///
+/// @return A new kv_budget
+kv_budget *kv_budget_factory(const string &spill_file) {
+  return new kv_budget(config_bytes, config_mode, spill_file);
+}
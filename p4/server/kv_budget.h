@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// The approximate number of bytes that the kv_store spends on each entry,
+/// beyond the bytes of its key and value: the list node, the std::string and
+/// std::vector headers, and their heap allocations.
+const size_t KV_ENTRY_OVERHEAD = 96;
+
+/// kv_budget keeps the kv_store within a memory budget.  It charges each entry
+/// for its key, its value and KV_ENTRY_OVERHEAD, and when the total goes over
+/// the budget it picks entries to evict with the CLOCK algorithm (an
+/// approximation of LRU: every access sets an entry's reference bit, and the
+/// clock hand clears bits until it finds an entry that hasn't been used since
+/// the last sweep).
+///
+/// Evicted entries are either dropped (the key is deleted) or moved to disk
+/// (the key stays in the map, but its value is written to a spill file and
+/// freed, and comes back on the next read).  A value's room in the spill file
+/// is reused once the value is read back, replaced or removed, and the file
+/// shrinks when the values at its end go.
+///
+/// The charge/forget/spill methods are meant to be called from the kv_store's
+/// callbacks, while the entry's bucket is locked, so that kv_budget always
+/// agrees with the map about each key.  Nothing in kv_budget calls back into
+/// the map, so holding its lock never means waiting for a bucket.
+class kv_budget {
+public:
+  /// What happens to an entry when it is evicted
+  enum class mode { drop, disk };
+
+  /// Counters describing the budget's work
+  struct stats_t {
+    size_t resident;  // Bytes currently charged to memory
+    size_t evictions; // Entries chosen for eviction
+    size_t drops;     // Entries deleted by eviction
+    size_t spills;    // Values written to the spill file
+    size_t faults;    // Values read back from the spill file
+  };
+
+  /// Construct a budget
+  ///
+  /// @param limit      The number of bytes the kv_store may use (0 = no limit)
+  /// @param how        What to do with evicted entries
+  /// @param spill_file The file for values evicted to disk
+  kv_budget(size_t limit, mode how, const std::string &spill_file);
+
+  /// Close the spill file
+  ~kv_budget();
+
+  /// Report whether the budget does anything
+  bool enabled() const { return limit > 0; }
+
+  /// Report what happens to evicted entries
+  mode how() const { return evict_mode; }
+
+  /// Charge an entry that was just inserted or updated.  Any eviction that was
+  /// in progress for it is cancelled, since it was just used.
+  ///
+  /// @param key The key
+  /// @param len The size of the new value
+  void charge(const std::string &key, size_t len);
+
+  /// Stop tracking an entry that was removed from the map
+  ///
+  /// @param key The key
+  void forget(const std::string &key);
+
+  /// Note that an entry was read, so that it isn't evicted soon
+  ///
+  /// @param key The key
+  void touch(const std::string &key);
+
+  /// Pick entries to evict until the kv_store would be back under budget.  The
+  /// entries stay charged until they are forgotten or spilled.
+  ///
+  /// @return The keys to evict
+  std::vector<std::string> pick_victims();
+
+  /// Give up on evicting an entry that pick_victims() chose
+  ///
+  /// @param key The key
+  void cancel(const std::string &key);
+
+  /// Write an entry's value to the spill file, if the entry is still waiting
+  /// to be evicted.  The caller frees the value if this returns true.
+  ///
+  /// @param key The key
+  /// @param val The value
+  ///
+  /// @return true if the value was spilled and can be freed
+  bool spill(const std::string &key, const std::vector<uint8_t> &val);
+
+  /// Read a spilled value back from the spill file.  The caller must hold the
+  /// entry's bucket lock, and should charge() the entry once the value is back
+  /// in the map.
+  ///
+  /// @param key The key
+  /// @param val Set to the value
+  ///
+  /// @return true if the key was spilled and its value was read
+  bool read_spilled(const std::string &key, std::vector<uint8_t> &val);
+
+  /// Get the size of a spilled value.  The caller must hold the entry's
+  /// bucket lock.
+  ///
+  /// @param key The key
+  /// @param len Set to the size of the value
+  ///
+  /// @return true if the key was spilled
+  bool spilled_size(const std::string &key, uint64_t &len);
+
+  /// Copy a spilled value from the spill file to the end of another file,
+  /// without reading it back into the map.  The caller must hold the entry's
+  /// bucket lock.
+  ///
+  /// @param key The key
+  /// @param out The file to copy into
+  ///
+  /// @return true if the key was spilled and its value was copied
+  bool copy_spilled(const std::string &key, FILE *out);
+
+  /// Get a snapshot of the counters
+  stats_t stats();
+
+private:
+  /// One entry in the clock
+  struct entry {
+    std::string key;        // The key ("" if this slot is free)
+    size_t bytes = 0;       // Bytes charged to memory for this entry
+    bool ref = false;       // Used since the hand last passed?
+    bool evicting = false;  // Chosen by pick_victims(), not yet evicted
+    bool spilled = false;   // Is the value in the spill file?
+    uint64_t spill_off = 0; // Where the value is in the spill file
+    uint64_t spill_len = 0; // How long the value is
+  };
+
+  /// Find a key's slot, or -1
+  long find(const std::string &key);
+
+  /// Find room for a value in the spill file.  The caller must hold lock.
+  uint64_t take_extent(uint64_t len);
+
+  /// Give back a value's room in the spill file.  The caller must hold lock.
+  void free_extent(uint64_t off, uint64_t len);
+
+  const size_t limit;                          // The budget, in bytes
+  const mode evict_mode;                       // See mode
+  int spill_fd = -1;                           // The spill file
+  std::mutex lock;                             // Protects everything below
+  uint64_t spill_end = 0;                      // The size of spill_fd
+  std::multimap<uint64_t, uint64_t> free_by_len; // Unused extents, len to off
+  std::map<uint64_t, uint64_t> free_by_off;    // The same extents, off to len
+  std::vector<entry> clock;                    // The clock's slots
+  std::vector<size_t> free_slots;              // Unused slots in clock
+  std::unordered_map<std::string, size_t> slot_of; // Key to slot
+  size_t hand = 0;                             // The clock hand
+  size_t resident = 0;                         // Sum of entry bytes
+  size_t pending = 0;                          // Bytes of evicting entries
+  size_t evictions = 0, drops = 0, spills = 0, faults = 0; // See stats_t
+};
+
+/// Configure the memory budget that storage_factory() gives the kv_store.
+/// This must be called before storage_factory().  By default there is no
+/// budget.
+///
+/// @param bytes The number of bytes the kv_store may use (0 = no limit)
+/// @param how   What to do with evicted entries
+void kv_budget_config(size_t bytes, kv_budget::mode how);
+
+/// Make a kv_budget according to kv_budget_config()
+///
+/// @param spill_file The file for values evicted to disk
+///
+/// @return A new kv_budget
+kv_budget *kv_budget_factory(const std::string &spill_file);
@@ -1,11 +1,14 @@
+#include <atomic>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
+#include <shared_mutex>
 #include <string>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -19,15 +22,61 @@
 #include "authtableentry.h"
 #include "format.h"
 #include "helpers.h"
+#include "kv_budget.h"
 #include "map.h"
 #include "map_factories.h"
 #include "mru.h"
 #include "persist.h"
 #include "quotas.h"
 #include "storage.h"
+#include "ttl_wheel.h"
 
 using namespace std;
 
+/// Append a batch of deletion messages to the open file with one write, so
+/// that a burst of deletions costs one flush instead of one per key.  The
+/// entries have the same format as the ones log_s() writes.
+///
+/// @param logfile The file to write into
+/// @param keys    The keys that were deleted
+static void log_deletes(FILE *logfile, const vector<string> &keys) {
+  if (keys.empty())
+    return;
+  vector<uint8_t> buf;
+  for (auto &key : keys) {
+    size_t len = key.size();
+    buf.insert(buf.end(), KVDELETE.begin(), KVDELETE.end());
+    buf.insert(buf.end(), (uint8_t *)&len, (uint8_t *)&len + sizeof(len));
+    buf.insert(buf.end(), key.begin(), key.end());
+    buf.resize(buf.size() + (8 - len % 8) % 8, 0);
+  }
+  // NB: one fwrite is atomic with respect to the other threads' log entries
+  fwrite(buf.data(), 1, buf.size(), logfile);
+  fflush(logfile);
+  fsync(fileno(logfile));
+}
+
+/// Write one field of a file entry: an 8-byte binary write of its length, and
+/// then its bytes (see format.h)
+///
+/// @param f    The file to write into
+/// @param data The bytes
+/// @param len  The number of bytes
+static void write_field(FILE *f, const void *data, size_t len) {
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(data, 1, len, f);
+}
+
+/// Pad a file entry to an 8-byte boundary
+///
+/// @param f   The file to write into
+/// @param len The number of bytes in the entry's fields, not counting their
+///            lengths
+static void write_padding(FILE *f, size_t len) {
+  const char zeros[8] = {0};
+  fwrite(zeros, 1, (8 - len % 8) % 8, f);
+}
+
 /// MyStorage is the student implementation of the Storage class
 class MyStorage : public Storage {
   /// The map of authentication information, indexed by username
@@ -61,6 +110,24 @@ class MyStorage : public Storage {
   /// A table for tracking quotas
   Map<string, Quotas *> *quota_table;
 
+  /// The memory budget for kv_store
+  kv_budget *budget;
+
+  /// The deadlines of keys that have a time to live
+  ttl_wheel *expiry;
+
+  /// The time to live that kv_insert() and kv_upsert() give keys (ms, 0 =
+  /// never expire)
+  const uint64_t ttl_ms;
+
+  /// The number of keys that have expired
+  atomic<size_t> expired_count{0};
+
+  /// Writes to kv_store hold this shared.  Expiring keys and saving the file
+  /// hold it exclusively, so that a batch of deletions can't be logged after
+  /// a concurrent write that re-created one of its keys.
+  shared_mutex log_order;
+
 public:
   /// Construct an empty object and specify the file from which it should be
   /// loaded.  To avoid exceptions and errors in the constructor, the act of
@@ -79,7 +146,9 @@ public:
       : auth_table(authtable_factory(buckets)),
         kv_store(kvstore_factory(buckets)), filename(fname), up_quota(upq),
         down_quota(dnq), req_quota(rqq), quota_dur(qd), mru(mru_factory(top)),
-        quota_table(quotatable_factory(buckets)) {}
+        quota_table(quotatable_factory(buckets)),
+        budget(kv_budget_factory(fname + ".spill")), expiry(new ttl_wheel()),
+        ttl_ms(ttl_default_ms()) {}
 
   /// Destructor for the storage object.
   virtual ~MyStorage() {
@@ -87,6 +156,8 @@ public:
 
     // thank you for this reminder professor. 
 
+    // NB: the reaper uses the maps, so it has to stop first
+    delete expiry;
     quota_table->clear(); 
     delete quota_table; 
     kv_store->clear();
@@ -95,6 +166,7 @@ public:
     delete auth_table; 
     mru->clear();
     delete mru;
+    delete budget;
 
   }
 
@@ -151,6 +223,60 @@ public:
     return ret; 
   }
 
+  /// If kv_store is over its memory budget, evict entries until it isn't.
+  /// Dropped entries are deleted (and logged as deletions); entries evicted to
+  /// disk keep their key in the map, with an empty value.
+  void enforce_budget() {
+    for (auto &key : budget->pick_victims()) {
+      bool found;
+      if (budget->how() == kv_budget::mode::drop) {
+        // NB: A drop is logged like any other write, so it must not land
+        //     after the reaper's batch, or in the middle of a save
+        {
+          shared_lock<shared_mutex> g(log_order);
+          found = kv_store->remove(key, [&]() {
+            log_s(storage_file, KVDELETE, key);
+            budget->forget(key);
+            expiry->cancel(key);
+          });
+        }
+        if (found)
+          mru->remove(key);
+      } else {
+        found = kv_store->do_with(key, [&](vector<uint8_t> &val) {
+          if (budget->spill(key, val))
+            vector<uint8_t>().swap(val);
+        });
+      }
+      if (!found)
+        budget->cancel(key);
+    }
+  }
+
+  /// Remove the keys whose time to live has run out.  The deletions are logged
+  /// together, with one write.
+  ///
+  /// @param keys Keys that may have expired; any that haven't are skipped
+  void reap(const vector<string> &keys) {
+    vector<string> gone;
+    {
+      unique_lock<shared_mutex> g(log_order);
+      for (auto &key : keys) {
+        if (!expiry->expired(key))
+          continue; // Updated since it was found
+        kv_store->remove(key, [&]() {
+          budget->forget(key);
+          gone.push_back(key);
+        });
+        expiry->cancel(key);
+      }
+      log_deletes(storage_file, gone);
+    }
+    for (auto &key : gone)
+      mru->remove(key);
+    expired_count += gone.size();
+  }
+
   /// Create a new entry in the Auth table.  If the user already exists, return
   /// an error.  Otherwise, create a salt, hash the password, and then save an
   /// entry with the username, salt, hashed password, and a zero-byte content.
@@ -238,6 +364,21 @@ public:
   /// @return A result tuple, as described in storage.h
   virtual result_t kv_insert(const string &user, const string &pass,
                              const string &key, const vector<uint8_t> &val) {
+    return kv_insert_ttl(user, pass, key, val, ttl_ms);
+  }
+
+  /// Create a new key/value mapping in the table, which expires after a while
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  /// @param key  The key whose mapping is being created
+  /// @param val  The value to copy into the map
+  /// @param ttl  Milliseconds until the mapping expires (0 = never)
+  ///
+  /// @return A result tuple, as described in storage.h
+  result_t kv_insert_ttl(const string &user, const string &pass,
+                         const string &key, const vector<uint8_t> &val,
+                         uint64_t ttl) {
     // NB: log_sv() in persist.h (implementation in persist.o) will be helpful
     //     here
     auto authReturn = auth(user, pass); 
@@ -251,14 +392,25 @@ public:
     if (!upload_check(user, val.size()))
       return result_t{false, RES_ERR_QUOTA_UP, {}};
 
-    bool check = this->kv_store->insert(key, val, [&] () {
-      log_sv(storage_file, KVENTRY, key, val);
-    });
+    // An expired key that the reaper hasn't reached yet doesn't count
+    if (expiry->expired(key))
+      reap({key});
+
+    bool check;
+    {
+      shared_lock<shared_mutex> g(log_order);
+      check = this->kv_store->insert(key, val, [&] () {
+        log_sv(storage_file, KVENTRY, key, val);
+        budget->charge(key, val.size());
+        expiry->schedule(key, ttl);
+      });
+    }
 
     if (check == false) 
       return result_t{false, RES_ERR_USER_EXISTS, {}};
     
     mru->insert(key);
+    enforce_budget();
     return result_t{true, RES_OK, {}};
     // NB: These asserts are to prevent compiler warnings.. you can delete them
     //     when you implement this method
@@ -283,6 +435,10 @@ public:
       return result_t{false, RES_ERR_LOGIN, {}};
 
     std::vector<uint8_t> valReturn; 
+
+    // Expire the key now if its time is up, rather than wait for the reaper
+    if (expiry->expired(key))
+      reap({key});
     
     auto f = [&] (const std::vector<uint8_t> &val) {
       valReturn = val; 
@@ -293,6 +449,18 @@ public:
 
     bool thisisSparta = this->kv_store->do_with_readonly(key, f);
 
+    // A value that was evicted to disk comes back into memory when it's read
+    if (thisisSparta && valReturn.empty() &&
+        budget->how() == kv_budget::mode::disk && budget->enabled()) {
+      kv_store->do_with(key, [&](std::vector<uint8_t> &val) {
+        if (val.empty() && budget->read_spilled(key, val))
+          budget->charge(key, val.size());
+        valReturn = val;
+      });
+      enforce_budget();
+    }
+    budget->touch(key);
+
     if (!download_check(user, valReturn.size()))
       return result_t{false, RES_ERR_QUOTA_DOWN, {}};
 
@@ -331,7 +499,14 @@ public:
     if (!req_check(user))
       return result_t{false, RES_ERR_QUOTA_REQ, {}};
 
-    kv_store->remove(key, [&] () { log_s(storage_file, KVDELETE, key); });
+    {
+      shared_lock<shared_mutex> g(log_order);
+      kv_store->remove(key, [&] () {
+        log_s(storage_file, KVDELETE, key);
+        budget->forget(key);
+        expiry->cancel(key);
+      });
+    }
     mru->remove(key);
 
     return result_t{true, RES_OK, {}};
@@ -353,6 +528,23 @@ public:
   ///         "OK" messages, depending on whether we get an insert or an update.
   virtual result_t kv_upsert(const string &user, const string &pass,
                              const string &key, const vector<uint8_t> &val) {
+    return kv_upsert_ttl(user, pass, key, val, ttl_ms);
+  }
+
+  /// Insert or update, so that the given key is mapped to the given value
+  /// until the given time to live runs out.  An update replaces the key's old
+  /// time to live.
+  ///
+  /// @param user The name of the user who made the request
+  /// @param pass The password for the user, used to authenticate
+  /// @param key  The key whose mapping is being upserted
+  /// @param val  The value to copy into the map
+  /// @param ttl  Milliseconds until the mapping expires (0 = never)
+  ///
+  /// @return A result tuple, as described in storage.h
+  result_t kv_upsert_ttl(const string &user, const string &pass,
+                         const string &key, const vector<uint8_t> &val,
+                         uint64_t ttl) {
     auto authCheck = auth(user, pass);
 
     if (!authCheck.succeeded)
@@ -367,10 +559,26 @@ public:
     if (!upload_check(user, val.size()))
       return result_t{false, RES_ERR_QUOTA_UP, {}};
 
-    bool check = kv_store->upsert(key, val, [&] () { log_sv(storage_file, KVUPDATE, key, val); }, 
-      [&] () { log_sv(storage_file, KVENTRY, key, val); });  
+    // An expired key is re-created, rather than updated
+    if (expiry->expired(key))
+      reap({key});
+
+    bool check;
+    {
+      shared_lock<shared_mutex> g(log_order);
+      check = kv_store->upsert(key, val, [&] () {
+          log_sv(storage_file, KVENTRY, key, val);
+          budget->charge(key, val.size());
+          expiry->schedule(key, ttl);
+        }, [&] () {
+          log_sv(storage_file, KVUPDATE, key, val);
+          budget->charge(key, val.size());
+          expiry->schedule(key, ttl);
+        });
+    }
 
     mru->insert(key);
+    enforce_budget();
 
     if (!check)
       return result_t{true, RES_OKUPD, {}};
@@ -402,6 +610,8 @@ public:
     std::vector<uint8_t> rContent; 
 
     auto f = [&] (std::string key, const std::vector<uint8_t> &val) {
+      if (expiry->expired(key))
+        return;
       rContent.insert(rContent.end(), key.begin(), key.end());
       rContent.push_back('\n');
     };
@@ -461,7 +671,17 @@ public:
   virtual void shutdown() {
     // NB: Based on how the other methods are implemented in the helper file, we
     //     need this command here:
+    expiry->stop();
     fclose(storage_file);
+    if (ttl_ms > 0)
+      cout << "K/V TTL: " << expired_count << " keys expired, "
+           << expiry->size() << " waiting to expire\n";
+    if (budget->enabled()) {
+      auto s = budget->stats();
+      cout << "K/V budget: " << s.resident << " bytes resident, " << s.evictions
+           << " evictions (" << s.drops << " dropped, " << s.spills
+           << " spilled to disk), " << s.faults << " reads from disk\n";
+    }
   }
 
   /// Write the entire Storage object to the file specified by this.filename. To
@@ -471,8 +691,74 @@ public:
   ///
   /// @return A result tuple, as described in storage.h
   virtual result_t save_file() {
-    // NB: the helper (.o provided) does all the work for this operation :)
-    return save_file_helper(auth_table, kv_store, filename, storage_file);
+    // NB: Expired keys shouldn't be saved, and the reaper mustn't write to the
+    //     file while it is replaced
+    vector<string> expired;
+    kv_store->do_all_readonly(
+        [&](const string key, const vector<uint8_t> &) {
+          if (expiry->expired(key))
+            expired.push_back(key);
+        },
+        []() {});
+    reap(expired);
+    unique_lock<shared_mutex> g(log_order);
+
+    // Write both tables while they are both locked, and then swap the new file
+    // in and re-open it for the log.  This is the same file that the provided
+    // helper writes, but a value that was evicted to disk goes straight from
+    // the spill file into the new file, instead of back into kv_store.
+    string tmpfile = filename + ".tmp";
+    FILE *f = fopen(tmpfile.c_str(), "w");
+    if (f == nullptr)
+      return err(result_t{false, RES_ERR_SERVER, {}},
+                 "Unable to create temporary file");
+    bool ok = true;
+    auth_table->do_all_readonly(
+        [&](const string, const AuthTableEntry &e) {
+          fwrite(AUTHENTRY.data(), 1, AUTHENTRY.size(), f);
+          write_field(f, e.username.data(), e.username.size());
+          write_field(f, e.salt.data(), e.salt.size());
+          write_field(f, e.pass_hash.data(), e.pass_hash.size());
+          write_field(f, e.content.data(), e.content.size());
+          write_padding(f, e.username.size() + e.salt.size() +
+                               e.pass_hash.size() + e.content.size());
+        },
+        [&]() {
+          kv_store->do_all_readonly(
+              [&](const string key, const vector<uint8_t> &val) {
+                uint64_t len = val.size();
+                bool spilled = val.empty() && budget->spilled_size(key, len);
+                fwrite(KVENTRY.data(), 1, KVENTRY.size(), f);
+                write_field(f, key.data(), key.size());
+                fwrite(&len, sizeof(len), 1, f);
+                if (spilled)
+                  ok = budget->copy_spilled(key, f) && ok;
+                else
+                  fwrite(val.data(), 1, len, f);
+                write_padding(f, key.size() + len);
+              },
+              [&]() {
+                ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && !ferror(f) &&
+                     ok;
+                ok = fclose(f) == 0 && ok;
+                if (!ok)
+                  return;
+                if (rename(tmpfile.c_str(), filename.c_str()) != 0) {
+                  ok = err(false, "Error renaming file after persisting");
+                  return;
+                }
+                // NB: The clients' writes wait on the tables' locks, so
+                //     nothing is logged to the old file after this
+                fclose(storage_file);
+                storage_file = fopen(filename.c_str(), "a");
+                if (storage_file == nullptr)
+                  ok = err(false, "Unable to re-open ", filename.c_str(),
+                           " after persisting");
+              });
+        });
+    if (!ok)
+      return result_t{false, RES_ERR_SERVER, {}};
+    return result_t{true, RES_OK, {}};
   }
 
   /// Populate the Storage object by loading this.filename.  Note that load()
@@ -486,7 +772,22 @@ public:
     // NB: the helper (.o provided) does all the work from p1/p2/p3 for this
     //     operation.  Depending on how you choose to implement quotas, you may
     //     need to edit this.
-    return load_file_helper(auth_table, kv_store, filename, storage_file);
+    auto res = load_file_helper(auth_table, kv_store, filename, storage_file);
+    // The helper fills kv_store directly, so charge everything it loaded.
+    // The file doesn't record deadlines, so loaded keys get a fresh time to
+    // live.
+    if (res.succeeded && (budget->enabled() || ttl_ms > 0)) {
+      kv_store->do_all_readonly(
+          [&](const string key, const vector<uint8_t> &val) {
+            budget->charge(key, val.size());
+            expiry->schedule(key, ttl_ms);
+          },
+          []() {});
+      enforce_budget();
+    }
+    if (res.succeeded && ttl_ms > 0)
+      expiry->start([&](const vector<string> &keys) { reap(keys); });
+    return res;
   };
 };
 
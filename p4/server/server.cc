@@ -11,8 +11,10 @@
 #include "../common/net.h"
 #include "../common/pool.h"
 
+#include "kv_budget.h"
 #include "parsing.h"
 #include "storage.h"
+#include "ttl_wheel.h"
 
 using namespace std;
 
@@ -29,6 +31,9 @@ struct arg_t {
   size_t quota_req = 16;       // K/V request quota (requests/interval)
   size_t top_size = 4;         // Number of keys to track for TOP queries
   string admin_name = "";      // Name of the administrator
+  size_t kv_budget_mb = 0;     // Memory budget for the K/V store (0 = none)
+  bool evict_to_disk = false;  // Evict K/V values to disk instead of dropping
+  size_t ttl_secs = 0;         // Seconds until K/V entries expire (0 = never)
 
   /// Construct an arg_t from the command-line arguments to the program
   ///
@@ -39,7 +44,7 @@ struct arg_t {
   ///        `-h` is passed in
   arg_t(int argc, char **argv) {
     long opt;
-    while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:f:k:ht:b:i:u:d:r:o:a:m:e:x:")) != -1) {
       switch (opt) {
       case 'p':
         port = atoi(optarg);
@@ -74,6 +79,18 @@ struct arg_t {
       case 'a':
         admin_name = string(optarg);
         break;
+      case 'm':
+        kv_budget_mb = atoi(optarg);
+        break;
+      case 'e':
+        if (string(optarg) == "disk")
+          evict_to_disk = true;
+        else if (string(optarg) != "drop")
+          throw 1;
+        break;
+      case 'x':
+        ttl_secs = atoi(optarg);
+        break;
       default: // on any error, print a help message.  This case subsumes `-h`
         throw 1;
         return;
@@ -98,6 +115,9 @@ struct arg_t {
          << "  -r [int]    Request quota (requests/interval)\n"
          << "  -o [int]    Size of the TOP key cache\n"
          << "  -a [string] Specify name of admin user\n"
+         << "  -m [int]    Memory budget for the K/V store (MB, 0 = none)\n"
+         << "  -e [string] What to do with K/V entries evicted by -m: drop or disk\n"
+         << "  -x [int]    Seconds until a K/V entry expires (0 = never)\n"
          << "  -h          Print help (this message)\n";
   }
 };
@@ -130,6 +150,13 @@ int main(int argc, char **argv) {
   if (pub.size() == 0)
     return 1;
 
+  // The K/V store's memory budget and time to live have to be set before it is
+  // created
+  kv_budget_config(args->kv_budget_mb * 1048576,
+                   args->evict_to_disk ? kv_budget::mode::disk
+                                       : kv_budget::mode::drop);
+  ttl_config(args->ttl_secs);
+
   // If the data file exists, load the data into a Storage object.  Otherwise,
   // create an empty Storage object.
   Storage *storage = storage_factory(
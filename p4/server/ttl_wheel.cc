@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ttl_wheel.h"
+
+using namespace std;
+
+/// The time to live that ttl_default_ms() reports
+static uint64_t config_ms = 0;
+
+/// The number of bits of a tick that index one level of the wheel
+static const int SLOT_BITS = 8;
+static_assert(TTL_WHEEL_SLOTS == 1 << SLOT_BITS,
+              "TTL_WHEEL_SLOTS must match SLOT_BITS");
+
+/// Construct an empty wheel
+ttl_wheel::ttl_wheel() : epoch(chrono::steady_clock::now()) {}
+
+/// Stop the reaper
+ttl_wheel::~ttl_wheel() { stop(); }
+
+/// Get the current tick
+uint64_t ttl_wheel::now_tick() const {
+  auto ms = chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - epoch)
+                .count();
+  return ms / TTL_TICK_MS;
+}
+
+/// Put a key's timer into the slot for t.at.  The caller holds lock.
+///
+/// @param key The key
+/// @param t   The key's timer, which is updated with its slot
+void ttl_wheel::place(const string &key, timer &t) {
+  // A deadline beyond the top level is parked as far out as the top level
+  // reaches; when it cascades, it gets placed again with its real deadline
+  uint64_t span = (uint64_t)1 << (SLOT_BITS * TTL_WHEEL_LEVELS);
+  uint64_t at = min(max(t.at, current + 1), current + span - 1);
+  uint64_t delta = at - current;
+  size_t level = 0;
+  while (level + 1 < TTL_WHEEL_LEVELS &&
+         delta >= (uint64_t)1 << (SLOT_BITS * (level + 1)))
+    ++level;
+  t.level = level;
+  t.slot = (at >> (SLOT_BITS * level)) & (TTL_WHEEL_SLOTS - 1);
+  wheel[t.level][t.slot].push_back(key);
+}
+
+/// Take a key's timer out of its slot.  The caller holds lock.
+///
+/// @param key The key
+/// @param t   The key's timer
+void ttl_wheel::unplace(const string &key, timer &t) {
+  auto &keys = wheel[t.level][t.slot];
+  auto it = find(keys.begin(), keys.end(), key);
+  if (it != keys.end()) {
+    swap(*it, keys.back());
+    keys.pop_back();
+  }
+  t.at = 0;
+}
+
+/// Move the wheel forward to a tick, and collect the keys whose deadlines have
+/// been reached.  The caller holds lock.
+///
+/// @param to  The tick to advance to
+/// @param due Keys that are due are appended here
+void ttl_wheel::advance(uint64_t to, vector<string> &due) {
+  while (current < to) {
+    ++current;
+    // Each time a level finishes a turn, the next slot of the level above
+    // cascades down
+    for (size_t level = 1; level < TTL_WHEEL_LEVELS; ++level) {
+      if ((current >> (SLOT_BITS * (level - 1))) & (TTL_WHEEL_SLOTS - 1))
+        break;
+      size_t slot = (current >> (SLOT_BITS * level)) & (TTL_WHEEL_SLOTS - 1);
+      vector<string> moving;
+      moving.swap(wheel[level][slot]);
+      for (auto &k : moving)
+        place(k, timers[k]);
+    }
+    vector<string> firing;
+    firing.swap(wheel[0][current & (TTL_WHEEL_SLOTS - 1)]);
+    for (auto &k : firing) {
+      auto it = timers.find(k);
+      if (it == timers.end())
+        continue;
+      timer &t = it->second;
+      if (t.deadline == 0) {
+        timers.erase(it); // Cancelled since it was placed
+      } else if (t.deadline > current) {
+        t.at = t.deadline; // Pushed back since it was placed
+        place(k, t);
+      } else {
+        // NB: The deadline stays until the key is cancelled, so that
+        //     expired() still says so until the reaper has removed the key
+        t.at = 0;
+        due.push_back(std::move(k));
+      }
+    }
+  }
+}
+
+/// Set (or replace) a key's time to live
+///
+/// @param key The key
+/// @param ms  Milliseconds until the key expires (0 = never)
+void ttl_wheel::schedule(const string &key, uint64_t ms) {
+  if (ms == 0) {
+    cancel(key);
+    return;
+  }
+  uint64_t ticks = max<uint64_t>(1, (ms + TTL_TICK_MS - 1) / TTL_TICK_MS);
+  uint64_t deadline = now_tick() + ticks;
+  lock_guard<mutex> g(lock);
+  timer &t = timers[key];
+  if (t.deadline == 0)
+    ++live;
+  t.deadline = deadline;
+  // A timer that fires before the deadline will move itself when it does
+  if (t.at != 0 && t.at <= deadline)
+    return;
+  if (t.at != 0)
+    unplace(key, t);
+  t.at = deadline;
+  place(key, t);
+}
+
+/// Stop tracking a key
+///
+/// @param key The key
+void ttl_wheel::cancel(const string &key) {
+  lock_guard<mutex> g(lock);
+  auto it = timers.find(key);
+  if (it == timers.end())
+    return;
+  if (it->second.deadline != 0)
+    --live;
+  it->second.deadline = 0;
+  if (it->second.at == 0)
+    timers.erase(it);
+}
+
+/// Report whether a key's deadline has passed
+///
+/// @param key The key
+///
+/// @return true if the key has a deadline, and it has passed
+bool ttl_wheel::expired(const string &key) {
+  lock_guard<mutex> g(lock);
+  auto it = timers.find(key);
+  return it != timers.end() && it->second.deadline != 0 &&
+         it->second.deadline <= now_tick();
+}
+
+/// Report how many keys have a deadline
+size_t ttl_wheel::size() {
+  lock_guard<mutex> g(lock);
+  return live;
+}
+
+/// Start the reaper thread
+///
+/// @param reap The code to run on each batch of expired keys
+void ttl_wheel::start(function<void(const vector<string> &)> reap) {
+  lock_guard<mutex> g(lock);
+  if (running)
+    return;
+  running = true;
+  reaper = thread([this, reap]() { run(reap); });
+}
+
+/// Stop the reaper thread, if it is running, and wait for it to finish
+void ttl_wheel::stop() {
+  {
+    lock_guard<mutex> g(lock);
+    running = false;
+  }
+  wake.notify_all();
+  if (reaper.joinable())
+    reaper.join();
+}
+
+/// The body of the reaper thread
+///
+/// @param reap The code to run on each batch of expired keys
+void ttl_wheel::run(function<void(const vector<string> &)> reap) {
+  unique_lock<mutex> g(lock);
+  while (running) {
+    wake.wait_for(g, chrono::milliseconds(TTL_TICK_MS));
+    if (!running)
+      break;
+    vector<string> due;
+    advance(now_tick(), due);
+    if (due.empty())
+      continue;
+    // NB: reap() takes bucket locks, which must never be taken while we hold
+    //     our own lock
+    g.unlock();
+    for (size_t i = 0; i < due.size(); i += TTL_REAP_BATCH) {
+      size_t end = min(due.size(), i + TTL_REAP_BATCH);
+      reap(vector<string>(due.begin() + i, due.begin() + end));
+    }
+    g.lock();
+  }
+}
+
+/// Configure the time to live that storage_factory()'s kv_store gives to every
+/// key it inserts or updates
+///
+/// @param seconds The time to live, in seconds (0 = never expire)
+void ttl_config(size_t seconds) { config_ms = seconds * 1000; }
+
+/// Get the time to live set by ttl_config()
+///
+/// @return The time to live, in milliseconds (0 = never expire)
+uint64_t ttl_default_ms() { return config_ms; }
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// The length of one tick of the timing wheel, in milliseconds.  Expirations
+/// are rounded up to the next tick.
+const uint64_t TTL_TICK_MS = 100;
+
+/// The number of slots in each level of the timing wheel (a power of two)
+const size_t TTL_WHEEL_SLOTS = 256;
+
+/// The number of levels in the timing wheel.  With 100ms ticks, four levels of
+/// 256 slots cover TTLs of more than 13 years.
+const size_t TTL_WHEEL_LEVELS = 4;
+
+/// The largest number of keys the reaper hands to its callback at once
+const size_t TTL_REAP_BATCH = 256;
+
+/// ttl_wheel tracks when keys expire.  Deadlines are kept in a hierarchical
+/// timing wheel: level 0 has one slot per tick, and each higher level has one
+/// slot per full turn of the level below it.  Scheduling a key is O(1), and
+/// each tick only looks at one slot of level 0, plus (once per turn) one slot
+/// of a higher level, whose keys cascade down to the level below.
+///
+/// A background reaper advances the wheel, and hands keys whose time has come
+/// to a callback in batches, so that the callback can remove them from the
+/// kv_store and log their deletion with one write.  Between ticks, expired()
+/// reports keys whose deadline has passed even if the reaper hasn't reached
+/// them yet, so that readers never see an expired key.
+///
+/// Each key has at most one timer in the wheel, so a hot key costs one slot
+/// entry no matter how often it is written.  Pushing a deadline back (the usual
+/// case, since every write restarts the key's time to live) only records the
+/// new deadline: the timer is moved when its slot comes up.  Bringing a
+/// deadline forward takes the timer out of its slot and places it again.
+/// Cancelling a key leaves its timer where it is, to be dropped when its slot
+/// comes up.
+///
+/// schedule() and cancel() are meant to be called from the kv_store's
+/// callbacks, while the key's bucket is locked.  The reaper lets go of the
+/// wheel's lock before it calls the callback, which locks buckets to remove
+/// keys.
+class ttl_wheel {
+public:
+  /// Construct an empty wheel.  The reaper doesn't run until start().
+  ttl_wheel();
+
+  /// Stop the reaper
+  ~ttl_wheel();
+
+  /// Set (or replace) a key's time to live
+  ///
+  /// @param key The key
+  /// @param ms  Milliseconds until the key expires (0 = never)
+  void schedule(const std::string &key, uint64_t ms);
+
+  /// Stop tracking a key, e.g. because it was removed from the map
+  ///
+  /// @param key The key
+  void cancel(const std::string &key);
+
+  /// Report whether a key's deadline has passed
+  ///
+  /// @param key The key
+  ///
+  /// @return true if the key has a deadline, and it has passed
+  bool expired(const std::string &key);
+
+  /// Start the reaper thread
+  ///
+  /// @param reap The code to run on each batch of keys whose deadline has
+  ///             passed.  The keys have not been cancelled; reap() should
+  ///             check expired() before removing each one.
+  void start(std::function<void(const std::vector<std::string> &)> reap);
+
+  /// Stop the reaper thread, if it is running, and wait for it to finish
+  void stop();
+
+  /// Report how many keys have a deadline
+  size_t size();
+
+private:
+  /// A key's deadline, and where its timer is
+  struct timer {
+    uint64_t deadline = 0; // The tick at which the key expires (0 = never)
+    uint64_t at = 0;       // The tick the timer is set for (0 = no timer)
+    size_t level = 0;      // The level of the timer's slot
+    size_t slot = 0;       // The timer's slot
+  };
+
+  /// Get the current tick
+  uint64_t now_tick() const;
+
+  /// Put a key's timer into the slot for t.at.  The caller holds lock.
+  ///
+  /// @param key The key
+  /// @param t   The key's timer, which is updated with its slot
+  void place(const std::string &key, timer &t);
+
+  /// Take a key's timer out of its slot.  The caller holds lock.
+  ///
+  /// @param key The key
+  /// @param t   The key's timer
+  void unplace(const std::string &key, timer &t);
+
+  /// Move the wheel forward to a tick, and collect the keys whose deadlines
+  /// have been reached.  The caller holds lock.
+  ///
+  /// @param to  The tick to advance to
+  /// @param due Keys that are due are appended here
+  void advance(uint64_t to, std::vector<std::string> &due);
+
+  /// The body of the reaper thread
+  void run(std::function<void(const std::vector<std::string> &)> reap);
+
+  const std::chrono::steady_clock::time_point epoch; // Tick 0
+  std::mutex lock;                          // Protects everything below
+  std::condition_variable wake;             // Wakes the reaper to stop
+  bool running = false;                     // Is the reaper running?
+  uint64_t current = 0;                     // Last tick the wheel reached
+  std::vector<std::string> wheel[TTL_WHEEL_LEVELS][TTL_WHEEL_SLOTS]; // Keys
+  std::unordered_map<std::string, timer> timers; // Keys with a deadline or timer
+  size_t live = 0;                          // Keys with a deadline
+  std::thread reaper;                       // The reaper thread
+};
+
+/// Configure the time to live that storage_factory()'s kv_store gives to
+/// every key it inserts or updates.  This must be called before
+/// storage_factory().  By default keys never expire.
+///
+/// @param seconds The time to live, in seconds (0 = never expire)
+void ttl_config(size_t seconds);
+
+/// Get the time to live set by ttl_config()
+///
+/// @return The time to live, in milliseconds (0 = never expire)
+uint64_t ttl_default_ms();